@@ -17,6 +17,7 @@ class BondAlgoExecutionService: public Service<string, AlgoExecution<T>>{
 private:
     map<string, AlgoExecution<T>> algo_map;
     vector<ServiceListener<AlgoExecution<T>>*> listeners;
+    ServiceMetrics metrics;
 public:
     BondAlgoExecutionService();
 
@@ -62,7 +63,7 @@ public:
 
 
 template<typename T>
-BondAlgoExecutionService<T>::BondAlgoExecutionService(){
+BondAlgoExecutionService<T>::BondAlgoExecutionService() : metrics("algo_execution"){
     algo_map = map<string, AlgoExecution<T>>();
 }
 
@@ -82,7 +83,7 @@ void BondAlgoExecutionService<T>::OnMessage(AlgoExecution<T> &data) {
 // for data to the Service.
 template<typename T>
 void BondAlgoExecutionService<T>::AddListener(ServiceListener<AlgoExecution<T>> *listener) {
-    listeners.push_back(listeners);
+    listeners.push_back(listener);
 }
 
 // Get all listeners on the Service.
@@ -94,21 +95,20 @@ const vector< ServiceListener<AlgoExecution<T>>* >& BondAlgoExecutionService<T>:
 // update information
 template<typename T>
 void BondAlgoExecutionService<T>::update_orderbook(OrderBook<T> & order_book){
+    ServiceHop hop(metrics);
     string bond_code = order_book.GetProduct().GetProductId();
-    // if it in algo_map, update its price
-    if(auto i= algo_map.find(bond_code) != algo_map.end()){
-        (i->second).Run(order_book);
-    } else{
+    // the first book of a product starts its algo
+    auto algo = algo_map.find(bond_code);
+    if(algo == algo_map.end()){
         auto exe_order = ExecutionOrder<T>(order_book.GetProduct(), BID,"orderID",LIMIT,0,0,0,"parentID",true);
-        algo_map.insert(pair<string,AlgoExecution<T>>(bond_code,AlgoExecution<T>(exe_order)));
-        update_orderbook(order_book);
-        return;
+        algo = algo_map.insert(pair<string,AlgoExecution<T>>(bond_code,AlgoExecution<T>(exe_order))).first;
     }
+    (algo->second).Run(order_book);
 
     for(auto& i:listeners){
-        i->ProcessAdd(i->second);
+        i->ProcessAdd(algo->second);
     }
-
+    metrics.CountOut(listeners.size());
 }
 
 
@@ -20,6 +20,7 @@ class BondAlgoStreamingService: public Service<string, AlgoStreaming<T>>{
 private:
     map<string, AlgoStreaming<T>> algo_map;
     vector<ServiceListener<AlgoStreaming<T>>*> listeners;
+    ServiceMetrics metrics;
 public:
     BondAlgoStreamingService();
 
@@ -39,6 +40,13 @@ public:
     // update price
     void update_price(Price<T> & price);
 
+    // Write the stream of every product's algo into a checkpoint
+    void SaveCheckpoint(CheckpointWriter& writer) const;
+
+    // Restore the algos of a checkpoint, looking the products up in products; listeners are
+    // not notified, the streaming service restores its own streams
+    void LoadCheckpoint(const CheckpointReader& reader, Service<string, T>* products);
+
 };
 
 
@@ -94,7 +102,7 @@ void AlgoStreaming<T>::Run(Price<T> price){
 
 
 template<typename T>
-BondAlgoStreamingService<T>::BondAlgoStreamingService(){
+BondAlgoStreamingService<T>::BondAlgoStreamingService() : metrics("algo_streaming"){
     algo_map = map<string,AlgoStreaming<T>>();
 }
 
@@ -127,23 +135,42 @@ const vector< ServiceListener<AlgoStreaming<T>>* >& BondAlgoStreamingService<T>:
 // update price
 template<typename T>
 void BondAlgoStreamingService<T>::update_price(Price<T> & price){
+    ServiceHop hop(metrics);
     auto bond_code=price.GetProduct().GetProductId();
 
-    // if it in algo_map, update its price
-    if(auto i = algo_map.find(bond_code) !=algo_map.end()){
-        (i->second).Run(price);
-    } else{
+    // the first price of a product starts its algo
+    auto algo = algo_map.find(bond_code);
+    if(algo == algo_map.end()){
         PriceStreamOrder ps_bid(0, 0, 0, BID);
         PriceStreamOrder ps_ask(0, 0, 0, OFFER);
-        PriceStream<Bond> ps(price.GetProduct(), ps_bid, ps_ask);
-        algo_map.insert(pair<string,PriceStream<Bond> >(bond_code,ps));
-        update_price(price);
-        return;
+        PriceStream<T> ps(price.GetProduct(), ps_bid, ps_ask);
+        algo = algo_map.insert(pair<string,AlgoStreaming<T> >(bond_code,AlgoStreaming<T>(ps))).first;
     }
+    (algo->second).Run(price);
 
     // notify the listeners
     for(auto& i:listeners){
-        i->ProcessAdd(i->second);
+        i->ProcessAdd(algo->second);
+    }
+    metrics.CountOut(listeners.size());
+}
+
+template<typename T>
+void BondAlgoStreamingService<T>::SaveCheckpoint(CheckpointWriter& writer) const{
+    writer.BeginSection(ALGO_STREAM_SECTION);
+    for(auto& i:algo_map){
+        StreamRecord record;
+        SaveStream(i.second.GetPriceStreaming(), record);
+        writer.Write(record);
+    }
+    writer.EndSection(algo_map.size());
+}
+
+template<typename T>
+void BondAlgoStreamingService<T>::LoadCheckpoint(const CheckpointReader& reader, Service<string, T>* products){
+    for(auto& record:reader.GetRecords<StreamRecord>(ALGO_STREAM_SECTION)){
+        PriceStream<T> ps = RestoreStream(record, products->GetData(record.productId));
+        algo_map[record.productId] = AlgoStreaming<T>(ps);
     }
 }
 
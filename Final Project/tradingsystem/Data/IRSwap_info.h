@@ -0,0 +1,33 @@
+//
+// Swaps traded alongside the treasuries in Bond_info.h
+//
+
+//Seven spot starting USD swaps matching the on-the-run terms: 2Y, 3Y, 5Y, 7Y, 10Y, 20Y and 30Y.
+//Fixed legs pay semi-annual 30/360, floating legs receive 3M LIBOR Act/360.
+
+#ifndef DATA_IRSWAP_INFO_H
+#define DATA_IRSWAP_INFO_H
+#include <vector>
+#include <string>
+#include "boost/date_time/gregorian/gregorian.hpp"
+using namespace std;
+using namespace boost::gregorian;
+
+//product ids
+vector<string> swap_code{
+    "USD_IRS_2Y",
+    "USD_IRS_3Y",
+    "USD_IRS_5Y",
+    "USD_IRS_7Y",
+    "USD_IRS_10Y",
+    "USD_IRS_20Y",
+    "USD_IRS_30Y"
+};
+
+//terms in years
+vector<int> swap_term{2, 3, 5, 7, 10, 20, 30};
+
+//effective date, spot from the auction date of the bonds
+date swap_effective(2022, Dec, 2);
+
+#endif //DATA_IRSWAP_INFO_H
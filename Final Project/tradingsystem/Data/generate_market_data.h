@@ -59,7 +59,7 @@ void Generate_Market_Data::run(int N, int kind=7){
 
                 file << code << "," << bid_price << "," << num << "," << "BID" << endl;
                 file << code << "," << ask_price << "," << num << "," << "OFFER" << endl;
-                count[j] += 2;
+                count[i] += 2;
             }
         }
 
@@ -7,6 +7,8 @@
 #include "soa.hpp"
 #include "pricingservice.hpp"
 #include "products.hpp"
+#include "schedulerservice.hpp"
+#include "metrics.hpp"
 #include <vector>
 #include <iostream>
 #include <algorithm>
@@ -16,55 +18,89 @@
 using namespace std;
 
 template<typename T>
-class GUIServiceConnector: public Connector<T>{
+class ModifyPriceByTime: public Price<T>{
+private:
+    boost::posix_time::ptime time;
 public:
-    GUIServiceConnector(){};
-    // Publish data to the Connector
-    virtual void Publish(T& data) override;
+    ModifyPriceByTime(boost::posix_time::ptime input_time,Price<T> price);
+    boost::posix_time::ptime GetTime();
 };
 
 
 
-
-
 template<typename T>
-class ModifyPriceByTime: public Price<T>{
-private:
-    boost::posix_time::ptime time;
+class GUIServiceConnector: public Connector<ModifyPriceByTime<T>>{
 public:
-    ModifyPriceByTime(boost::posix_time::ptime input_time,Price<T> price);
-    boost::posix_time::ptime GetTime();
+    GUIServiceConnector(){};
+    // Publish data to the Connector
+    virtual void Publish(ModifyPriceByTime<T>& data) override;
 };
 
 
 
+// Without a scheduler every price checks the clock and goes out if the throttle time passed.
+// With a scheduler, prices only update the pending one and a periodic timer sends
+// the latest price once per throttle period.
 template<typename T>
-class GUIService: public  PricingService<T>{
+class GUIService: public Service<string, Price<T>>{
 private:
     GUIServiceConnector<T>* gui_connector;
+    // latest price sent for each product
+    map<string, Price<T>> sent_map;
+    vector<ServiceListener<Price<T>>*> listeners;
     boost::posix_time::time_duration throtte_time;
     boost::posix_time::ptime last_time;
+    SchedulerService* scheduler;
+    // latest price not yet sent, at most one
+    vector<Price<T>> pending;
+    // prices in, and those replaced or throttled before they went out
+    ServiceMetrics gui_metrics;
+    Counter dropped_updates;
+
+    // send the pending price, on the throttle timer
+    void send_pending();
+
+    // send a price to the GUI stamped with the time now
+    void send(Price<T> &data);
 
 public:
     GUIService(GUIServiceConnector<T>* connector);
-    // Get data on our service given a key
-    virtual Price<T>& GetData(string key) override {};
+    GUIService(GUIServiceConnector<T>* connector, SchedulerService* _scheduler);
+    // Get the latest price sent for a product
+    virtual Price<T>& GetData(string key) override;
 
     // The callback that a Connector should invoke for any new or updated data
-    virtual void OnMessage(Price<T> &data)  override {};
+    virtual void OnMessage(Price<T> &data)  override;
 
-    // Add a listener to the Service for callbacks on add, remove, and update events
-    // for data to the Service.
-    virtual void AddListener(ServiceListener<Price<T>> *listener) override {};
+    // Add a listener to the Service for callbacks on each price sent to the GUI
+    virtual void AddListener(ServiceListener<Price<T>> *listener) override;
 
     // Get all listeners on the Service.
-    virtual const vector< ServiceListener<Price<T>>* >& GetListeners() const override {};
+    virtual const vector< ServiceListener<Price<T>>* >& GetListeners() const override;
 
     void send_throtte(Price<T> &data);
 
 };
 
 
+template<typename T>
+class GUIServiceListener: public ServiceListener<Price<T>>{
+private:
+    GUIService<T>* gui_service;
+public:
+    GUIServiceListener(GUIService<T>* service);
+    // Listener callback to process an add event to the Service
+    virtual void ProcessAdd(Price<T> &data) override;
+
+    // Listener callback to process a remove event to the Service
+    virtual void ProcessRemove(Price<T> &data) override{};
+
+    // Listener callback to process an update event to the Service
+    virtual void ProcessUpdate(Price<T> &data) override{};
+
+};
+
+
 
 
 
@@ -85,7 +121,7 @@ boost::posix_time::ptime ModifyPriceByTime<T>::GetTime(){
 
 // Publish data to the Connector
 template<typename T>
-void GUIServiceConnector<T>::Publish(T& data) {
+void GUIServiceConnector<T>::Publish(ModifyPriceByTime<T>& data) {
     auto bond=data.GetProduct();
     auto mid=data.GetMid();
     auto spread=data.GetBidOfferSpread();
@@ -99,24 +135,91 @@ void GUIServiceConnector<T>::Publish(T& data) {
 
 
 template<typename T>
-GUIService<T>::GUIService(GUIServiceConnector<T>* connector){
+GUIService<T>::GUIService(GUIServiceConnector<T>* connector) :
+    gui_metrics("gui") {
+    dropped_updates = gui_metrics.AddCounter("dropped_updates");
     gui_connector = connector;
     //Define the GUIService with a 300 millisecond throttle
     throtte_time = boost::posix_time::millisec(3);
     last_time = boost::posix_time::microsec_clock::local_time();
+    scheduler = nullptr;
+}
+
+template<typename T>
+GUIService<T>::GUIService(GUIServiceConnector<T>* connector, SchedulerService* _scheduler): GUIService(connector){
+    scheduler = _scheduler;
+    scheduler->SchedulePeriodic("gui_throttle", throtte_time.total_milliseconds(), [this](){ send_pending(); });
+}
+
+template<typename T>
+Price<T>& GUIService<T>::GetData(string key){
+    return sent_map[key];
+}
+
+template<typename T>
+void GUIService<T>::OnMessage(Price<T> &data){
+    send_throtte(data);
+}
+
+template<typename T>
+void GUIService<T>::AddListener(ServiceListener<Price<T>> *listener){
+    listeners.push_back(listener);
+}
+
+template<typename T>
+const vector< ServiceListener<Price<T>>* >& GUIService<T>::GetListeners() const{
+    return listeners;
 }
 
 template<typename T>
 void GUIService<T>::send_throtte(Price<T> &data){
+    ServiceHop hop(gui_metrics);
+    if(scheduler){
+        if(!pending.empty())
+            dropped_updates.Add();
+        pending.clear();
+        pending.push_back(data);
+        return;
+    }
     boost::posix_time::ptime current = boost::posix_time::microsec_clock::local_time();
     boost::posix_time::time_duration time_diff = current - last_time;
     if(time_diff > throtte_time){
         last_time = current;
-        auto ts_price = ModifyPriceByTime<T>(current, data);
-        gui_connector->Publish(ts_price);
+        send(data);
+    }else{
+        dropped_updates.Add();
     }
 }
 
+template<typename T>
+void GUIService<T>::send_pending(){
+    if(pending.empty())
+        return;
+    send(pending.back());
+    pending.clear();
+}
+
+template<typename T>
+void GUIService<T>::send(Price<T> &data){
+    auto ts_price = ModifyPriceByTime<T>(boost::posix_time::microsec_clock::local_time(), data);
+    gui_connector->Publish(ts_price);
+    sent_map[data.GetProduct().GetProductId()] = data;
+    for(auto& i:listeners){
+        i->ProcessAdd(data);
+    }
+}
+
+
+template<typename T>
+GUIServiceListener<T>::GUIServiceListener(GUIService<T>* service){
+    gui_service = service;
+}
+
+template<typename T>
+void GUIServiceListener<T>::ProcessAdd(Price<T> &data){
+    gui_service->send_throtte(data);
+}
+
 
 
 
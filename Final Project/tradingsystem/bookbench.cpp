@@ -0,0 +1,144 @@
+/**
+ * bookbench.cpp
+ * Benchmarks the order stack kernels on books of 5, 10 and 50 levels a side: finding the best
+ * bid and offer, and aggregating the quantity at each price in one pass, on every instruction
+ * set the CPU supports. Every result is checked against the scalar kernels, and the aggregation
+ * against the earlier one that rescanned the whole stack for each distinct price.
+ *
+ * Usage: bookbench [--books n] [--rounds n]
+ *   defaults: 1000 books a depth, 2000 rounds over them
+ */
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include "marketdataservice.hpp"
+
+using namespace std;
+
+// Get the seconds since start
+double SecondsSince(const chrono::steady_clock::time_point &start)
+{
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Aggregate a stack by rescanning it for the quantity at each price it has not seen yet
+OrderStack RescanAggregate(const OrderStack &stack)
+{
+  OrderStack levels;
+  const double *prices = stack.GetPrices();
+  for (int i = 0; i < stack.Size(); i++) {
+    if (FindPrice(prices, i, prices[i]) < 0)
+      levels.Add(prices[i], SumQuantityAtPrice(prices, stack.GetQuantities(), stack.Size(), prices[i]));
+  }
+  return levels;
+}
+
+// Check two stacks hold the same levels in the same order
+bool SameLevels(const OrderStack &a, const OrderStack &b)
+{
+  if (a.Size() != b.Size()) return false;
+  for (int i = 0; i < a.Size(); i++) {
+    if (a.GetPrices()[i] != b.GetPrices()[i] || a.GetQuantities()[i] != b.GetQuantities()[i]) return false;
+  }
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  int books = 1000;
+  int rounds = 2000;
+  for (int i = 1; i < argc; i++)
+  {
+    string argument = argv[i];
+    if (i + 1 < argc && argument == "--books") books = stoi(argv[++i]);
+    else if (i + 1 < argc && argument == "--rounds") rounds = stoi(argv[++i]);
+    else
+    {
+      cerr << "usage: " << argv[0] << " [--books n] [--rounds n]" << '\n';
+      return 1;
+    }
+  }
+
+  KernelIsa best_isa = DetectKernelIsa();
+  cout << "cpu supports " << KernelIsaName(best_isa) << "; ns per book, both sides\n";
+  cout << setw(7) << "levels" << setw(8) << "isa" << setw(12) << "best b/o" << setw(12) << "aggregate" << setw(12) << "rescan" << '\n';
+
+  mt19937_64 random(7);
+  bool ok = true;
+  for (int depth : {5, 10, 50})
+  {
+    // prices on the 1/256 tick, half as many ticks as levels so the aggregation merges some
+    vector<OrderStack> bids(books), offers(books);
+    for (int b = 0; b < books; b++)
+    {
+      for (int l = 0; l < depth; l++)
+      {
+        bids[b].Add(99.5 - (random() % (depth / 2 + 1)) / 256.0, (1 + random() % 5) * 1000000);
+        offers[b].Add(100.5 + (random() % (depth / 2 + 1)) / 256.0, (1 + random() % 5) * 1000000);
+      }
+    }
+
+    // the scalar results every instruction set must match
+    SetKernelIsa(SCALAR_KERNELS);
+    vector<int> best_bids(books), best_offers(books);
+    vector<OrderStack> aggregated_bids(books), aggregated_offers(books);
+    for (int b = 0; b < books; b++)
+    {
+      best_bids[b] = bids[b].BestIndex(BID);
+      best_offers[b] = offers[b].BestIndex(OFFER);
+      aggregated_bids[b] = bids[b].Aggregate();
+      aggregated_offers[b] = offers[b].Aggregate();
+    }
+
+    for (int isa = SCALAR_KERNELS; isa <= best_isa; isa++)
+    {
+      SetKernelIsa((KernelIsa)isa);
+      long sink = 0;
+
+      auto start = chrono::steady_clock::now();
+      for (int r = 0; r < rounds; r++)
+      {
+        for (int b = 0; b < books; b++)
+          sink += bids[b].BestIndex(BID) + offers[b].BestIndex(OFFER);
+      }
+      double best_ns = SecondsSince(start) * 1e9 / ((double)rounds * books);
+
+      start = chrono::steady_clock::now();
+      for (int r = 0; r < rounds; r++)
+      {
+        for (int b = 0; b < books; b++)
+          sink += bids[b].Aggregate().Size() + offers[b].Aggregate().Size();
+      }
+      double aggregate_ns = SecondsSince(start) * 1e9 / ((double)rounds * books);
+
+      start = chrono::steady_clock::now();
+      for (int r = 0; r < rounds; r++)
+      {
+        for (int b = 0; b < books; b++)
+          sink += RescanAggregate(bids[b]).Size() + RescanAggregate(offers[b]).Size();
+      }
+      double rescan_ns = SecondsSince(start) * 1e9 / ((double)rounds * books);
+
+      for (int b = 0; b < books; b++)
+      {
+        if (bids[b].BestIndex(BID) != best_bids[b] || offers[b].BestIndex(OFFER) != best_offers[b] ||
+            !SameLevels(bids[b].Aggregate(), aggregated_bids[b]) || !SameLevels(offers[b].Aggregate(), aggregated_offers[b]) ||
+            !SameLevels(RescanAggregate(bids[b]), aggregated_bids[b]) || !SameLevels(RescanAggregate(offers[b]), aggregated_offers[b]))
+        {
+          cerr << KernelIsaName((KernelIsa)isa) << " disagrees with the scalar kernels on book " << b << " of depth " << depth << '\n';
+          ok = false;
+          break;
+        }
+      }
+
+      cout << setw(7) << depth << setw(8) << KernelIsaName((KernelIsa)isa) << fixed << setprecision(1)
+           << setw(12) << best_ns << setw(12) << aggregate_ns << setw(12) << rescan_ns
+           << (sink == 0 ? " " : "") << '\n';
+    }
+  }
+  SetKernelIsa(best_isa);
+  return ok ? 0 : 1;
+}
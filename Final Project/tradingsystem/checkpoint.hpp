@@ -0,0 +1,458 @@
+/**
+ * checkpoint.hpp
+ * Defines the binary checkpoint of service state: the file layout, the writer the
+ * services save their sections through, the memory-mapped reader they restore from,
+ * and the Checkpointer taking checkpoints periodically together with the feed offsets
+ * they correspond to, so a restarted process only replays the feed lines after them.
+ */
+#ifndef CHECKPOINT_HPP
+#define CHECKPOINT_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <functional>
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <type_traits>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+/**
+ * Checkpoint file layout, native byte order since a checkpoint is only read back on the
+ * machine that wrote it:
+ *   CheckpointHeader, then sectionCount sections of
+ *   CheckpointSectionHeader followed by size bytes of records, padded to 8 bytes.
+ * Records are fixed-size structs owned by the service that writes the section; a section
+ * is skipped by readers that do not know its type.
+ */
+const uint32_t CHECKPOINT_MAGIC = 0x54504b43;
+const uint32_t CHECKPOINT_VERSION = 1;
+
+// Longest product identifier or feed name a checkpoint record holds
+const size_t CHECKPOINT_ID_SIZE = 32;
+
+enum CheckpointSectionType : uint32_t
+{
+  FEED_OFFSET_SECTION = 1,
+  BOOK_NAME_SECTION = 2,
+  POSITION_SECTION = 3,
+  ORDER_BOOK_SECTION = 4,
+  TOP_OF_BOOK_SECTION = 5,
+  PV01_SECTION = 6,
+  QUOTE_LEVEL_SECTION = 7,
+  PNL_SECTION = 8,
+  OPEN_INQUIRY_SECTION = 9,
+  INQUIRY_COUNT_SECTION = 10,
+  PRICE_SECTION = 11,
+  CURVE_PILLAR_SECTION = 12,
+  ALGO_STREAM_SECTION = 13,
+  PRICE_STREAM_SECTION = 14
+};
+
+struct CheckpointHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t sectionCount;
+  uint32_t reserved;
+  // checkpoint number within the run, and when it was taken in ns since the epoch
+  uint64_t sequence;
+  int64_t timestamp;
+};
+
+struct CheckpointSectionHeader
+{
+  uint32_t type;
+  uint32_t count;
+  uint64_t size;
+};
+
+/**
+ * How far into a feed the state in the checkpoint got.
+ */
+struct FeedOffsetRecord
+{
+  char feed[CHECKPOINT_ID_SIZE];
+  // bytes into the uncompressed feed
+  uint64_t offset;
+  // 1 once the whole feed was processed
+  uint64_t finished;
+};
+
+// Copy a string into a fixed-size id field, throwing if it does not fit
+void CopyCheckpointId(char *field, const string &id);
+
+/**
+ * Builds a checkpoint in memory and writes it to a file.
+ */
+class CheckpointWriter
+{
+
+public:
+
+  // ctor
+  CheckpointWriter(uint64_t _sequence = 0);
+
+  // Start a section of the type
+  void BeginSection(uint32_t type);
+
+  // Append a record to the open section
+  template<typename R>
+  void Write(const R &record);
+
+  // Append size raw bytes to the open section
+  void Write(const void *data, size_t size);
+
+  // Close the open section, recording count records
+  void EndSection(uint32_t count);
+
+  // Write the checkpoint to path: to path.tmp, synced, then renamed over path,
+  // so path always holds a whole checkpoint
+  void Save(const string &path);
+
+  // Get the bytes written so far
+  size_t Size() const;
+
+private:
+  vector<char> data;
+  uint32_t section_count;
+  // offset of the open section's header, or -1
+  long open_section;
+
+};
+
+/**
+ * A checkpoint file mapped into memory.
+ */
+class CheckpointReader
+{
+
+public:
+
+  // ctor; throws if the file is missing, truncated or of another version
+  CheckpointReader(const string &path);
+  ~CheckpointReader();
+
+  CheckpointReader(const CheckpointReader&) = delete;
+  CheckpointReader& operator=(const CheckpointReader&) = delete;
+
+  // Find the section of the type; false if the checkpoint has none
+  bool GetSection(uint32_t type, const char *&records, uint32_t &count, uint64_t &size) const;
+
+  // Copy the records of a section of fixed-size records; empty if there is none
+  template<typename R>
+  vector<R> GetRecords(uint32_t type) const;
+
+  // Get the feed offset recorded for feed, 0 if there is none
+  uint64_t GetFeedOffset(const string &feed) const;
+
+  // Get whether feed was processed to its end
+  bool IsFeedFinished(const string &feed) const;
+
+  // Get the header
+  const CheckpointHeader& GetHeader() const;
+
+private:
+  const char *data;
+  size_t size;
+  map<uint32_t, const CheckpointSectionHeader*> sections;
+
+};
+
+/**
+ * Takes a checkpoint every interval milliseconds of the wall clock, when polled.
+ * Services add a saver writing their sections; readers of the feeds report how far they
+ * got. The feed readers poll, on buffer refills of their FeedStream, so a checkpoint is
+ * taken between lines with every earlier line fully processed.
+ */
+class Checkpointer
+{
+
+public:
+
+  // ctor; interval 0 only checkpoints on Take()
+  Checkpointer(const string &_path, long _interval = 1000);
+
+  // Add a function writing a service's sections into every checkpoint
+  void AddSaver(function<void(CheckpointWriter&)> saver);
+
+  // Record how far into feed the services got
+  void SetFeedOffset(const string &feed, uint64_t offset, bool finished = false);
+
+  // Record feed offsets from a restored checkpoint, so the next checkpoint keeps them
+  void Restore(const CheckpointReader &reader);
+
+  // Take a checkpoint if interval has passed since the last one. Feed readers call this
+  // from inside an istream, which would swallow an exception and end the feed, so a
+  // failed checkpoint is reported on cerr and retried an interval later instead.
+  void Poll();
+
+  // Take a checkpoint now
+  void Take();
+
+  // Get the number of checkpoints taken
+  uint64_t GetCount() const;
+
+  // Get how long the last checkpoint took, in microseconds
+  long GetLastDuration() const;
+
+  // Get the file checkpoints go to
+  const string& GetPath() const;
+
+private:
+  string path;
+  long interval;
+  vector<function<void(CheckpointWriter&)>> savers;
+  map<string, FeedOffsetRecord> feed_offsets;
+  chrono::steady_clock::time_point last;
+  uint64_t count;
+  long last_duration;
+
+};
+
+void CopyCheckpointId(char *field, const string &id)
+{
+  if (id.size() >= CHECKPOINT_ID_SIZE) throw invalid_argument("id too long for a checkpoint: " + id);
+  memset(field, 0, CHECKPOINT_ID_SIZE);
+  memcpy(field, id.data(), id.size());
+}
+
+CheckpointWriter::CheckpointWriter(uint64_t _sequence) :
+  data(sizeof(CheckpointHeader)), section_count(0), open_section(-1)
+{
+  CheckpointHeader header;
+  header.magic = CHECKPOINT_MAGIC;
+  header.version = CHECKPOINT_VERSION;
+  header.sectionCount = 0;
+  header.reserved = 0;
+  header.sequence = _sequence;
+  header.timestamp = chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+  memcpy(data.data(), &header, sizeof(header));
+}
+
+void CheckpointWriter::BeginSection(uint32_t type)
+{
+  if (open_section >= 0) throw logic_error("checkpoint section already open");
+  open_section = data.size();
+  CheckpointSectionHeader section = {type, 0, 0};
+  Write(&section, sizeof(section));
+}
+
+template<typename R>
+void CheckpointWriter::Write(const R &record)
+{
+  static_assert(is_trivially_copyable<R>::value, "checkpoint records are copied byte-wise");
+  Write(&record, sizeof(R));
+}
+
+void CheckpointWriter::Write(const void *bytes, size_t size)
+{
+  data.insert(data.end(), (const char*)bytes, (const char*)bytes + size);
+}
+
+void CheckpointWriter::EndSection(uint32_t count)
+{
+  if (open_section < 0) throw logic_error("no checkpoint section open");
+  CheckpointSectionHeader section;
+  memcpy(&section, data.data() + open_section, sizeof(section));
+  section.count = count;
+  section.size = data.size() - open_section - sizeof(section);
+  memcpy(data.data() + open_section, &section, sizeof(section));
+  data.resize((data.size() + 7) / 8 * 8, 0);
+  open_section = -1;
+  ++section_count;
+}
+
+void CheckpointWriter::Save(const string &path)
+{
+  if (open_section >= 0) throw logic_error("checkpoint section left open");
+  memcpy(data.data() + offsetof(CheckpointHeader, sectionCount), &section_count, sizeof(section_count));
+
+  string temporary = path + ".tmp";
+  int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) throw runtime_error("cannot create " + temporary + ": " + strerror(errno));
+  size_t written = 0;
+  while (written < data.size())
+  {
+    ssize_t n = write(fd, data.data() + written, data.size() - written);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0)
+    {
+      int error = errno;
+      close(fd);
+      throw runtime_error("cannot write " + temporary + ": " + strerror(error));
+    }
+    written += n;
+  }
+  if (fdatasync(fd) < 0 || close(fd) < 0) throw runtime_error("cannot sync " + temporary + ": " + strerror(errno));
+  if (rename(temporary.c_str(), path.c_str()) < 0) throw runtime_error("cannot rename " + temporary + ": " + strerror(errno));
+}
+
+size_t CheckpointWriter::Size() const
+{
+  return data.size();
+}
+
+CheckpointReader::CheckpointReader(const string &path)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) throw runtime_error("cannot open " + path + ": " + strerror(errno));
+  struct stat st;
+  fstat(fd, &st);
+  size = st.st_size;
+  if (size < sizeof(CheckpointHeader))
+  {
+    close(fd);
+    throw runtime_error(path + " is not a checkpoint");
+  }
+  data = (const char*)mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) throw runtime_error("cannot map " + path + ": " + strerror(errno));
+
+  const CheckpointHeader &header = GetHeader();
+  if (header.magic != CHECKPOINT_MAGIC || header.version != CHECKPOINT_VERSION)
+  {
+    munmap((void*)data, size);
+    throw runtime_error(path + " is not a version " + to_string(CHECKPOINT_VERSION) + " checkpoint");
+  }
+  size_t offset = sizeof(CheckpointHeader);
+  for (uint32_t i = 0; i < header.sectionCount; i++)
+  {
+    const CheckpointSectionHeader *section = (const CheckpointSectionHeader*)(data + offset);
+    if (offset + sizeof(CheckpointSectionHeader) > size || section->size > size - offset - sizeof(CheckpointSectionHeader))
+    {
+      munmap((void*)data, size);
+      throw runtime_error(path + " is truncated");
+    }
+    sections[section->type] = section;
+    offset += (sizeof(CheckpointSectionHeader) + section->size + 7) / 8 * 8;
+  }
+}
+
+CheckpointReader::~CheckpointReader()
+{
+  munmap((void*)data, size);
+}
+
+bool CheckpointReader::GetSection(uint32_t type, const char *&records, uint32_t &count, uint64_t &size) const
+{
+  auto found = sections.find(type);
+  if (found == sections.end()) return false;
+  records = (const char*)(found->second + 1);
+  count = found->second->count;
+  size = found->second->size;
+  return true;
+}
+
+template<typename R>
+vector<R> CheckpointReader::GetRecords(uint32_t type) const
+{
+  const char *records;
+  uint32_t count;
+  uint64_t bytes;
+  vector<R> result;
+  if (!GetSection(type, records, count, bytes)) return result;
+  if (bytes != (uint64_t)count * sizeof(R)) throw runtime_error("checkpoint section " + to_string(type) + " has the wrong record size");
+  result.resize(count);
+  memcpy(result.data(), records, bytes);
+  return result;
+}
+
+uint64_t CheckpointReader::GetFeedOffset(const string &feed) const
+{
+  for (auto &record : GetRecords<FeedOffsetRecord>(FEED_OFFSET_SECTION))
+    if (feed == record.feed) return record.offset;
+  return 0;
+}
+
+bool CheckpointReader::IsFeedFinished(const string &feed) const
+{
+  for (auto &record : GetRecords<FeedOffsetRecord>(FEED_OFFSET_SECTION))
+    if (feed == record.feed) return record.finished != 0;
+  return false;
+}
+
+const CheckpointHeader& CheckpointReader::GetHeader() const
+{
+  return *(const CheckpointHeader*)data;
+}
+
+Checkpointer::Checkpointer(const string &_path, long _interval) :
+  path(_path), interval(_interval), last(chrono::steady_clock::now()), count(0), last_duration(0)
+{
+}
+
+void Checkpointer::AddSaver(function<void(CheckpointWriter&)> saver)
+{
+  savers.push_back(saver);
+}
+
+void Checkpointer::SetFeedOffset(const string &feed, uint64_t offset, bool finished)
+{
+  FeedOffsetRecord &record = feed_offsets[feed];
+  CopyCheckpointId(record.feed, feed);
+  record.offset = offset;
+  record.finished = finished;
+}
+
+void Checkpointer::Restore(const CheckpointReader &reader)
+{
+  for (auto &record : reader.GetRecords<FeedOffsetRecord>(FEED_OFFSET_SECTION))
+    feed_offsets[record.feed] = record;
+  count = reader.GetHeader().sequence;
+}
+
+void Checkpointer::Poll()
+{
+  if (interval <= 0 || chrono::steady_clock::now() - last < chrono::milliseconds(interval)) return;
+  try
+  {
+    Take();
+  }
+  catch (const exception &e)
+  {
+    cerr << "checkpoint to " << path << " failed: " << e.what() << '\n';
+    last = chrono::steady_clock::now();
+  }
+}
+
+void Checkpointer::Take()
+{
+  auto start = chrono::steady_clock::now();
+  CheckpointWriter writer(count + 1);
+  writer.BeginSection(FEED_OFFSET_SECTION);
+  for (auto &feed : feed_offsets) writer.Write(feed.second);
+  writer.EndSection(feed_offsets.size());
+  for (auto &saver : savers) saver(writer);
+  writer.Save(path);
+  ++count;
+  last = chrono::steady_clock::now();
+  last_duration = chrono::duration_cast<chrono::microseconds>(last - start).count();
+}
+
+uint64_t Checkpointer::GetCount() const
+{
+  return count;
+}
+
+long Checkpointer::GetLastDuration() const
+{
+  return last_duration;
+}
+
+const string& Checkpointer::GetPath() const
+{
+  return path;
+}
+
+#endif
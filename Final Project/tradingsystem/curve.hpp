@@ -0,0 +1,137 @@
+/**
+ * curve.hpp
+ * Defines the discount curve products are priced off: continuously compounded zero rates
+ * at pillar times, interpolated linearly in log discount factor (flat forwards between pillars).
+ */
+#ifndef CURVE_HPP
+#define CURVE_HPP
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+#include "boost/date_time/gregorian/gregorian.hpp"
+
+using namespace std;
+using namespace boost::gregorian;
+
+// Days in the year of curve time
+const double CURVE_DAYS_PER_YEAR = 365.0;
+
+/**
+ * Zero curve as of a curve date. Time is Act/365 years from the curve date. Before the first
+ * pillar and after the last the zero rate is held flat.
+ */
+class DiscountCurve
+{
+
+public:
+
+  // ctor for a curve with zeroRates at the increasing pillar times
+  DiscountCurve(const date &_curveDate, const vector<double> &_times, const vector<double> &_zeroRates);
+  DiscountCurve();
+
+  // Get the curve date
+  const date& GetCurveDate() const;
+
+  // Get the curve time of d
+  double GetTime(const date &d) const;
+
+  // Get the discount factor to time t
+  double GetDiscountFactor(double t) const;
+
+  // Get the discount factor to d
+  double GetDiscountFactor(const date &d) const;
+
+  // Get the zero rate to time t
+  double GetZeroRate(double t) const;
+
+  // Get the pillar times
+  const vector<double>& GetTimes() const;
+
+  // Get the zero rates at the pillars
+  const vector<double>& GetZeroRates() const;
+
+  // Set the zero rate at pillar k
+  void SetZeroRate(size_t k, double zeroRate);
+
+  // Get a copy with every zero rate moved by shift
+  DiscountCurve Shifted(double shift) const;
+
+private:
+  date curveDate;
+  vector<double> times;
+  vector<double> zeroRates;
+
+};
+
+DiscountCurve::DiscountCurve(const date &_curveDate, const vector<double> &_times, const vector<double> &_zeroRates) :
+  curveDate(_curveDate), times(_times), zeroRates(_zeroRates)
+{
+  if (times.empty() || times.size() != zeroRates.size())
+    throw invalid_argument("a curve needs one zero rate per pillar");
+  for (size_t k = 0; k < times.size(); k++) {
+    if (times[k] <= 0 || (k > 0 && times[k] <= times[k - 1]))
+      throw invalid_argument("curve pillar times must be positive and increasing");
+  }
+}
+
+DiscountCurve::DiscountCurve()
+{
+}
+
+const date& DiscountCurve::GetCurveDate() const
+{
+  return curveDate;
+}
+
+double DiscountCurve::GetTime(const date &d) const
+{
+  return (d - curveDate).days() / CURVE_DAYS_PER_YEAR;
+}
+
+double DiscountCurve::GetDiscountFactor(double t) const
+{
+  return exp(-GetZeroRate(t) * t);
+}
+
+double DiscountCurve::GetDiscountFactor(const date &d) const
+{
+  return GetDiscountFactor(GetTime(d));
+}
+
+double DiscountCurve::GetZeroRate(double t) const
+{
+  if (t <= times.front()) return zeroRates.front();
+  if (t >= times.back()) return zeroRates.back();
+  size_t k = upper_bound(times.begin(), times.end(), t) - times.begin();
+  // z t is the log discount factor; interpolating it linearly makes forwards flat
+  double a = (t - times[k - 1]) / (times[k] - times[k - 1]);
+  double logDf = (1 - a) * zeroRates[k - 1] * times[k - 1] + a * zeroRates[k] * times[k];
+  return logDf / t;
+}
+
+const vector<double>& DiscountCurve::GetTimes() const
+{
+  return times;
+}
+
+const vector<double>& DiscountCurve::GetZeroRates() const
+{
+  return zeroRates;
+}
+
+void DiscountCurve::SetZeroRate(size_t k, double zeroRate)
+{
+  zeroRates.at(k) = zeroRate;
+}
+
+DiscountCurve DiscountCurve::Shifted(double shift) const
+{
+  vector<double> shifted(zeroRates);
+  for (auto &rate : shifted) rate += shift;
+  return DiscountCurve(curveDate, times, shifted);
+}
+
+#endif
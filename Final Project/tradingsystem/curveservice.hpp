@@ -0,0 +1,400 @@
+/**
+ * curveservice.hpp
+ * Defines the Service bootstrapping the Treasury zero curve from the mid prices of the
+ * on-the-run bonds, a pillar at each maturity. Every coupon's time and its place between
+ * the pillars are worked out once, so a price tick re-solves only the pillars from the
+ * bond that moved outward, each a short Newton iteration over that bond's last flows.
+ * A bootstrap that does not converge leaves the last curve in place.
+ */
+#ifndef CURVE_SERVICE_HPP
+#define CURVE_SERVICE_HPP
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include "soa.hpp"
+#include "pricingservice.hpp"
+#include "curve.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "checkpoint.hpp"
+
+using namespace std;
+
+// Name the bootstrapped curve is keyed on
+const string TREASURY_CURVE = "UST";
+// Newton iterations a pillar may take before the bootstrap gives up
+const int BOOTSTRAP_MAX_ITERATIONS = 20;
+// Dirty price per 100 a pillar is solved to
+const double BOOTSTRAP_TOLERANCE = 1e-10;
+
+// Line logged when a bootstrap gives up, with the pillar and the bond's dirty price
+const LogFormat BOOTSTRAP_FAILED_LOG = RegisterLogFormat("Curve bootstrap did not converge at pillar {} priced {}, keeping the last curve");
+/**
+ * Checkpointed state of a curve pillar, keyed on the bond maturing at it.
+ */
+struct CurvePillarRecord
+{
+  char productId[CHECKPOINT_ID_SIZE];
+  // NAN until the bond is priced
+  double dirtyPrice;
+  double logDiscountFactor;
+  double zeroRate;
+  // whether the pillar has moved since the last bootstrap
+  long stale;
+};
+
+/**
+ * Curve Service bootstrapping a zero curve with linear interpolation in log discount
+ * factor, which reprices each bond at its mid plus accrued interest. The curve is published
+ * to the listeners on every price that moves it, once every bond has had a price.
+ * Keyed on curve name.
+ * Type T is the product type.
+ */
+template<typename T>
+class BondCurveService : public Service<string, DiscountCurve>
+{
+
+public:
+
+  // ctor for a curve settling on settlement with a pillar at the maturity of each of bonds
+  BondCurveService(const date &settlement, const vector<T> &bonds);
+
+  // Get data on our service given a key
+  virtual DiscountCurve& GetData(string key) override;
+
+  // The callback that a Connector should invoke for any new or updated data
+  virtual void OnMessage(DiscountCurve &data) override;
+
+  // Add a listener to the Service for callbacks on add, remove, and update events
+  // for data to the Service.
+  virtual void AddListener(ServiceListener<DiscountCurve> *listener) override;
+
+  // Get all listeners on the Service.
+  virtual const vector< ServiceListener<DiscountCurve>* >& GetListeners() const override;
+
+  // Take a new price, re-bootstrapping from its pillar outward if it moved the mid
+  void OnPrice(const Price<T> &price);
+
+  // Get the curve
+  const DiscountCurve& GetCurve() const;
+
+  // Get the number of bootstraps so far
+  long GetBootstrapCount() const;
+
+  // Get the number of pillars solved over all bootstraps
+  long GetPillarCount() const;
+
+  // Get the number of bootstraps that did not converge and kept the last curve
+  long GetFailedBootstrapCount() const;
+
+  // Write the prices and solved pillars into a checkpoint
+  void SaveCheckpoint(CheckpointWriter &writer) const;
+
+  // Restore the prices and pillars of a checkpoint without re-bootstrapping;
+  // listeners are not notified
+  void LoadCheckpoint(const CheckpointReader &reader);
+
+private:
+  DiscountCurve curve;
+  vector<ServiceListener<DiscountCurve>*> listeners;
+  unordered_map<string, size_t> pillar_index;
+  // id of the bond at each pillar
+  vector<string> pillar_ids;
+  // dirty price per 100 of each pillar's bond, NAN until it is priced
+  vector<double> dirty_prices;
+  vector<double> accrued;
+  vector<double> pillar_times;
+  // log discount factor at each pillar, z t
+  vector<double> log_dfs;
+  // every bond's flows after settlement, bond k's from flow_begin[k]; those from
+  // last_begin[k] fall after the previous pillar, so they move with pillar k
+  vector<size_t> flow_begin;
+  vector<size_t> last_begin;
+  vector<double> flow_amounts;
+  vector<int> flow_segments;
+  vector<double> flow_weights;
+  size_t priced;
+  size_t first_stale;
+  long bootstraps;
+  long pillars_solved;
+  long failed_bootstraps;
+  ServiceMetrics metrics;
+  Counter bootstrap_counter;
+  Counter failed_bootstrap_counter;
+
+  // Get the log discount factor at a flow in segment between pillars segment - 1 and segment
+  double LogDiscountFactor(int segment, double weight) const;
+
+  // Solve the pillars from first outward; false, with the curve as it was, if one does not converge
+  bool Bootstrap(size_t first);
+
+  // Send the curve to every listener
+  void Publish();
+
+};
+
+/**
+ * Listener feeding bond prices into the curve service.
+ * Type T is the product type.
+ */
+template<typename T>
+class BondCurveServiceListener : public ServiceListener<Price<T>>
+{
+
+public:
+
+  // ctor for a listener updating service
+  BondCurveServiceListener(BondCurveService<T> *_service);
+
+  // Listener callback to process an add event to the Service
+  virtual void ProcessAdd(Price<T> &data) override;
+
+  // Listener callback to process a remove event to the Service
+  virtual void ProcessRemove(Price<T> &data) override {};
+
+  // Listener callback to process an update event to the Service
+  virtual void ProcessUpdate(Price<T> &data) override {};
+
+private:
+  BondCurveService<T> *service;
+
+};
+
+template<typename T>
+BondCurveService<T>::BondCurveService(const date &settlement, const vector<T> &bonds) :
+  priced(0), bootstraps(0), pillars_solved(0), failed_bootstraps(0), metrics("curve")
+{
+  bootstrap_counter = metrics.AddCounter("bootstraps");
+  failed_bootstrap_counter = metrics.AddCounter("failed_bootstraps");
+  vector<T> sorted(bonds);
+  sort(sorted.begin(), sorted.end(), [](const T &a, const T &b) { return a.GetMaturityDate() < b.GetMaturityDate(); });
+  if (sorted.empty() || sorted.front().GetMaturityDate() <= settlement)
+    throw invalid_argument("a curve needs bonds maturing after settlement");
+
+  vector<double> zero_rates;
+  for (auto &bond : sorted) {
+    pillar_index.insert(make_pair(bond.GetProductId(), pillar_times.size()));
+    pillar_ids.push_back(bond.GetProductId());
+    pillar_times.push_back((bond.GetMaturityDate() - settlement).days() / CURVE_DAYS_PER_YEAR);
+    // the coupon is the first guess at the zero rate
+    zero_rates.push_back(bond.GetCoupon());
+  }
+  curve = DiscountCurve(settlement, pillar_times, zero_rates);
+  for (size_t k = 0; k < pillar_times.size(); k++)
+    log_dfs.push_back(zero_rates[k] * pillar_times[k]);
+  dirty_prices.assign(sorted.size(), NAN);
+  first_stale = sorted.size();
+
+  for (size_t k = 0; k < sorted.size(); k++) {
+    const date &maturity = sorted[k].GetMaturityDate();
+    double coupon = 100 * sorted[k].GetCoupon() / 2;
+    // semi-annual coupons rolled back from maturity; months() keeps month ends at month end
+    vector<date> coupon_dates;
+    int period = 0;
+    date d = maturity;
+    while (d > settlement) {
+      coupon_dates.push_back(d);
+      d = maturity - months(6 * ++period);
+    }
+    reverse(coupon_dates.begin(), coupon_dates.end());
+    date next = coupon_dates.front();
+    accrued.push_back(coupon * (settlement - d).days() / (next - d).days());
+
+    flow_begin.push_back(flow_amounts.size());
+    last_begin.push_back(flow_amounts.size());
+    for (auto &pay : coupon_dates) {
+      double t = curve.GetTime(pay);
+      int segment = lower_bound(pillar_times.begin(), pillar_times.end(), t - 1e-12) - pillar_times.begin();
+      double start = segment > 0 ? pillar_times[segment - 1] : 0.0;
+      flow_amounts.push_back(pay == maturity ? coupon + 100 : coupon);
+      flow_segments.push_back(segment);
+      flow_weights.push_back((t - start) / (pillar_times[segment] - start));
+      if (segment < (int)k) last_begin[k] = flow_amounts.size();
+    }
+  }
+  flow_begin.push_back(flow_amounts.size());
+}
+
+template<typename T>
+DiscountCurve& BondCurveService<T>::GetData(string key)
+{
+  if (key != TREASURY_CURVE) throw out_of_range("no curve " + key);
+  return curve;
+}
+
+template<typename T>
+void BondCurveService<T>::OnMessage(DiscountCurve &data)
+{
+  ServiceHop hop(metrics);
+  if (data.GetTimes() != pillar_times) throw invalid_argument("the curve has other pillars");
+  curve = data;
+  for (size_t k = 0; k < pillar_times.size(); k++)
+    log_dfs[k] = curve.GetZeroRates()[k] * pillar_times[k];
+  Publish();
+}
+
+template<typename T>
+void BondCurveService<T>::AddListener(ServiceListener<DiscountCurve> *listener)
+{
+  listeners.push_back(listener);
+}
+
+template<typename T>
+const vector< ServiceListener<DiscountCurve>* >& BondCurveService<T>::GetListeners() const
+{
+  return listeners;
+}
+
+template<typename T>
+void BondCurveService<T>::OnPrice(const Price<T> &price)
+{
+  ServiceHop hop(metrics);
+  auto found = pillar_index.find(price.GetProduct().GetProductId());
+  if (found == pillar_index.end()) return;
+  size_t k = found->second;
+  double dirty = price.GetMid() + accrued[k];
+  if (dirty == dirty_prices[k]) return;
+  if (dirty_prices[k] != dirty_prices[k]) priced++;
+  dirty_prices[k] = dirty;
+  first_stale = min(first_stale, k);
+  if (priced < dirty_prices.size()) return;
+
+  // a failed bootstrap keeps first_stale, so the next price retries from there
+  if (!Bootstrap(first_stale)) return;
+  first_stale = dirty_prices.size();
+  Publish();
+}
+
+template<typename T>
+const DiscountCurve& BondCurveService<T>::GetCurve() const
+{
+  return curve;
+}
+
+template<typename T>
+long BondCurveService<T>::GetBootstrapCount() const
+{
+  return bootstraps;
+}
+
+template<typename T>
+long BondCurveService<T>::GetPillarCount() const
+{
+  return pillars_solved;
+}
+
+template<typename T>
+long BondCurveService<T>::GetFailedBootstrapCount() const
+{
+  return failed_bootstraps;
+}
+
+template<typename T>
+void BondCurveService<T>::SaveCheckpoint(CheckpointWriter &writer) const
+{
+  writer.BeginSection(CURVE_PILLAR_SECTION);
+  for (size_t k = 0; k < pillar_times.size(); k++) {
+    CurvePillarRecord record;
+    CopyCheckpointId(record.productId, pillar_ids[k]);
+    record.dirtyPrice = dirty_prices[k];
+    record.logDiscountFactor = log_dfs[k];
+    record.zeroRate = curve.GetZeroRates()[k];
+    record.stale = k >= first_stale;
+    writer.Write(record);
+  }
+  writer.EndSection(pillar_times.size());
+}
+
+template<typename T>
+void BondCurveService<T>::LoadCheckpoint(const CheckpointReader &reader)
+{
+  for (auto &record : reader.GetRecords<CurvePillarRecord>(CURVE_PILLAR_SECTION)) {
+    auto found = pillar_index.find(record.productId);
+    if (found == pillar_index.end()) continue;
+    size_t k = found->second;
+    if (dirty_prices[k] != dirty_prices[k] && record.dirtyPrice == record.dirtyPrice) priced++;
+    dirty_prices[k] = record.dirtyPrice;
+    log_dfs[k] = record.logDiscountFactor;
+    curve.SetZeroRate(k, record.zeroRate);
+    if (record.stale) first_stale = min(first_stale, k);
+  }
+}
+
+template<typename T>
+double BondCurveService<T>::LogDiscountFactor(int segment, double weight) const
+{
+  double start = segment > 0 ? log_dfs[segment - 1] : 0.0;
+  return start + weight * (log_dfs[segment] - start);
+}
+
+template<typename T>
+bool BondCurveService<T>::Bootstrap(size_t first)
+{
+  for (size_t k = first; k < pillar_times.size(); k++) {
+    // flows up to the previous pillar are fixed by the pillars solved already
+    double fixed_pv = 0;
+    for (size_t i = flow_begin[k]; i < last_begin[k]; i++)
+      fixed_pv += flow_amounts[i] * exp(-LogDiscountFactor(flow_segments[i], flow_weights[i]));
+
+    // the rest discount at exp(-(1 - w) start - w x), x the log discount factor at pillar k
+    double start = k > 0 ? log_dfs[k - 1] : 0.0;
+    double target = dirty_prices[k] - fixed_pv;
+    double x = log_dfs[k];
+    int iteration = 0;
+    for (; iteration < BOOTSTRAP_MAX_ITERATIONS; iteration++) {
+      double value = 0, slope = 0;
+      for (size_t i = last_begin[k]; i < flow_begin[k + 1]; i++) {
+        double w = flow_weights[i];
+        double pv = flow_amounts[i] * exp(-(1 - w) * start - w * x);
+        value += pv;
+        slope -= w * pv;
+      }
+      double error = value - target;
+      if (fabs(error) < BOOTSTRAP_TOLERANCE) break;
+      x -= error / slope;
+    }
+    if (iteration == BOOTSTRAP_MAX_ITERATIONS || x != x) {
+      // the curve is only written once every pillar has solved, so it still holds the last one
+      for (size_t j = first; j < k; j++)
+        log_dfs[j] = curve.GetZeroRates()[j] * pillar_times[j];
+      failed_bootstraps++;
+      failed_bootstrap_counter.Add();
+      async_logger.Log(BOOTSTRAP_FAILED_LOG, k, dirty_prices[k]);
+      return false;
+    }
+    log_dfs[k] = x;
+    pillars_solved++;
+  }
+  for (size_t k = first; k < pillar_times.size(); k++)
+    curve.SetZeroRate(k, log_dfs[k] / pillar_times[k]);
+  bootstraps++;
+  bootstrap_counter.Add();
+  return true;
+}
+
+template<typename T>
+void BondCurveService<T>::Publish()
+{
+  for (auto &listener : listeners)
+    listener->ProcessAdd(curve);
+  metrics.CountOut(listeners.size());
+}
+
+template<typename T>
+BondCurveServiceListener<T>::BondCurveServiceListener(BondCurveService<T> *_service) :
+  service(_service)
+{
+}
+
+template<typename T>
+void BondCurveServiceListener<T>::ProcessAdd(Price<T> &data)
+{
+  service->OnPrice(data);
+}
+
+#endif
@@ -0,0 +1,792 @@
+/**
+ * eventloop.hpp
+ * Defines the epoll event loop the socket connectors run on, and the
+ * sockets themselves: a SocketPublisher fanning messages out to subscriber
+ * processes, and a SocketSource receiving a feed from a publisher.
+ *
+ * Addresses are "unix:<path>" or "tcp:<host>:<port>". All socket I/O happens
+ * on the loop's thread; service threads only queue bytes, and either side
+ * pushes back when a peer falls behind by more than a high-water mark.
+ * A MetricsEndpoint answers HTTP requests on the same loop with the metrics.
+ */
+#ifndef EVENT_LOOP_HPP
+#define EVENT_LOOP_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <sstream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <exception>
+#include <condition_variable>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "transport.hpp"
+#include "metrics.hpp"
+
+using namespace std;
+
+/**
+ * One thread waiting on epoll and running the handlers of ready sockets,
+ * plus tasks posted to it from other threads.
+ */
+class EventLoop
+{
+
+public:
+
+  // ctor starting the loop thread
+  EventLoop();
+  ~EventLoop();
+
+  EventLoop(const EventLoop&) = delete;
+  EventLoop& operator=(const EventLoop&) = delete;
+
+  // Run task on the loop thread
+  void Post(function<void()> task);
+
+  // Run task on the loop thread and wait for it
+  void Run(function<void()> task);
+
+  // Whether the caller is the loop thread
+  bool InLoop() const;
+
+  // Call handler with the ready events whenever fd has any of events; loop thread only
+  void Watch(int fd, uint32_t events, function<void(uint32_t)> handler);
+
+  // Change the events fd is watched for; loop thread only
+  void Modify(int fd, uint32_t events);
+
+  // Stop watching fd; loop thread only
+  void Unwatch(int fd);
+
+private:
+  int epoll_fd;
+  int wake_fd;
+  bool running;
+  mutex task_lock;
+  vector<function<void()>> tasks;
+  map<int, shared_ptr<function<void(uint32_t)>>> handlers;
+  thread worker;
+
+  void Loop();
+
+};
+
+/**
+ * Publishes messages to every process subscribed on a listening socket,
+ * e.g. the executions and price streams. Send blocks while any subscriber
+ * has more than high_water bytes queued, so a slow reader slows the
+ * publisher rather than growing memory without bound.
+ */
+class SocketPublisher : public MessageSink
+{
+
+public:
+
+  // ctor listening on address
+  SocketPublisher(EventLoop *_loop, const string &address, size_t _high_water = 4 << 20);
+  ~SocketPublisher();
+
+  SocketPublisher(const SocketPublisher&) = delete;
+  SocketPublisher& operator=(const SocketPublisher&) = delete;
+
+  // Block until count subscribers have connected
+  void WaitForSubscribers(size_t count);
+
+  void Send(const char *data, size_t size) override;
+
+  // Deliver everything queued, then disconnect the subscribers and stop listening
+  void Close() override;
+
+  // Get the number of connected subscribers
+  size_t GetSubscriberCount() const;
+
+private:
+  struct Subscriber
+  {
+    vector<char> out;
+    size_t offset;
+    bool writable;
+  };
+
+  EventLoop *loop;
+  int listener;
+  string unix_path;
+  size_t high_water;
+  mutable mutex lock;
+  condition_variable changed;
+  map<int, Subscriber> subscribers;
+  bool flush_posted;
+  bool closed;
+
+  void OnAccept();
+  void FlushAll();
+  // Write what the socket takes; false if the subscriber went away
+  bool FlushOne(int fd, Subscriber &subscriber);
+  void Drop(int fd);
+
+};
+
+/**
+ * Receives the messages a publisher sends, e.g. a feed served by the
+ * feedreplayer. The loop stops reading the socket while more than
+ * high_water bytes wait to be received, letting TCP flow control hold the
+ * sender back.
+ */
+class SocketSource : public MessageSource
+{
+
+public:
+
+  // ctor connecting to address, retrying for up to timeout milliseconds while nothing listens there
+  SocketSource(EventLoop *_loop, const string &address, size_t _high_water = 4 << 20, long timeout = 5000);
+  ~SocketSource();
+
+  SocketSource(const SocketSource&) = delete;
+  SocketSource& operator=(const SocketSource&) = delete;
+
+  bool Receive(const char *&data, size_t &size) override;
+
+private:
+  EventLoop *loop;
+  int fd;
+  size_t high_water;
+  mutex lock;
+  condition_variable arrived;
+  vector<char> inbox;
+  size_t begin;
+  bool paused;
+  bool finished;
+  string error;
+  vector<char> current;
+
+  void OnReadable();
+  void Finish(const string &reason);
+
+};
+
+/**
+ * Text feed read from a SocketSource, the socket counterpart of FeedStream:
+ * a Connector's Subscribe(istream&) reads the lines a feedreplayer serves.
+ */
+class SocketFeedStream : public istream
+{
+
+public:
+
+  // ctor connecting to the feed at address
+  SocketFeedStream(EventLoop *loop, const string &address);
+
+private:
+  SocketSource source;
+  MessageStreamBuf buffer;
+
+};
+
+/**
+ * Answers every HTTP request on a listening socket with the metrics of a
+ * registry in the Prometheus text format, e.g.
+ * curl http://127.0.0.1:9100/metrics, so the counters can be watched or
+ * scraped while the process runs. Requests are served on the loop thread.
+ */
+class MetricsEndpoint
+{
+
+public:
+
+  // ctor listening on address
+  MetricsEndpoint(EventLoop *_loop, MetricsRegistry *_registry, const string &address);
+  ~MetricsEndpoint();
+
+  MetricsEndpoint(const MetricsEndpoint&) = delete;
+  MetricsEndpoint& operator=(const MetricsEndpoint&) = delete;
+
+  // Get the number of requests answered
+  long GetRequestCount() const;
+
+private:
+  EventLoop *loop;
+  MetricsRegistry *registry;
+  int listener;
+  string unix_path;
+  // responses not yet written in full, by socket
+  map<int, string> responses;
+  atomic<long> requests;
+
+  void OnAccept();
+  void OnEvents(int fd, uint32_t events);
+  // Write what the socket takes of its response; closes it once all is sent
+  void Send(int fd);
+  void Drop(int fd);
+
+};
+
+// Open a non-blocking socket listening on address
+int ListenSocket(const string &address);
+
+// Connect a non-blocking socket to address, retrying for up to timeout milliseconds
+int ConnectSocket(const string &address, long timeout);
+
+// Split "tcp:<host>:<port>" or "unix:<path>" into a socket address
+void ParseSocketAddress(const string &address, sockaddr_storage &storage, socklen_t &length);
+
+void ParseSocketAddress(const string &address, sockaddr_storage &storage, socklen_t &length)
+{
+  memset(&storage, 0, sizeof(storage));
+  if (address.compare(0, 5, "unix:") == 0)
+  {
+    string path = address.substr(5);
+    sockaddr_un *unix_address = (sockaddr_un*)&storage;
+    if (path.empty() || path.size() >= sizeof(unix_address->sun_path)) throw invalid_argument("bad socket path: " + address);
+    unix_address->sun_family = AF_UNIX;
+    memcpy(unix_address->sun_path, path.c_str(), path.size());
+    length = sizeof(sockaddr_un);
+    return;
+  }
+  if (address.compare(0, 4, "tcp:") == 0)
+  {
+    size_t colon = address.rfind(':');
+    string host = address.substr(4, colon - 4);
+    string port = address.substr(colon + 1);
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *result;
+    if (colon <= 4 || getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0) throw invalid_argument("bad tcp address: " + address);
+    memcpy(&storage, result->ai_addr, result->ai_addrlen);
+    length = result->ai_addrlen;
+    freeaddrinfo(result);
+    return;
+  }
+  throw invalid_argument("address must start with unix: or tcp: " + address);
+}
+
+int ListenSocket(const string &address)
+{
+  sockaddr_storage storage;
+  socklen_t length;
+  ParseSocketAddress(address, storage, length);
+  int fd = socket(storage.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) throw runtime_error(string("cannot create socket: ") + strerror(errno));
+  int one = 1;
+  if (storage.ss_family == AF_UNIX) unlink(((sockaddr_un*)&storage)->sun_path);
+  else setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(fd, (sockaddr*)&storage, length) < 0 || listen(fd, 64) < 0)
+  {
+    int error = errno;
+    close(fd);
+    throw runtime_error("cannot listen on " + address + ": " + strerror(error));
+  }
+  return fd;
+}
+
+int ConnectSocket(const string &address, long timeout)
+{
+  sockaddr_storage storage;
+  socklen_t length;
+  ParseSocketAddress(address, storage, length);
+  auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeout);
+  while (true)
+  {
+    int fd = socket(storage.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) throw runtime_error(string("cannot create socket: ") + strerror(errno));
+    if (connect(fd, (sockaddr*)&storage, length) == 0)
+    {
+      int one = 1;
+      if (storage.ss_family != AF_UNIX) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+      return fd;
+    }
+    int error = errno;
+    close(fd);
+    bool absent = error == ECONNREFUSED || error == ENOENT;
+    if (!absent || chrono::steady_clock::now() > deadline)
+      throw runtime_error("cannot connect to " + address + ": " + strerror(error));
+    this_thread::sleep_for(chrono::milliseconds(10));
+  }
+}
+
+EventLoop::EventLoop() :
+  running(true)
+{
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) throw runtime_error(string("cannot create epoll: ") + strerror(errno));
+  wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wake_fd < 0) throw runtime_error(string("cannot create eventfd: ") + strerror(errno));
+  epoll_event event;
+  event.events = EPOLLIN;
+  event.data.fd = wake_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event);
+  worker = thread([this](){ Loop(); });
+}
+
+EventLoop::~EventLoop()
+{
+  Post([this](){ running = false; });
+  worker.join();
+  close(wake_fd);
+  close(epoll_fd);
+}
+
+void EventLoop::Post(function<void()> task)
+{
+  bool first;
+  {
+    lock_guard<mutex> guard(task_lock);
+    first = tasks.empty();
+    tasks.push_back(move(task));
+  }
+  // one wakeup covers every task posted before the loop drains them
+  if (first)
+  {
+    uint64_t one = 1;
+    ssize_t written = write(wake_fd, &one, sizeof(one));
+    (void)written;
+  }
+}
+
+void EventLoop::Run(function<void()> task)
+{
+  if (InLoop())
+  {
+    task();
+    return;
+  }
+  mutex done_lock;
+  condition_variable done_signal;
+  bool done = false;
+  exception_ptr failure;
+  Post([&](){
+    try { task(); } catch (...) { failure = current_exception(); }
+    lock_guard<mutex> guard(done_lock);
+    done = true;
+    done_signal.notify_one();
+  });
+  unique_lock<mutex> guard(done_lock);
+  done_signal.wait(guard, [&](){ return done; });
+  if (failure) rethrow_exception(failure);
+}
+
+bool EventLoop::InLoop() const
+{
+  return this_thread::get_id() == worker.get_id();
+}
+
+void EventLoop::Watch(int fd, uint32_t events, function<void(uint32_t)> handler)
+{
+  epoll_event event;
+  event.events = events;
+  event.data.fd = fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) throw runtime_error(string("cannot watch socket: ") + strerror(errno));
+  handlers[fd] = make_shared<function<void(uint32_t)>>(move(handler));
+}
+
+void EventLoop::Modify(int fd, uint32_t events)
+{
+  epoll_event event;
+  event.events = events;
+  event.data.fd = fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+}
+
+void EventLoop::Unwatch(int fd)
+{
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+  handlers.erase(fd);
+}
+
+void EventLoop::Loop()
+{
+  epoll_event events[64];
+  vector<function<void()>> ready;
+  while (running)
+  {
+    int count = epoll_wait(epoll_fd, events, 64, -1);
+    if (count < 0 && errno != EINTR) throw runtime_error(string("epoll_wait failed: ") + strerror(errno));
+    for (int i = 0; i < count; i++)
+    {
+      int fd = events[i].data.fd;
+      if (fd == wake_fd)
+      {
+        uint64_t value;
+        ssize_t n = read(wake_fd, &value, sizeof(value));
+        (void)n;
+        continue;
+      }
+      auto handler = handlers.find(fd);
+      if (handler == handlers.end()) continue;
+      // hold the handler, which may unwatch its own socket
+      shared_ptr<function<void(uint32_t)>> callback = handler->second;
+      (*callback)(events[i].events);
+    }
+    {
+      lock_guard<mutex> guard(task_lock);
+      ready.swap(tasks);
+    }
+    for (auto &task : ready) task();
+    ready.clear();
+  }
+}
+
+SocketPublisher::SocketPublisher(EventLoop *_loop, const string &address, size_t _high_water) :
+  loop(_loop), high_water(_high_water), flush_posted(false), closed(false)
+{
+  listener = ListenSocket(address);
+  if (address.compare(0, 5, "unix:") == 0) unix_path = address.substr(5);
+  loop->Run([this](){ loop->Watch(listener, EPOLLIN, [this](uint32_t){ OnAccept(); }); });
+}
+
+SocketPublisher::~SocketPublisher()
+{
+  Close();
+}
+
+void SocketPublisher::WaitForSubscribers(size_t count)
+{
+  unique_lock<mutex> guard(lock);
+  changed.wait(guard, [&](){ return subscribers.size() >= count; });
+}
+
+void SocketPublisher::Send(const char *data, size_t size)
+{
+  unique_lock<mutex> guard(lock);
+  if (closed) throw runtime_error("send on a closed publisher");
+  changed.wait(guard, [&](){
+    for (auto &entry : subscribers)
+      if (entry.second.out.size() - entry.second.offset > high_water) return false;
+    return true;
+  });
+  for (auto &entry : subscribers)
+    entry.second.out.insert(entry.second.out.end(), data, data + size);
+  if (!flush_posted && !subscribers.empty())
+  {
+    flush_posted = true;
+    loop->Post([this](){ FlushAll(); });
+  }
+}
+
+void SocketPublisher::Close()
+{
+  {
+    unique_lock<mutex> guard(lock);
+    if (closed) return;
+    closed = true;
+    changed.wait(guard, [&](){
+      for (auto &entry : subscribers)
+        if (entry.second.offset < entry.second.out.size()) return false;
+      return true;
+    });
+  }
+  loop->Run([this](){
+    loop->Unwatch(listener);
+    close(listener);
+    lock_guard<mutex> guard(lock);
+    for (auto &entry : subscribers)
+    {
+      loop->Unwatch(entry.first);
+      close(entry.first);
+    }
+    subscribers.clear();
+  });
+  if (!unix_path.empty()) unlink(unix_path.c_str());
+}
+
+size_t SocketPublisher::GetSubscriberCount() const
+{
+  lock_guard<mutex> guard(lock);
+  return subscribers.size();
+}
+
+void SocketPublisher::OnAccept()
+{
+  while (true)
+  {
+    int fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) return;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    lock_guard<mutex> guard(lock);
+    subscribers[fd] = Subscriber{vector<char>(), 0, true};
+    // subscribers only send to hang up; watch for that and for room to write
+    loop->Watch(fd, EPOLLIN | EPOLLRDHUP, [this, fd](uint32_t events){
+      lock_guard<mutex> guard(lock);
+      auto entry = subscribers.find(fd);
+      if (entry == subscribers.end()) return;
+      if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+      {
+        char scratch[256];
+        ssize_t n = recv(fd, scratch, sizeof(scratch), 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN)) { Drop(fd); return; }
+      }
+      if (events & EPOLLOUT)
+      {
+        entry->second.writable = true;
+        loop->Modify(fd, EPOLLIN | EPOLLRDHUP);
+        if (!FlushOne(fd, entry->second)) return;
+      }
+      changed.notify_all();
+    });
+    changed.notify_all();
+  }
+}
+
+void SocketPublisher::FlushAll()
+{
+  lock_guard<mutex> guard(lock);
+  flush_posted = false;
+  vector<int> fds;
+  for (auto &entry : subscribers) fds.push_back(entry.first);
+  for (int fd : fds)
+  {
+    Subscriber &subscriber = subscribers[fd];
+    if (subscriber.writable) FlushOne(fd, subscriber);
+  }
+  changed.notify_all();
+}
+
+bool SocketPublisher::FlushOne(int fd, Subscriber &subscriber)
+{
+  while (subscriber.offset < subscriber.out.size())
+  {
+    ssize_t n = send(fd, subscriber.out.data() + subscriber.offset, subscriber.out.size() - subscriber.offset, MSG_NOSIGNAL);
+    if (n < 0)
+    {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        // wait for the socket to drain
+        subscriber.writable = false;
+        loop->Modify(fd, EPOLLIN | EPOLLRDHUP | EPOLLOUT);
+        break;
+      }
+      Drop(fd);
+      return false;
+    }
+    subscriber.offset += n;
+  }
+  if (subscriber.offset == subscriber.out.size())
+  {
+    subscriber.out.clear();
+    subscriber.offset = 0;
+  }
+  else if (subscriber.offset > subscriber.out.size() / 2)
+  {
+    subscriber.out.erase(subscriber.out.begin(), subscriber.out.begin() + subscriber.offset);
+    subscriber.offset = 0;
+  }
+  return true;
+}
+
+void SocketPublisher::Drop(int fd)
+{
+  loop->Unwatch(fd);
+  close(fd);
+  subscribers.erase(fd);
+  changed.notify_all();
+}
+
+SocketSource::SocketSource(EventLoop *_loop, const string &address, size_t _high_water, long timeout) :
+  loop(_loop), high_water(_high_water), begin(0), paused(false), finished(false)
+{
+  fd = ConnectSocket(address, timeout);
+  loop->Run([this](){ loop->Watch(fd, EPOLLIN | EPOLLRDHUP, [this](uint32_t){ OnReadable(); }); });
+}
+
+SocketSource::~SocketSource()
+{
+  loop->Run([this](){
+    if (fd < 0) return;
+    loop->Unwatch(fd);
+    close(fd);
+    fd = -1;
+  });
+}
+
+bool SocketSource::Receive(const char *&data, size_t &size)
+{
+  unique_lock<mutex> guard(lock);
+  while (true)
+  {
+    size_t queued = inbox.size() - begin;
+    if (queued >= MESSAGE_HEADER_SIZE)
+    {
+      MessageHeader header = DecodeHeader(inbox.data() + begin);
+      if (header.length < MESSAGE_HEADER_SIZE) throw runtime_error("corrupt message length");
+      if (queued >= header.length)
+      {
+        current.assign(inbox.data() + begin, inbox.data() + begin + header.length);
+        begin += header.length;
+        if (begin > inbox.size() / 2)
+        {
+          inbox.erase(inbox.begin(), inbox.begin() + begin);
+          begin = 0;
+        }
+        if (paused && inbox.size() - begin < high_water / 2)
+        {
+          paused = false;
+          loop->Post([this](){ if (fd >= 0) loop->Modify(fd, EPOLLIN | EPOLLRDHUP); });
+        }
+        data = current.data();
+        size = current.size();
+        return true;
+      }
+    }
+    if (finished)
+    {
+      if (!error.empty()) throw runtime_error(error);
+      if (queued != 0) throw runtime_error("feed ended inside a message");
+      return false;
+    }
+    arrived.wait(guard);
+  }
+}
+
+void SocketSource::OnReadable()
+{
+  char chunk[64 * 1024];
+  while (true)
+  {
+    ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+    if (n > 0)
+    {
+      lock_guard<mutex> guard(lock);
+      inbox.insert(inbox.end(), chunk, chunk + n);
+      arrived.notify_one();
+      if (inbox.size() - begin > high_water)
+      {
+        // stop reading; the kernel buffers fill and the sender blocks
+        paused = true;
+        loop->Modify(fd, 0);
+        return;
+      }
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+    if (n < 0 && errno == EINTR) continue;
+    Finish(n == 0 ? "" : string("recv failed: ") + strerror(errno));
+    return;
+  }
+}
+
+void SocketSource::Finish(const string &reason)
+{
+  loop->Unwatch(fd);
+  close(fd);
+  fd = -1;
+  lock_guard<mutex> guard(lock);
+  finished = true;
+  error = reason;
+  arrived.notify_one();
+}
+
+SocketFeedStream::SocketFeedStream(EventLoop *loop, const string &address) :
+  istream(nullptr), source(loop, address), buffer(&source)
+{
+  rdbuf(&buffer);
+}
+
+MetricsEndpoint::MetricsEndpoint(EventLoop *_loop, MetricsRegistry *_registry, const string &address) :
+  loop(_loop), registry(_registry), requests(0)
+{
+  listener = ListenSocket(address);
+  if (address.compare(0, 5, "unix:") == 0) unix_path = address.substr(5);
+  loop->Run([this](){ loop->Watch(listener, EPOLLIN, [this](uint32_t){ OnAccept(); }); });
+}
+
+MetricsEndpoint::~MetricsEndpoint()
+{
+  loop->Run([this](){
+    loop->Unwatch(listener);
+    close(listener);
+    for (auto &entry : responses)
+    {
+      loop->Unwatch(entry.first);
+      close(entry.first);
+    }
+    responses.clear();
+  });
+  if (!unix_path.empty()) unlink(unix_path.c_str());
+}
+
+long MetricsEndpoint::GetRequestCount() const
+{
+  return requests.load();
+}
+
+void MetricsEndpoint::OnAccept()
+{
+  while (true)
+  {
+    int fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) return;
+    responses[fd] = string();
+    loop->Watch(fd, EPOLLIN | EPOLLRDHUP, [this, fd](uint32_t events){ OnEvents(fd, events); });
+  }
+}
+
+void MetricsEndpoint::OnEvents(int fd, uint32_t events)
+{
+  auto entry = responses.find(fd);
+  if (entry == responses.end()) return;
+  if (events & EPOLLOUT)
+  {
+    Send(fd);
+    return;
+  }
+  // whatever the request asks for, the answer is the metrics; it only has to arrive
+  char scratch[4096];
+  ssize_t n = recv(fd, scratch, sizeof(scratch), 0);
+  if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+  if (n <= 0)
+  {
+    Drop(fd);
+    return;
+  }
+  ostringstream body;
+  registry->Write(body);
+  string text = body.str();
+  entry->second = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + to_string(text.size()) +
+                  "\r\nConnection: close\r\n\r\n" + text;
+  requests++;
+  loop->Modify(fd, EPOLLOUT);
+  Send(fd);
+}
+
+void MetricsEndpoint::Send(int fd)
+{
+  string &response = responses[fd];
+  while (!response.empty())
+  {
+    ssize_t n = send(fd, response.data(), response.size(), MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && errno == EAGAIN) return;
+    if (n <= 0) break;
+    response.erase(0, n);
+  }
+  Drop(fd);
+}
+
+void MetricsEndpoint::Drop(int fd)
+{
+  loop->Unwatch(fd);
+  close(fd);
+  responses.erase(fd);
+}
+
+#endif
@@ -9,24 +9,32 @@
 
 #include <string>
 #include "soa.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
 #include "marketdataservice.hpp"
+#include "wireformat.hpp"
+#include "transport.hpp"
 //#include "BondAlgoExecutionService.h"
 
 enum OrderType { FOK, IOC, MARKET, LIMIT, STOP };
 
 enum Market { BROKERTEC, ESPEED, CME };
 
+// Line logged for an order when there is no sink to send it to
+const LogFormat EXECUTION_ORDER_LOG = RegisterLogFormat("{}, {}, {}, {}, {}");
+
 /**
  * An execution order that can be placed on an exchange.
  * Type T is the product type.
  */
 template<typename T>
-class ExecutionOrder
+class ExecutionOrder : private CopyCounted<ExecutionOrder<T>>
 {
 
 public:
 
   // ctor for an order
+  ExecutionOrder() = default;
   ExecutionOrder(const T &_product, PricingSide _side, string _orderId, OrderType _orderType, double _price, double _visibleQuantity, double _hiddenQuantity, string _parentOrderId, bool _isChildOrder);
 
   // Get the product
@@ -81,18 +89,19 @@ class ExecutionService : public Service<string,ExecutionOrder <T> >
 public:
 
   // Execute an order on a market
-  void ExecuteOrder(const ExecutionOrder<T>& order, Market market) = 0;
+  virtual void ExecuteOrder(const ExecutionOrder<T>& order, Market market) = 0;
 
 };
 
 
 template<typename T>
-class AlgoExecution{
+class AlgoExecution : private CopyCounted<AlgoExecution<T>>{
 private:
     ExecutionOrder<T> execution_order;
 
 public:
     // ctor
+    AlgoExecution() = default;
     AlgoExecution(ExecutionOrder<T> order);
     // Update the information
     void Run(OrderBook<T> order_book);
@@ -106,10 +115,15 @@ public:
 
 
 
+// Prints executions, or given a MessageSink (e.g. a SocketPublisher) sends them
+// as EXECUTION_ORDER_MESSAGEs to the processes listening on it.
 template<typename T>
 class BondExecutionServiceConnector: public Connector<ExecutionOrder<T>>{
+private:
+    MessageSink* sink;
+    uint32_t sequence;
 public:
-    BondExecutionServiceConnector();
+    BondExecutionServiceConnector(MessageSink* _sink = nullptr);
     virtual void Publish(ExecutionOrder<T>& data) override;
 };
 
@@ -125,6 +139,8 @@ private:
     map<string, ExecutionOrder<T>> execution_map;
     vector<ServiceListener<ExecutionOrder<T>>*> listeners;
     BondExecutionServiceConnector<T>* bond_execution_service_connector;
+    ServiceMetrics metrics;
+    Counter orders_sent;
 public:
     BondExecutionService(BondExecutionServiceConnector<T>* connector);
     // Get data on our service given a key
@@ -140,6 +156,9 @@ public:
     // Get all listeners on the Service.
     virtual const vector< ServiceListener<ExecutionOrder<T>>* >& GetListeners() const override;
 
+    // Execute an order on a market through the connector
+    virtual void ExecuteOrder(const ExecutionOrder<T>& order, Market market) override;
+
     void AddAlgoExecution(AlgoExecution<T>& algo);
 
 
@@ -151,7 +170,7 @@ class BondExecutionServiceListener: public ServiceListener<AlgoExecution<T>>{
 private:
     BondExecutionService<T>* bond_execution_service;
 public:
-    BondExecutionServiceListener(ExecutionService<T>* service);
+    BondExecutionServiceListener(BondExecutionService<T>* service);
     ~BondExecutionServiceListener();
     // Listener callback to process an add event to the Service
     virtual void ProcessAdd(AlgoExecution<T> &data) override;
@@ -258,21 +277,21 @@ void AlgoExecution<T>::Run(OrderBook<T> order_book){
     }else{
         pside=OFFER;
     }
-    auto bid_order=order_book.GetBidStack().begin();
-    auto ask_order=order_book.GetOfferStack().begin();
+    auto bid_order=order_book.GetBidLevels().GetOrder(0, BID);
+    auto ask_order=order_book.GetOfferLevels().GetOrder(0, OFFER);
 
     double price;
     long visiable_num = 0,hidden_num;
     if(pside==BID){
-        price=bid_order->GetPrice();
-        if(ask_order->GetPrice()-bid_order->GetPrice()<1.5/128.0)
-            visiable_num = bid_order->GetQuantity();
+        price=bid_order.GetPrice();
+        if(ask_order.GetPrice()-bid_order.GetPrice()<1.5/128.0)
+            visiable_num = bid_order.GetQuantity();
         hidden_num = 2 * visiable_num;
     }
     else{
-        price = ask_order->GetPrice();
-        if(ask_order->GetPrice()-bid_order->GetPrice()<1.5/128.0)
-            visiable_num = ask_order->GetQuantity();
+        price = ask_order.GetPrice();
+        if(ask_order.GetPrice()-bid_order.GetPrice()<1.5/128.0)
+            visiable_num = ask_order.GetQuantity();
         hidden_num= 2 * visiable_num;
     }
     execution_order = ExecutionOrder<T>(bond,pside,"orderID",LIMIT,price,visiable_num,hidden_num,"parentID",true);
@@ -286,20 +305,38 @@ ExecutionOrder<T> AlgoExecution<T>::GetExecutionOrder() const{
 
 
 template<typename T>
-BondExecutionServiceConnector<T>::BondExecutionServiceConnector(){};
+BondExecutionServiceConnector<T>::BondExecutionServiceConnector(MessageSink* _sink){
+    sink = _sink;
+    sequence = 0;
+};
 
 template<typename T>
 void BondExecutionServiceConnector<T>::Publish(ExecutionOrder<T>& data) {
-    T bond = data.GetProduct();
-    string side;
-    chrono::milliseconds time = chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch());
-    cout<<time.count()<<", "<< bond.GetProduct().GetProductID()<<", "<<data.GetPrice() <<", "<<data.GetSide()<<
-    ", "<<data.GetVisibleQuantity()<<", "<<data.GetHiddenQuantity()<<endl;
+    if(!sink){
+        async_logger.Log(EXECUTION_ORDER_LOG, data.GetProduct().GetProductId(), data.GetPrice(), data.GetSide(),
+                         data.GetVisibleQuantity(), data.GetHiddenQuantity());
+        return;
+    }
+    ExecutionOrderRecord record;
+    CopyWireString(record.productId, data.GetProduct().GetProductId());
+    CopyWireString(record.orderId, data.GetOrderId());
+    CopyWireString(record.parentOrderId, data.GetParentOrderId());
+    record.price = data.GetPrice();
+    record.visibleQuantity = data.GetVisibleQuantity();
+    record.hiddenQuantity = data.GetHiddenQuantity();
+    record.side = data.GetSide() == BID ? 0 : 1;
+    record.orderType = data.GetOrderType();
+    record.isChildOrder = data.IsChildOrder() ? 1 : 0;
+    char message[EXECUTION_ORDER_MESSAGE_SIZE];
+    EncodeExecutionOrder(message, ++sequence, WireTimestamp(), record);
+    sink->Send(message, EXECUTION_ORDER_MESSAGE_SIZE);
 }
 
 
 template<typename T>
-BondExecutionService<T>::BondExecutionService(BondExecutionServiceConnector<T>* connector){
+BondExecutionService<T>::BondExecutionService(BondExecutionServiceConnector<T>* connector) :
+    metrics("execution") {
+    orders_sent = metrics.AddCounter("orders_sent");
     bond_execution_service_connector = connector;
 }
     // Get data on our service given a key
@@ -310,7 +347,8 @@ ExecutionOrder<T>& BondExecutionService<T>::GetData(string key) {
 
 template<typename T>
 void BondExecutionService<T>::OnMessage(ExecutionOrder<T> &data) {
-    execution_map[data.GetProduct().GetProductID()] = data;
+    ServiceHop hop(metrics);
+    execution_map[data.GetProduct().GetProductId()] = data;
 }
 
 // Add a listener to the Service for callbacks on add, remove, and update events
@@ -320,8 +358,16 @@ void BondExecutionService<T>::AddListener(ServiceListener<ExecutionOrder<T>> *li
     listeners.push_back(listener);
 }
 
+template<typename T>
+void BondExecutionService<T>::ExecuteOrder(const ExecutionOrder<T>& order, Market market) {
+    ExecutionOrder<T> published = order;
+    bond_execution_service_connector->Publish(published);
+    orders_sent.Add();
+}
+
 template<typename T>
 void BondExecutionService<T>::AddAlgoExecution(AlgoExecution<T>& algo){
+    ServiceHop hop(metrics);
     auto execution_order = algo.GetExecutionOrder();
     string bond_code = execution_order.GetProduct().GetProductId();
 
@@ -332,6 +378,7 @@ void BondExecutionService<T>::AddAlgoExecution(AlgoExecution<T>& algo){
     for(auto& i:listeners) {
         i->ProcessAdd(execution_order);
     }
+    metrics.CountOut(listeners.size());
 
 
 }
@@ -348,7 +395,7 @@ const vector< ServiceListener<ExecutionOrder<T>>* >& BondExecutionService<T>::Ge
 
 
 template<typename T>
-BondExecutionServiceListener<T>::BondExecutionServiceListener(ExecutionService<T>* service) {
+BondExecutionServiceListener<T>::BondExecutionServiceListener(BondExecutionService<T>* service) {
     bond_execution_service = service;
 }
 
@@ -358,9 +405,8 @@ BondExecutionServiceListener<T>::~BondExecutionServiceListener(){}
 // Listener callback to process an add event to the Service
 template<typename T>
 void BondExecutionServiceListener<T>::ProcessAdd(AlgoExecution<T> &data) {
-    ExecutionOrder<T>* execution_order = data.GetExecutionOrder();
-    bond_execution_service->OnMessage(*execution_order); //***
-    bond_execution_service->ExecuteOrder(*execution_order);
+    bond_execution_service->AddAlgoExecution(data);
+    bond_execution_service->ExecuteOrder(data.GetExecutionOrder(), BROKERTEC);
 }
 //template<typename T>
 //void BondExecutionServiceConnector<T>::Publish(ExecutionOrder<Bond>& data){
@@ -0,0 +1,699 @@
+/**
+ * feedinput.hpp
+ * Defines the input layer the connectors read their feeds through.
+ * A FeedStream is an istream over a plain, zip, gzip or LZB (our LZ4-style block format) file,
+ * with the decompression running on its own thread ahead of the parser.
+ */
+#ifndef FEED_INPUT_HPP
+#define FEED_INPUT_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <fstream>
+#include <istream>
+#include <streambuf>
+#include <stdexcept>
+#include <exception>
+#include <cstring>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <zlib.h>
+
+using namespace std;
+
+/**
+ * A source of raw bytes.
+ */
+class ByteSource
+{
+
+public:
+
+  virtual ~ByteSource() = default;
+
+  // Read up to n bytes into buf, returning 0 at the end of the input
+  virtual size_t Read(char *buf, size_t n) = 0;
+
+  // Discard the next n bytes, returning how many there were
+  virtual uint64_t Skip(uint64_t n);
+
+};
+
+/**
+ * Bytes of an uncompressed file.
+ */
+class FileSource : public ByteSource
+{
+
+public:
+
+  // ctor
+  FileSource(const string &path);
+
+  size_t Read(char *buf, size_t n) override;
+
+  // Seek instead of reading
+  uint64_t Skip(uint64_t n) override;
+
+private:
+  ifstream file;
+
+};
+
+/**
+ * Bytes of a deflate-compressed file: the first entry of a zip archive, or a gzip file.
+ */
+class InflateSource : public ByteSource
+{
+
+public:
+
+  // ctor; zip selects a zip archive, otherwise gzip
+  InflateSource(const string &path, bool zip);
+  ~InflateSource();
+
+  size_t Read(char *buf, size_t n) override;
+
+private:
+  ifstream file;
+  z_stream stream;
+  vector<char> input;
+  // zip entries can also be stored uncompressed
+  bool stored;
+  // bytes left of a stored entry
+  uint64_t stored_left;
+  bool finished;
+
+  // Parse the local header of the first zip entry, leaving the file at its data
+  void ReadZipHeader();
+
+};
+
+/**
+ * LZB block format, written by CompressFeed for our own archives:
+ * the magic "LZB1", then blocks of [uint32 raw size][uint32 compressed size][data],
+ * with raw size 0 ending the stream. Blocks hold at most LZB_BLOCK_SIZE bytes and are encoded
+ * as LZ4 sequences (token, literals, 16 bit offset, match length); a block whose compressed
+ * size equals its raw size is stored as is.
+ */
+const size_t LZB_BLOCK_SIZE = 1 << 20;
+
+/**
+ * Bytes of an LZB file.
+ */
+class LzbSource : public ByteSource
+{
+
+public:
+
+  // ctor
+  LzbSource(const string &path);
+
+  size_t Read(char *buf, size_t n) override;
+
+private:
+  ifstream file;
+  vector<char> compressed;
+  vector<char> block;
+  size_t block_pos;
+  bool finished;
+
+  // Decode the next block, returning false at the end of the stream
+  bool NextBlock();
+
+};
+
+// Encode src[0, n) as LZ4 sequences into dst, returning the encoded size
+size_t LzbCompressBlock(const char *src, size_t n, vector<char> &dst);
+
+// Decode an LZ4 sequence block of raw_size bytes
+void LzbDecompressBlock(const char *src, size_t n, char *dst, size_t raw_size);
+
+// Compress in into out as an LZB stream
+void CompressFeed(istream &in, ostream &out);
+
+/**
+ * Runs another source on a background thread so decompression overlaps with parsing.
+ * At most max_buffers buffers are decoded ahead of the reader.
+ */
+class PipelinedSource : public ByteSource
+{
+
+public:
+
+  // ctor
+  PipelinedSource(unique_ptr<ByteSource> _source, size_t _buffer_size = 1 << 20, size_t _max_buffers = 4);
+  ~PipelinedSource();
+
+  size_t Read(char *buf, size_t n) override;
+
+private:
+  unique_ptr<ByteSource> source;
+  size_t buffer_size;
+  size_t max_buffers;
+  deque<vector<char>> buffers;
+  size_t front_pos;
+  bool finished;
+  bool stopping;
+  exception_ptr error;
+  mutex lock;
+  condition_variable filled, drained;
+  thread worker;
+
+  void Run();
+
+};
+
+/**
+ * Stream buffer reading from a ByteSource.
+ * It counts the bytes handed out, so a reader can record how far into the feed it got
+ * and a later run can start there.
+ */
+class FeedStreamBuf : public streambuf
+{
+
+public:
+
+  // ctor; start is the offset of the source's first byte in the feed
+  FeedStreamBuf(unique_ptr<ByteSource> _source, uint64_t _start = 0);
+
+  // Get the offset of the next byte to be read
+  uint64_t GetOffset() const;
+
+  // Call callback before each refill with the offset just past the last newline read.
+  // A getline loop has processed every line before that offset by then.
+  void SetRefillCallback(function<void(uint64_t)> callback);
+
+protected:
+  int_type underflow() override;
+
+private:
+  unique_ptr<ByteSource> source;
+  vector<char> buffer;
+  // feed offset of the start of buffer
+  uint64_t buffer_offset;
+  function<void(uint64_t)> refill_callback;
+
+};
+
+/**
+ * istream over a feed file. The format is detected from the file's magic bytes,
+ * so connectors read compressed and plain feeds with the same getline loop.
+ */
+class FeedStream : public istream
+{
+
+public:
+
+  // ctor; pipelined runs the decompression on its own thread.
+  // The stream starts start bytes into the uncompressed feed, at the offset a checkpoint recorded.
+  FeedStream(const string &path, bool pipelined = true, uint64_t start = 0);
+
+  // Get the offset into the uncompressed feed of the next byte to be read
+  uint64_t GetOffset() const;
+
+  // Call callback(offset) whenever a line boundary is passed on a buffer refill;
+  // see FeedStreamBuf::SetRefillCallback
+  void SetRefillCallback(function<void(uint64_t)> callback);
+
+private:
+  FeedStreamBuf buf;
+
+  // Open the source matching the file's format, positioned start bytes in
+  static unique_ptr<ByteSource> Open(const string &path, bool pipelined, uint64_t start);
+
+};
+
+
+static uint32_t ReadLE32(const unsigned char *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint16_t ReadLE16(const unsigned char *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+static void WriteLE32(ostream &out, uint32_t v)
+{
+  char b[4] = { (char)(v & 0xff), (char)((v >> 8) & 0xff), (char)((v >> 16) & 0xff), (char)(v >> 24) };
+  out.write(b, 4);
+}
+
+FileSource::FileSource(const string &path) :
+  file(path, ios::binary)
+{
+  if (!file)
+    throw runtime_error("cannot open " + path);
+}
+
+uint64_t ByteSource::Skip(uint64_t n)
+{
+  vector<char> scratch(1 << 16);
+  uint64_t skipped = 0;
+  while (skipped < n) {
+    size_t got = Read(scratch.data(), min<uint64_t>(n - skipped, scratch.size()));
+    if (got == 0)
+      break;
+    skipped += got;
+  }
+  return skipped;
+}
+
+size_t FileSource::Read(char *buf, size_t n)
+{
+  file.read(buf, n);
+  return file.gcount();
+}
+
+uint64_t FileSource::Skip(uint64_t n)
+{
+  streamoff start = file.tellg();
+  file.seekg(0, ios::end);
+  uint64_t left = (uint64_t)(file.tellg() - start);
+  uint64_t skipped = min(n, left);
+  file.seekg(start + (streamoff)skipped);
+  return skipped;
+}
+
+InflateSource::InflateSource(const string &path, bool zip) :
+  file(path, ios::binary), input(1 << 16)
+{
+  if (!file)
+    throw runtime_error("cannot open " + path);
+  stored = false;
+  stored_left = 0;
+  finished = false;
+  memset(&stream, 0, sizeof(stream));
+  if (zip)
+    ReadZipHeader();
+  // raw deflate inside a zip, gzip header otherwise
+  if (inflateInit2(&stream, zip ? -MAX_WBITS : 16 + MAX_WBITS) != Z_OK)
+    throw runtime_error("inflateInit2 failed for " + path);
+}
+
+InflateSource::~InflateSource()
+{
+  inflateEnd(&stream);
+}
+
+void InflateSource::ReadZipHeader()
+{
+  unsigned char header[30];
+  file.read((char*)header, 30);
+  if (file.gcount() != 30 || ReadLE32(header) != 0x04034b50)
+    throw runtime_error("not a zip archive");
+  uint16_t flags = ReadLE16(header + 6);
+  uint16_t method = ReadLE16(header + 8);
+  uint32_t compressed_size = ReadLE32(header + 18);
+  uint16_t name_length = ReadLE16(header + 26);
+  uint16_t extra_length = ReadLE16(header + 28);
+  file.seekg(name_length + extra_length, ios::cur);
+  if (method == 0) {
+    // a stored entry needs its size up front
+    if (flags & 0x8)
+      throw runtime_error("unsupported zip entry: stored with data descriptor");
+    stored = true;
+    stored_left = compressed_size;
+  } else if (method != 8) {
+    throw runtime_error("unsupported zip compression method " + to_string(method));
+  }
+}
+
+size_t InflateSource::Read(char *buf, size_t n)
+{
+  if (stored) {
+    size_t want = min<uint64_t>(n, stored_left);
+    file.read(buf, want);
+    size_t got = file.gcount();
+    stored_left -= got;
+    return got;
+  }
+  if (finished)
+    return 0;
+  stream.next_out = (Bytef*)buf;
+  stream.avail_out = n;
+  while (stream.avail_out == n) {
+    if (stream.avail_in == 0) {
+      file.read(input.data(), input.size());
+      stream.next_in = (Bytef*)input.data();
+      stream.avail_in = file.gcount();
+      if (stream.avail_in == 0)
+        throw runtime_error("truncated deflate stream");
+    }
+    int ret = inflate(&stream, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END) {
+      finished = true;
+      break;
+    }
+    if (ret != Z_OK && ret != Z_BUF_ERROR)
+      throw runtime_error(string("inflate failed: ") + (stream.msg ? stream.msg : to_string(ret)));
+  }
+  return n - stream.avail_out;
+}
+
+LzbSource::LzbSource(const string &path) :
+  file(path, ios::binary)
+{
+  if (!file)
+    throw runtime_error("cannot open " + path);
+  char magic[4];
+  file.read(magic, 4);
+  if (file.gcount() != 4 || memcmp(magic, "LZB1", 4) != 0)
+    throw runtime_error("not an LZB file: " + path);
+  block_pos = 0;
+  finished = false;
+}
+
+bool LzbSource::NextBlock()
+{
+  unsigned char header[8];
+  file.read((char*)header, 8);
+  if (file.gcount() == 0)
+    return false;
+  if (file.gcount() != 8)
+    throw runtime_error("truncated LZB block header");
+  uint32_t raw_size = ReadLE32(header);
+  uint32_t compressed_size = ReadLE32(header + 4);
+  if (raw_size == 0)
+    return false;
+  if (raw_size > LZB_BLOCK_SIZE || compressed_size > raw_size)
+    throw runtime_error("corrupt LZB block header");
+  compressed.resize(compressed_size);
+  file.read(compressed.data(), compressed_size);
+  if ((uint32_t)file.gcount() != compressed_size)
+    throw runtime_error("truncated LZB block");
+  block.resize(raw_size);
+  if (compressed_size == raw_size)
+    memcpy(block.data(), compressed.data(), raw_size);
+  else
+    LzbDecompressBlock(compressed.data(), compressed_size, block.data(), raw_size);
+  block_pos = 0;
+  return true;
+}
+
+size_t LzbSource::Read(char *buf, size_t n)
+{
+  if (block_pos == block.size()) {
+    if (finished || !NextBlock()) {
+      finished = true;
+      return 0;
+    }
+  }
+  size_t got = min(n, block.size() - block_pos);
+  memcpy(buf, block.data() + block_pos, got);
+  block_pos += got;
+  return got;
+}
+
+static void LzbWriteLength(vector<char> &dst, size_t length)
+{
+  while (length >= 255) {
+    dst.push_back((char)255);
+    length -= 255;
+  }
+  dst.push_back((char)length);
+}
+
+size_t LzbCompressBlock(const char *src, size_t n, vector<char> &dst)
+{
+  const int HASH_BITS = 14;
+  const size_t MIN_MATCH = 4;
+  // as in LZ4, the last literals are never part of a match
+  const size_t MATCH_LIMIT = n < 12 ? 0 : n - 12;
+  const size_t END_LITERALS = 5;
+  vector<int64_t> table(1 << HASH_BITS, -1);
+  size_t start = dst.size();
+  size_t anchor = 0, i = 0;
+
+  while (i < MATCH_LIMIT) {
+    uint32_t sequence;
+    memcpy(&sequence, src + i, 4);
+    uint32_t h = (sequence * 2654435761u) >> (32 - HASH_BITS);
+    int64_t candidate = table[h];
+    table[h] = i;
+    uint32_t candidate_sequence = 0;
+    if (candidate >= 0)
+      memcpy(&candidate_sequence, src + candidate, 4);
+    if (candidate < 0 || i - candidate > 0xffff || candidate_sequence != sequence) {
+      i++;
+      continue;
+    }
+    size_t match = MIN_MATCH;
+    while (i + match < n - END_LITERALS && src[candidate + match] == src[i + match])
+      match++;
+
+    size_t literals = i - anchor;
+    size_t match_code = match - MIN_MATCH;
+    dst.push_back((char)((min<size_t>(literals, 15) << 4) | min<size_t>(match_code, 15)));
+    if (literals >= 15)
+      LzbWriteLength(dst, literals - 15);
+    dst.insert(dst.end(), src + anchor, src + i);
+    size_t offset = i - candidate;
+    dst.push_back((char)(offset & 0xff));
+    dst.push_back((char)(offset >> 8));
+    if (match_code >= 15)
+      LzbWriteLength(dst, match_code - 15);
+    i += match;
+    anchor = i;
+  }
+
+  size_t literals = n - anchor;
+  dst.push_back((char)(min<size_t>(literals, 15) << 4));
+  if (literals >= 15)
+    LzbWriteLength(dst, literals - 15);
+  dst.insert(dst.end(), src + anchor, src + n);
+  return dst.size() - start;
+}
+
+void LzbDecompressBlock(const char *src, size_t n, char *dst, size_t raw_size)
+{
+  const unsigned char *in = (const unsigned char*)src;
+  const unsigned char *in_end = in + n;
+  size_t out = 0;
+  auto read_length = [&](size_t length) {
+    if (length == 15) {
+      unsigned char b;
+      do {
+        if (in == in_end)
+          throw runtime_error("corrupt LZB block");
+        b = *in++;
+        length += b;
+      } while (b == 255);
+    }
+    return length;
+  };
+  while (in < in_end) {
+    unsigned char token = *in++;
+    size_t literals = read_length(token >> 4);
+    if (literals > (size_t)(in_end - in) || literals > raw_size - out)
+      throw runtime_error("corrupt LZB block");
+    memcpy(dst + out, in, literals);
+    in += literals;
+    out += literals;
+    // the last sequence has no match
+    if (in == in_end)
+      break;
+    if (in_end - in < 2)
+      throw runtime_error("corrupt LZB block");
+    size_t offset = in[0] | (in[1] << 8);
+    in += 2;
+    size_t match = read_length(token & 15) + 4;
+    if (offset == 0 || offset > out || match > raw_size - out)
+      throw runtime_error("corrupt LZB block");
+    // byte by byte, matches may overlap their own output
+    for (size_t k = 0; k < match; k++, out++)
+      dst[out] = dst[out - offset];
+  }
+  if (out != raw_size)
+    throw runtime_error("corrupt LZB block");
+}
+
+void CompressFeed(istream &in, ostream &out)
+{
+  out.write("LZB1", 4);
+  vector<char> block(LZB_BLOCK_SIZE);
+  vector<char> encoded;
+  while (true) {
+    in.read(block.data(), block.size());
+    size_t raw_size = in.gcount();
+    if (raw_size == 0)
+      break;
+    encoded.clear();
+    size_t compressed_size = LzbCompressBlock(block.data(), raw_size, encoded);
+    WriteLE32(out, raw_size);
+    if (compressed_size >= raw_size) {
+      // incompressible, store it
+      WriteLE32(out, raw_size);
+      out.write(block.data(), raw_size);
+    } else {
+      WriteLE32(out, compressed_size);
+      out.write(encoded.data(), compressed_size);
+    }
+  }
+  WriteLE32(out, 0);
+  WriteLE32(out, 0);
+}
+
+PipelinedSource::PipelinedSource(unique_ptr<ByteSource> _source, size_t _buffer_size, size_t _max_buffers) :
+  source(std::move(_source))
+{
+  buffer_size = _buffer_size;
+  max_buffers = _max_buffers;
+  front_pos = 0;
+  finished = false;
+  stopping = false;
+  worker = thread(&PipelinedSource::Run, this);
+}
+
+PipelinedSource::~PipelinedSource()
+{
+  {
+    lock_guard<mutex> guard(lock);
+    stopping = true;
+  }
+  drained.notify_all();
+  worker.join();
+}
+
+void PipelinedSource::Run()
+{
+  try {
+    while (true) {
+      vector<char> buffer(buffer_size);
+      size_t got = 0;
+      // fill the whole buffer so the reader wakes up once per buffer
+      while (got < buffer_size) {
+        size_t r = source->Read(buffer.data() + got, buffer_size - got);
+        if (r == 0)
+          break;
+        got += r;
+      }
+      buffer.resize(got);
+      unique_lock<mutex> guard(lock);
+      drained.wait(guard, [&]() { return stopping || buffers.size() < max_buffers; });
+      if (stopping)
+        return;
+      if (got == 0) {
+        finished = true;
+        filled.notify_all();
+        return;
+      }
+      buffers.push_back(std::move(buffer));
+      filled.notify_all();
+    }
+  } catch (...) {
+    lock_guard<mutex> guard(lock);
+    error = current_exception();
+    finished = true;
+    filled.notify_all();
+  }
+}
+
+size_t PipelinedSource::Read(char *buf, size_t n)
+{
+  unique_lock<mutex> guard(lock);
+  filled.wait(guard, [&]() { return !buffers.empty() || finished; });
+  if (buffers.empty()) {
+    if (error)
+      rethrow_exception(error);
+    return 0;
+  }
+  vector<char> &front = buffers.front();
+  size_t got = min(n, front.size() - front_pos);
+  memcpy(buf, front.data() + front_pos, got);
+  front_pos += got;
+  if (front_pos == front.size()) {
+    buffers.pop_front();
+    front_pos = 0;
+    drained.notify_all();
+  }
+  return got;
+}
+
+FeedStreamBuf::FeedStreamBuf(unique_ptr<ByteSource> _source, uint64_t _start) :
+  source(std::move(_source)), buffer(1 << 16)
+{
+  buffer_offset = _start;
+  setg(buffer.data(), buffer.data(), buffer.data());
+}
+
+uint64_t FeedStreamBuf::GetOffset() const
+{
+  return buffer_offset + (gptr() - eback());
+}
+
+void FeedStreamBuf::SetRefillCallback(function<void(uint64_t)> callback)
+{
+  refill_callback = callback;
+}
+
+FeedStreamBuf::int_type FeedStreamBuf::underflow()
+{
+  if (gptr() < egptr())
+    return traits_type::to_int_type(*gptr());
+  size_t used = egptr() - eback();
+  if (refill_callback && used > 0) {
+    // the bytes after the last newline belong to the line being read
+    const char *end = (const char*)memrchr(eback(), '\n', used);
+    if (end)
+      refill_callback(buffer_offset + (end + 1 - eback()));
+  }
+  buffer_offset += used;
+  size_t got = source->Read(buffer.data(), buffer.size());
+  setg(buffer.data(), buffer.data(), buffer.data() + got);
+  if (got == 0)
+    return traits_type::eof();
+  return traits_type::to_int_type(*gptr());
+}
+
+FeedStream::FeedStream(const string &path, bool pipelined, uint64_t start) :
+  istream(nullptr), buf(Open(path, pipelined, start), start)
+{
+  rdbuf(&buf);
+}
+
+uint64_t FeedStream::GetOffset() const
+{
+  return buf.GetOffset();
+}
+
+void FeedStream::SetRefillCallback(function<void(uint64_t)> callback)
+{
+  buf.SetRefillCallback(callback);
+}
+
+unique_ptr<ByteSource> FeedStream::Open(const string &path, bool pipelined, uint64_t start)
+{
+  unsigned char magic[4] = {0, 0, 0, 0};
+  {
+    ifstream probe(path, ios::binary);
+    if (!probe)
+      throw runtime_error("cannot open " + path);
+    probe.read((char*)magic, 4);
+  }
+  unique_ptr<ByteSource> source;
+  if (ReadLE32(magic) == 0x04034b50)
+    source.reset(new InflateSource(path, true));
+  else if (magic[0] == 0x1f && magic[1] == 0x8b)
+    source.reset(new InflateSource(path, false));
+  else if (memcmp(magic, "LZB1", 4) == 0)
+    source.reset(new LzbSource(path));
+  else
+    source.reset(new FileSource(path));
+  // skip on the underlying source, where a plain file can seek
+  if (start > 0 && source->Skip(start) != start)
+    throw runtime_error(path + " is shorter than the offset " + to_string(start) + " to start at");
+  // plain files gain nothing from a reader thread
+  if (pipelined && !dynamic_cast<FileSource*>(source.get()))
+    source.reset(new PipelinedSource(std::move(source)));
+  return source;
+}
+
+#endif
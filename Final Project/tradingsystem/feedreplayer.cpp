@@ -0,0 +1,127 @@
+/**
+ * feedreplayer.cpp
+ * Serves the feed files (prices.txt, trades.txt, marketdata.txt,
+ * inquiries.txt, plain or compressed) over sockets, one FEED_LINE_MESSAGE per
+ * line, so the trading system can be load-tested on one box.
+ *
+ * Usage: feedreplayer [--subscribers n] [--repeat n] [--rate lines/s] <address>=<file> ...
+ *   e.g. feedreplayer unix:/tmp/mfe/prices.sock=prices.txt tcp:127.0.0.1:7001=trades.txt
+ *
+ * Each feed waits for n subscribers (default 1) before sending, sends its
+ * file repeat times (default 1) at up to rate lines a second (default as
+ * fast as the subscribers take them), then closes.
+ */
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include "feedinput.hpp"
+#include "eventloop.hpp"
+
+using namespace std;
+
+/**
+ * Options shared by every feed.
+ */
+struct ReplayOptions
+{
+  size_t subscribers;
+  long repeat;
+  long rate;
+};
+
+// Serve the lines of path on publisher; returns the number of lines sent
+long ReplayFeed(SocketPublisher &publisher, const string &path, const ReplayOptions &options)
+{
+  publisher.WaitForSubscribers(options.subscribers);
+  vector<char> message(MESSAGE_HEADER_SIZE + MAX_FEED_LINE);
+  uint32_t sequence = 0;
+  auto start = chrono::steady_clock::now();
+  long sent = 0;
+  string line;
+  for (long pass = 0; pass < options.repeat; pass++)
+  {
+    FeedStream feed(path);
+    while (getline(feed, line))
+    {
+      if (!line.empty() && line.back() == '\r') line.pop_back();
+      size_t size = EncodeFeedLine(message.data(), ++sequence, WireTimestamp(), line.data(), line.size());
+      publisher.Send(message.data(), size);
+      ++sent;
+      if (options.rate > 0)
+        this_thread::sleep_until(start + chrono::microseconds(sent * 1000000 / options.rate));
+    }
+  }
+  publisher.Close();
+  return sent;
+}
+
+int main(int argc, char *argv[])
+{
+  ReplayOptions options = {1, 1, 0};
+  vector<pair<string, string>> feeds;
+  for (int i = 1; i < argc; i++)
+  {
+    string argument = argv[i];
+    if ((argument == "--subscribers" || argument == "--repeat" || argument == "--rate") && i + 1 < argc)
+    {
+      long value = stol(argv[++i]);
+      if (argument == "--subscribers") options.subscribers = value;
+      else if (argument == "--repeat") options.repeat = value;
+      else options.rate = value;
+      continue;
+    }
+    size_t equals = argument.find('=');
+    if (equals == string::npos)
+    {
+      cerr << "usage: " << argv[0] << " [--subscribers n] [--repeat n] [--rate lines/s] <address>=<file> ..." << '\n';
+      return 2;
+    }
+    feeds.push_back(make_pair(argument.substr(0, equals), argument.substr(equals + 1)));
+  }
+  if (feeds.empty())
+  {
+    cerr << "usage: " << argv[0] << " [--subscribers n] [--repeat n] [--rate lines/s] <address>=<file> ..." << '\n';
+    return 2;
+  }
+
+  try
+  {
+    EventLoop loop;
+    vector<unique_ptr<SocketPublisher>> publishers;
+    for (auto &feed : feeds) publishers.emplace_back(new SocketPublisher(&loop, feed.first));
+
+    vector<thread> workers;
+    vector<long> sent(feeds.size());
+    vector<string> errors(feeds.size());
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < feeds.size(); i++)
+    {
+      workers.emplace_back([&, i](){
+        try { sent[i] = ReplayFeed(*publishers[i], feeds[i].second, options); }
+        catch (const exception &e) { errors[i] = e.what(); }
+      });
+    }
+    for (auto &worker : workers) worker.join();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    int status = 0;
+    for (size_t i = 0; i < feeds.size(); i++)
+    {
+      if (!errors[i].empty())
+      {
+        cerr << feeds[i].second << ": " << errors[i] << '\n';
+        status = 1;
+        continue;
+      }
+      cerr << feeds[i].second << ": " << sent[i] << " lines to " << feeds[i].first
+           << " (" << (long)(sent[i] / seconds) << " lines/s)" << '\n';
+    }
+    return status;
+  }
+  catch (const exception &e)
+  {
+    cerr << e.what() << '\n';
+    return 1;
+  }
+}
@@ -13,6 +13,7 @@
 #include "products.hpp"
 #include "GUIService.h"
 #include "positionservice.hpp"
+#include "metrics.hpp"
 
 enum ServiceType { POSITION, RISK, EXECUTION, STREAMING, INQUIRY };
 
@@ -50,14 +51,17 @@ class BondHistoricalDataListener;
 
 template<typename T>
 class HistoricalPositionConnector: public Connector<Position<T> >{
+private:
+    ServiceMetrics metrics;
 public:
     // ctor
-    HistoricalPositionConnector(){};
+    HistoricalPositionConnector() : metrics("historical_position"){};
     virtual void Publish(Position<T> &data) override;
 };
 
 template<typename T>
 void HistoricalPositionConnector<T>::Publish(Position<T> &data) {
+    ServiceHop hop(metrics);
     auto bond=data.GetProduct();
     auto position=data.GetAggregatePosition();
 
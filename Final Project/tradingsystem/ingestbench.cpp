@@ -0,0 +1,219 @@
+/**
+ * ingestbench.cpp
+ * Benchmarks the market data connector reading a marketdata.txt line by line against the
+ * parallel ingest parsing it on 1 to the given number of threads, and checks every parallel
+ * run leaves the same books, tops of book and suppressed count as the line by line one, as
+ * does reading the first half line by line and resuming the parallel ingest at its offset.
+ * It then checks an error feeding a book stops the parallel ingest and comes back to the caller.
+ *
+ * Usage: ingestbench [--file path] [--lines n] [--threads n]
+ *   defaults: a generated file of 1000000 lines, up to 4 threads
+ */
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <cstdio>
+#include <sstream>
+#include "products.hpp"
+#include "marketdataservice.hpp"
+#include "./Data/Bond_info.h"
+
+using namespace std;
+
+/**
+ * Depth listener throwing on the given book, to exercise the error path.
+ */
+class ThrowingListener : public ServiceListener<OrderBook<Bond>>
+{
+
+public:
+
+  // ctor for a listener throwing on the books'th book it sees
+  ThrowingListener(long _books) : books(_books) {}
+
+  // Listener callback to process an add event to the Service
+  void ProcessAdd(OrderBook<Bond> &) override
+  {
+    if (--books == 0) throw runtime_error("listener failed");
+  }
+
+  // Listener callback to process a remove event to the Service
+  void ProcessRemove(OrderBook<Bond> &) override {}
+
+  // Listener callback to process an update event to the Service
+  void ProcessUpdate(OrderBook<Bond> &) override {}
+
+private:
+  long books;
+
+};
+
+// Get the seconds since start
+double SecondsSince(const chrono::steady_clock::time_point &start)
+{
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Write lines of five level books on every product, the prices moving a tick at random
+void WriteMarketData(const string &path, long lines)
+{
+  ofstream file(path);
+  mt19937_64 random(7);
+  const char *bids[] = {"99-316", "99-315", "99-31+", "99-313", "99-312", "99-311", "99-310"};
+  const char *offers[] = {"100-000", "100-001", "100-002", "100-003", "100-00+", "100-005", "100-006"};
+  for (long n = 0; n < lines; n += 10)
+  {
+    const string &code = bond_code[random() % bond_code.size()];
+    int shift = random() % 3;
+    for (int m = 1; m <= 5; m++)
+    {
+      file << code << ',' << bids[m - 1 + shift] << ',' << m * 1000000 << ",BID\n";
+      file << code << ',' << offers[m - 1 + shift] << ',' << m * 1000000 << ",OFFER\n";
+    }
+  }
+}
+
+// Check two services hold the same books, tops and suppressed count, naming the first difference
+bool SameBooks(const BondMarketDataService<Bond> &expected, const BondMarketDataService<Bond> &actual, string &difference)
+{
+  if (expected.GetSuppressedCount() != actual.GetSuppressedCount())
+  {
+    difference = "suppressed counts " + to_string(expected.GetSuppressedCount()) + " and " + to_string(actual.GetSuppressedCount());
+    return false;
+  }
+  auto &expected_books = expected.GetOrderBooks();
+  auto &actual_books = actual.GetOrderBooks();
+  if (expected_books.size() != actual_books.size())
+  {
+    difference = "book counts";
+    return false;
+  }
+  for (auto &book : expected_books)
+  {
+    auto found = actual_books.find(book.first);
+    if (found == actual_books.end())
+    {
+      difference = "no book for " + book.first;
+      return false;
+    }
+    for (PricingSide side : {BID, OFFER})
+    {
+      const OrderStack &a = side == BID ? book.second.GetBidLevels() : book.second.GetOfferLevels();
+      const OrderStack &b = side == BID ? found->second.GetBidLevels() : found->second.GetOfferLevels();
+      bool same = a.Size() == b.Size();
+      for (int l = 0; same && l < a.Size(); l++)
+        same = a.GetPrices()[l] == b.GetPrices()[l] && a.GetQuantities()[l] == b.GetQuantities()[l];
+      if (!same)
+      {
+        difference = (side == BID ? "bids of " : "offers of ") + book.first;
+        return false;
+      }
+    }
+  }
+  vector<pair<string, TopOfBook>> expected_tops, actual_tops;
+  expected.GetTopSnapshots().ReadAll(expected_tops);
+  actual.GetTopSnapshots().ReadAll(actual_tops);
+  if (expected_tops != actual_tops)
+  {
+    difference = "tops of book";
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  string path;
+  long lines = 1000000;
+  int max_threads = 4;
+  for (int i = 1; i < argc; i++)
+  {
+    string argument = argv[i];
+    if (i + 1 < argc && argument == "--file") path = argv[++i];
+    else if (i + 1 < argc && argument == "--lines") lines = stol(argv[++i]);
+    else if (i + 1 < argc && argument == "--threads") max_threads = stoi(argv[++i]);
+    else
+    {
+      cerr << "usage: " << argv[0] << " [--file path] [--lines n] [--threads n]" << '\n';
+      return 1;
+    }
+  }
+  bool generated = path.empty();
+  if (generated)
+  {
+    path = "ingestbench.txt";
+    WriteMarketData(path, lines);
+  }
+
+  BondProductService products;
+  for (size_t k = 0; k < bond_code.size(); k++)
+  {
+    Bond bond(bond_code[k], CUSIP, "T", bond_coupon[k], bond_maturity[k]);
+    products.AddBond(bond);
+  }
+
+  BondMarketDataService<Bond> expected;
+  BondMarketDataServiceConnector<Bond> expected_connector(&expected, &products);
+  auto start = chrono::steady_clock::now();
+  {
+    ifstream file(path);
+    expected_connector.Subscribe(file);
+  }
+  cout << setw(12) << "line by line" << fixed << setprecision(3) << setw(10) << SecondsSince(start) << " s\n";
+
+  bool ok = true;
+  for (int threads = 1; threads <= max_threads; threads *= 2)
+  {
+    BondMarketDataService<Bond> service;
+    BondMarketDataServiceConnector<Bond> connector(&service, &products);
+    start = chrono::steady_clock::now();
+    connector.SubscribeParallel(path, threads);
+    double seconds = SecondsSince(start);
+    string difference;
+    bool same = SameBooks(expected, service, difference);
+    cout << setw(9) << threads << " th" << setw(10) << seconds << " s  " << (same ? "same books" : "differs: " + difference) << '\n';
+    ok = ok && same;
+  }
+
+  // as after a restart from a checkpoint taken half way through the file
+  {
+    BondMarketDataService<Bond> service;
+    BondMarketDataServiceConnector<Bond> connector(&service, &products);
+    ifstream file(path);
+    string text((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    size_t offset = text.find('\n', text.size() / 2) + 1;
+    istringstream first_half(text.substr(0, offset));
+    connector.Subscribe(first_half);
+    connector.SubscribeParallel(path, max_threads, offset);
+    string difference;
+    bool same = SameBooks(expected, service, difference);
+    cout << "resumed at " << offset << ": " << (same ? "same books" : "differs: " + difference) << '\n';
+    ok = ok && same;
+  }
+
+  // a failure feeding a book must reach the caller with every thread joined
+  {
+    BondMarketDataService<Bond> service;
+    BondMarketDataServiceConnector<Bond> connector(&service, &products);
+    ThrowingListener listener(lines / 2);
+    service.AddDepthListener(&listener);
+    try
+    {
+      connector.SubscribeParallel(path, max_threads);
+      cout << "a listener error was lost\n";
+      ok = false;
+    }
+    catch (const runtime_error &e)
+    {
+      cout << "a listener error stopped the ingest: " << e.what() << '\n';
+    }
+  }
+
+  if (generated) remove(path.c_str());
+  return ok ? 0 : 1;
+}
@@ -8,7 +8,13 @@
 #define INQUIRY_SERVICE_HPP
 
 #include "soa.hpp"
+#include "metrics.hpp"
 #include "tradebookingservice.hpp"
+#include "pricingservice.hpp"
+#include "schedulerservice.hpp"
+#include "checkpoint.hpp"
+#include <functional>
+#include <stdexcept>
 
 // Various inqyury states
 enum InquiryState { RECEIVED, QUOTED, DONE, REJECTED, CUSTOMER_REJECTED };
@@ -18,12 +24,13 @@ enum InquiryState { RECEIVED, QUOTED, DONE, REJECTED, CUSTOMER_REJECTED };
  * Type T is the product type.
  */
 template<typename T>
-class Inquiry
+class Inquiry : private CopyCounted<Inquiry<T>>
 {
 
 public:
 
   // ctor for an inquiry
+  Inquiry() = default;
   Inquiry(string _inquiryId, const T &_product, Side _side, long _quantity, double _price, InquiryState _state);
 
   // Get the inquiry ID
@@ -44,6 +51,9 @@ public:
   // Get the current state on the inquiry
   InquiryState GetState() const;
 
+  // Set the price we responded with and the state
+  void SetState(double _price, InquiryState _state);
+
 private:
   string inquiryId;
   T product;
@@ -66,21 +76,115 @@ class InquiryService : public Service<string,Inquiry <T> >
 public:
 
   // Send a quote back to the client
-  void SendQuote(const string &inquiryId, double price) = 0;
+  virtual void SendQuote(const string &inquiryId, double price) = 0;
 
   // Reject an inquiry from the client
-  void RejectInquiry(const string &inquiryId) = 0;
+  virtual void RejectInquiry(const string &inquiryId) = 0;
+
+};
+
+/**
+ * Latest mid and bid/offer spread for a product.
+ */
+struct QuoteLevel
+{
+  double mid;
+  double bidOfferSpread;
+};
 
+/**
+ * Checkpointed quote level of a product.
+ */
+struct QuoteLevelRecord
+{
+  char productId[CHECKPOINT_ID_SIZE];
+  QuoteLevel level;
 };
 
+/**
+ * Checkpointed open inquiry, with what was left of its quote's time when it was taken.
+ */
+struct OpenInquiryRecord
+{
+  char inquiryId[CHECKPOINT_ID_SIZE];
+  char productId[CHECKPOINT_ID_SIZE];
+  int32_t side;
+  int32_t state;
+  long quantity;
+  double price;
+  // milliseconds until a QUOTED inquiry expires
+  long remaining;
+};
+
+/**
+ * Checkpointed number of inquiries a connector has read.
+ */
+struct InquiryCountRecord
+{
+  long count;
+};
+
+/**
+ * Slot of the open inquiry table.
+ * Type T is the product type.
+ */
+template<typename T>
+struct InquirySlot
+{
+  Inquiry<T> inquiry;
+  uint64_t key = 0;
+  bool open = false;
+  TimerHandle expiry = 0;
+  // when the quote expires on the scheduler's clock, if it is QUOTED
+  long expires_at = 0;
+};
+
+// Inquiries move RECEIVED -> QUOTED -> DONE / CUSTOMER_REJECTED on the customer's reply,
+// or to REJECTED when there is no price to quote or the quote expires unanswered.
+// Expiries run on the given SchedulerService, or on an own one following the times passed
+// to ExpireInquiries().
+// A RECEIVED inquiry is quoted right away at the latest mid -/+ half the spread from the
+// PricingService (through a BondInquiryPricingListener); customer replies arrive through
+// OnMessage with the same inquiry id and the DONE or CUSTOMER_REJECTED state.
+// Open inquiries live in a fixed-size table indexed by the inquiry id (numeric ids map
+// directly, others are hashed); an inquiry whose slot is held by another open inquiry
+// is rejected, so memory stays bounded. Listeners get ProcessAdd for every new inquiry
+// and ProcessUpdate for every state change after that.
 template<typename T>
 class BondInquiryService:public InquiryService<T>{
 private:
-    map<string, Inquiry<T>> inquiry_map;
+    vector<InquirySlot<T>> inquiry_table;
+    size_t table_mask;
+    map<string, QuoteLevel> price_map;
     vector<ServiceListener<Inquiry<T>>*> listeners;
+    ReplayClock expiry_clock;
+    SchedulerService own_scheduler;
+    SchedulerService* scheduler;
+    // how long a quote stays open, in milliseconds
+    long quote_timeout;
+    size_t open_count;
+    // inquiries rejected because their slot was taken
+    long overflow_count;
+    ServiceMetrics metrics;
+    Gauge open_inquiries;
+
+    // Get the table key of an inquiry id
+    static uint64_t GetKey(const string &inquiryId);
+
+    // Find the open slot of an inquiry, nullptr if it is not open
+    InquirySlot<T>* FindOpen(const string &inquiryId);
+
+    // Move an open inquiry to a final state and free its slot
+    void Close(InquirySlot<T> &slot, InquiryState state);
+
+    // Notify the listeners of a state change
+    void NotifyUpdate(Inquiry<T> &inquiry);
+
+    // Reject the quoted inquiry in slot if it is still open after delay milliseconds
+    void ScheduleExpiry(InquirySlot<T> &slot, long delay);
 
 public:
-    BondInquiryService();
+    BondInquiryService(size_t capacity = 1 << 16, long _quote_timeout = 1000, SchedulerService* _scheduler = nullptr);
     // Get data on our service given a key
     virtual Inquiry<T>& GetData(string key) override;
 
@@ -95,10 +199,45 @@ public:
     virtual const vector< ServiceListener<Inquiry<T>>* >& GetListeners() const override;
 
     // Send a quote back to the client
-    void SendQuote(const string &inquiryId, double price) override {};
+    void SendQuote(const string &inquiryId, double price) override;
 
     // Reject an inquiry from the client
-    void RejectInquiry(const string &inquiryId) override {};
+    void RejectInquiry(const string &inquiryId) override;
+
+    // Update the price quotes are made off
+    void UpdatePrice(const Price<T> &price);
+
+    // Advance the expiry clock to now (milliseconds) and reject expired quotes
+    void ExpireInquiries(long now);
+
+    // Get the number of open inquiries
+    size_t GetOpenCount() const;
+
+    // Get the number of inquiries rejected because the table slot was taken
+    long GetOverflowCount() const;
+
+    // Write the latest prices quotes are made off and the open inquiries into a checkpoint
+    void SaveCheckpoint(CheckpointWriter& writer) const;
+
+    // Restore the prices and open inquiries of a checkpoint, the quoted ones expiring
+    // when what was left of their time runs out; listeners are not notified
+    void LoadCheckpoint(const CheckpointReader& reader, Service<string,T>* products);
+};
+
+template<typename T>
+class BondInquiryPricingListener: public ServiceListener<Price<T>>{
+private:
+    BondInquiryService<T>* bond_inquiry_service;
+public:
+    BondInquiryPricingListener(BondInquiryService<T>* service);
+    // Listener callback to process an add event to the Service
+    virtual void ProcessAdd(Price<T> &data) override;
+
+    // Listener callback to process a remove event to the Service
+    virtual void ProcessRemove(Price<T> &data) override{};
+
+    // Listener callback to process an update event to the Service
+    virtual void ProcessUpdate(Price<T> &data) override;
 };
 
 template<typename T>
@@ -106,10 +245,18 @@ class BondInquiryConnector: public Connector<Inquiry<T>>{
 private:
     BondInquiryService<T>* bond_inquiry_service;
     BondProductService* bond_product_service;
+    // inquiries read so far, used to number them
+    long count;
 public:
     BondInquiryConnector(BondInquiryService<T>* inquiry_service, BondProductService* product_service);
     virtual void Publish(Inquiry<T>& data) override {};
-    void Subscribe(ifstream& data);
+    void Subscribe(istream& data);
+
+    // Write the number of inquiries read into a checkpoint
+    void SaveCheckpoint(CheckpointWriter& writer) const;
+
+    // Restore the number of inquiries read, so ids go on from where the checkpoint left them
+    void LoadCheckpoint(const CheckpointReader& reader);
 };
 
 
@@ -165,25 +312,226 @@ InquiryState Inquiry<T>::GetState() const
   return state;
 }
 
+template<typename T>
+void Inquiry<T>::SetState(double _price, InquiryState _state)
+{
+  price = _price;
+  state = _state;
+}
+
 
 template<typename T>
-BondInquiryService<T>::BondInquiryService(){
-    inquiry_map = map<string, Inquiry<T>>();
+BondInquiryService<T>::BondInquiryService(size_t capacity, long _quote_timeout, SchedulerService* _scheduler) :
+    own_scheduler(&expiry_clock), metrics("inquiry")
+{
+    open_inquiries = metrics.AddGauge("open_inquiries");
+    scheduler = _scheduler ? _scheduler : &own_scheduler;
+    size_t size = 1;
+    while(size < capacity) size <<= 1;
+    inquiry_table = vector<InquirySlot<T>>(size);
+    table_mask = size - 1;
+    quote_timeout = _quote_timeout;
+    open_count = 0;
+    overflow_count = 0;
 }
+
+template<typename T>
+uint64_t BondInquiryService<T>::GetKey(const string &inquiryId){
+    uint64_t key = 0;
+    for(char c:inquiryId){
+        if(c < '0' || c > '9')
+            return hash<string>()(inquiryId);
+        key = key * 10 + (c - '0');
+    }
+    return key;
+}
+
+template<typename T>
+InquirySlot<T>* BondInquiryService<T>::FindOpen(const string &inquiryId){
+    uint64_t key = GetKey(inquiryId);
+    InquirySlot<T>& slot = inquiry_table[key & table_mask];
+    if(slot.open && slot.key == key && slot.inquiry.GetInquiryId() == inquiryId)
+        return &slot;
+    return nullptr;
+}
+
 // Get data on our service given a key
 template<typename T>
 Inquiry<T>& BondInquiryService<T>::GetData(string key){
-    return inquiry_map[key];
+    InquirySlot<T>& slot = inquiry_table[GetKey(key) & table_mask];
+    if(slot.inquiry.GetInquiryId() != key)
+        throw out_of_range("no inquiry " + key);
+    return slot.inquiry;
 }
 
 // The callback that a Connector should invoke for any new or updated data
 template<typename T>
 void BondInquiryService<T>::OnMessage(Inquiry<T> &data) {
-    data.SetState(data.GetPrice(), DONE);
-    inquiry_map.insert(pair<string,Inquiry<T> >(data.GetInquiryId(),data));
-    for(auto& i:listeners) {
-        i->ProcessAdd(data);
+    ServiceHop hop(metrics);
+    const string& inquiry_id = data.GetInquiryId();
+    if(data.GetState() == RECEIVED){
+        uint64_t key = GetKey(inquiry_id);
+        InquirySlot<T>& slot = inquiry_table[key & table_mask];
+        if(slot.open){
+            // a resent inquiry that is still open needs nothing new
+            if(slot.key == key && slot.inquiry.GetInquiryId() == inquiry_id)
+                return;
+            overflow_count++;
+            data.SetState(data.GetPrice(), REJECTED);
+            for(auto& i:listeners)
+                i->ProcessAdd(data);
+            metrics.CountOut(listeners.size());
+            return;
+        }
+        slot.inquiry = data;
+        slot.key = key;
+        slot.open = true;
+        slot.expiry = 0;
+        open_count++;
+        open_inquiries.Set(open_count);
+        for(auto& i:listeners)
+            i->ProcessAdd(slot.inquiry);
+        metrics.CountOut(listeners.size());
+
+        auto level = price_map.find(data.GetProduct().GetProductId());
+        if(level == price_map.end()){
+            RejectInquiry(inquiry_id);
+            return;
+        }
+        // we sell at the offer to a buying customer and buy at the bid from a selling one
+        double half_spread = level->second.bidOfferSpread / 2.0;
+        SendQuote(inquiry_id, data.GetSide() == BUY ? level->second.mid + half_spread : level->second.mid - half_spread);
+    }else if(data.GetState() == DONE || data.GetState() == CUSTOMER_REJECTED){
+        InquirySlot<T>* slot = FindOpen(inquiry_id);
+        if(slot && slot->inquiry.GetState() == QUOTED)
+            Close(*slot, data.GetState());
+    }
+}
+
+template<typename T>
+void BondInquiryService<T>::SendQuote(const string &inquiryId, double price){
+    InquirySlot<T>* slot = FindOpen(inquiryId);
+    if(!slot || slot->inquiry.GetState() != RECEIVED)
+        return;
+    slot->inquiry.SetState(price, QUOTED);
+    ScheduleExpiry(*slot, quote_timeout);
+    NotifyUpdate(slot->inquiry);
+}
+
+template<typename T>
+void BondInquiryService<T>::ScheduleExpiry(InquirySlot<T> &slot, long delay){
+    uint64_t key = slot.key;
+    size_t index = &slot - inquiry_table.data();
+    slot.expires_at = scheduler->Now() + delay;
+    slot.expiry = scheduler->ScheduleAfter(delay, [this, index, key](){
+        InquirySlot<T>& expired = inquiry_table[index];
+        if(expired.open && expired.key == key){
+            expired.expiry = 0;
+            Close(expired, REJECTED);
+        }
+    });
+}
+
+template<typename T>
+void BondInquiryService<T>::RejectInquiry(const string &inquiryId){
+    InquirySlot<T>* slot = FindOpen(inquiryId);
+    if(slot)
+        Close(*slot, REJECTED);
+}
+
+template<typename T>
+void BondInquiryService<T>::Close(InquirySlot<T> &slot, InquiryState state){
+    if(slot.expiry){
+        scheduler->Cancel(slot.expiry);
+        slot.expiry = 0;
+    }
+    slot.open = false;
+    open_count--;
+    open_inquiries.Set(open_count);
+    slot.inquiry.SetState(slot.inquiry.GetPrice(), state);
+    NotifyUpdate(slot.inquiry);
+}
+
+template<typename T>
+void BondInquiryService<T>::NotifyUpdate(Inquiry<T> &inquiry){
+    for(auto& i:listeners)
+        i->ProcessUpdate(inquiry);
+    metrics.CountOut(listeners.size());
+}
+
+template<typename T>
+void BondInquiryService<T>::UpdatePrice(const Price<T> &price){
+    QuoteLevel level;
+    level.mid = price.GetMid();
+    level.bidOfferSpread = price.GetBidOfferSpread();
+    price_map[price.GetProduct().GetProductId()] = level;
+}
+
+template<typename T>
+void BondInquiryService<T>::ExpireInquiries(long now){
+    TimerEvent tick("", now);
+    scheduler->OnMessage(tick);
+}
+
+template<typename T>
+size_t BondInquiryService<T>::GetOpenCount() const{
+    return open_count;
+}
+
+template<typename T>
+long BondInquiryService<T>::GetOverflowCount() const{
+    return overflow_count;
+}
+
+template<typename T>
+void BondInquiryService<T>::SaveCheckpoint(CheckpointWriter& writer) const{
+    writer.BeginSection(QUOTE_LEVEL_SECTION);
+    for(auto& i:price_map){
+        QuoteLevelRecord record;
+        CopyCheckpointId(record.productId, i.first);
+        record.level = i.second;
+        writer.Write(record);
+    }
+    writer.EndSection(price_map.size());
+
+    writer.BeginSection(OPEN_INQUIRY_SECTION);
+    long now = scheduler->Now();
+    for(auto& slot:inquiry_table){
+        if(!slot.open)
+            continue;
+        const Inquiry<T>& inquiry = slot.inquiry;
+        OpenInquiryRecord record;
+        CopyCheckpointId(record.inquiryId, inquiry.GetInquiryId());
+        CopyCheckpointId(record.productId, inquiry.GetProduct().GetProductId());
+        record.side = inquiry.GetSide();
+        record.state = inquiry.GetState();
+        record.quantity = inquiry.GetQuantity();
+        record.price = inquiry.GetPrice();
+        record.remaining = inquiry.GetState() == QUOTED ? max(slot.expires_at - now, 0L) : 0;
+        writer.Write(record);
+    }
+    writer.EndSection(open_count);
+}
+
+template<typename T>
+void BondInquiryService<T>::LoadCheckpoint(const CheckpointReader& reader, Service<string,T>* products){
+    for(auto& record:reader.GetRecords<QuoteLevelRecord>(QUOTE_LEVEL_SECTION))
+        price_map[record.productId] = record.level;
+    for(auto& record:reader.GetRecords<OpenInquiryRecord>(OPEN_INQUIRY_SECTION)){
+        uint64_t key = GetKey(record.inquiryId);
+        InquirySlot<T>& slot = inquiry_table[key & table_mask];
+        if(slot.open)
+            continue;
+        slot.inquiry = Inquiry<T>(record.inquiryId, products->GetData(record.productId), (Side)record.side,
+                                  record.quantity, record.price, (InquiryState)record.state);
+        slot.key = key;
+        slot.open = true;
+        slot.expiry = 0;
+        open_count++;
+        if(record.state == QUOTED)
+            ScheduleExpiry(slot, record.remaining);
     }
+    open_inquiries.Set(open_count);
 }
 
 // Add a listener to the Service for callbacks on add, remove, and update events
@@ -200,13 +548,31 @@ const vector< ServiceListener<Inquiry<T>>* >& BondInquiryService<T>::GetListener
 }
 
 
+template<typename T>
+BondInquiryPricingListener<T>::BondInquiryPricingListener(BondInquiryService<T>* service){
+    bond_inquiry_service = service;
+}
+
+// Listener callback to process an add event to the Service
+template<typename T>
+void BondInquiryPricingListener<T>::ProcessAdd(Price<T> &data){
+    bond_inquiry_service->UpdatePrice(data);
+}
+
+// Listener callback to process an update event to the Service
+template<typename T>
+void BondInquiryPricingListener<T>::ProcessUpdate(Price<T> &data){
+    bond_inquiry_service->UpdatePrice(data);
+}
+
 template<typename T>
 BondInquiryConnector<T>::BondInquiryConnector(BondInquiryService<T>* inquiry_service, BondProductService* product_service) {
     bond_product_service = product_service;
     bond_inquiry_service = inquiry_service;
+    count = 0;
 }
 template<typename T>
-void BondInquiryConnector<T>::Subscribe(ifstream& data){
+void BondInquiryConnector<T>::Subscribe(istream& data){
     //generate inquiries.txt
     //--------
     //code | price |  num | direction | RECEIVED
@@ -231,11 +597,26 @@ void BondInquiryConnector<T>::Subscribe(ifstream& data){
         }
         InquiryState state = RECEIVED;
         auto bond = bond_product_service->GetData(bond_code);
-        Inquiry<Bond> inquiry(bond_code, bond, side, num, price, state);
+        Inquiry<Bond> inquiry(to_string(++count), bond, side, num, price, state);
         bond_inquiry_service -> OnMessage(inquiry);
     }
 }
 
+template<typename T>
+void BondInquiryConnector<T>::SaveCheckpoint(CheckpointWriter& writer) const{
+    InquiryCountRecord record;
+    record.count = count;
+    writer.BeginSection(INQUIRY_COUNT_SECTION);
+    writer.Write(record);
+    writer.EndSection(1);
+}
+
+template<typename T>
+void BondInquiryConnector<T>::LoadCheckpoint(const CheckpointReader& reader){
+    for(auto& record:reader.GetRecords<InquiryCountRecord>(INQUIRY_COUNT_SECTION))
+        count = record.count;
+}
+
 #endif
 
 
@@ -0,0 +1,596 @@
+/**
+ * logger.hpp
+ * Defines an asynchronous binary logger. A log call copies the id of a format
+ * registered up front, a tick count and its arguments into a ring of the calling
+ * thread's own; a background thread turns the records into text and writes them
+ * in batches, so the thread logging never formats, takes a lock or makes a
+ * system call.
+ */
+#ifndef LOGGER_HPP
+#define LOGGER_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <type_traits>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <cerrno>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+using namespace std;
+
+// Id of a registered format
+typedef uint32_t LogFormat;
+
+// Bytes of the ring each logging thread writes into; a power of two
+const size_t LOG_RING_SIZE = 1 << 20;
+// Formats that can be registered
+const size_t LOG_MAX_FORMATS = 1024;
+// Longest string argument kept; longer ones are cut
+const size_t LOG_MAX_STRING = 255;
+// Microseconds the writer thread sleeps once every ring is empty
+const int LOG_IDLE_SLEEP = 1000;
+// Text the writer thread holds before it writes
+const size_t LOG_WRITE_BATCH = 64 * 1024;
+
+// Type tag written ahead of each argument
+enum LogArgumentType : uint8_t { LOG_INT, LOG_UNSIGNED, LOG_DOUBLE, LOG_STRING };
+
+/**
+ * Start of each record in a ring. Records are padded to 8 bytes; a record with
+ * format LOG_WRAP only marks that the rest of the ring is unused.
+ */
+struct LogRecordHeader
+{
+  uint32_t size;
+  uint32_t format;
+  uint64_t ticks;
+};
+
+// Format of the record marking the end of a ring's used space
+const uint32_t LOG_WRAP = 0xffffffff;
+
+/**
+ * Ring of records from one logging thread to the writer thread. The logging
+ * thread only moves head and the writer only moves tail; a record that does not
+ * fit is dropped and counted rather than waited for.
+ */
+class LogRing
+{
+
+public:
+
+  // ctor for a ring of size bytes, a power of two
+  LogRing(size_t size);
+
+  // Get space for a record of size bytes, a multiple of 8, or nullptr if the ring is full
+  char* Reserve(size_t size);
+
+  // Hand the record written at the last Reserve to the writer
+  void Commit(size_t size);
+
+  // Count a record that did not fit
+  void Drop();
+
+  // Pass every committed record to format, which takes the header and the arguments after it
+  template<typename F>
+  size_t Drain(F format);
+
+  // Get the number of records dropped
+  long GetDroppedCount() const;
+
+private:
+  unique_ptr<uint64_t[]> words;
+  char *buffer;
+  uint64_t size;
+  uint64_t mask;
+  // the logging thread's side
+  atomic<uint64_t> head;
+  uint64_t reserved;
+  uint64_t cached_tail;
+  atomic<long> dropped;
+  char padding[64];
+  // the writer's side
+  atomic<uint64_t> tail;
+
+};
+
+/**
+ * Logger writing lines of text, each a local time to the microsecond and a format
+ * filled in with the arguments of one Log call, to stdout or to a file. The writer
+ * thread starts with the first Log call and stops, writing what is left, on Stop
+ * or destruction. Formats are registered with RegisterLogFormat; each {} in one
+ * takes the next argument, which may be an integer, an enum, a floating point
+ * number, a string or a C string.
+ */
+class AsyncLogger
+{
+
+public:
+
+  // ctor for a logger giving each logging thread a ring of ring_size bytes
+  AsyncLogger(size_t _ring_size = LOG_RING_SIZE);
+  ~AsyncLogger();
+
+  AsyncLogger(const AsyncLogger&) = delete;
+  AsyncLogger& operator=(const AsyncLogger&) = delete;
+
+  // Write to a file, truncating it, instead of stdout; call before the first Log
+  void Open(const string &path);
+
+  // Log args in format
+  template<typename... Args>
+  void Log(LogFormat format, const Args&... args);
+
+  // Wait until everything logged before the call is written
+  void Flush();
+
+  // Write what is left and stop the writer thread
+  void Stop();
+
+  // Get the number of records dropped because a ring was full
+  long GetDroppedCount() const;
+
+private:
+  size_t ring_size;
+  uint64_t id;
+  int fd;
+  mutex rings_mutex;
+  vector<unique_ptr<LogRing>> rings;
+  map<thread::id, LogRing*> thread_rings;
+  thread writer;
+  atomic<bool> running;
+  atomic<uint64_t> passes;
+  // a tick count and the wall clock read together, to turn ticks into times
+  uint64_t base_ticks;
+  int64_t base_nanos;
+  double nanos_per_tick;
+  string text;
+  time_t prefix_second;
+  char prefix[32];
+  long reported_drops;
+
+  // Get the calling thread's ring, adding it the first time
+  LogRing* GetRing();
+
+  // Get the ring of a thread not seen by this logger yet
+  LogRing* AddRing();
+
+  // Drain every ring until Stop
+  void Run();
+
+  // Format every record in the rings into text and write it; returns the records formatted
+  size_t Drain();
+
+  // Append the line of one record, made nanos after the epoch, to text
+  void FormatRecord(const LogRecordHeader &header, const char *arguments, int64_t nanos);
+
+  // Write text out and clear it
+  void WriteText();
+
+};
+
+// Register format, a string literal, returning the id to log it with
+LogFormat RegisterLogFormat(const char *format);
+
+// Get the tick count records are stamped with
+uint64_t LogTicks();
+
+// Formats by id, filled in before their count is raised
+const char* log_formats[LOG_MAX_FORMATS];
+atomic<size_t> log_format_count(0);
+mutex log_format_mutex;
+// Loggers are told apart by a number, as an address may be reused
+atomic<uint64_t> logger_count(0);
+
+/**
+ * Ring the calling thread last logged to, and the logger it belongs to.
+ */
+struct LogRingCache
+{
+  uint64_t logger;
+  LogRing *ring;
+};
+thread_local LogRingCache log_ring_cache = {0, nullptr};
+
+// The process's logger
+AsyncLogger async_logger;
+
+// Get the bytes an argument takes in a record
+template<typename T, typename enable_if<is_arithmetic<T>::value || is_enum<T>::value, int>::type = 0>
+size_t LogArgumentSize(const T &value)
+{
+  return 1 + 8;
+}
+
+size_t LogArgumentSize(const char *value)
+{
+  return 2 + min(strlen(value), LOG_MAX_STRING);
+}
+
+size_t LogArgumentSize(const string &value)
+{
+  return 2 + min(value.size(), LOG_MAX_STRING);
+}
+
+size_t LogArgumentsSize()
+{
+  return 0;
+}
+
+template<typename T, typename... Args>
+size_t LogArgumentsSize(const T &value, const Args&... args)
+{
+  return LogArgumentSize(value) + LogArgumentsSize(args...);
+}
+
+// Write an argument into a record at out, returning the end of it
+template<typename T, typename enable_if<is_floating_point<T>::value, int>::type = 0>
+char* EncodeLogArgument(char *out, const T &value)
+{
+  double number = value;
+  *out = LOG_DOUBLE;
+  memcpy(out + 1, &number, 8);
+  return out + 9;
+}
+
+template<typename T, typename enable_if<is_integral<T>::value && is_signed<T>::value, int>::type = 0>
+char* EncodeLogArgument(char *out, const T &value)
+{
+  int64_t number = value;
+  *out = LOG_INT;
+  memcpy(out + 1, &number, 8);
+  return out + 9;
+}
+
+template<typename T, typename enable_if<(is_integral<T>::value && !is_signed<T>::value) || is_enum<T>::value, int>::type = 0>
+char* EncodeLogArgument(char *out, const T &value)
+{
+  // enums go as their signed value
+  int64_t number = static_cast<int64_t>(value);
+  *out = is_enum<T>::value ? LOG_INT : LOG_UNSIGNED;
+  memcpy(out + 1, &number, 8);
+  return out + 9;
+}
+
+char* EncodeLogString(char *out, const char *value, size_t length)
+{
+  length = min(length, LOG_MAX_STRING);
+  out[0] = LOG_STRING;
+  out[1] = static_cast<char>(length);
+  // short strings are the rule, so copy in words rather than let memcpy set up a block move
+  char *to = out + 2;
+  if (length >= 8) {
+    for (size_t i = 0; i + 8 < length; i += 8)
+      memcpy(to + i, value + i, 8);
+    memcpy(to + length - 8, value + length - 8, 8);
+  } else {
+    for (size_t i = 0; i < length; i++)
+      to[i] = value[i];
+  }
+  return to + length;
+}
+
+char* EncodeLogArgument(char *out, const char *value)
+{
+  return EncodeLogString(out, value, strlen(value));
+}
+
+char* EncodeLogArgument(char *out, const string &value)
+{
+  return EncodeLogString(out, value.data(), value.size());
+}
+
+void EncodeLogArguments(char*)
+{
+}
+
+template<typename T, typename... Args>
+void EncodeLogArguments(char *out, const T &value, const Args&... args)
+{
+  EncodeLogArguments(EncodeLogArgument(out, value), args...);
+}
+
+LogRing::LogRing(size_t _size) :
+  words(new uint64_t[_size / 8]), size(_size), mask(_size - 1), head(0), reserved(0), cached_tail(0), dropped(0), tail(0)
+{
+  if (size < 64 || (size & mask) != 0) throw invalid_argument("log ring size " + to_string(size) + " is not a power of two");
+  buffer = reinterpret_cast<char*>(words.get());
+}
+
+char* LogRing::Reserve(size_t record_size)
+{
+  uint64_t start = head.load(memory_order_relaxed);
+  uint64_t offset = start & mask;
+  // a record does not wrap: if it does not fit before the end, it starts over at the front
+  uint64_t skip = size - offset < record_size ? size - offset : 0;
+  if (start + skip + record_size - cached_tail > size) {
+    cached_tail = tail.load(memory_order_acquire);
+    if (start + skip + record_size - cached_tail > size) return nullptr;
+  }
+  if (skip) {
+    LogRecordHeader wrap = {static_cast<uint32_t>(skip), LOG_WRAP, 0};
+    memcpy(buffer + offset, &wrap, 8);
+    start += skip;
+    offset = 0;
+  }
+  reserved = start;
+  return buffer + offset;
+}
+
+void LogRing::Commit(size_t record_size)
+{
+  head.store(reserved + record_size, memory_order_release);
+}
+
+void LogRing::Drop()
+{
+  dropped.store(dropped.load(memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+template<typename F>
+size_t LogRing::Drain(F format)
+{
+  uint64_t position = tail.load(memory_order_relaxed);
+  uint64_t end = head.load(memory_order_acquire);
+  size_t count = 0;
+  while (position < end) {
+    const char *record = buffer + (position & mask);
+    LogRecordHeader header;
+    memcpy(&header, record, 8);
+    if (header.format != LOG_WRAP) {
+      memcpy(&header, record, sizeof(header));
+      format(header, record + sizeof(header));
+      count++;
+    }
+    position += header.size;
+  }
+  tail.store(position, memory_order_release);
+  return count;
+}
+
+long LogRing::GetDroppedCount() const
+{
+  return dropped.load(memory_order_relaxed);
+}
+
+AsyncLogger::AsyncLogger(size_t _ring_size) :
+  ring_size(_ring_size), id(++logger_count), fd(STDOUT_FILENO), running(false), passes(0),
+  base_ticks(LogTicks()), base_nanos(chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count()),
+  nanos_per_tick(1), prefix_second(-1), reported_drops(0)
+{
+  if (ring_size < 64 || (ring_size & (ring_size - 1)) != 0)
+    throw invalid_argument("log ring size " + to_string(ring_size) + " is not a power of two");
+}
+
+AsyncLogger::~AsyncLogger()
+{
+  Stop();
+  if (fd != STDOUT_FILENO) close(fd);
+}
+
+void AsyncLogger::Open(const string &path)
+{
+  int opened = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (opened < 0) throw runtime_error("cannot open log " + path + ": " + strerror(errno));
+  if (fd != STDOUT_FILENO) close(fd);
+  fd = opened;
+}
+
+template<typename... Args>
+void AsyncLogger::Log(LogFormat format, const Args&... args)
+{
+  size_t size = (sizeof(LogRecordHeader) + LogArgumentsSize(args...) + 7) & ~size_t(7);
+  LogRing *ring = GetRing();
+  char *out = ring->Reserve(size);
+  if (!out) {
+    ring->Drop();
+    return;
+  }
+  LogRecordHeader header = {static_cast<uint32_t>(size), format, LogTicks()};
+  memcpy(out, &header, sizeof(header));
+  EncodeLogArguments(out + sizeof(header), args...);
+  ring->Commit(size);
+}
+
+void AsyncLogger::Flush()
+{
+  if (!running.load()) return;
+  // a pass that started after this call has taken everything logged before it
+  uint64_t target = passes.load(memory_order_acquire) + 2;
+  while (running.load() && passes.load(memory_order_acquire) < target)
+    this_thread::sleep_for(chrono::microseconds(100));
+}
+
+void AsyncLogger::Stop()
+{
+  {
+    lock_guard<mutex> lock(rings_mutex);
+    running.store(false);
+  }
+  if (writer.joinable()) writer.join();
+  Drain();
+}
+
+long AsyncLogger::GetDroppedCount() const
+{
+  long dropped = 0;
+  lock_guard<mutex> lock(const_cast<mutex&>(rings_mutex));
+  for (auto &ring : rings)
+    dropped += ring->GetDroppedCount();
+  return dropped;
+}
+
+LogRing* AsyncLogger::GetRing()
+{
+  if (log_ring_cache.logger == id) return log_ring_cache.ring;
+  return AddRing();
+}
+
+LogRing* AsyncLogger::AddRing()
+{
+  lock_guard<mutex> lock(rings_mutex);
+  LogRing *&ring = thread_rings[this_thread::get_id()];
+  if (!ring) {
+    rings.emplace_back(new LogRing(ring_size));
+    ring = rings.back().get();
+  }
+  if (!running.load() && !writer.joinable()) {
+    running.store(true);
+    writer = thread(&AsyncLogger::Run, this);
+  }
+  log_ring_cache.logger = id;
+  log_ring_cache.ring = ring;
+  return ring;
+}
+
+void AsyncLogger::Run()
+{
+  while (running.load()) {
+    size_t count = Drain();
+    passes.fetch_add(1, memory_order_release);
+    if (count == 0) this_thread::sleep_for(chrono::microseconds(LOG_IDLE_SLEEP));
+  }
+}
+
+size_t AsyncLogger::Drain()
+{
+  // the tick rate is measured over the logger's life so far; records are read soon after
+  // they are made, so they are timed back from now
+  uint64_t now_ticks = LogTicks();
+  int64_t now_nanos = chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+  if (now_ticks > base_ticks + 1000000) nanos_per_tick = double(now_nanos - base_nanos) / (now_ticks - base_ticks);
+
+  vector<LogRing*> current;
+  {
+    lock_guard<mutex> lock(rings_mutex);
+    for (auto &ring : rings)
+      current.push_back(ring.get());
+  }
+  size_t count = 0;
+  long drops = 0;
+  for (LogRing *ring : current) {
+    count += ring->Drain([&](const LogRecordHeader &header, const char *arguments) {
+      int64_t age = static_cast<int64_t>(now_ticks - header.ticks);
+      FormatRecord(header, arguments, now_nanos - static_cast<int64_t>(age * nanos_per_tick));
+      if (text.size() >= LOG_WRITE_BATCH) WriteText();
+    });
+    drops += ring->GetDroppedCount();
+  }
+  if (drops > reported_drops) {
+    text += "log ring full, dropped " + to_string(drops - reported_drops) + " records\n";
+    reported_drops = drops;
+  }
+  WriteText();
+  return count;
+}
+
+void AsyncLogger::FormatRecord(const LogRecordHeader &header, const char *arguments, int64_t nanos)
+{
+  time_t second = nanos / 1000000000;
+  if (second != prefix_second) {
+    struct tm local;
+    localtime_r(&second, &local);
+    strftime(prefix, sizeof(prefix), "%Y-%m-%d %H:%M:%S", &local);
+    prefix_second = second;
+  }
+  char number[32];
+  snprintf(number, sizeof(number), ".%06ld ", static_cast<long>(nanos % 1000000000 / 1000));
+  text += prefix;
+  text += number;
+
+  const char *format = header.format < log_format_count.load(memory_order_acquire) ? log_formats[header.format] : "(unknown format)";
+  const char *argument = arguments;
+  const char *record_end = arguments + header.size - sizeof(LogRecordHeader);
+  for (const char *c = format; *c; c++) {
+    if (c[0] != '{' || c[1] != '}') {
+      text += *c;
+      continue;
+    }
+    c++;
+    if (argument >= record_end) continue;
+    switch (static_cast<uint8_t>(*argument)) {
+      case LOG_INT: {
+        int64_t value;
+        memcpy(&value, argument + 1, 8);
+        snprintf(number, sizeof(number), "%lld", static_cast<long long>(value));
+        text += number;
+        argument += 9;
+        break;
+      }
+      case LOG_UNSIGNED: {
+        uint64_t value;
+        memcpy(&value, argument + 1, 8);
+        snprintf(number, sizeof(number), "%llu", static_cast<unsigned long long>(value));
+        text += number;
+        argument += 9;
+        break;
+      }
+      case LOG_DOUBLE: {
+        double value;
+        memcpy(&value, argument + 1, 8);
+        snprintf(number, sizeof(number), "%g", value);
+        text += number;
+        argument += 9;
+        break;
+      }
+      case LOG_STRING: {
+        size_t length = static_cast<uint8_t>(argument[1]);
+        text.append(argument + 2, length);
+        argument += 2 + length;
+        break;
+      }
+      default:
+        argument = record_end;
+    }
+  }
+  text += '\n';
+}
+
+void AsyncLogger::WriteText()
+{
+  size_t written = 0;
+  while (written < text.size()) {
+    ssize_t result = write(fd, text.data() + written, text.size() - written);
+    if (result < 0 && errno == EINTR) continue;
+    // nowhere to report a failed write to, so the text is let go
+    if (result <= 0) break;
+    written += result;
+  }
+  text.clear();
+}
+
+LogFormat RegisterLogFormat(const char *format)
+{
+  lock_guard<mutex> lock(log_format_mutex);
+  size_t count = log_format_count.load(memory_order_relaxed);
+  if (count == LOG_MAX_FORMATS) throw length_error("more than " + to_string(LOG_MAX_FORMATS) + " log formats");
+  log_formats[count] = format;
+  log_format_count.store(count + 1, memory_order_release);
+  return static_cast<LogFormat>(count);
+}
+
+uint64_t LogTicks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+#endif
@@ -11,89 +11,322 @@
 #include "inquiryservice.hpp"
 #include "historicaldataservice.hpp"
 #include "riskservice.hpp"
+#include "riskgate.hpp"
+#include "curveservice.hpp"
+#include "pnlservice.hpp"
 #include "streamingservice.hpp"
 #include "tradebookingservice.hpp"
 #include "GUIService.h"
 #include "BondAlgoStreamingService.h"
 #include "BondAlgoExecutionService.h"
+#include "feedinput.hpp"
+#include "schedulerservice.hpp"
+#include "transport.hpp"
+#include "eventloop.hpp"
+#include "checkpoint.hpp"
 #include "./Data/generate_trade.h"
 #include "./Data/generate_price.h"
 #include "./Data/generate_market_data.h"
 #include "./Data/generate_inquiry.h"
 #include "./Data/Bond_info.h"
-#include "boost/date_time/posix_time/posix_time.hpp"
+#include "logger.hpp"
 
 using namespace std;
 
-int main() {
-    cout<<"Generate raw data..."<<endl;
-    //generate prices.txt
-    //--------
-    //code | price | spread
-    //--------
-    Generate_Price generate_price = Generate_Price();
-    generate_price.run(1000000);
-
-    //generate trades.txt
-    //--------
-    //code | trader_id | price | book | num | direction
-    //--------
-    Generate_Trade generate_trade = Generate_Trade();
-    generate_trade.run(10);
-
-
-    //generate marketdata.txt
-    //--------
-    //code | price |  num | direction
-    //--------
-    Generate_Market_Data generate_market_data = Generate_Market_Data();
-    generate_market_data.run(1000000);
-
-
-    //generate inquiries.txt
-    //--------
-    //code | price |  num | direction | RECEIVED
-    //--------
-    Generate_Inquiry generate_inquiry = Generate_Inquiry();
-    generate_inquiry.run(10);
-    cout<<"Finished generate raw data..."<<endl;
-
-    PricingService<Bond> pricing_service;
+// Progress lines; each is stamped with the time it was logged
+const LogFormat PROGRESS_LOG = RegisterLogFormat("{}");
+const LogFormat RESTORED_FEED_LOG = RegisterLogFormat("Restored {} from {}");
+const LogFormat RESTORED_CHECKPOINT_LOG = RegisterLogFormat("Restored checkpoint {} in {}us");
+const LogFormat SUPPRESSED_LOG = RegisterLogFormat("Suppressed top of book updates: {}");
+const LogFormat REJECTED_TRADES_LOG = RegisterLogFormat("Rejected trade messages: {}");
+const LogFormat REJECTED_BOOKS_LOG = RegisterLogFormat("Trades not booked for want of a book id: {}");
+const LogFormat CHECKPOINTS_LOG = RegisterLogFormat("Took {} checkpoints, the last in {}us");
+
+int main(int argc, char* argv[]) {
+    // options come as --name value pairs
+    map<string, string> options;
+    for(int i = 1; i + 1 < argc; i += 2)
+        options[argv[i]] = argv[i + 1];
+
+    // with --checkpoint <path> the service state and the feed offsets it corresponds to go to
+    // path every second and at the end; if path already holds a checkpoint, the run starts
+    // from it and only replays the feed lines after it. Delete the file to start a new day.
+    string checkpoint_path = options["--checkpoint"];
+    unique_ptr<CheckpointReader> restored;
+    if(!checkpoint_path.empty() && access(checkpoint_path.c_str(), F_OK) == 0)
+        restored.reset(new CheckpointReader(checkpoint_path));
+    Checkpointer checkpointer(checkpoint_path);
+
+    // the checkpoint's offsets are into the feeds it was taken on, so keep them
+    if(!restored){
+        async_logger.Log(PROGRESS_LOG, "Generate raw data...");
+        //generate prices.txt
+        //--------
+        //code | price | spread
+        //--------
+        Generate_Price generate_price = Generate_Price();
+        generate_price.run(1000000);
+
+        //generate trades.txt
+        //--------
+        //code | trader_id | price | book | num | direction
+        //--------
+        Generate_Trade generate_trade = Generate_Trade();
+        generate_trade.run(10);
+
+
+        //generate marketdata.txt
+        //--------
+        //code | price |  num | direction
+        //--------
+        Generate_Market_Data generate_market_data = Generate_Market_Data();
+        generate_market_data.run(1000000);
+
+
+        //generate inquiries.txt
+        //--------
+        //code | price |  num | direction | RECEIVED
+        //--------
+        Generate_Inquiry generate_inquiry = Generate_Inquiry();
+        generate_inquiry.run(10);
+        async_logger.Log(PROGRESS_LOG, "Finished generate raw data...");
+    }
+
+    // with --feed-sockets <dir> the feeds come from a feedreplayer serving
+    // unix:<dir>/<feed>.sock, and executions and price streams are published
+    // to subscribers on unix:<dir>/executions.sock and unix:<dir>/streams.sock
+    string socket_dir = options["--feed-sockets"];
+    EventLoop event_loop;
+    // file feeds start at the checkpoint's offset and report how far they got on every refill
+    auto open_feed = [&](const string& name) -> unique_ptr<istream> {
+        if(socket_dir.empty()){
+            FeedStream* feed = new FeedStream(name + ".txt", true, restored ? restored->GetFeedOffset(name) : 0);
+            if(!checkpoint_path.empty()){
+                feed->SetRefillCallback([&checkpointer, name](uint64_t offset){
+                    checkpointer.SetFeedOffset(name, offset);
+                    checkpointer.Poll();
+                });
+            }
+            return unique_ptr<istream>(feed);
+        }
+        return unique_ptr<istream>(new SocketFeedStream(&event_loop, "unix:" + socket_dir + "/" + name + ".sock"));
+    };
+    // run a feed through subscribe, unless the checkpoint already holds all of it
+    auto run_feed = [&](const string& name, function<void(istream&)> subscribe){
+        if(restored && restored->IsFeedFinished(name)){
+            async_logger.Log(RESTORED_FEED_LOG, name, checkpoint_path);
+            return;
+        }
+        auto feed = open_feed(name);
+        subscribe(*feed);
+        // a read error also ends the getline loop, but the feed is not done
+        FeedStream* file = dynamic_cast<FeedStream*>(feed.get());
+        if(file && !file->bad())
+            checkpointer.SetFeedOffset(name, file->GetOffset(), true);
+    };
+    // with --metrics <address>, e.g. tcp:127.0.0.1:9100, every service's counters are served
+    // as text to any HTTP request there for as long as the run lasts
+    unique_ptr<MetricsEndpoint> metrics_endpoint;
+    if(options.count("--metrics"))
+        metrics_endpoint.reset(new MetricsEndpoint(&event_loop, &metrics_registry, options["--metrics"]));
+    unique_ptr<SocketPublisher> execution_publisher, stream_publisher;
+    if(!socket_dir.empty()){
+        execution_publisher.reset(new SocketPublisher(&event_loop, "unix:" + socket_dir + "/executions.sock"));
+        stream_publisher.reset(new SocketPublisher(&event_loop, "unix:" + socket_dir + "/streams.sock"));
+    }
+
+    // throttles, expiries and periodic flushes run off the wall clock
+    WallClock wall_clock;
+    SchedulerService scheduler(&wall_clock);
+
+    BondProductService product_service;
+    vector<Bond> on_the_runs;
+    for(size_t k = 0; k < bond_code.size(); k++){
+        on_the_runs.push_back(Bond(bond_code[k], CUSIP, "T", bond_coupon[k], bond_maturity[k]));
+        product_service.AddBond(on_the_runs.back());
+    }
+    PricingService<Bond> pricing_service(&product_service);
     BondTradeBookingService<Bond> trade_booking_service;
     BondPositionService<Bond> position_service;
     BondRiskService<Bond> risk_ervice;
     BondMarketDataService<Bond> market_data_service;
     BondAlgoExecutionService<Bond> algo_execution_service;
     BondAlgoStreamingService<Bond> algo_streaming_service;
-    GUIService<Bond> gui_service;
-    BondExecutionService<Bond> execution_service;
-    BondStreamingService<Bond> streaming_service;
-    BondInquiryService<Bond> inquiry_service;
-     //the number of different kind bonds
-    int kind = 7;
-
-    BondAlgoStreamingServiceListener<Bond>* algo_streaming_service_listener =new BondAlgoStreamingServiceListener<Bond>(algo_streaming_service);
-
-    pricing_service->AddListener(algo_streaming_service_listener);
-
-    cout << boost::posix_time::second_clock::local_time() << "Price Data is Running..." << endl;
-    ifstream price("prices.txt");
-    pricing_service.GetConnector()->Subscribe(price);
-    cout << "Finished Price Data" << endl;
-    cout << boost::posix_time::second_clock::local_time() << "Trade Data is Running..." << endl;
-    ifstream trade("trades.txt");
-    trade_booking_service.GetConnector()->Subscribe(trade);
-    cout  << "Finished Trade Data" << endl;
-
-    cout << boost::posix_time::second_clock::local_time() << "Market Data is Running..." << endl;
-    ifstream market("marketdata.txt");
-    market_data_service.GetConnector()->Subscribe(market);
-    cout << "Finished Market Data" << endl;
-
-    cout << boost::posix_time::second_clock::local_time() << "Inquiry Data is Running..." << endl;
-    ifstream inquiry("inquiries.txt");
-    inquiry_service.GetConnector()->Subscribe(inquiry);
-    cout  << "Finished Inquiry Data" << endl;
-
-    cout<<"-------- END--------"<<endl;
+    GUIService<Bond> gui_service(new GUIServiceConnector<Bond>(), &scheduler);
+    BondExecutionService<Bond> execution_service(new BondExecutionServiceConnector<Bond>(execution_publisher.get()));
+    // price streams go out as binary messages, batched to a file or to socket subscribers;
+    // streamconsumer reads either
+    BatchWriter stream_writer;
+    BondStreamingServiceConnector<Bond>* streaming_connector;
+    if(stream_publisher){
+        streaming_connector = new BondStreamingServiceConnector<Bond>(stream_publisher.get());
+    }else{
+        stream_writer.OpenFile("streaming.bin");
+        streaming_connector = new BondStreamingServiceConnector<Bond>(&stream_writer, &scheduler);
+    }
+    // with the scheduler, each product's latest stream is published once per refresh period
+    BondStreamingService<Bond> streaming_service(streaming_connector, &scheduler);
+    BondInquiryService<Bond> inquiry_service(1 << 16, 1000, &scheduler);
+    BondTradeBookingServiceConnector<Bond> trade_connector(&trade_booking_service, &product_service);
+    BondInquiryConnector<Bond> inquiry_connector(&inquiry_service, &product_service);
+    BondMarketDataServiceConnector<Bond> market_data_connector(&market_data_service, &product_service);
+
+    BondPnLService<Bond> pnl_service;
+    // the zero curve is bootstrapped off every price tick, settling on the auction date
+    BondCurveService<Bond> curve_service(date(2022, Nov, 30), on_the_runs);
+
+    if(restored){
+        auto start = chrono::steady_clock::now();
+        // the position service restores the book ids the P&L is indexed by
+        position_service.LoadCheckpoint(*restored, &product_service);
+        pnl_service.LoadCheckpoint(*restored, &product_service);
+        risk_ervice.LoadCheckpoint(*restored, &product_service);
+        market_data_service.LoadCheckpoint(*restored, &product_service);
+        market_data_connector.Restore();
+        inquiry_service.LoadCheckpoint(*restored, &product_service);
+        inquiry_connector.LoadCheckpoint(*restored);
+        // the services fed by prices restore what the prices before the checkpoint left them
+        // with, so they go on as if those prices had been read again
+        pricing_service.LoadCheckpoint(*restored, &product_service);
+        algo_streaming_service.LoadCheckpoint(*restored, &product_service);
+        streaming_service.LoadCheckpoint(*restored, &product_service);
+        curve_service.LoadCheckpoint(*restored);
+        checkpointer.Restore(*restored);
+        async_logger.Log(RESTORED_CHECKPOINT_LOG, restored->GetHeader().sequence,
+                         chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count());
+    }
+    checkpointer.AddSaver([&](CheckpointWriter& writer){
+        position_service.SaveCheckpoint(writer);
+        pnl_service.SaveCheckpoint(writer);
+        risk_ervice.SaveCheckpoint(writer);
+        market_data_service.SaveCheckpoint(writer);
+        inquiry_service.SaveCheckpoint(writer);
+        inquiry_connector.SaveCheckpoint(writer);
+        pricing_service.SaveCheckpoint(writer);
+        algo_streaming_service.SaveCheckpoint(writer);
+        streaming_service.SaveCheckpoint(writer);
+        curve_service.SaveCheckpoint(writer);
+    });
+    BondAlgoStreamingServiceListener<Bond>* algo_streaming_service_listener =new BondAlgoStreamingServiceListener<Bond>(&algo_streaming_service);
+
+    pricing_service.AddListener(algo_streaming_service_listener);
+    algo_streaming_service.AddListener(new BondStreamingServiceListener<Bond>(&streaming_service));
+
+    // the GUI gets prices throttled to one per throttle period
+    pricing_service.AddListener(new GUIServiceListener<Bond>(&gui_service));
+
+    // inquiries are quoted off the latest prices
+    BondInquiryPricingListener<Bond>* inquiry_pricing_listener = new BondInquiryPricingListener<Bond>(&inquiry_service);
+    pricing_service.AddListener(inquiry_pricing_listener);
+
+    pricing_service.AddListener(new BondCurveServiceListener<Bond>(&curve_service));
+
+    // P&L books every trade at average cost and marks on every price
+    trade_booking_service.AddListener(new BondPnLTradeListener<Bond>(&pnl_service));
+    pricing_service.AddListener(new BondPnLPricingListener<Bond>(&pnl_service));
+
+    // algo orders reach the execution service only through the pre-trade risk gate, which
+    // tracks positions and PV01s as the position and risk services publish them
+    PreTradeRiskGate<Bond> risk_gate(on_the_runs, book_registry.GetBookId("execution_book"));
+    RiskLimits execution_limits;
+    execution_limits.maxPosition = 100000000;
+    execution_limits.maxOrderNotional = 10000000;
+    risk_gate.SetBookLimits(book_registry.GetBookId("execution_book"), execution_limits);
+    // restored positions and PV01s reach no listener, so the gate starts from what they published
+    if(restored)
+        risk_gate.Seed(position_service.GetSnapshots(), risk_ervice.GetSnapshots());
+    trade_booking_service.AddListener(new BondPositionServiceListener<Bond>(&position_service));
+    position_service.AddListener(new BondRiskServiceListener<Bond>(&risk_ervice));
+    position_service.AddListener(new RiskGatePositionListener<Bond>(&risk_gate));
+    risk_ervice.AddListener(new RiskGatePV01Listener<Bond>(&risk_gate));
+    // tops of book drive the algo; its orders pass the gate to the execution service, whose
+    // executions are booked to execution_book and come back to the gate as positions
+    market_data_service.AddListener(new BondAlgoExecutionListener<Bond>(&algo_execution_service));
+    algo_execution_service.AddListener(new BondRiskGateListener<Bond>(&risk_gate, new BondExecutionServiceListener<Bond>(&execution_service)));
+    execution_service.AddListener(new BondTradeBookingServiceListener<Bond>(&trade_booking_service));
+
+    // timers run as the feeds are read: every price, trade, book and inquiry polls the
+    // scheduler once the service's other listeners have seen it
+    pricing_service.AddListener(new SchedulerPollListener<Price<Bond>>(&scheduler));
+    trade_booking_service.AddListener(new SchedulerPollListener<Trade<Bond>>(&scheduler));
+    market_data_service.AddDepthListener(new SchedulerPollListener<OrderBook<Bond>>(&scheduler));
+    inquiry_service.AddListener(new SchedulerPollListener<Inquiry<Bond>>(&scheduler));
+    scheduler.SchedulePeriodic("position_flush", 1000, [&position_service](){ position_service.Flush(); });
+
+    async_logger.Log(PROGRESS_LOG, "Price Data is Running...");
+    run_feed("prices", [&](istream& feed){ pricing_service.GetConnector()->Subscribe(feed); });
+    async_logger.Log(PROGRESS_LOG, "Finished Price Data");
+    async_logger.Log(PROGRESS_LOG, "Trade Data is Running...");
+    // trades come from trades.txt, or from a tradefeeder process with
+    // --trades-shm <name> or --trades-tcp <port>; a feeder numbers its messages from 1 on
+    // every run, so the checkpoint keeps the last sequence number booked as the offset of
+    // trade_messages and a restart skips the messages up to it
+    bool trade_stream = options.count("--trades-shm") || options.count("--trades-tcp");
+    string trade_feed = trade_stream ? "trade_messages" : "trades";
+    string other_trade_feed = trade_stream ? "trades" : "trade_messages";
+    if(restored && (restored->GetFeedOffset(other_trade_feed) || restored->IsFeedFinished(other_trade_feed)))
+        throw runtime_error("checkpoint " + checkpoint_path + " was taken reading " + other_trade_feed + ", restart with the same trade source");
+    if(!trade_stream){
+        run_feed("trades", [&](istream& feed){ trade_connector.Subscribe(feed); });
+    }else if(restored && restored->IsFeedFinished(trade_feed)){
+        async_logger.Log(RESTORED_FEED_LOG, trade_feed, checkpoint_path);
+    }else{
+        unique_ptr<MessageSource> trade_source;
+        if(options.count("--trades-shm"))
+            trade_source.reset(new ShmRingReader(options["--trades-shm"], 5000, true));
+        else
+            trade_source.reset(new TcpSource(stoi(options["--trades-tcp"])));
+        function<void(uint32_t)> received;
+        if(!checkpoint_path.empty()){
+            received = [&checkpointer](uint32_t sequence){
+                checkpointer.SetFeedOffset("trade_messages", sequence);
+                checkpointer.Poll();
+            };
+        }
+        uint32_t last = trade_connector.Subscribe(*trade_source,
+            restored ? restored->GetFeedOffset(trade_feed) : 0, received);
+        checkpointer.SetFeedOffset(trade_feed, last, true);
+    }
+    if(trade_connector.GetRejectedCount())
+        async_logger.Log(REJECTED_TRADES_LOG, trade_connector.GetRejectedCount());
+    if(position_service.GetRejectedCount())
+        async_logger.Log(REJECTED_BOOKS_LOG, position_service.GetRejectedCount());
+    // batch boundary: publish the netted positions
+    position_service.Flush();
+    async_logger.Log(PROGRESS_LOG, "Finished Trade Data");
+
+    async_logger.Log(PROGRESS_LOG, "Market Data is Running...");
+    // plain, or compressed like Data/marketdata.txt.zip; with --parallel-ingest <threads> a plain
+    // marketdata.txt is memory-mapped and parsed on that many threads while this one feeds it
+    int parallel_ingest = options.count("--parallel-ingest") ? stoi(options["--parallel-ingest"]) : 0;
+    if(parallel_ingest > 0 && socket_dir.empty()){
+        if(restored && restored->IsFeedFinished("marketdata")){
+            async_logger.Log(RESTORED_FEED_LOG, "marketdata", checkpoint_path);
+        }else{
+            uint64_t end = market_data_connector.SubscribeParallel("marketdata.txt", parallel_ingest,
+                restored ? restored->GetFeedOffset("marketdata") : 0,
+                [&checkpointer](uint64_t offset){
+                    checkpointer.SetFeedOffset("marketdata", offset);
+                    checkpointer.Poll();
+                });
+            checkpointer.SetFeedOffset("marketdata", end, true);
+        }
+    }else{
+        run_feed("marketdata", [&](istream& feed){ market_data_connector.Subscribe(feed); });
+    }
+    async_logger.Log(PROGRESS_LOG, "Finished Market Data");
+    async_logger.Log(SUPPRESSED_LOG, market_data_service.GetSuppressedCount());
+
+    async_logger.Log(PROGRESS_LOG, "Inquiry Data is Running...");
+    run_feed("inquiries", [&](istream& feed){ inquiry_connector.Subscribe(feed); });
+    // run whatever came due after the last message
+    scheduler.Poll();
+    async_logger.Log(PROGRESS_LOG, "Finished Inquiry Data");
+
+    if(!checkpoint_path.empty()){
+        checkpointer.Take();
+        async_logger.Log(CHECKPOINTS_LOG, checkpointer.GetCount(), checkpointer.GetLastDuration());
+    }
+
+    async_logger.Log(PROGRESS_LOG, "-------- END--------");
 }
@@ -10,8 +10,24 @@
 #include <string>
 #include <vector>
 #include "soa.hpp"
-#include <unordered_map>
+#include "metrics.hpp"
+#include "orderbookkernels.hpp"
+#include "snapshot.hpp"
+#include "checkpoint.hpp"
 #include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unordered_map>
 
 using namespace std;
 
@@ -69,34 +85,137 @@ private:
 };
 
 /**
- * Order book with a bid and offer stack.
+ * One side of an order book laid out as separate price and quantity arrays,
+ * so the best price search and the depth aggregation run over contiguous doubles and longs.
+ */
+class OrderStack
+{
+
+public:
+
+  // ctor for an order stack
+  OrderStack() = default;
+  OrderStack(const vector<Order> &orders);
+
+  // Get the number of levels
+  int Size() const;
+
+  // Get the level prices
+  const double* GetPrices() const;
+
+  // Get the level quantities
+  const long* GetQuantities() const;
+
+  // Add a level
+  void Add(double price, long quantity);
+
+  // Remove every level, keeping the arrays' capacity
+  void Clear();
+
+  // Get the level at index as an order on side
+  Order GetOrder(int index, PricingSide side) const;
+
+  // Get the levels as orders on side
+  vector<Order> GetOrders(PricingSide side) const;
+
+  // Get the index of the best level: highest bid or lowest offer
+  int BestIndex(PricingSide side) const;
+
+  // Aggregate the quantity at each distinct price, in order of first appearance, in one pass
+  OrderStack Aggregate() const;
+
+private:
+  vector<double> prices;
+  vector<long> quantities;
+
+};
+
+// Stacks up to this deep are aggregated by searching the distinct prices seen so far,
+// deeper ones through a hash of them; below a few hundred levels the search is the faster
+const int AGGREGATE_SEARCH_LEVELS = 256;
+
+/**
+ * Order book with a bid and offer stack, held only as price and quantity arrays.
  * Type T is the product type.
  */
 template<typename T>
-class OrderBook
+class OrderBook : private CopyCounted<OrderBook<T>>
 {
 
 public:
 
   // ctor for the order book
+  OrderBook() = default;
   OrderBook(const T &_product, const vector<Order> &_bidStack, const vector<Order> &_offerStack);
+  OrderBook(const T &_product, const OrderStack &_bidLevels, const OrderStack &_offerLevels);
 
   // Get the product
   const T& GetProduct() const;
 
-  // Get the bid stack
-  const vector<Order>& GetBidStack() const;
+  // Get the bid stack, built from the bid levels
+  vector<Order> GetBidStack() const;
+
+  // Get the offer stack, built from the offer levels
+  vector<Order> GetOfferStack() const;
+
+  // Get the bid stack as price and quantity arrays
+  const OrderStack& GetBidLevels() const;
 
-  // Get the offer stack
-  const vector<Order>& GetOfferStack() const;
+  // Get the offer stack as price and quantity arrays
+  const OrderStack& GetOfferLevels() const;
 
 private:
   T product;
-  vector<Order> bidStack;
-  vector<Order> offerStack;
+  OrderStack bidLevels;
+  OrderStack offerLevels;
 
 };
 
+/**
+ * Best bid and offer price and size last published for a product.
+ */
+struct TopOfBook
+{
+  TopOfBook() = default;
+  TopOfBook(const BidOffer &bidOffer);
+
+  bool operator==(const TopOfBook &other) const;
+
+  double bidPrice = 0;
+  long bidQuantity = 0;
+  double offerPrice = 0;
+  long offerQuantity = 0;
+};
+
+/**
+ * Checkpointed order book of a product, followed by its bidCount bid levels
+ * and offerCount offer levels.
+ */
+struct OrderBookRecord
+{
+  char productId[CHECKPOINT_ID_SIZE];
+  uint32_t bidCount;
+  uint32_t offerCount;
+};
+
+/**
+ * Checkpointed level of an order book.
+ */
+struct OrderLevelRecord
+{
+  double price;
+  long quantity;
+};
+
+/**
+ * Checkpointed last published top of book of a product.
+ */
+struct TopOfBookRecord
+{
+  char productId[CHECKPOINT_ID_SIZE];
+  TopOfBook top;
+};
+
 /**
  * Market Data Service which distributes market data
  * Keyed on product identifier.
@@ -109,19 +228,31 @@ class MarketDataService : public Service<string,OrderBook <T> >
 public:
 
   // Get the best bid/offer order
-  virtual const BidOffer& GetBestBidOffer(const string &productId) = 0;
+  virtual BidOffer GetBestBidOffer(const string &productId) = 0;
 
   // Aggregate the order book
-  virtual const OrderBook<T>& AggregateDepth(const string &productId) = 0;
+  virtual OrderBook<T> AggregateDepth(const string &productId) = 0;
 
 };
 
 
+// Listeners added with AddListener() receive the top of book, and only when the best
+// price or size on either side changed. Listeners added with AddDepthListener()
+// receive the full book on every update.
 template<typename T>
 class BondMarketDataService: public MarketDataService<T>{
 private:
     map<string, OrderBook<T>> order_map;
+    map<string, TopOfBook> top_map;
     vector<ServiceListener<OrderBook<T>>*> listeners;
+    vector<ServiceListener<OrderBook<T>>*> depth_listeners;
+    // top of book events not sent because the top did not change
+    long suppressed_count;
+    // the published tops, for readers on other threads
+    SnapshotTable<TopOfBook> top_snapshots;
+    // book updates in, and the listener calls and suppressed tops they led to
+    ServiceMetrics metrics;
+    Counter suppressed_updates;
 public:
     BondMarketDataService();
 
@@ -138,24 +269,101 @@ public:
     // Get all listeners on the Service.
     virtual const vector< ServiceListener<OrderBook<T>>* >& GetListeners() const override;
 
+    // Add a listener for every full depth update
+    void AddDepthListener(ServiceListener<OrderBook<T>> *listener);
+
+    // Get all depth listeners on the Service.
+    const vector< ServiceListener<OrderBook<T>>* >& GetDepthListeners() const;
+
+    // Get the number of top of book events suppressed so far
+    long GetSuppressedCount() const;
+
+    // Get the published tops of book, safe to read from any thread
+    const SnapshotTable<TopOfBook>& GetTopSnapshots() const;
+
+    // Get every product's latest book
+    const map<string, OrderBook<T>>& GetOrderBooks() const;
+
+    // Write the books and the last published tops into a checkpoint
+    void SaveCheckpoint(CheckpointWriter& writer) const;
+
+    // Restore the books and tops of a checkpoint into an empty service, looking the
+    // products up in products; listeners are not notified
+    void LoadCheckpoint(const CheckpointReader& reader, Service<string, T>* products);
+
     // Get the best bid/offer order
-    virtual BidOffer GetBestBidOffer(const string &productId) ;
+    virtual BidOffer GetBestBidOffer(const string &productId) override;
 
     // Aggregate the order book
-    virtual const OrderBook<T>& AggregateDepth(const string &productId)override;
+    virtual OrderBook<T> AggregateDepth(const string &productId) override;
 
 };
 
+/**
+ * One market data line: a level on one side of a product's book.
+ */
+struct MarketDataRecord
+{
+  double price;
+  long quantity;
+  PricingSide side;
+};
+
+/**
+ * The records parsed from one chunk of a market data file,
+ * grouped by product in order of first appearance and kept in file order within a product.
+ */
+struct MarketDataChunk
+{
+  vector<string> products;
+  vector<vector<MarketDataRecord>> records;
+};
+
+// Parse the lines in [begin, end) into chunk
+void ParseMarketDataChunk(const char* begin, const char* end, MarketDataChunk& chunk);
+
+/**
+ * The bid and offer stacks being built for a product.
+ * Type T is the product type.
+ */
+template<typename T>
+struct ProductStacks
+{
+  T product;
+  OrderStack bidStack;
+  OrderStack offerStack;
+};
+
+// Each product keeps its own bid and offer stacks. A side holds at most book_depth
+// levels; the level after a full side starts that side's next snapshot.
 template<typename T>
 class BondMarketDataServiceConnector: public Connector<OrderBook<T>>{
 private:
-        BondMarketDataServiceConnector<T>* bond_market_data_service;
+        BondMarketDataService<T>* bond_market_data_service;
         BondProductService* bond_product_service;
+        map<string, ProductStacks<T>> stack_map;
+        // levels per side in one snapshot of marketdata.txt
+        size_t book_depth;
+
+        // add a product's levels in order, sending the book to the service after each
+        void OnRecords(const string& bond_code, const MarketDataRecord* begin, const MarketDataRecord* end);
 public:
-        BondMarketDataServiceConnector(BondMarketDataService<T>* market_service, BondProductService* product_service);
+        BondMarketDataServiceConnector(BondMarketDataService<T>* market_service, BondProductService* product_service, size_t _book_depth = 5);
         ~BondMarketDataServiceConnector();
         virtual void Publish(OrderBook<T>& data) override {};
-        void Subscribe(ifstream& data);
+        void Subscribe(istream& data);
+
+        // Pick up the stacks being built from the service's books, after the service
+        // was restored from a checkpoint
+        void Restore();
+
+        // Memory-map the plain file at path and parse newline-aligned chunks of it, from the line
+        // boundary start on, on threads threads. Chunks are fed to the service in file order as they
+        // complete, so updates for a product arrive in file order; updates across products may
+        // interleave differently than in the file. After each chunk fed, fed gets the offset past it.
+        // An error parsing or feeding stops the threads and is rethrown once they are joined.
+        // Returns the offset of the end of the file.
+        uint64_t SubscribeParallel(const string& path, int threads, uint64_t start = 0, function<void(uint64_t)> fed = nullptr);
 };
 
 
@@ -199,9 +407,111 @@ const Order& BidOffer::GetOfferOrder() const
   return offerOrder;
 }
 
+OrderStack::OrderStack(const vector<Order> &orders)
+{
+  prices.reserve(orders.size());
+  quantities.reserve(orders.size());
+  for (auto& order : orders) {
+    Add(order.GetPrice(), order.GetQuantity());
+  }
+}
+
+int OrderStack::Size() const
+{
+  return prices.size();
+}
+
+const double* OrderStack::GetPrices() const
+{
+  return prices.data();
+}
+
+const long* OrderStack::GetQuantities() const
+{
+  return quantities.data();
+}
+
+void OrderStack::Add(double price, long quantity)
+{
+  prices.push_back(price);
+  quantities.push_back(quantity);
+}
+
+void OrderStack::Clear()
+{
+  prices.clear();
+  quantities.clear();
+}
+
+Order OrderStack::GetOrder(int index, PricingSide side) const
+{
+  return Order(prices[index], quantities[index], side);
+}
+
+vector<Order> OrderStack::GetOrders(PricingSide side) const
+{
+  vector<Order> orders;
+  orders.reserve(Size());
+  for (int i = 0; i < Size(); i++) {
+    orders.push_back(GetOrder(i, side));
+  }
+  return orders;
+}
+
+int OrderStack::BestIndex(PricingSide side) const
+{
+  double best = side == BID ? MaxPrice(prices.data(), Size()) : MinPrice(prices.data(), Size());
+  return FindPrice(prices.data(), Size(), best);
+}
+
+OrderStack OrderStack::Aggregate() const
+{
+  // each level adds its quantity to the aggregated level at its price,
+  // and only the first level at a price starts a new one
+  OrderStack levels;
+  levels.prices.reserve(Size());
+  levels.quantities.reserve(Size());
+  if (Size() <= AGGREGATE_SEARCH_LEVELS) {
+    for (int i = 0; i < Size(); i++) {
+      int level = FindPrice(levels.prices.data(), levels.Size(), prices[i]);
+      if (level < 0) levels.Add(prices[i], quantities[i]);
+      else levels.quantities[level] += quantities[i];
+    }
+    return levels;
+  }
+  unordered_map<double, int> index;
+  index.reserve(Size());
+  for (int i = 0; i < Size(); i++) {
+    auto level = index.emplace(prices[i], levels.Size());
+    if (level.second) levels.Add(prices[i], quantities[i]);
+    else levels.quantities[level.first->second] += quantities[i];
+  }
+  return levels;
+}
+
+TopOfBook::TopOfBook(const BidOffer &bidOffer)
+{
+  bidPrice = bidOffer.GetBidOrder().GetPrice();
+  bidQuantity = bidOffer.GetBidOrder().GetQuantity();
+  offerPrice = bidOffer.GetOfferOrder().GetPrice();
+  offerQuantity = bidOffer.GetOfferOrder().GetQuantity();
+}
+
+bool TopOfBook::operator==(const TopOfBook &other) const
+{
+  return bidPrice == other.bidPrice && bidQuantity == other.bidQuantity &&
+         offerPrice == other.offerPrice && offerQuantity == other.offerQuantity;
+}
+
 template<typename T>
 OrderBook<T>::OrderBook(const T &_product, const vector<Order> &_bidStack, const vector<Order> &_offerStack) :
-  product(_product), bidStack(_bidStack), offerStack(_offerStack)
+  product(_product), bidLevels(_bidStack), offerLevels(_offerStack)
+{
+}
+
+template<typename T>
+OrderBook<T>::OrderBook(const T &_product, const OrderStack &_bidLevels, const OrderStack &_offerLevels) :
+  product(_product), bidLevels(_bidLevels), offerLevels(_offerLevels)
 {
 }
 
@@ -212,24 +522,39 @@ const T& OrderBook<T>::GetProduct() const
 }
 
 template<typename T>
-const vector<Order>& OrderBook<T>::GetBidStack() const
+vector<Order> OrderBook<T>::GetBidStack() const
 {
-  return bidStack;
+  return bidLevels.GetOrders(BID);
 }
 
 template<typename T>
-const vector<Order>& OrderBook<T>::GetOfferStack() const
+vector<Order> OrderBook<T>::GetOfferStack() const
 {
-  return offerStack;
+  return offerLevels.GetOrders(OFFER);
+}
+
+template<typename T>
+const OrderStack& OrderBook<T>::GetBidLevels() const
+{
+  return bidLevels;
+}
+
+template<typename T>
+const OrderStack& OrderBook<T>::GetOfferLevels() const
+{
+  return offerLevels;
 }
 
 
 
 
 template<typename T>
-BondMarketDataService<T>::BondMarketDataService(){
+BondMarketDataService<T>::BondMarketDataService() :
+    metrics("market_data") {
+    suppressed_updates = metrics.AddCounter("suppressed_updates");
     order_map = map<string, OrderBook<T> >();
-
+    top_map = map<string, TopOfBook>();
+    suppressed_count = 0;
 }
 
 // Get data on our service given a key
@@ -241,21 +566,47 @@ OrderBook<T>& BondMarketDataService<T>::GetData(string key) {
 // The callback that a Connector should invoke for any new or updated data
 template<typename T>
 void BondMarketDataService<T>::OnMessage(OrderBook<T> &data) {
-    string key = data.GetProduct().GetProductId();
-    //if key in order_map
-    if(order_map.find(key) !=order_map.end())
-        order_map.erase(key);
-    order_map.insert(pair<string, OrderBook<T> >(key,data));
+    ServiceHop hop(metrics);
+    const string& key = data.GetProduct().GetProductId();
+    auto book = order_map.find(key);
+    if(book != order_map.end())
+        book->second = data;
+    else
+        book = order_map.insert(pair<string, OrderBook<T> >(key,data)).first;
+
+    for(auto& i:depth_listeners){
+        i->ProcessAdd(book->second);
+    }
+    metrics.CountOut(depth_listeners.size());
+
+    // no top of book until both sides are quoted
+    if(data.GetBidLevels().Size() == 0 || data.GetOfferLevels().Size() == 0)
+        return;
 
     auto bestOrder=GetBestBidOffer(key);
+    TopOfBook top(bestOrder);
+    auto last = top_map.find(key);
+    if(last != top_map.end()){
+        if(last->second == top){
+            suppressed_count++;
+            suppressed_updates.Add();
+            return;
+        }
+        last->second = top;
+    }else{
+        top_map.insert(pair<string, TopOfBook>(key, top));
+    }
+    top_snapshots.Publish(key, top);
+
     vector<Order> bid,ask;
     bid.push_back(bestOrder.GetBidOrder());
     ask.push_back(bestOrder.GetOfferOrder());
-    OrderBook<T> best_bid_ask_book=OrderBook<Bond>(data.GetProduct(),bid,ask);
+    OrderBook<T> best_bid_ask_book(data.GetProduct(),bid,ask);
 
     for(auto& i:listeners){
         i->ProcessAdd(best_bid_ask_book);
     }
+    metrics.CountOut(listeners.size());
 }
 
 // Add a listener to the Service for callbacks on add, remove, and update events
@@ -271,60 +622,106 @@ const vector< ServiceListener<OrderBook<T>>* >& BondMarketDataService<T>::GetLis
     return listeners;
 }
 
-// Get the best bid/offer order
 template<typename T>
-BidOffer BondMarketDataService<T>::GetBestBidOffer(const string &productId) {
-    auto order_book = order_map[productId];
-    auto bid_stack = order_book.GetBidStack(); auto ask_stack = order_book.GetOfferStack();
-    auto best_bid = bid_stack[0]; auto best_ask = ask_stack[0];
-    for(auto& i:ask_stack) {
-        if (i.GetPrice() < best_ask.GetPrice()) {
-            best_ask = i;
-        }
-    }
-    for(auto& i:bid_stack) {
-        if(i.GetPrice() > best_bid.GetPrice()){
-            best_bid = i;
-        }
-    }
-    return BidOffer(best_bid, best_ask);
+void BondMarketDataService<T>::AddDepthListener(ServiceListener<OrderBook<T>> *listener){
+    depth_listeners.push_back(listener);
+}
 
+template<typename T>
+const vector< ServiceListener<OrderBook<T>>* >& BondMarketDataService<T>::GetDepthListeners() const{
+    return depth_listeners;
+}
+
+template<typename T>
+long BondMarketDataService<T>::GetSuppressedCount() const{
+    return suppressed_count;
+}
+
+template<typename T>
+const SnapshotTable<TopOfBook>& BondMarketDataService<T>::GetTopSnapshots() const{
+    return top_snapshots;
 }
 
-// Aggregate the order book
 template<typename T>
-const OrderBook<T>& BondMarketDataService<T>::AggregateDepth(const string &productId){
-    OrderBook<T> order_book = order_map[productId];
-    auto bid_stack = order_book.GetBidStack(); auto ask_stack = order_book.GetOfferStack();
-    auto best_bid = bid_stack[0]; auto best_ask = ask_stack[0];
-    unordered_map<double, long> bid_info, ask_info;
-    vector<Order> new_bid_stack, new_ask_stack;
-    //update ask depth
-    for(auto& i:ask_stack) {
-        if (ask_info.find(i.GetPrice()!=ask_info.end())) {
-            ask_info[i.GetPrice()] += i.GetQuantity();
-        }else{
-            ask_info[i.GetPrice()] = i.GetQuantity();
+const map<string, OrderBook<T>>& BondMarketDataService<T>::GetOrderBooks() const{
+    return order_map;
+}
+
+template<typename T>
+void BondMarketDataService<T>::SaveCheckpoint(CheckpointWriter& writer) const{
+    writer.BeginSection(ORDER_BOOK_SECTION);
+    for(auto& i:order_map){
+        OrderBookRecord record;
+        CopyCheckpointId(record.productId, i.first);
+        record.bidCount = i.second.GetBidLevels().Size();
+        record.offerCount = i.second.GetOfferLevels().Size();
+        writer.Write(record);
+        for(const OrderStack* stack : {&i.second.GetBidLevels(), &i.second.GetOfferLevels()}){
+            for(int l = 0; l < stack->Size(); l++){
+                writer.Write(OrderLevelRecord{stack->GetPrices()[l], stack->GetQuantities()[l]});
+            }
         }
     }
-    //save result
-    for(auto& i:ask_stack){
-        new_ask_stack.push_back(Order(i.first, i.second, OFFER));
+    writer.EndSection(order_map.size());
+
+    writer.BeginSection(TOP_OF_BOOK_SECTION);
+    for(auto& i:top_map){
+        TopOfBookRecord record;
+        CopyCheckpointId(record.productId, i.first);
+        record.top = i.second;
+        writer.Write(record);
     }
-    //update bid depth
-    for(auto& i:bid_stack) {
-        if (bid_info.find(i.GetPrice()!=bid_info.end())) {
-            bid_info[i.GetPrice()] += i.GetQuantity();
-        }else{
-            bid_info[i.GetPrice()] = i.GetQuantity();
+    writer.EndSection(top_map.size());
+}
+
+template<typename T>
+void BondMarketDataService<T>::LoadCheckpoint(const CheckpointReader& reader, Service<string, T>* products){
+    const char* records;
+    uint32_t count;
+    uint64_t size;
+    if(reader.GetSection(ORDER_BOOK_SECTION, records, count, size)){
+        const char* end = records + size;
+        for(uint32_t n = 0; n < count; n++){
+            OrderBookRecord record;
+            if(records + sizeof(record) > end)
+                throw runtime_error("checkpoint order books are truncated");
+            memcpy(&record, records, sizeof(record));
+            records += sizeof(record);
+            if((uint64_t)(end - records) < (uint64_t)(record.bidCount + record.offerCount) * sizeof(OrderLevelRecord))
+                throw runtime_error("checkpoint order books are truncated");
+
+            OrderStack bid, ask;
+            for(uint32_t l = 0; l < record.bidCount + record.offerCount; l++){
+                OrderLevelRecord level;
+                memcpy(&level, records, sizeof(level));
+                records += sizeof(level);
+                (l < record.bidCount ? bid : ask).Add(level.price, level.quantity);
+            }
+            string key = record.productId;
+            order_map.insert(pair<string, OrderBook<T> >(key, OrderBook<T>(products->GetData(key), bid, ask)));
         }
     }
-    //save result
-    for(auto& i:bid_stack){
-        new_bid_stack.push_back(Order(i.first, i.second, BID));
+
+    for(auto& record:reader.GetRecords<TopOfBookRecord>(TOP_OF_BOOK_SECTION)){
+        top_map.insert(pair<string, TopOfBook>(record.productId, record.top));
+        top_snapshots.Publish(record.productId, record.top);
     }
-    return OrderBook<T>(order_book.GetProduct(), new_bid_stack, new_ask_stack);
+}
 
+// Get the best bid/offer order
+template<typename T>
+BidOffer BondMarketDataService<T>::GetBestBidOffer(const string &productId) {
+    const OrderBook<T>& order_book = order_map.at(productId);
+    const OrderStack& bid = order_book.GetBidLevels();
+    const OrderStack& ask = order_book.GetOfferLevels();
+    return BidOffer(bid.GetOrder(bid.BestIndex(BID), BID), ask.GetOrder(ask.BestIndex(OFFER), OFFER));
+}
+
+// Aggregate the order book
+template<typename T>
+OrderBook<T> BondMarketDataService<T>::AggregateDepth(const string &productId){
+    const OrderBook<T>& order_book = order_map.at(productId);
+    return OrderBook<T>(order_book.GetProduct(), order_book.GetBidLevels().Aggregate(), order_book.GetOfferLevels().Aggregate());
 }
 
 ////convert input data to price
@@ -341,10 +738,57 @@ const OrderBook<T>& BondMarketDataService<T>::AggregateDepth(const string &produ
 
 
 
+void ParseMarketDataChunk(const char* begin, const char* end, MarketDataChunk& chunk){
+    //--------
+    //code | price |  num | direction
+    //--------
+    vector<MarketDataRecord>* records = nullptr;
+    const char* line = begin;
+    while(line < end){
+        const char* eol = (const char*)memchr(line, '\n', end - line);
+        if(!eol) eol = end;
+        const char* fields[4];
+        const char* field_end[4];
+        int n = 0;
+        const char* f = line;
+        while(n < 4 && f <= eol){
+            const char* comma = (const char*)memchr(f, ',', eol - f);
+            fields[n] = f;
+            field_end[n] = comma ? comma : eol;
+            n++;
+            f = field_end[n - 1] + 1;
+        }
+        if(n == 4){
+            // lines for the same product come in runs, so compare against the last one first
+            size_t code_len = field_end[0] - fields[0];
+            const string* last = chunk.products.empty() ? nullptr : &chunk.products.back();
+            if(!last || last->size() != code_len || memcmp(last->data(), fields[0], code_len) != 0){
+                string code(fields[0], code_len);
+                size_t p = 0;
+                while(p < chunk.products.size() && chunk.products[p] != code) p++;
+                if(p == chunk.products.size()){
+                    chunk.products.push_back(code);
+                    chunk.records.emplace_back();
+                }
+                records = &chunk.records[p];
+            }else{
+                records = &chunk.records.back();
+            }
+            MarketDataRecord record;
+            record.price = transform_data_to_price(fields[1], field_end[1]);
+            record.quantity = strtol(fields[2], nullptr, 10);
+            record.side = *fields[3] == 'B' ? BID : OFFER;
+            records->push_back(record);
+        }
+        line = eol + 1;
+    }
+}
+
 template<typename T>
-BondMarketDataServiceConnector<T>::BondMarketDataServiceConnector(BondMarketDataService<T>* market_service, BondProductService* product_service) {
+BondMarketDataServiceConnector<T>::BondMarketDataServiceConnector(BondMarketDataService<T>* market_service, BondProductService* product_service, size_t _book_depth) {
     bond_market_data_service = market_service;
     bond_product_service = product_service;
+    book_depth = _book_depth;
 }
 
 template<typename T>
@@ -352,14 +796,33 @@ BondMarketDataServiceConnector<T>::~BondMarketDataServiceConnector(){}
 
 
 template<typename T>
-void BondMarketDataServiceConnector<T>::Subscribe(ifstream& data){
+void BondMarketDataServiceConnector<T>::OnRecords(const string& bond_code, const MarketDataRecord* begin, const MarketDataRecord* end){
+    auto i = stack_map.find(bond_code);
+    if(i == stack_map.end()){
+        ProductStacks<T> stacks;
+        stacks.product = bond_product_service->GetData(bond_code);
+        i = stack_map.insert(pair<string, ProductStacks<T>>(bond_code, stacks)).first;
+    }
+    ProductStacks<T>& stacks = i->second;
+    for(const MarketDataRecord* r = begin; r != end; r++){
+        OrderStack& stack = r->side == BID ? stacks.bidStack : stacks.offerStack;
+        if((size_t)stack.Size() == book_depth)
+            stack.Clear();
+        stack.Add(r->price, r->quantity);
+
+        OrderBook<T> order_book(stacks.product, stacks.bidStack, stacks.offerStack);
+        bond_market_data_service -> OnMessage(order_book);
+    }
+}
+
+template<typename T>
+void BondMarketDataServiceConnector<T>::Subscribe(istream& data){
     //generate marketdata.txt
     //--------
     //code | price |  num | direction
     //--------
 
     string info;
-    vector<Order> bid_stack,ask_stack;
     while(getline(data, info)){
         stringstream info_stream(info);
         vector<string> vec_s;
@@ -368,22 +831,146 @@ void BondMarketDataServiceConnector<T>::Subscribe(ifstream& data){
             vec_s.push_back(s);
         }
         string bond_code = vec_s[0];
-        double price = transform_data_to_price(vec_s[1]);
-        long num = stol(vec_s[2]);
-        auto direction = vec_s[3];
-        auto bond = bond_product_service->GetData(bond_code);
-
-        if (direction =="BID"){
-            bid_stack.push_back(Order(price,num,BID));
-        }else{
-            ask_stack.push_back(Order(price,num,OFFER));
-        }
-
-        OrderBook<Bond> order_book(bond, bid_stack, ask_stack);
-        bond_market_data_service -> OnMessage(order_book);
+        MarketDataRecord record;
+        record.price = transform_data_to_price(vec_s[1]);
+        record.quantity = stol(vec_s[2]);
+        record.side = vec_s[3] == "BID" ? BID : OFFER;
+        OnRecords(bond_code, &record, &record + 1);
     }
 }
-#endif
 
+template<typename T>
+void BondMarketDataServiceConnector<T>::Restore(){
+    // the connector sent each book as it built it, so the stacks are the last books sent
+    for(auto& i:bond_market_data_service->GetOrderBooks()){
+        ProductStacks<T> stacks;
+        stacks.product = i.second.GetProduct();
+        stacks.bidStack = i.second.GetBidLevels();
+        stacks.offerStack = i.second.GetOfferLevels();
+        stack_map[i.first] = stacks;
+    }
+}
 
+template<typename T>
+uint64_t BondMarketDataServiceConnector<T>::SubscribeParallel(const string& path, int threads, uint64_t start, function<void(uint64_t)> fed_callback){
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        throw runtime_error("cannot open " + path);
+    struct stat st;
+    fstat(fd, &st);
+    size_t size = st.st_size;
+    if(start > size){
+        close(fd);
+        throw runtime_error(path + " is shorter than the offset " + to_string(start) + " to start at");
+    }
+    if(start == size){
+        close(fd);
+        return size;
+    }
+    const char* data = (const char*)mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
+        throw runtime_error("cannot map " + path);
+    // the chunks are split at newlines, which a compressed file does not keep
+    if(size >= 4 && (memcmp(data, "PK\3\4", 4) == 0 || memcmp(data, "\x1f\x8b", 2) == 0 || memcmp(data, "LZB1", 4) == 0)){
+        munmap((void*)data, size);
+        throw runtime_error(path + " is compressed; parallel ingest reads plain files");
+    }
+    madvise((void*)data, size, MADV_SEQUENTIAL);
+
+    // more chunks than threads, so feeding starts early and parsed chunks do not pile up
+    if(threads < 1) threads = 1;
+    int num_chunks = threads * 8;
+    size -= start;
+    const char* text = data + start;
+    vector<const char*> bounds(num_chunks + 1);
+    bounds[0] = text;
+    for(int k = 1; k < num_chunks; k++){
+        const char* p = max(text + size * k / num_chunks, bounds[k - 1]);
+        const char* eol = (const char*)memchr(p, '\n', text + size - p);
+        bounds[k] = eol ? eol + 1 : text + size;
+    }
+    bounds[num_chunks] = text + size;
+
+    vector<MarketDataChunk> chunks(num_chunks);
+    vector<char> parsed(num_chunks, 0);
+    int next = 0, fed = 0;
+    // the first error on any thread, which stops them all
+    exception_ptr error;
+    bool stopping = false;
+    mutex lock;
+    condition_variable chunk_parsed, chunk_fed;
+
+    auto stop = [&](exception_ptr e){
+        {
+            lock_guard<mutex> guard(lock);
+            if(!error) error = e;
+            stopping = true;
+        }
+        chunk_parsed.notify_all();
+        chunk_fed.notify_all();
+    };
+    auto worker = [&](){
+        while(true){
+            int k;
+            {
+                unique_lock<mutex> guard(lock);
+                if(stopping || next == num_chunks)
+                    return;
+                k = next++;
+                // stay at most 2 * threads chunks ahead of the feeder
+                chunk_fed.wait(guard, [&](){ return stopping || k < fed + 2 * threads; });
+                if(stopping)
+                    return;
+            }
+            try{
+                ParseMarketDataChunk(bounds[k], bounds[k + 1], chunks[k]);
+            }catch(...){
+                stop(current_exception());
+                return;
+            }
+            {
+                lock_guard<mutex> guard(lock);
+                parsed[k] = 1;
+            }
+            chunk_parsed.notify_all();
+        }
+    };
+    vector<thread> pool;
+    for(int t = 0; t < threads; t++)
+        pool.emplace_back(worker);
+
+    try{
+        for(int k = 0; k < num_chunks; k++){
+            {
+                unique_lock<mutex> guard(lock);
+                chunk_parsed.wait(guard, [&](){ return stopping || parsed[k] != 0; });
+                if(stopping)
+                    break;
+            }
+            MarketDataChunk& chunk = chunks[k];
+            for(size_t p = 0; p < chunk.products.size(); p++){
+                const vector<MarketDataRecord>& records = chunk.records[p];
+                OnRecords(chunk.products[p], records.data(), records.data() + records.size());
+            }
+            chunk = MarketDataChunk();
+            {
+                lock_guard<mutex> guard(lock);
+                fed = k + 1;
+            }
+            chunk_fed.notify_all();
+            if(fed_callback)
+                fed_callback(bounds[k + 1] - data);
+        }
+    }catch(...){
+        stop(current_exception());
+    }
 
+    for(auto& t:pool)
+        t.join();
+    munmap((void*)data, start + size);
+    if(error)
+        rethrow_exception(error);
+    return start + size;
+}
+#endif
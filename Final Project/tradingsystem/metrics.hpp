@@ -0,0 +1,394 @@
+/**
+ * metrics.hpp
+ * Defines the counters and gauges services keep on their throughput and queue
+ * depths, and the registry they are read from. A counter has a cache line for
+ * each thread counting into it, so counting is a plain add on a line no other
+ * thread writes; reading sums the lines.
+ */
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <ostream>
+#include <utility>
+#include <algorithm>
+#include <cstdlib>
+#include <cstdint>
+#include <new>
+#include <stdexcept>
+#include "profiling.hpp"
+
+using namespace std;
+
+// Threads that get a line of their own in each counter; later ones share the last
+const int METRICS_MAX_THREADS = 16;
+// Bytes of a cache line
+const size_t METRICS_CACHE_LINE = 64;
+
+/**
+ * A metric's value, or one thread's share of it, on its own cache line.
+ */
+struct MetricSlot
+{
+  alignas(METRICS_CACHE_LINE) atomic<int64_t> value;
+};
+
+/**
+ * Handle to a registered counter. Copies count into the same counter.
+ */
+class Counter
+{
+
+public:
+
+  // ctor for a counter not in any registry, which counts but is never read
+  Counter();
+
+  // ctor for the counter with a line per thread at slots
+  Counter(MetricSlot *_slots);
+
+  // Add n
+  void Add(int64_t n = 1);
+
+  // Get the count over every thread
+  int64_t GetValue() const;
+
+private:
+  MetricSlot *slots;
+
+};
+
+/**
+ * Handle to a registered gauge, a level such as a queue depth that any thread
+ * may set or move.
+ */
+class Gauge
+{
+
+public:
+
+  // ctor for a gauge not in any registry
+  Gauge();
+
+  // ctor for the gauge at slot
+  Gauge(MetricSlot *_slot);
+
+  // Set the level
+  void Set(int64_t level);
+
+  // Move the level by n
+  void Add(int64_t n);
+
+  // Get the level
+  int64_t GetValue() const;
+
+private:
+  MetricSlot *slot;
+
+};
+
+/**
+ * Every counter and gauge of the process, by name and labels, written out in
+ * the Prometheus text format. Metrics are added at construction of whatever
+ * keeps them and are never removed, so a handle stays valid for the life of
+ * the registry.
+ */
+class MetricsRegistry
+{
+
+public:
+
+  // ctor
+  MetricsRegistry();
+  ~MetricsRegistry();
+
+  MetricsRegistry(const MetricsRegistry&) = delete;
+  MetricsRegistry& operator=(const MetricsRegistry&) = delete;
+
+  // Get a name for a new instance of service: service the first time, then service_2, service_3, ...
+  string AddInstance(const string &service);
+
+  // Get the counter name with labels, such as service="pricing", adding it the first time
+  Counter AddCounter(const string &name, const string &labels = "");
+
+  // Get the gauge name with labels, adding it the first time
+  Gauge AddGauge(const string &name, const string &labels = "");
+
+  // Get the value of a metric, 0 if there is none
+  int64_t GetValue(const string &name, const string &labels = "") const;
+
+  // Write every metric, a "name{labels} value" line each, grouped by name
+  void Write(ostream &out) const;
+
+private:
+  struct Metric
+  {
+    bool counter;
+    MetricSlot *slots;
+  };
+  mutable mutex lock;
+  map<pair<string, string>, Metric> metrics;
+  map<string, int> instances;
+
+  // Get the metric name with labels, adding one with count slots the first time
+  Metric& Find(const string &name, const string &labels, bool counter);
+
+};
+
+/**
+ * The counters every instrumented service keeps under its instance name:
+ * messages taken in, through OnMessage or the call that stands for it, and
+ * listener callbacks made.
+ */
+class ServiceMetrics
+{
+
+public:
+
+  // ctor registering the counters of a new instance of service
+  ServiceMetrics(const string &service);
+
+  // Get the instance name, the service label of its metrics
+  const string& GetName() const;
+
+  // Count a message in
+  void CountIn();
+
+  // Count a message out to each of listeners listeners
+  void CountOut(size_t listeners);
+
+  // Get a further counter of this instance
+  Counter AddCounter(const string &name) const;
+
+  // Get a gauge of this instance
+  Gauge AddGauge(const string &name) const;
+
+  // Get the instance's hop in the copy and allocation profile
+  int GetProfileHop() const;
+
+private:
+  string name;
+  Counter messages_in;
+  Counter listener_calls;
+  int profile_hop;
+
+};
+
+/**
+ * A service's handling of one message in, from its OnMessage or the call that
+ * stands for it until that returns: counts the message in and, in the profiling
+ * build, puts the copies and allocations made meanwhile down to the service.
+ */
+class ServiceHop
+{
+
+public:
+
+  // ctor for a message into the service keeping metrics
+  ServiceHop(ServiceMetrics &metrics);
+  ~ServiceHop();
+
+  ServiceHop(const ServiceHop&) = delete;
+  ServiceHop& operator=(const ServiceHop&) = delete;
+
+private:
+  int previous_hop;
+
+};
+
+// Get the calling thread's line in every counter
+int MetricsThreadSlot();
+
+// The process's metrics
+MetricsRegistry metrics_registry;
+
+// Threads given a line so far
+atomic<int> metrics_thread_count(0);
+thread_local int metrics_thread_slot = -1;
+// Lines of the handles not in a registry
+MetricSlot unregistered_slots[METRICS_MAX_THREADS];
+
+Counter::Counter() :
+  slots(unregistered_slots)
+{
+}
+
+Counter::Counter(MetricSlot *_slots) :
+  slots(_slots)
+{
+}
+
+void Counter::Add(int64_t n)
+{
+  int slot = MetricsThreadSlot();
+  atomic<int64_t> &value = slots[slot].value;
+  // a line of its own needs no locked add; the shared last line does
+  if (slot < METRICS_MAX_THREADS - 1) value.store(value.load(memory_order_relaxed) + n, memory_order_relaxed);
+  else value.fetch_add(n, memory_order_relaxed);
+}
+
+int64_t Counter::GetValue() const
+{
+  int64_t sum = 0;
+  for (int i = 0; i < METRICS_MAX_THREADS; i++)
+    sum += slots[i].value.load(memory_order_relaxed);
+  return sum;
+}
+
+Gauge::Gauge() :
+  slot(unregistered_slots)
+{
+}
+
+Gauge::Gauge(MetricSlot *_slot) :
+  slot(_slot)
+{
+}
+
+void Gauge::Set(int64_t level)
+{
+  slot->value.store(level, memory_order_relaxed);
+}
+
+void Gauge::Add(int64_t n)
+{
+  slot->value.fetch_add(n, memory_order_relaxed);
+}
+
+int64_t Gauge::GetValue() const
+{
+  return slot->value.load(memory_order_relaxed);
+}
+
+MetricsRegistry::MetricsRegistry()
+{
+}
+
+MetricsRegistry::~MetricsRegistry()
+{
+  for (auto &entry : metrics)
+    free(entry.second.slots);
+}
+
+string MetricsRegistry::AddInstance(const string &service)
+{
+  lock_guard<mutex> guard(lock);
+  int count = ++instances[service];
+  return count == 1 ? service : service + "_" + to_string(count);
+}
+
+Counter MetricsRegistry::AddCounter(const string &name, const string &labels)
+{
+  lock_guard<mutex> guard(lock);
+  return Counter(Find(name, labels, true).slots);
+}
+
+Gauge MetricsRegistry::AddGauge(const string &name, const string &labels)
+{
+  lock_guard<mutex> guard(lock);
+  return Gauge(Find(name, labels, false).slots);
+}
+
+int64_t MetricsRegistry::GetValue(const string &name, const string &labels) const
+{
+  lock_guard<mutex> guard(lock);
+  auto found = metrics.find(make_pair(name, labels));
+  if (found == metrics.end()) return 0;
+  const Metric &metric = found->second;
+  return metric.counter ? Counter(metric.slots).GetValue() : Gauge(metric.slots).GetValue();
+}
+
+void MetricsRegistry::Write(ostream &out) const
+{
+  lock_guard<mutex> guard(lock);
+  const string *last = nullptr;
+  for (auto &entry : metrics) {
+    const string &name = entry.first.first;
+    const string &labels = entry.first.second;
+    const Metric &metric = entry.second;
+    if (!last || *last != name) out << "# TYPE " << name << (metric.counter ? " counter" : " gauge") << '\n';
+    last = &name;
+    out << name;
+    if (!labels.empty()) out << '{' << labels << '}';
+    out << ' ' << (metric.counter ? Counter(metric.slots).GetValue() : Gauge(metric.slots).GetValue()) << '\n';
+  }
+}
+
+MetricsRegistry::Metric& MetricsRegistry::Find(const string &name, const string &labels, bool counter)
+{
+  auto found = metrics.find(make_pair(name, labels));
+  if (found != metrics.end()) {
+    if (found->second.counter != counter) throw invalid_argument(name + " is registered as another kind of metric");
+    return found->second;
+  }
+  int count = counter ? METRICS_MAX_THREADS : 1;
+  MetricSlot *slots = static_cast<MetricSlot*>(aligned_alloc(METRICS_CACHE_LINE, count * sizeof(MetricSlot)));
+  if (!slots) throw bad_alloc();
+  for (int i = 0; i < count; i++)
+    new (&slots[i]) MetricSlot{{0}};
+  Metric &metric = metrics[make_pair(name, labels)];
+  metric.counter = counter;
+  metric.slots = slots;
+  return metric;
+}
+
+ServiceMetrics::ServiceMetrics(const string &service) :
+  name(metrics_registry.AddInstance(service)), profile_hop(RegisterProfileHop(name))
+{
+  messages_in = AddCounter("messages_in");
+  listener_calls = AddCounter("listener_calls");
+}
+
+const string& ServiceMetrics::GetName() const
+{
+  return name;
+}
+
+void ServiceMetrics::CountIn()
+{
+  messages_in.Add();
+}
+
+void ServiceMetrics::CountOut(size_t listeners)
+{
+  listener_calls.Add(listeners);
+}
+
+Counter ServiceMetrics::AddCounter(const string &counter) const
+{
+  return metrics_registry.AddCounter(counter, "service=\"" + name + "\"");
+}
+
+Gauge ServiceMetrics::AddGauge(const string &gauge) const
+{
+  return metrics_registry.AddGauge(gauge, "service=\"" + name + "\"");
+}
+
+int ServiceMetrics::GetProfileHop() const
+{
+  return profile_hop;
+}
+
+ServiceHop::ServiceHop(ServiceMetrics &metrics)
+{
+  metrics.CountIn();
+  CountProfileMessage(metrics.GetProfileHop());
+  previous_hop = EnterProfileHop(metrics.GetProfileHop());
+}
+
+ServiceHop::~ServiceHop()
+{
+  LeaveProfileHop(previous_hop);
+}
+
+int MetricsThreadSlot()
+{
+  if (metrics_thread_slot < 0)
+    metrics_thread_slot = min(metrics_thread_count.fetch_add(1), METRICS_MAX_THREADS - 1);
+  return metrics_thread_slot;
+}
+
+#endif
@@ -0,0 +1,144 @@
+/**
+ * multiasset.cpp
+ * Runs the bond and swap pipelines of MultiAssetRuntime side by side on generated prices
+ * and trades in the seven on-the-run terms, then prints the PV01 of each shared sector by
+ * asset class and in total, checking the totals the pipelines built up concurrently against
+ * each risk service's bucketed risk.
+ *
+ * Usage: multiasset [--trades n] [--prices n]
+ *   defaults: 10000 trades and 10000 prices per product
+ */
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cmath>
+#include "multiasset.hpp"
+#include "./Data/Bond_info.h"
+#include "./Data/IRSwap_info.h"
+
+using namespace std;
+
+// Write n prices per product: bonds in 32nds between 99 and 101, swaps as rates in percent
+void GeneratePrices(ostream &bonds, ostream &swaps, long n, mt19937_64 &random)
+{
+  for (long i = 0; i < n; i++) {
+    for (size_t k = 0; k < bond_code.size(); k++) {
+      int thirty_seconds = random() % 32;
+      bonds << bond_code[k] << ',' << 99 + random() % 2 << '-' << (thirty_seconds < 10 ? "0" : "") << thirty_seconds
+            << random() % 8 << ",0-00" << (random() % 2 ? '2' : '4') << '\n';
+      swaps << swap_code[k] << ',' << fixed << setprecision(4) << 3.5 + (random() % 1000) / 1000.0 << ",0.0100" << '\n';
+    }
+  }
+}
+
+// Write n trades per product across books TRSY1 to TRSY3: bonds of 1 to 5 million at 99 or 100,
+// swaps of 10 to 50 million notional at a rate
+void GenerateTrades(ostream &bonds, ostream &swaps, long n, mt19937_64 &random)
+{
+  for (long i = 0; i < n; i++) {
+    for (size_t k = 0; k < bond_code.size(); k++) {
+      bool buy = random() % 2;
+      bonds << bond_code[k] << ",Trader" << k << ',' << (buy ? "99-000" : "100-000") << ",TRSY" << random() % 3 + 1 << ','
+            << (random() % 5 + 1) * 1000000 << ',' << (buy ? "BUY" : "SELL") << '\n';
+      buy = random() % 2;
+      swaps << swap_code[k] << ",Trader" << k << ',' << fixed << setprecision(4) << 3.5 + (random() % 1000) / 1000.0
+            << ",TRSY" << random() % 3 + 1 << ',' << (random() % 5 + 1) * 10000000 << ',' << (buy ? "BUY" : "SELL") << '\n';
+    }
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  long trades = 10000, prices = 10000;
+  for (int i = 1; i < argc; i++)
+  {
+    string argument = argv[i];
+    if (i + 1 < argc && argument == "--trades") trades = stol(argv[++i]);
+    else if (i + 1 < argc && argument == "--prices") prices = stol(argv[++i]);
+    else
+    {
+      cerr << "usage: " << argv[0] << " [--trades n] [--prices n]" << '\n';
+      return 1;
+    }
+  }
+
+  date today(2022, Nov, 30);
+  vector<double> times = {0.25, 0.5, 1, 2, 3, 5, 7, 10, 20, 30};
+  vector<double> rates = {0.043, 0.046, 0.047, 0.0435, 0.041, 0.039, 0.038, 0.0375, 0.038, 0.0365};
+  DiscountCurve curve(today, times, rates);
+
+  BondProductService bonds;
+  IRSwapProductService swaps;
+  vector<Bond> bond_products;
+  vector<IRSwap> swap_products;
+  for (size_t k = 0; k < bond_code.size(); k++)
+  {
+    bond_products.push_back(Bond(bond_code[k], CUSIP, "T", bond_coupon[k], bond_maturity[k]));
+    bonds.AddBond(bond_products.back());
+    swap_products.push_back(IRSwap(swap_code[k], THIRTY_THREE_SIXTY, ACT_THREE_SIXTY, SEMI_ANNUAL, LIBOR, TENOR_3M, swap_effective,
+                                   swap_effective + years(swap_term[k]), USD, swap_term[k], STANDARD, OUTRIGHT));
+    swaps.AddSwap(swap_products.back());
+  }
+
+  MultiAssetRuntime runtime(&bonds, &swaps, curve);
+  // the 2Y and 3Y, the 5Y to 10Y and the 20Y and 30Y, bonds and swaps alike
+  vector<pair<string, vector<size_t>>> sector_terms = {{"front_end", {0, 1}}, {"belly", {2, 3, 4}}, {"long_end", {5, 6}}};
+  vector<BucketedSector<Bond>> bond_sectors;
+  vector<BucketedSector<IRSwap>> swap_sectors;
+  for (auto &sector : sector_terms)
+  {
+    vector<Bond> sector_bonds;
+    vector<IRSwap> sector_swaps;
+    for (size_t k : sector.second)
+    {
+      sector_bonds.push_back(bond_products[k]);
+      sector_swaps.push_back(swap_products[k]);
+    }
+    bond_sectors.push_back(BucketedSector<Bond>(sector_bonds, sector.first));
+    swap_sectors.push_back(BucketedSector<IRSwap>(sector_swaps, sector.first));
+    runtime.GetSectors().AddSector(bond_sectors.back());
+    runtime.GetSectors().AddSector(swap_sectors.back());
+  }
+
+  mt19937_64 random(7);
+  stringstream bond_prices, swap_prices, bond_trades, swap_trades;
+  GeneratePrices(bond_prices, swap_prices, prices, random);
+  GenerateTrades(bond_trades, swap_trades, trades, random);
+
+  auto start = chrono::steady_clock::now();
+  runtime.Run(bond_prices, bond_trades, swap_prices, swap_trades);
+  double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  long messages = 2 * (long)bond_code.size() * (trades + prices);
+  cout << messages << " prices and trades through both pipelines in " << fixed << setprecision(1) << seconds * 1e3 << " ms, "
+       << setprecision(2) << seconds * 1e9 / messages << " ns each" << '\n';
+
+  cout << '\n' << left << setw(12) << "term" << right << setw(14) << "bond PV01" << setw(14) << "swap PV01" << "   (per 100)" << '\n';
+  for (size_t k = 0; k < bond_code.size(); k++)
+  {
+    cout << left << setw(12) << to_string(swap_term[k]) + "Y" << right << setprecision(4)
+         << setw(14) << runtime.GetBondPipeline().GetRiskService().GetPV01Model().GetUnitPV01(bond_products[k])
+         << setw(14) << runtime.GetSwapPipeline().GetRiskService().GetPV01Model().GetUnitPV01(swap_products[k]) << '\n';
+  }
+
+  cout << '\n' << left << setw(12) << "sector" << right << setw(16) << "bonds" << setw(16) << "swaps" << setw(16) << "total" << '\n';
+  int failures = 0;
+  for (size_t s = 0; s < sector_terms.size(); s++)
+  {
+    double bond_pv01 = runtime.GetBondPipeline().GetRiskService().GetBucketedRisk(bond_sectors[s]).GetPV01();
+    double swap_pv01 = runtime.GetSwapPipeline().GetRiskService().GetBucketedRisk(swap_sectors[s]).GetPV01();
+    double total = runtime.GetSectors().GetSectorPV01(sector_terms[s].first);
+    cout << left << setw(12) << sector_terms[s].first << right << setprecision(0)
+         << setw(16) << bond_pv01 << setw(16) << swap_pv01 << setw(16) << total << '\n';
+    // the shared total is a running sum of changes, so allow for rounding
+    if (fabs(total - bond_pv01 - swap_pv01) > 1e-9 * (fabs(bond_pv01) + fabs(swap_pv01)) + 1e-6)
+    {
+      cout << "sector " << sector_terms[s].first << " total does not match its asset classes" << '\n';
+      failures++;
+    }
+  }
+  return failures == 0 ? 0 : 1;
+}
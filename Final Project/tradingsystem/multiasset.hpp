@@ -0,0 +1,319 @@
+/**
+ * multiasset.hpp
+ * Runs the pricing, trade booking, position and risk services for bonds and for interest
+ * rate swaps side by side, each asset class on a thread of its own, with the PV01 of both
+ * summed into shared sectors. What differs between the asset classes (the product service,
+ * price quoting, the PV01 model) is picked at compile time through ProductTraits and
+ * PV01Model, so the pipelines are the same templates instantiated twice.
+ */
+#ifndef MULTI_ASSET_HPP
+#define MULTI_ASSET_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <unordered_map>
+#include <atomic>
+#include <thread>
+#include <exception>
+#include <stdexcept>
+
+#include "soa.hpp"
+#include "pricingservice.hpp"
+#include "tradebookingservice.hpp"
+#include "positionservice.hpp"
+#include "riskservice.hpp"
+
+using namespace std;
+
+/**
+ * PV01 totals of risk sectors shared by every asset class. A sector is keyed on the name of
+ * its BucketedSectors, so the bonds and the swaps of a sector bucket into the same total.
+ * Each product is updated by the pipeline of its asset class only; the totals are atomics,
+ * safe to read from any thread while the pipelines run.
+ */
+class SectorRiskAggregator
+{
+
+public:
+
+  // ctor
+  SectorRiskAggregator();
+
+  // Bucket the products of sector into the sector of the same name, adding it if new;
+  // every sector is added before the pipelines run
+  template<typename T>
+  void AddSector(const BucketedSector<T> &sector);
+
+  // Set the PV01 of a product, times its quantity, moving the totals of its sectors
+  void Update(const string &productId, double pv01);
+
+  // Get the names of the sectors, in the order they were added
+  const vector<string>& GetSectorNames() const;
+
+  // Get the total PV01 of sector index
+  double GetSectorPV01(size_t index) const;
+
+  // Get the total PV01 of the sector named name
+  double GetSectorPV01(const string &name) const;
+
+private:
+  struct ProductRisk
+  {
+    double pv01;
+    vector<size_t> sectors;
+  };
+  vector<string> names;
+  deque<atomic<double>> totals;
+  unordered_map<string, ProductRisk> products;
+
+};
+
+/**
+ * Listener feeding the PV01s of a risk service into the shared sectors.
+ * Type T is the product type.
+ */
+template<typename T>
+class SectorRiskListener : public ServiceListener<PV01<T>>
+{
+
+public:
+
+  // ctor for a listener updating sectors
+  SectorRiskListener(SectorRiskAggregator *_sectors);
+
+  // Listener callback to process an add event to the Service
+  virtual void ProcessAdd(PV01<T> &data) override;
+
+  // Listener callback to process a remove event to the Service
+  virtual void ProcessRemove(PV01<T> &data) override {};
+
+  // Listener callback to process an update event to the Service
+  virtual void ProcessUpdate(PV01<T> &data) override {};
+
+private:
+  SectorRiskAggregator *sectors;
+
+};
+
+/**
+ * The services of one asset class, linked through listeners: trades book into positions,
+ * positions are risked and the risk goes to the shared sectors.
+ * Type T is the product type.
+ */
+template<typename T>
+class AssetPipeline
+{
+
+public:
+
+  // ctor for a pipeline over the products in products, risked by model into sectors
+  AssetPipeline(typename ProductTraits<T>::ProductService *products, const PV01Model<T> &model, SectorRiskAggregator *sectors);
+
+  // Get the pricing service
+  PricingService<T>& GetPricingService();
+
+  // Get the trade booking service
+  BondTradeBookingService<T>& GetTradeBookingService();
+
+  // Get the position service
+  BondPositionService<T>& GetPositionService();
+
+  // Get the risk service
+  BondRiskService<T>& GetRiskService();
+
+  // Run a price feed and then a trade feed through the services, publishing the netted
+  // positions at the end
+  void Run(istream &prices, istream &trades);
+
+private:
+  PricingService<T> pricing_service;
+  BondTradeBookingService<T> trade_booking_service;
+  BondPositionService<T> position_service;
+  BondRiskService<T> risk_service;
+  BondTradeBookingServiceConnector<T> trade_connector;
+  BondPositionServiceListener<T> position_listener;
+  BondRiskServiceListener<T> risk_listener;
+  SectorRiskListener<T> sector_listener;
+
+};
+
+/**
+ * Bond and swap pipelines sharing risk sectors. Both pipelines register the books their
+ * trades go to in book_registry as they first see them.
+ */
+class MultiAssetRuntime
+{
+
+public:
+
+  // ctor for pipelines over bonds and swaps, the swaps risked off curve
+  MultiAssetRuntime(BondProductService *bonds, IRSwapProductService *swaps, const DiscountCurve &curve);
+
+  // Get the shared sectors
+  SectorRiskAggregator& GetSectors();
+
+  // Get the bond pipeline
+  AssetPipeline<Bond>& GetBondPipeline();
+
+  // Get the swap pipeline
+  AssetPipeline<IRSwap>& GetSwapPipeline();
+
+  // Run the bond feeds on this thread and the swap feeds on another; returns when both are
+  // done, rethrowing the first error either raised
+  void Run(istream &bondPrices, istream &bondTrades, istream &swapPrices, istream &swapTrades);
+
+private:
+  SectorRiskAggregator sectors;
+  AssetPipeline<Bond> bond_pipeline;
+  AssetPipeline<IRSwap> swap_pipeline;
+
+};
+
+SectorRiskAggregator::SectorRiskAggregator()
+{
+}
+
+template<typename T>
+void SectorRiskAggregator::AddSector(const BucketedSector<T> &sector)
+{
+  size_t index = find(names.begin(), names.end(), sector.GetName()) - names.begin();
+  if (index == names.size()) {
+    names.push_back(sector.GetName());
+    totals.emplace_back(0.0);
+  }
+  for (auto &product : sector.GetProducts()) {
+    ProductRisk &risk = products[product.GetProductId()];
+    if (find(risk.sectors.begin(), risk.sectors.end(), index) == risk.sectors.end())
+      risk.sectors.push_back(index);
+  }
+}
+
+void SectorRiskAggregator::Update(const string &productId, double pv01)
+{
+  // the map is not changed once the pipelines run, so finding in it needs no lock
+  auto found = products.find(productId);
+  if (found == products.end()) return;
+  double change = pv01 - found->second.pv01;
+  found->second.pv01 = pv01;
+  for (size_t index : found->second.sectors) {
+    atomic<double> &total = totals[index];
+    double current = total.load(memory_order_relaxed);
+    while (!total.compare_exchange_weak(current, current + change, memory_order_relaxed)) {
+    }
+  }
+}
+
+const vector<string>& SectorRiskAggregator::GetSectorNames() const
+{
+  return names;
+}
+
+double SectorRiskAggregator::GetSectorPV01(size_t index) const
+{
+  return totals[index].load(memory_order_relaxed);
+}
+
+double SectorRiskAggregator::GetSectorPV01(const string &name) const
+{
+  size_t index = find(names.begin(), names.end(), name) - names.begin();
+  if (index == names.size()) throw out_of_range("no risk sector " + name);
+  return GetSectorPV01(index);
+}
+
+template<typename T>
+SectorRiskListener<T>::SectorRiskListener(SectorRiskAggregator *_sectors) :
+  sectors(_sectors)
+{
+}
+
+template<typename T>
+void SectorRiskListener<T>::ProcessAdd(PV01<T> &data)
+{
+  sectors->Update(data.GetProduct().GetProductId(), data.GetPV01() * data.GetQuantity());
+}
+
+template<typename T>
+AssetPipeline<T>::AssetPipeline(typename ProductTraits<T>::ProductService *products, const PV01Model<T> &model, SectorRiskAggregator *sectors) :
+  pricing_service(products), risk_service(model), trade_connector(&trade_booking_service, products),
+  position_listener(&position_service), risk_listener(&risk_service), sector_listener(sectors)
+{
+  trade_booking_service.AddListener(&position_listener);
+  position_service.AddListener(&risk_listener);
+  risk_service.AddListener(&sector_listener);
+}
+
+template<typename T>
+PricingService<T>& AssetPipeline<T>::GetPricingService()
+{
+  return pricing_service;
+}
+
+template<typename T>
+BondTradeBookingService<T>& AssetPipeline<T>::GetTradeBookingService()
+{
+  return trade_booking_service;
+}
+
+template<typename T>
+BondPositionService<T>& AssetPipeline<T>::GetPositionService()
+{
+  return position_service;
+}
+
+template<typename T>
+BondRiskService<T>& AssetPipeline<T>::GetRiskService()
+{
+  return risk_service;
+}
+
+template<typename T>
+void AssetPipeline<T>::Run(istream &prices, istream &trades)
+{
+  pricing_service.GetConnector()->Subscribe(prices);
+  trade_connector.Subscribe(trades);
+  position_service.Flush();
+}
+
+MultiAssetRuntime::MultiAssetRuntime(BondProductService *bonds, IRSwapProductService *swaps, const DiscountCurve &curve) :
+  bond_pipeline(bonds, PV01Model<Bond>(), &sectors), swap_pipeline(swaps, PV01Model<IRSwap>(curve), &sectors)
+{
+}
+
+SectorRiskAggregator& MultiAssetRuntime::GetSectors()
+{
+  return sectors;
+}
+
+AssetPipeline<Bond>& MultiAssetRuntime::GetBondPipeline()
+{
+  return bond_pipeline;
+}
+
+AssetPipeline<IRSwap>& MultiAssetRuntime::GetSwapPipeline()
+{
+  return swap_pipeline;
+}
+
+void MultiAssetRuntime::Run(istream &bondPrices, istream &bondTrades, istream &swapPrices, istream &swapTrades)
+{
+  exception_ptr swap_error;
+  thread swap_thread([&]() {
+    try {
+      swap_pipeline.Run(swapPrices, swapTrades);
+    } catch (...) {
+      swap_error = current_exception();
+    }
+  });
+  try {
+    bond_pipeline.Run(bondPrices, bondTrades);
+  } catch (...) {
+    swap_thread.join();
+    throw;
+  }
+  swap_thread.join();
+  if (swap_error) rethrow_exception(swap_error);
+}
+
+#endif
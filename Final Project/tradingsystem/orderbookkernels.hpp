@@ -0,0 +1,247 @@
+/**
+ * orderbookkernels.hpp
+ * Kernels searching and aggregating order stacks stored as separate price and quantity arrays.
+ * On x86-64 the AVX2 and SSE4.1 versions are compiled for their instruction set whatever the
+ * build targets, and each call runs the best one the CPU supports, found once with cpuid;
+ * elsewhere the scalar loops do all the work.
+ */
+#ifndef ORDER_BOOK_KERNELS_HPP
+#define ORDER_BOOK_KERNELS_HPP
+
+#include <algorithm>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define ORDER_BOOK_SIMD_KERNELS
+#include <immintrin.h>
+static_assert(sizeof(long) == 8, "the SIMD kernels sum quantities as 64 bit lanes");
+#endif
+
+// Instruction sets the kernels can run on, in order of preference
+enum KernelIsa { SCALAR_KERNELS, SSE41_KERNELS, AVX2_KERNELS };
+
+// Get the best instruction set the CPU supports
+KernelIsa DetectKernelIsa();
+
+// Get the instruction set the kernels run on
+KernelIsa GetKernelIsa();
+
+// Run the kernels on isa, or on the best the CPU supports if it does not support isa;
+// returns the instruction set they now run on
+KernelIsa SetKernelIsa(KernelIsa isa);
+
+// Get the name of an instruction set
+const char* KernelIsaName(KernelIsa isa);
+
+// Get the highest price in prices[0, n), n > 0
+double MaxPrice(const double *prices, int n);
+
+// Get the lowest price in prices[0, n), n > 0
+double MinPrice(const double *prices, int n);
+
+// Get the first index of price in prices[0, n), -1 if it is not there
+int FindPrice(const double *prices, int n, double price);
+
+// Sum the quantities of the levels quoted at price
+long SumQuantityAtPrice(const double *prices, const long *quantities, int n, double price);
+
+// The instruction set the kernels run on, the detected one unless set
+KernelIsa kernel_isa = DetectKernelIsa();
+
+KernelIsa DetectKernelIsa()
+{
+#ifdef ORDER_BOOK_SIMD_KERNELS
+  // may run before libgcc's own constructor has filled in the CPU model
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return AVX2_KERNELS;
+  if (__builtin_cpu_supports("sse4.1")) return SSE41_KERNELS;
+#endif
+  return SCALAR_KERNELS;
+}
+
+KernelIsa GetKernelIsa()
+{
+  return kernel_isa;
+}
+
+KernelIsa SetKernelIsa(KernelIsa isa)
+{
+  kernel_isa = std::min(isa, DetectKernelIsa());
+  return kernel_isa;
+}
+
+const char* KernelIsaName(KernelIsa isa)
+{
+  switch (isa) {
+  case AVX2_KERNELS: return "avx2";
+  case SSE41_KERNELS: return "sse4.1";
+  default: return "scalar";
+  }
+}
+
+// Scalar tails of the kernels, from index i on with what the vector loop found so far
+
+inline double MaxPriceFrom(const double *prices, int i, int n, double best)
+{
+  for (; i < n; i++) {
+    if (prices[i] > best) best = prices[i];
+  }
+  return best;
+}
+
+inline double MinPriceFrom(const double *prices, int i, int n, double best)
+{
+  for (; i < n; i++) {
+    if (prices[i] < best) best = prices[i];
+  }
+  return best;
+}
+
+inline int FindPriceFrom(const double *prices, int i, int n, double price)
+{
+  for (; i < n; i++) {
+    if (prices[i] == price) return i;
+  }
+  return -1;
+}
+
+inline long SumQuantityAtPriceFrom(const double *prices, const long *quantities, int i, int n, double price, long total)
+{
+  for (; i < n; i++) {
+    if (prices[i] == price) total += quantities[i];
+  }
+  return total;
+}
+
+#ifdef ORDER_BOOK_SIMD_KERNELS
+
+__attribute__((target("avx2"))) double MaxPriceAvx2(const double *prices, int n)
+{
+  if (n < 4) return MaxPriceFrom(prices, 1, n, prices[0]);
+  __m256d m = _mm256_loadu_pd(prices);
+  int i;
+  for (i = 4; i + 4 <= n; i += 4)
+    m = _mm256_max_pd(m, _mm256_loadu_pd(prices + i));
+  __m128d h = _mm_max_pd(_mm256_castpd256_pd128(m), _mm256_extractf128_pd(m, 1));
+  return MaxPriceFrom(prices, i, n, _mm_cvtsd_f64(_mm_max_pd(h, _mm_unpackhi_pd(h, h))));
+}
+
+__attribute__((target("sse4.1"))) double MaxPriceSse41(const double *prices, int n)
+{
+  if (n < 2) return prices[0];
+  __m128d m = _mm_loadu_pd(prices);
+  int i;
+  for (i = 2; i + 2 <= n; i += 2)
+    m = _mm_max_pd(m, _mm_loadu_pd(prices + i));
+  return MaxPriceFrom(prices, i, n, _mm_cvtsd_f64(_mm_max_pd(m, _mm_unpackhi_pd(m, m))));
+}
+
+__attribute__((target("avx2"))) double MinPriceAvx2(const double *prices, int n)
+{
+  if (n < 4) return MinPriceFrom(prices, 1, n, prices[0]);
+  __m256d m = _mm256_loadu_pd(prices);
+  int i;
+  for (i = 4; i + 4 <= n; i += 4)
+    m = _mm256_min_pd(m, _mm256_loadu_pd(prices + i));
+  __m128d h = _mm_min_pd(_mm256_castpd256_pd128(m), _mm256_extractf128_pd(m, 1));
+  return MinPriceFrom(prices, i, n, _mm_cvtsd_f64(_mm_min_pd(h, _mm_unpackhi_pd(h, h))));
+}
+
+__attribute__((target("sse4.1"))) double MinPriceSse41(const double *prices, int n)
+{
+  if (n < 2) return prices[0];
+  __m128d m = _mm_loadu_pd(prices);
+  int i;
+  for (i = 2; i + 2 <= n; i += 2)
+    m = _mm_min_pd(m, _mm_loadu_pd(prices + i));
+  return MinPriceFrom(prices, i, n, _mm_cvtsd_f64(_mm_min_pd(m, _mm_unpackhi_pd(m, m))));
+}
+
+__attribute__((target("avx2"))) int FindPriceAvx2(const double *prices, int n, double price)
+{
+  int i = 0;
+  __m256d target = _mm256_set1_pd(price);
+  for (; i + 4 <= n; i += 4) {
+    int mask = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(prices + i), target, _CMP_EQ_OQ));
+    if (mask) return i + __builtin_ctz(mask);
+  }
+  return FindPriceFrom(prices, i, n, price);
+}
+
+__attribute__((target("sse4.1"))) int FindPriceSse41(const double *prices, int n, double price)
+{
+  int i = 0;
+  __m128d target = _mm_set1_pd(price);
+  for (; i + 2 <= n; i += 2) {
+    int mask = _mm_movemask_pd(_mm_cmpeq_pd(_mm_loadu_pd(prices + i), target));
+    if (mask) return i + __builtin_ctz(mask);
+  }
+  return FindPriceFrom(prices, i, n, price);
+}
+
+__attribute__((target("avx2"))) long SumQuantityAtPriceAvx2(const double *prices, const long *quantities, int n, double price)
+{
+  int i = 0;
+  __m256d target = _mm256_set1_pd(price);
+  __m256i acc = _mm256_setzero_si256();
+  for (; i + 4 <= n; i += 4) {
+    __m256i eq = _mm256_castpd_si256(_mm256_cmp_pd(_mm256_loadu_pd(prices + i), target, _CMP_EQ_OQ));
+    __m256i q = _mm256_loadu_si256((const __m256i*)(quantities + i));
+    acc = _mm256_add_epi64(acc, _mm256_and_si256(eq, q));
+  }
+  long lanes[4];
+  _mm256_storeu_si256((__m256i*)lanes, acc);
+  return SumQuantityAtPriceFrom(prices, quantities, i, n, price, lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+}
+
+__attribute__((target("sse4.1"))) long SumQuantityAtPriceSse41(const double *prices, const long *quantities, int n, double price)
+{
+  int i = 0;
+  __m128d target = _mm_set1_pd(price);
+  __m128i acc = _mm_setzero_si128();
+  for (; i + 2 <= n; i += 2) {
+    __m128i eq = _mm_castpd_si128(_mm_cmpeq_pd(_mm_loadu_pd(prices + i), target));
+    __m128i q = _mm_loadu_si128((const __m128i*)(quantities + i));
+    acc = _mm_add_epi64(acc, _mm_and_si128(eq, q));
+  }
+  return SumQuantityAtPriceFrom(prices, quantities, i, n, price, _mm_extract_epi64(acc, 0) + _mm_extract_epi64(acc, 1));
+}
+
+#endif
+
+double MaxPrice(const double *prices, int n)
+{
+#ifdef ORDER_BOOK_SIMD_KERNELS
+  if (kernel_isa == AVX2_KERNELS) return MaxPriceAvx2(prices, n);
+  if (kernel_isa == SSE41_KERNELS) return MaxPriceSse41(prices, n);
+#endif
+  return MaxPriceFrom(prices, 1, n, prices[0]);
+}
+
+double MinPrice(const double *prices, int n)
+{
+#ifdef ORDER_BOOK_SIMD_KERNELS
+  if (kernel_isa == AVX2_KERNELS) return MinPriceAvx2(prices, n);
+  if (kernel_isa == SSE41_KERNELS) return MinPriceSse41(prices, n);
+#endif
+  return MinPriceFrom(prices, 1, n, prices[0]);
+}
+
+int FindPrice(const double *prices, int n, double price)
+{
+#ifdef ORDER_BOOK_SIMD_KERNELS
+  if (kernel_isa == AVX2_KERNELS) return FindPriceAvx2(prices, n, price);
+  if (kernel_isa == SSE41_KERNELS) return FindPriceSse41(prices, n, price);
+#endif
+  return FindPriceFrom(prices, 0, n, price);
+}
+
+long SumQuantityAtPrice(const double *prices, const long *quantities, int n, double price)
+{
+#ifdef ORDER_BOOK_SIMD_KERNELS
+  if (kernel_isa == AVX2_KERNELS) return SumQuantityAtPriceAvx2(prices, quantities, n, price);
+  if (kernel_isa == SSE41_KERNELS) return SumQuantityAtPriceSse41(prices, quantities, n, price);
+#endif
+  return SumQuantityAtPriceFrom(prices, quantities, 0, n, price, 0);
+}
+
+#endif
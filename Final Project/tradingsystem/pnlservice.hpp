@@ -0,0 +1,545 @@
+/**
+ * pnlservice.hpp
+ * Defines the data types and Service for realized and unrealized profit and loss,
+ * per book and per product, at average cost and marked to the pricing service's mids.
+ */
+#ifndef PNL_SERVICE_HPP
+#define PNL_SERVICE_HPP
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdlib>
+#include <cmath>
+
+#include "soa.hpp"
+#include "pricingservice.hpp"
+#include "tradebookingservice.hpp"
+#include "positionservice.hpp"
+#include "snapshot.hpp"
+#include "checkpoint.hpp"
+#include "metrics.hpp"
+
+using namespace std;
+
+// Prices are quoted per this much face, so P&L is quantity times price over it
+const double PNL_PRICE_SCALE = 100.0;
+// Snapshot slot of the P&L summed over every product
+const string PNL_TOTAL = "TOTAL";
+
+/**
+ * Checkpointed P&L of a product; the books are indexed by the checkpoint's book ids.
+ */
+struct PnLRecord
+{
+  char productId[CHECKPOINT_ID_SIZE];
+  long positions[MAX_BOOKS];
+  double averageCosts[MAX_BOOKS];
+  double realized[MAX_BOOKS];
+  double mark;
+};
+
+/**
+ * Realized and unrealized P&L of a product in each book. Positions carry at average
+ * cost: buying more averages in, selling against a long realizes the difference to the
+ * average and leaves it unchanged. Until the first mark, unrealized P&L is zero.
+ * Type T is the product type.
+ */
+template<typename T>
+class PnL
+{
+
+public:
+
+  // ctor for a P&L
+  PnL() = default;
+  PnL(const T &_product);
+
+  // Get the product
+  const T& GetProduct() const;
+
+  // Get the position in a book
+  long GetPosition(int book_id) const;
+
+  // Get the average cost of the position in a book
+  double GetAverageCost(int book_id) const;
+
+  // Get the realized P&L in a book
+  double GetRealized(int book_id) const;
+
+  // Get the unrealized P&L in a book
+  double GetUnrealized(int book_id) const;
+
+  // Get the realized P&L over every book
+  double GetRealized() const;
+
+  // Get the unrealized P&L over every book
+  double GetUnrealized() const;
+
+  // Get the mark, NAN until there is one
+  double GetMark() const;
+
+  // Book quantity, negative to sell, at price into a book; returns the P&L it realizes
+  double AddTrade(int book_id, long quantity, double price);
+
+  // Mark the positions at mid
+  void Mark(double mid);
+
+  // Copy the books and mark into a checkpoint record
+  void Save(PnLRecord &record) const;
+
+  // Take the books and mark from a checkpoint record
+  void Restore(const PnLRecord &record);
+
+private:
+  T product;
+  long positions[MAX_BOOKS] = {};
+  double average_costs[MAX_BOOKS] = {};
+  double realized[MAX_BOOKS] = {};
+  long aggregate = 0;
+  // sum over books of position times average cost, so the unrealized total is one multiply
+  double cost_basis = 0;
+  double realized_total = 0;
+  double mark = NAN;
+
+};
+
+/**
+ * Published P&L of a product, or of every product, as other threads read it.
+ */
+struct PnLSnapshot
+{
+  // P&L per book id
+  double realized[MAX_BOOKS];
+  double unrealized[MAX_BOOKS];
+  double realizedTotal;
+  double unrealizedTotal;
+};
+
+/**
+ * P&L Service fed trades and prices through listeners.
+ * Keyed on product identifier.
+ * Type T is the product type.
+ */
+template<typename T>
+class PnLService : public Service<string, PnL<T>>
+{
+
+public:
+
+  // Book a trade into the P&L
+  virtual void AddTrade(const Trade<T> &trade) = 0;
+
+  // Mark the P&L at a new price
+  virtual void AddPrice(const Price<T> &price) = 0;
+
+};
+
+/**
+ * Keeps the P&L of every product and the totals over them up to date as each trade and
+ * price comes in: a price tick re-marks one product's books and moves the totals by the
+ * change, so its cost does not grow with the number of products or trades. The latest
+ * P&L of each product, and the totals, are published to snapshot tables any thread can
+ * read without locks.
+ * Type T is the product type.
+ */
+template<typename T>
+class BondPnLService : public PnLService<T>
+{
+
+public:
+
+  // ctor
+  BondPnLService();
+
+  // Get data on our service given a key
+  virtual PnL<T>& GetData(string key) override;
+
+  // The callback that a Connector should invoke for any new or updated data
+  virtual void OnMessage(PnL<T> &data) override;
+
+  // Add a listener to the Service for callbacks on add, remove, and update events
+  // for data to the Service.
+  virtual void AddListener(ServiceListener<PnL<T>> *listener) override;
+
+  // Get all listeners on the Service.
+  virtual const vector< ServiceListener<PnL<T>>* >& GetListeners() const override;
+
+  // Book a trade into the P&L
+  virtual void AddTrade(const Trade<T> &trade) override;
+
+  // Mark the P&L at a new price
+  virtual void AddPrice(const Price<T> &price) override;
+
+  // Get the published P&L of each product, safe to read from any thread
+  const SnapshotTable<PnLSnapshot>& GetSnapshots() const;
+
+  // Copy the published P&L over every product; safe from any thread, false before any
+  bool ReadTotal(PnLSnapshot &value) const;
+
+  // Write every product's P&L into a checkpoint
+  void SaveCheckpoint(CheckpointWriter &writer) const;
+
+  // Restore the P&L of a checkpoint into an empty service, looking the products up in
+  // products; the book ids must already be restored, and listeners are not notified
+  void LoadCheckpoint(const CheckpointReader &reader, Service<string, T> *products);
+
+private:
+  struct ProductPnL
+  {
+    PnL<T> pnl;
+    // what was last published for it, to move the totals by
+    PnLSnapshot published;
+    size_t snapshot_index;
+  };
+  unordered_map<string, ProductPnL> pnl_map;
+  vector<ServiceListener<PnL<T>>*> listeners;
+  SnapshotTable<PnLSnapshot> snapshots;
+  SnapshotTable<PnLSnapshot> totals;
+  PnLSnapshot total;
+  ServiceMetrics metrics;
+
+  // Get the entry of product, adding a flat one the first time
+  ProductPnL& GetEntry(const T &product);
+
+  // Publish the entry's P&L and move the totals by its change
+  void Publish(ProductPnL &entry);
+
+  // Publish the entry's P&L and the totals to the snapshot tables only
+  void PublishSnapshots(ProductPnL &entry);
+
+};
+
+/**
+ * Listener booking trades into the P&L service.
+ * Type T is the product type.
+ */
+template<typename T>
+class BondPnLTradeListener : public ServiceListener<Trade<T>>
+{
+
+public:
+
+  // ctor for a listener updating service
+  BondPnLTradeListener(BondPnLService<T> *_service);
+
+  // Listener callback to process an add event to the Service
+  virtual void ProcessAdd(Trade<T> &data) override;
+
+  // Listener callback to process a remove event to the Service
+  virtual void ProcessRemove(Trade<T> &data) override {};
+
+  // Listener callback to process an update event to the Service
+  virtual void ProcessUpdate(Trade<T> &data) override {};
+
+private:
+  BondPnLService<T> *service;
+
+};
+
+/**
+ * Listener marking the P&L service to the pricing service's mids.
+ * Type T is the product type.
+ */
+template<typename T>
+class BondPnLPricingListener : public ServiceListener<Price<T>>
+{
+
+public:
+
+  // ctor for a listener updating service
+  BondPnLPricingListener(BondPnLService<T> *_service);
+
+  // Listener callback to process an add event to the Service
+  virtual void ProcessAdd(Price<T> &data) override;
+
+  // Listener callback to process a remove event to the Service
+  virtual void ProcessRemove(Price<T> &data) override {};
+
+  // Listener callback to process an update event to the Service
+  virtual void ProcessUpdate(Price<T> &data) override {};
+
+private:
+  BondPnLService<T> *service;
+
+};
+
+template<typename T>
+PnL<T>::PnL(const T &_product) :
+  product(_product)
+{
+}
+
+template<typename T>
+const T& PnL<T>::GetProduct() const
+{
+  return product;
+}
+
+template<typename T>
+long PnL<T>::GetPosition(int book_id) const
+{
+  return positions[book_id];
+}
+
+template<typename T>
+double PnL<T>::GetAverageCost(int book_id) const
+{
+  return average_costs[book_id];
+}
+
+template<typename T>
+double PnL<T>::GetRealized(int book_id) const
+{
+  return realized[book_id];
+}
+
+template<typename T>
+double PnL<T>::GetUnrealized(int book_id) const
+{
+  if (mark != mark) return 0;
+  return positions[book_id] * (mark - average_costs[book_id]) / PNL_PRICE_SCALE;
+}
+
+template<typename T>
+double PnL<T>::GetRealized() const
+{
+  return realized_total;
+}
+
+template<typename T>
+double PnL<T>::GetUnrealized() const
+{
+  if (mark != mark) return 0;
+  return (aggregate * mark - cost_basis) / PNL_PRICE_SCALE;
+}
+
+template<typename T>
+double PnL<T>::GetMark() const
+{
+  return mark;
+}
+
+template<typename T>
+double PnL<T>::AddTrade(int book_id, long quantity, double price)
+{
+  long held = positions[book_id];
+  aggregate += quantity;
+  double realized_now = 0;
+  if (held != 0 && (held > 0) != (quantity > 0)) {
+    // close what the trade offsets at the average cost; any excess opens the other way
+    long closed = min(labs(quantity), labs(held));
+    if (held < 0) closed = -closed;
+    realized_now = closed * (price - average_costs[book_id]) / PNL_PRICE_SCALE;
+    positions[book_id] -= closed;
+    quantity += closed;
+    if (positions[book_id] == 0) average_costs[book_id] = 0;
+  }
+  if (quantity != 0) {
+    long after = positions[book_id] + quantity;
+    average_costs[book_id] = (positions[book_id] * average_costs[book_id] + quantity * price) / after;
+    positions[book_id] = after;
+  }
+  realized[book_id] += realized_now;
+  realized_total += realized_now;
+
+  cost_basis = 0;
+  for (int b = 0; b < MAX_BOOKS; b++)
+    cost_basis += positions[b] * average_costs[b];
+  return realized_now;
+}
+
+template<typename T>
+void PnL<T>::Mark(double mid)
+{
+  mark = mid;
+}
+
+template<typename T>
+void PnL<T>::Save(PnLRecord &record) const
+{
+  CopyCheckpointId(record.productId, product.GetProductId());
+  for (int b = 0; b < MAX_BOOKS; b++) {
+    record.positions[b] = positions[b];
+    record.averageCosts[b] = average_costs[b];
+    record.realized[b] = realized[b];
+  }
+  record.mark = mark;
+}
+
+template<typename T>
+void PnL<T>::Restore(const PnLRecord &record)
+{
+  aggregate = 0;
+  cost_basis = 0;
+  realized_total = 0;
+  for (int b = 0; b < MAX_BOOKS; b++) {
+    positions[b] = record.positions[b];
+    average_costs[b] = record.averageCosts[b];
+    realized[b] = record.realized[b];
+    aggregate += positions[b];
+    cost_basis += positions[b] * average_costs[b];
+    realized_total += realized[b];
+  }
+  mark = record.mark;
+}
+
+template<typename T>
+BondPnLService<T>::BondPnLService() :
+  totals(1), total(), metrics("pnl")
+{
+  totals.Register(PNL_TOTAL);
+}
+
+template<typename T>
+PnL<T>& BondPnLService<T>::GetData(string key)
+{
+  return pnl_map[key].pnl;
+}
+
+template<typename T>
+void BondPnLService<T>::OnMessage(PnL<T> &data)
+{
+  ServiceHop hop(metrics);
+  ProductPnL &entry = GetEntry(data.GetProduct());
+  entry.pnl = data;
+  Publish(entry);
+}
+
+template<typename T>
+void BondPnLService<T>::AddListener(ServiceListener<PnL<T>> *listener)
+{
+  listeners.push_back(listener);
+}
+
+template<typename T>
+const vector< ServiceListener<PnL<T>>* >& BondPnLService<T>::GetListeners() const
+{
+  return listeners;
+}
+
+template<typename T>
+void BondPnLService<T>::AddTrade(const Trade<T> &trade)
+{
+  ServiceHop hop(metrics);
+  // the position service counts the trades in books there is no id left for
+  int book_id = book_registry.GetBookId(trade.GetBook());
+  if (book_id < 0) return;
+  ProductPnL &entry = GetEntry(trade.GetProduct());
+  long quantity = trade.GetSide() == BUY ? trade.GetQuantity() : -trade.GetQuantity();
+  entry.pnl.AddTrade(book_id, quantity, trade.GetPrice());
+  Publish(entry);
+}
+
+template<typename T>
+void BondPnLService<T>::AddPrice(const Price<T> &price)
+{
+  ServiceHop hop(metrics);
+  ProductPnL &entry = GetEntry(price.GetProduct());
+  if (price.GetMid() == entry.pnl.GetMark()) return;
+  entry.pnl.Mark(price.GetMid());
+  Publish(entry);
+}
+
+template<typename T>
+const SnapshotTable<PnLSnapshot>& BondPnLService<T>::GetSnapshots() const
+{
+  return snapshots;
+}
+
+template<typename T>
+bool BondPnLService<T>::ReadTotal(PnLSnapshot &value) const
+{
+  return totals.Read(0, value);
+}
+
+template<typename T>
+void BondPnLService<T>::SaveCheckpoint(CheckpointWriter &writer) const
+{
+  writer.BeginSection(PNL_SECTION);
+  for (auto &i : pnl_map) {
+    PnLRecord record;
+    i.second.pnl.Save(record);
+    writer.Write(record);
+  }
+  writer.EndSection(pnl_map.size());
+}
+
+template<typename T>
+void BondPnLService<T>::LoadCheckpoint(const CheckpointReader &reader, Service<string, T> *products)
+{
+  for (auto &record : reader.GetRecords<PnLRecord>(PNL_SECTION)) {
+    ProductPnL &entry = GetEntry(products->GetData(record.productId));
+    entry.pnl.Restore(record);
+    PublishSnapshots(entry);
+  }
+}
+
+template<typename T>
+typename BondPnLService<T>::ProductPnL& BondPnLService<T>::GetEntry(const T &product)
+{
+  const string &id = product.GetProductId();
+  auto found = pnl_map.find(id);
+  if (found != pnl_map.end()) return found->second;
+  ProductPnL &entry = pnl_map[id];
+  entry.pnl = PnL<T>(product);
+  entry.published = PnLSnapshot();
+  entry.snapshot_index = snapshots.Register(id);
+  return entry;
+}
+
+template<typename T>
+void BondPnLService<T>::Publish(ProductPnL &entry)
+{
+  PublishSnapshots(entry);
+  for (auto &listener : listeners)
+    listener->ProcessAdd(entry.pnl);
+  metrics.CountOut(listeners.size());
+}
+
+template<typename T>
+void BondPnLService<T>::PublishSnapshots(ProductPnL &entry)
+{
+  PnLSnapshot now;
+  for (int b = 0; b < MAX_BOOKS; b++) {
+    now.realized[b] = entry.pnl.GetRealized(b);
+    now.unrealized[b] = entry.pnl.GetUnrealized(b);
+    total.realized[b] += now.realized[b] - entry.published.realized[b];
+    total.unrealized[b] += now.unrealized[b] - entry.published.unrealized[b];
+  }
+  now.realizedTotal = entry.pnl.GetRealized();
+  now.unrealizedTotal = entry.pnl.GetUnrealized();
+  total.realizedTotal += now.realizedTotal - entry.published.realizedTotal;
+  total.unrealizedTotal += now.unrealizedTotal - entry.published.unrealizedTotal;
+  entry.published = now;
+
+  snapshots.Publish(entry.snapshot_index, now);
+  totals.Publish(0, total);
+}
+
+template<typename T>
+BondPnLTradeListener<T>::BondPnLTradeListener(BondPnLService<T> *_service) :
+  service(_service)
+{
+}
+
+template<typename T>
+void BondPnLTradeListener<T>::ProcessAdd(Trade<T> &data)
+{
+  service->AddTrade(data);
+}
+
+template<typename T>
+BondPnLPricingListener<T>::BondPnLPricingListener(BondPnLService<T> *_service) :
+  service(_service)
+{
+}
+
+template<typename T>
+void BondPnLPricingListener<T>::ProcessAdd(Price<T> &data)
+{
+  service->AddPrice(data);
+}
+
+#endif
@@ -9,39 +9,140 @@
 
 #include <string>
 #include <map>
+#include <vector>
+#include <stdexcept>
+#include <atomic>
+#include <mutex>
 #include "soa.hpp"
+#include "metrics.hpp"
 #include "tradebookingservice.hpp"
+#include "snapshot.hpp"
+#include "checkpoint.hpp"
 
 using namespace std;
 
+// Maximum number of distinct books a position can be held in
+const int MAX_BOOKS = 7;
+
+/**
+ * Registry interning book names to small integer ids.
+ * The books used by the system are registered up front so their ids are stable:
+ * TRSY1, TRSY2, TRSY3 are 0, 1, 2 and execution_book is 3.
+ * Finding a book never locks and is safe on any thread while another registers one;
+ * registering takes a lock.
+ */
+class BookRegistry
+{
+
+public:
+
+  // ctor
+  BookRegistry();
+
+  // Get the id of a book, registering it if it is new; -1 if it is new and MAX_BOOKS are registered
+  int GetBookId(const string &book);
+
+  // Find the id of a book, -1 if it was never registered
+  int FindBookId(const string &book) const;
+
+  // Get the name of a book id
+  const string& GetBookName(int id) const;
+
+  // Get the number of registered books
+  int Size() const;
+
+private:
+  // a slot's name is set before the count that publishes it and never changes after
+  string books[MAX_BOOKS];
+  atomic<int> count;
+  mutex registering;
+
+};
+
+// Books shared by every position
+BookRegistry book_registry;
+
 /**
  * Position class in a particular book.
  * Type T is the product type.
  */
 template<typename T>
-class Position
+class Position : private CopyCounted<Position<T>>
 {
 
 public:
 
-  // ctor for a position
+  // ctor for a flat position in a product
   Position(const T &_product);
 
   // Get the product
   const T& GetProduct() const;
 
   // Get the position quantity
-  long GetPosition(string &book);
+  long GetPosition(const string &book) const;
+  long GetPosition(int book_id) const;
 
   // Get the aggregate position
-  long GetAggregatePosition();
-//  // update the position
-//  void AddPosition(string& book, long position);
+  long GetAggregatePosition() const;
+
+  // update the position; false if the book is new and there is no id left for it
+  bool AddPosition(const string& book, long position);
+  void AddPosition(int book_id, long position);
 
 private:
   T product;
-  map<string,long> positions;
+  long positions[MAX_BOOKS] = {};
+  // sum over the books, kept up to date by AddPosition
+  long aggregate = 0;
+
+};
+
+/**
+ * Published position of a product as other threads read it.
+ */
+struct PositionSnapshot
+{
+  // position per book id
+  long positions[MAX_BOOKS];
+  long aggregate;
+};
+
+/**
+ * Checkpointed position of a product, with its unpublished deltas.
+ */
+struct PositionRecord
+{
+  char productId[CHECKPOINT_ID_SIZE];
+  long positions[MAX_BOOKS];
+  long pending[MAX_BOOKS];
+  long pendingTrades;
+};
 
+/**
+ * Checkpointed book name; a book's id is its index in the section.
+ */
+struct BookNameRecord
+{
+  char name[CHECKPOINT_ID_SIZE];
+};
+
+/**
+ * A position together with the product it is in and the per-book deltas that have not been
+ * published yet.
+ * Type T is the product type.
+ */
+template<typename T>
+struct NettedPosition
+{
+  NettedPosition(const T &_product);
+
+  Position<T> position;
+  // net quantity per book id since the last publish
+  long positions[MAX_BOOKS] = {};
+  // number of trades since the last publish
+  long pending_trades = 0;
+  // slot in the service's snapshot table
+  size_t snapshot_index = 0;
 };
 
 
@@ -68,14 +169,32 @@ public:
 // and send all positions to the BondRiskService via the AddPosition() method
 // (note that the BondPositionService should not have an explicit reference to the BondRiskService though or versa
 // – link them through a ServiceListener).
+// Trades can be netted: per-book deltas are accumulated and the net position is
+// published to the listeners every netting_cadence trades on a product, or on Flush().
+// A cadence of 1 publishes every trade.
 template<typename T>
 class BondPositionService: public PositionService<T>{
 private:
-    map<string, Position<T>> position_map;
+    map<string, NettedPosition<T>> position_map;
     vector<ServiceListener<Position<T>>*> listeners;
+    long netting_cadence;
+    SnapshotTable<PositionSnapshot> snapshots;
+    // trades not booked because their book is new and there is no id left for it
+    long rejected_count;
+    ServiceMetrics metrics;
+    Counter rejected_trades;
+
+    // get the position of a product, inserting a flat one the first time it is seen
+    NettedPosition<T>& GetNetted(const T& product);
+
+    // apply the pending deltas and notify the listeners
+    void Publish(NettedPosition<T>& netted);
+
+    // copy the position into the snapshot table
+    void PublishSnapshot(const NettedPosition<T>& netted);
 public:
     //ctor
-    BondPositionService();
+    BondPositionService(long _netting_cadence = 1);
     // Get data on our service given a key
     virtual Position<T>& GetData(string key) override;
 
@@ -92,6 +211,25 @@ public:
     // Add a trade to the service
     virtual void AddTrade(const Trade<T> &trade) override;
 
+    // Publish the net position every cadence trades on a product
+    void SetNettingCadence(long cadence);
+
+    // Batch boundary: publish every product with pending trades
+    void Flush();
+
+    // Get the number of trades rejected so far because their book had no id left
+    long GetRejectedCount() const;
+
+    // Get the published positions, safe to read from any thread
+    const SnapshotTable<PositionSnapshot>& GetSnapshots() const;
+
+    // Write the books and every position, pending deltas included, into a checkpoint
+    void SaveCheckpoint(CheckpointWriter& writer) const;
+
+    // Restore the positions of a checkpoint into an empty service, looking the products up
+    // in products; listeners are not notified, they restore their own state
+    void LoadCheckpoint(const CheckpointReader& reader, Service<string, T>* products);
+
 };
 
 
@@ -127,38 +265,119 @@ const T& Position<T>::GetProduct() const
 }
 
 template<typename T>
-long Position<T>::GetPosition(string &book)
+long Position<T>::GetPosition(const string &book) const
+{
+  int id = book_registry.FindBookId(book);
+  return id < 0 ? 0 : positions[id];
+}
+
+template<typename T>
+long Position<T>::GetPosition(int book_id) const
 {
-  return positions[book];
+  return positions[book_id];
 }
 
 template<typename T>
-long Position<T>::GetAggregatePosition()
+long Position<T>::GetAggregatePosition() const
 {
-  // No-op implementation - should be filled out for implementations
-  return 0;
+  return aggregate;
+}
+
+template<typename T>
+bool Position<T>::AddPosition(const string& book, long position) {
+    int id = book_registry.GetBookId(book);
+    if(id < 0){
+        return false;
+    }
+    AddPosition(id, position);
+    return true;
+}
+
+template<typename T>
+void Position<T>::AddPosition(int book_id, long position) {
+    positions[book_id] += position;
+    aggregate += position;
 }
 
-//template<typename T>
-//void Position<T>::AddPosition(string& book, long position) {
-//    positions[book] += position;
-//}
+BookRegistry::BookRegistry(){
+    books[0] = "TRSY1";
+    books[1] = "TRSY2";
+    books[2] = "TRSY3";
+    books[3] = "execution_book";
+    count.store(4, memory_order_release);
+}
+
+int BookRegistry::GetBookId(const string &book){
+    int id = FindBookId(book);
+    if(id >= 0){
+        return id;
+    }
+    lock_guard<mutex> guard(registering);
+    // another thread may have registered it since
+    id = FindBookId(book);
+    if(id >= 0){
+        return id;
+    }
+    int registered = count.load(memory_order_relaxed);
+    if(registered == MAX_BOOKS){
+        return -1;
+    }
+    books[registered] = book;
+    count.store(registered + 1, memory_order_release);
+    return registered;
+}
+
+int BookRegistry::FindBookId(const string &book) const{
+    // a handful of books, a linear scan beats hashing
+    int registered = count.load(memory_order_acquire);
+    for(int i = 0; i < registered; i++){
+        if(books[i] == book){
+            return i;
+        }
+    }
+    return -1;
+}
+
+const string& BookRegistry::GetBookName(int id) const{
+    return books[id];
+}
+
+int BookRegistry::Size() const{
+    return count.load(memory_order_acquire);
+}
+
+template<typename T>
+NettedPosition<T>::NettedPosition(const T &_product) :
+  position(_product)
+{
+}
 
 //ctor
 template<typename T>
-BondPositionService<T>::BondPositionService(){
-    position_map = map<string, Position<T>>();
+BondPositionService<T>::BondPositionService(long _netting_cadence) :
+    metrics("position") {
+    netting_cadence = _netting_cadence;
+    rejected_count = 0;
+    rejected_trades = metrics.AddCounter("rejected_trades");
 }
 // Get data on our service given a key
 template<typename T>
 Position<T>& BondPositionService<T>::GetData(string key){
-    return position_map[key];
+    auto i = position_map.find(key);
+    if(i == position_map.end()){
+        throw out_of_range("no position in " + key);
+    }
+    return i->second.position;
 }
 
 // The callback that a Connector should invoke for any new or updated data
 template<typename T>
 void BondPositionService<T>::OnMessage(Position<T> &data){
-    position_map[data.GetProduct().GetProductID()] = data;
+    ServiceHop hop(metrics);
+    Position<T>& position = GetNetted(data.GetProduct()).position;
+    for(int b = 0; b < MAX_BOOKS; b++){
+        position.AddPosition(b, data.GetPosition(b) - position.GetPosition(b));
+    }
 }
 
 // Add a listener to the Service for callbacks on add, remove, and update events
@@ -176,28 +395,137 @@ const vector< ServiceListener<Position<T>>* >& BondPositionService<T>::GetListen
 // Add a trade to the service
 template<typename T>
 void BondPositionService<T>::AddTrade(const Trade<T> &trade){
-    T bond = trade.GetProduct();
-    string bond_code = bond.GetProductID();
-    double price = trade.GetPrice();
-    string book = trade.GetBook();
-    auto num = trade.GetQuantity();
-    Side side = trade.GetSide();
-    auto i = position_map.find(bond_code);
-    if (side != BUY){
+    ServiceHop hop(metrics);
+    long num = trade.GetQuantity();
+    if (trade.GetSide() != BUY){
         num = -num;
     }
 
-    if(i!=position_map.end()){
-        (i->second).AddPosition(trade.GetBook(), num);
-    }else{
-        position_map.insert(pair<string, Position<T>>(bond_code, Position<T>(bond)));
-        AddTrade(trade);
+    // a book past the last id is not booked rather than stopping the feed
+    int book_id = book_registry.GetBookId(trade.GetBook());
+    if(book_id < 0){
+        rejected_count++;
+        rejected_trades.Add();
+        return;
+    }
+
+    NettedPosition<T>& netted = GetNetted(trade.GetProduct());
+    netted.positions[book_id] += num;
+
+    if(++netted.pending_trades >= netting_cadence){
+        Publish(netted);
+    }
+}
+
+template<typename T>
+NettedPosition<T>& BondPositionService<T>::GetNetted(const T& product){
+    // one lookup, inserting a flat position the first time we see the product
+    const string& bond_code = product.GetProductId();
+    auto i = position_map.find(bond_code);
+    if(i == position_map.end()){
+        i = position_map.emplace(piecewise_construct, forward_as_tuple(bond_code), forward_as_tuple(product)).first;
+        i->second.snapshot_index = snapshots.Register(bond_code);
+    }
+    return i->second;
+}
+
+template<typename T>
+void BondPositionService<T>::SetNettingCadence(long cadence){
+    netting_cadence = cadence;
+}
+
+template<typename T>
+void BondPositionService<T>::Flush(){
+    for(auto& i:position_map){
+        if(i.second.pending_trades > 0){
+            Publish(i.second);
+        }
+    }
+}
+
+template<typename T>
+long BondPositionService<T>::GetRejectedCount() const{
+    return rejected_count;
+}
+
+template<typename T>
+const SnapshotTable<PositionSnapshot>& BondPositionService<T>::GetSnapshots() const{
+    return snapshots;
+}
+
+template<typename T>
+void BondPositionService<T>::Publish(NettedPosition<T>& netted){
+    for(int b = 0; b < book_registry.Size(); b++){
+        if(netted.positions[b] != 0){
+            netted.position.AddPosition(b, netted.positions[b]);
+            netted.positions[b] = 0;
+        }
     }
+    netted.pending_trades = 0;
+
+    PublishSnapshot(netted);
 
     for(auto& each:listeners){
-        each->ProcessAdd(i->second);
+        each->ProcessAdd(netted.position);
+    }
+    metrics.CountOut(listeners.size());
+}
+
+template<typename T>
+void BondPositionService<T>::PublishSnapshot(const NettedPosition<T>& netted){
+    PositionSnapshot snapshot;
+    for(int b = 0; b < MAX_BOOKS; b++){
+        snapshot.positions[b] = netted.position.GetPosition(b);
     }
+    snapshot.aggregate = netted.position.GetAggregatePosition();
+    snapshots.Publish(netted.snapshot_index, snapshot);
+}
 
+template<typename T>
+void BondPositionService<T>::SaveCheckpoint(CheckpointWriter& writer) const{
+    writer.BeginSection(BOOK_NAME_SECTION);
+    for(int b = 0; b < book_registry.Size(); b++){
+        BookNameRecord record;
+        CopyCheckpointId(record.name, book_registry.GetBookName(b));
+        writer.Write(record);
+    }
+    writer.EndSection(book_registry.Size());
+
+    writer.BeginSection(POSITION_SECTION);
+    for(auto& i:position_map){
+        PositionRecord record;
+        CopyCheckpointId(record.productId, i.first);
+        for(int b = 0; b < MAX_BOOKS; b++){
+            record.positions[b] = i.second.position.GetPosition(b);
+            record.pending[b] = i.second.positions[b];
+        }
+        record.pendingTrades = i.second.pending_trades;
+        writer.Write(record);
+    }
+    writer.EndSection(position_map.size());
+}
+
+template<typename T>
+void BondPositionService<T>::LoadCheckpoint(const CheckpointReader& reader, Service<string, T>* products){
+    // book ids index the position arrays, so they must come back the same
+    vector<BookNameRecord> books = reader.GetRecords<BookNameRecord>(BOOK_NAME_SECTION);
+    for(int b = 0; b < (int)books.size(); b++){
+        if(book_registry.GetBookId(books[b].name) != b){
+            throw runtime_error(string("checkpoint book ") + books[b].name + " has another id here");
+        }
+    }
+
+    for(auto& record:reader.GetRecords<PositionRecord>(POSITION_SECTION)){
+        NettedPosition<T>& netted = GetNetted(products->GetData(record.productId));
+        for(int b = 0; b < MAX_BOOKS; b++){
+            if(record.positions[b] != 0){
+                netted.position.AddPosition(b, record.positions[b]);
+            }
+            netted.positions[b] = record.pending[b];
+        }
+        netted.pending_trades = record.pendingTrades;
+        PublishSnapshot(netted);
+    }
 }
 
 
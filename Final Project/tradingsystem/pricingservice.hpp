@@ -9,6 +9,8 @@
 
 #include <string>
 #include "soa.hpp"
+#include "metrics.hpp"
+#include "checkpoint.hpp"
 #include <iostream>
 #include <map>
 #include <fstream>
@@ -19,7 +21,7 @@ using namespace std;
  * Type T is the product type.
  */
 template<typename T>
-class Price
+class Price : private CopyCounted<Price<T>>
 {
 
 public:
@@ -38,7 +40,7 @@ public:
   double GetBidOfferSpread() const;
 
 private:
-  const T& product;
+  T product;
   double mid;
   double bidOfferSpread;
 
@@ -70,6 +72,16 @@ double Price<T>::GetBidOfferSpread() const
     return bidOfferSpread;
 }
 
+/**
+ * Checkpointed latest price of a product.
+ */
+struct PriceRecord
+{
+  char productId[CHECKPOINT_ID_SIZE];
+  double mid;
+  double bidOfferSpread;
+};
+
 ////convert input data to price
 //double transform_data_to_price(string& s) {
 //    double ans;
@@ -99,11 +111,13 @@ private:
     map<string, Price<T>> price_map;
     vector<ServiceListener<Price<T>>*> listeners;
     BondPricingConnector<T>* bond_pricing_connector;
+    ServiceMetrics metrics;
 public:
-    PricingService();
+    // ctor; the connector looks the products it is sent prices for up in products
+    PricingService(Service<string, T>* products);
     ~PricingService();
     // Get data on our service given a key
-    Price<T>& GetData(string key) = 0;
+    Price<T>& GetData(string key);
 
     // The callback that a Connector should invoke for any new or updated data
     void OnMessage(Price<T> &data);
@@ -116,13 +130,21 @@ public:
     const vector< ServiceListener<Price<T>>* >& GetListeners() const;
     // Get its connector
     BondPricingConnector<T>* GetConnector();
+
+    // Write the latest price of every product into a checkpoint
+    void SaveCheckpoint(CheckpointWriter& writer) const;
+
+    // Restore the prices of a checkpoint, looking the products up in products;
+    // listeners are not notified, they restore their own state
+    void LoadCheckpoint(const CheckpointReader& reader, Service<string, T>* products);
 };
 
 template<typename T>
-PricingService<T>::PricingService(){
+PricingService<T>::PricingService(Service<string, T>* products) :
+    metrics("pricing") {
     price_map = map<string, Price<T>>();
     listeners = vector<ServiceListener<Price<T>>*>();
-    bond_pricing_connector = new BondPricingConnector<T>(this);
+    bond_pricing_connector = new BondPricingConnector<T>(this, products);
 }
 
 template<typename T>
@@ -136,12 +158,14 @@ Price<T>& PricingService<T>::GetData(string key){
 template<typename T>
 void PricingService<T>::OnMessage(Price<T>& bond_data)
 {
-    price_map[bond_data.GetProduct()] = bond_data;
+    ServiceHop hop(metrics);
+    price_map[bond_data.GetProduct().GetProductId()] = bond_data;
 
     for (auto& l : listeners)
     {
         l->ProcessAdd(bond_data);
     }
+    metrics.CountOut(listeners.size());
 }
 
 template<typename T>
@@ -162,6 +186,30 @@ BondPricingConnector<T>* PricingService<T>::GetConnector()
     return bond_pricing_connector;
 }
 
+template<typename T>
+void PricingService<T>::SaveCheckpoint(CheckpointWriter& writer) const
+{
+    writer.BeginSection(PRICE_SECTION);
+    for (auto& i : price_map)
+    {
+        PriceRecord record;
+        CopyCheckpointId(record.productId, i.first);
+        record.mid = i.second.GetMid();
+        record.bidOfferSpread = i.second.GetBidOfferSpread();
+        writer.Write(record);
+    }
+    writer.EndSection(price_map.size());
+}
+
+template<typename T>
+void PricingService<T>::LoadCheckpoint(const CheckpointReader& reader, Service<string, T>* products)
+{
+    for (auto& record : reader.GetRecords<PriceRecord>(PRICE_SECTION))
+    {
+        price_map[record.productId] = Price<T>(products->GetData(record.productId), record.mid, record.bidOfferSpread);
+    }
+}
+
 
 
 
@@ -172,18 +220,19 @@ template<typename  T>
 class BondPricingConnector: public Connector<Price<T>>{
 private:
     PricingService<T>* price_service;
+    Service<string, T>* product_service;
 public:
-    BondPricingConnector();
-    BondPricingConnector(PricingService<T>* service);
+    BondPricingConnector(PricingService<T>* service, Service<string, T>* products);
     ~BondPricingConnector();
     //Publish() method on the Connector publishes data to the connectivity source and can be invoked from a Service
     void Publish(Price<T>& data);
-    void Subscribe(ifstream& data);
+    void Subscribe(istream& data);
 };
 
 template<typename T>
-BondPricingConnector<T>::BondPricingConnector(PricingService<T>* service){
+BondPricingConnector<T>::BondPricingConnector(PricingService<T>* service, Service<string, T>* products){
     price_service = service;
+    product_service = products;
 }
 
 template<typename T>
@@ -194,7 +243,7 @@ template<typename T>
 void BondPricingConnector<T>::Publish(Price<T>& data) {}
 
 template<typename T>
-void BondPricingConnector<T>::Subscribe(ifstream& data) {
+void BondPricingConnector<T>::Subscribe(istream& data) {
     string info;
     while(getline(data, info)){
         stringstream info_stream(info);
@@ -204,10 +253,10 @@ void BondPricingConnector<T>::Subscribe(ifstream& data) {
             vec_s.push_back(s);
         }
         string bond_code = vec_s[0];
-        double price = transform_data_to_price(vec_s[1]);
-        double spread =transform_data_to_price(vec_s[2]);
+        double price = ProductTraits<T>::ParsePrice(vec_s[1]);
+        double spread = ProductTraits<T>::ParsePrice(vec_s[2]);
 
-        Price<T> _price(bond_code, price, spread);
+        Price<T> _price(product_service->GetData(bond_code), price, spread);
         price_service->OnMessage(_price);
 
     }
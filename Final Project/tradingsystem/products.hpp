@@ -11,6 +11,7 @@
 #include <string>
 
 #include "boost/date_time/gregorian/gregorian.hpp"
+#include "profiling.hpp"
 
 using namespace std;
 using namespace boost::gregorian;
@@ -46,7 +47,7 @@ enum BondIdType { CUSIP, ISIN };
 /**
  * Bond product class
  */
-class Bond : public Product
+class Bond : public Product, private CopyCounted<Bond>
 {
 
 public:
@@ -93,7 +94,7 @@ enum SwapLegType { OUTRIGHT, CURVE, FLY };
 /**
  * Interest Rate Swap product
  */
-class IRSwap : public Product
+class IRSwap : public Product, private CopyCounted<IRSwap>
 {
 
 public:
@@ -184,7 +185,7 @@ Bond::Bond(string _productId, BondIdType _bondIdType, string _ticker, float _cou
   maturityDate =_maturityDate;
 }
 
-Bond::Bond() : Product(0, BOND)
+Bond::Bond() : Product("", BOND)
 {
 }
 
@@ -232,7 +233,7 @@ IRSwap::IRSwap(string _productId, DayCountConvention _fixedLegDayCountConvention
   terminationDate =_terminationDate;
 }
 
-IRSwap::IRSwap() : Product(0, IRSWAP)
+IRSwap::IRSwap() : Product("", IRSWAP)
 {
 }
 
@@ -0,0 +1,242 @@
+/**
+ * profiling.hpp
+ * Defines the copy and allocation profiling build mode. Built with
+ * TRADING_PROFILE_COPIES defined (cmake -DTRADING_PROFILE_COPIES=ON), every copy
+ * of a message or product type deriving from CopyCounted, and every heap
+ * allocation, is counted against the service hop the thread is in, and a
+ * table of them per message is written to stderr at exit. Built without it,
+ * CopyCounted is an empty base and a hop marks nothing, so they cost nothing.
+ */
+#ifndef PROFILING_HPP
+#define PROFILING_HPP
+
+#include <string>
+
+using namespace std;
+
+#ifdef TRADING_PROFILE_COPIES
+
+#include <atomic>
+#include <algorithm>
+#include <typeinfo>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <cxxabi.h>
+
+// Service hops that can be told apart; hop 0 is time spent outside every service
+const int PROFILE_MAX_HOPS = 64;
+// Types whose copies can be told apart
+const int PROFILE_MAX_TYPES = 32;
+// Longest hop name kept
+const size_t PROFILE_NAME_SIZE = 32;
+
+// Register a service hop, returning its index
+int RegisterProfileHop(const string &name);
+
+// Register a counted type by its mangled name, returning its index
+int RegisterProfileType(const char *name);
+
+// Count a copy of type in the calling thread's hop
+void CountProfileCopy(int type);
+
+// Count a message into hop
+void CountProfileMessage(int hop);
+
+// Make hop the calling thread's hop, returning the one it was in
+int EnterProfileHop(int hop);
+
+// Return to the hop the calling thread was in before
+void LeaveProfileHop(int previous);
+
+// Index of a counted type, registered on its first copy
+template<typename T>
+int ProfileTypeIndex()
+{
+  static const int index = RegisterProfileType(typeid(T).name());
+  return index;
+}
+
+/**
+ * Base of a type whose copies are counted; moves are not copies and are not counted.
+ * Type T is the derived type.
+ */
+template<typename T>
+class CopyCounted
+{
+
+protected:
+
+  CopyCounted() = default;
+
+  CopyCounted(const CopyCounted&)
+  {
+    CountProfileCopy(ProfileTypeIndex<T>());
+  }
+
+  CopyCounted(CopyCounted&&) = default;
+
+  CopyCounted& operator=(const CopyCounted&)
+  {
+    CountProfileCopy(ProfileTypeIndex<T>());
+    return *this;
+  }
+
+  CopyCounted& operator=(CopyCounted&&) = default;
+
+};
+
+/**
+ * Counts of one build's run, written out at exit.
+ */
+struct ProfileCounts
+{
+  char hop_names[PROFILE_MAX_HOPS][PROFILE_NAME_SIZE];
+  const char *type_names[PROFILE_MAX_TYPES];
+  atomic<int> hop_count;
+  atomic<int> type_count;
+  atomic<long> messages[PROFILE_MAX_HOPS];
+  atomic<long> allocations[PROFILE_MAX_HOPS];
+  atomic<long> allocated_bytes[PROFILE_MAX_HOPS];
+  atomic<long> copies[PROFILE_MAX_HOPS][PROFILE_MAX_TYPES];
+
+  // Write the table of counts to stderr
+  ~ProfileCounts();
+};
+
+// Zero-initialized before any constructor runs, so allocations during static initialization count too
+ProfileCounts profile_counts;
+thread_local int profile_hop = 0;
+
+int RegisterProfileHop(const string &name)
+{
+  int hop = profile_counts.hop_count.fetch_add(1) + 1;
+  // hops past the last share it
+  if (hop >= PROFILE_MAX_HOPS) return PROFILE_MAX_HOPS - 1;
+  strncpy(profile_counts.hop_names[hop], name.c_str(), PROFILE_NAME_SIZE - 1);
+  return hop;
+}
+
+int RegisterProfileType(const char *name)
+{
+  int type = profile_counts.type_count.fetch_add(1);
+  if (type >= PROFILE_MAX_TYPES) return PROFILE_MAX_TYPES - 1;
+  profile_counts.type_names[type] = name;
+  return type;
+}
+
+void CountProfileCopy(int type)
+{
+  profile_counts.copies[profile_hop][type].fetch_add(1, memory_order_relaxed);
+}
+
+void CountProfileMessage(int hop)
+{
+  profile_counts.messages[hop].fetch_add(1, memory_order_relaxed);
+}
+
+int EnterProfileHop(int hop)
+{
+  int previous = profile_hop;
+  profile_hop = hop;
+  return previous;
+}
+
+void LeaveProfileHop(int previous)
+{
+  profile_hop = previous;
+}
+
+ProfileCounts::~ProfileCounts()
+{
+  int hops = min(hop_count.load() + 1, PROFILE_MAX_HOPS);
+  int types = min(type_count.load(), PROFILE_MAX_TYPES);
+  fprintf(stderr, "\ncopies and heap allocations by service hop (per message in, where it has any)\n");
+  fprintf(stderr, "%-24s %12s %12s %10s %14s\n", "hop", "messages", "allocations", "per msg", "bytes");
+  for (int hop = 0; hop < hops; hop++) {
+    long count = messages[hop].load();
+    long allocated = allocations[hop].load();
+    if (count == 0 && allocated == 0) continue;
+    const char *name = hop == 0 ? "(outside services)" : hop_names[hop];
+    fprintf(stderr, "%-24s %12ld %12ld %10.2f %14ld\n", name, count, allocated, count ? double(allocated) / count : 0.0, allocated_bytes[hop].load());
+    for (int type = 0; type < types; type++) {
+      long copied = copies[hop][type].load();
+      if (copied == 0) continue;
+      // demangling goes through malloc, so it is not counted
+      int status;
+      char *readable = abi::__cxa_demangle(type_names[type], nullptr, nullptr, &status);
+      fprintf(stderr, "    copies of %-40s %10ld %10.2f\n", status == 0 ? readable : type_names[type], copied, count ? double(copied) / count : 0.0);
+      free(readable);
+    }
+  }
+}
+
+void* operator new(size_t size)
+{
+  profile_counts.allocations[profile_hop].fetch_add(1, memory_order_relaxed);
+  profile_counts.allocated_bytes[profile_hop].fetch_add(size, memory_order_relaxed);
+  void *memory = malloc(size ? size : 1);
+  if (!memory) throw bad_alloc();
+  return memory;
+}
+
+void* operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+// kept out of line, or the compiler pairs the free with a new at the call site and warns
+__attribute__((noinline)) void operator delete(void *memory) noexcept
+{
+  free(memory);
+}
+
+__attribute__((noinline)) void operator delete[](void *memory) noexcept
+{
+  free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void *memory, size_t) noexcept
+{
+  free(memory);
+}
+
+__attribute__((noinline)) void operator delete[](void *memory, size_t) noexcept
+{
+  free(memory);
+}
+
+#else
+
+/**
+ * Base of a type whose copies are counted in the profiling build; empty otherwise.
+ * Type T is the derived type.
+ */
+template<typename T>
+class CopyCounted
+{
+};
+
+// Hops are not told apart outside the profiling build
+inline int RegisterProfileHop(const string&)
+{
+  return 0;
+}
+
+inline void CountProfileMessage(int)
+{
+}
+
+inline int EnterProfileHop(int)
+{
+  return 0;
+}
+
+inline void LeaveProfileHop(int)
+{
+}
+
+#endif
+
+#endif
@@ -0,0 +1,461 @@
+/**
+ * riskgate.hpp
+ * Defines the pre-trade risk gate between the algo execution service and the execution
+ * service: every order is checked against position, order notional and PV01 limits per
+ * product and per book before it may go out. Positions and PV01s come in from the position
+ * and risk services through listeners; the order path only reads and bumps atomics.
+ */
+#ifndef RISK_GATE_HPP
+#define RISK_GATE_HPP
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+#include <limits>
+#include <cmath>
+#include <cstdlib>
+#include <stdexcept>
+
+#include "soa.hpp"
+#include "executionservice.hpp"
+#include "positionservice.hpp"
+#include "riskservice.hpp"
+
+using namespace std;
+
+// Orders are priced per this much face, so notional is quantity times price over it
+const double RISK_GATE_PRICE_SCALE = 100.0;
+
+/**
+ * Limits on a product or a book. Position and PV01 limits bound the absolute net position
+ * and PV01 the order would leave; the notional limit bounds the order itself.
+ */
+struct RiskLimits
+{
+  long maxPosition = numeric_limits<long>::max();
+  double maxOrderNotional = numeric_limits<double>::infinity();
+  double maxPV01 = numeric_limits<double>::infinity();
+};
+
+// Outcome of a pre-trade check
+enum RiskCheckResult { RISK_ACCEPTED, RISK_UNKNOWN_PRODUCT, RISK_NOTIONAL_LIMIT, RISK_POSITION_LIMIT, RISK_PV01_LIMIT };
+
+/**
+ * Limit tables and the exposures they are checked against, for a fixed set of products.
+ * Orders are booked to one book, the execution book. An order that passes is reserved as
+ * pending until the position service shows it filled, so a burst of orders cannot each
+ * pass against the same position. Reserving is an atomic add that is undone if it breaks
+ * a limit, so orders checked on several threads at once cannot together pass one.
+ * Limits are set before trading. Positions and PV01s are applied from one thread.
+ * Type T is the product type.
+ */
+template<typename T>
+class PreTradeRiskGate
+{
+
+public:
+
+  // ctor for a gate over products whose orders are booked to execution_book_id
+  PreTradeRiskGate(const vector<T> &products, int execution_book_id);
+
+  // Set the limits on a product
+  void SetProductLimits(const string &productId, const RiskLimits &limits);
+
+  // Set the limits on a book
+  void SetBookLimits(int book_id, const RiskLimits &limits);
+
+  // Check an order, reserving it if it passes; buying is taking the offer
+  RiskCheckResult Check(const ExecutionOrder<T> &order);
+
+  // Apply a position the position service published
+  void OnPosition(const Position<T> &position);
+
+  // Apply a PV01 per unit the risk service published
+  void OnPV01(const PV01<T> &pv01);
+
+  // Apply the positions and PV01s the position and risk services last published, such as
+  // those they restored from a checkpoint, which reach no listener
+  void Seed(const SnapshotTable<PositionSnapshot> &positions, const SnapshotTable<RiskSnapshot> &pv01s);
+
+  // Get the net position of a product, pending orders included
+  long GetPosition(const string &productId) const;
+
+  // Get the PV01 of a book, pending orders included
+  double GetBookPV01(int book_id) const;
+
+  // Get the number of orders accepted
+  long GetAcceptedCount() const;
+
+  // Get the number of orders rejected
+  long GetRejectedCount() const;
+
+private:
+  struct ProductRisk
+  {
+    RiskLimits limits;
+    // per book as last published, and their sum
+    atomic<long> positions[MAX_BOOKS];
+    atomic<long> position;
+    // accepted orders not filled yet, in the execution book
+    atomic<long> pending;
+    atomic<double> unit_pv01;
+  };
+  struct BookRisk
+  {
+    RiskLimits limits;
+    // positions and pending orders over every product
+    atomic<long> position;
+    atomic<long> pending;
+    atomic<double> pv01;
+  };
+  vector<ProductRisk> products;
+  vector<BookRisk> books;
+  unordered_map<string, size_t> product_index;
+  int execution_book;
+  atomic<long> accepted;
+  atomic<long> rejected;
+
+  // Get the index of a product, or -1
+  long FindProduct(const string &productId) const;
+
+  // Apply a product's positions per book
+  void ApplyPositions(ProductRisk &product, const long *positions);
+
+  // Apply a product's PV01 per unit
+  void ApplyPV01(ProductRisk &product, double unit_pv01);
+
+  // Add to an atomic double, returning its value before
+  static double AddPV01(atomic<double> &value, double change);
+
+  // Undo the reservation of quantity on product and count a rejection
+  RiskCheckResult Reject(ProductRisk &product, BookRisk *book, long quantity, double pv01, RiskCheckResult result);
+
+};
+
+/**
+ * Stage between the algo execution service and the execution service's listener: orders
+ * that pass the gate go on to next, the rest stop here.
+ * Type T is the product type.
+ */
+template<typename T>
+class BondRiskGateListener : public ServiceListener<AlgoExecution<T>>
+{
+
+public:
+
+  // ctor for a stage checking orders on gate before passing them to next
+  BondRiskGateListener(PreTradeRiskGate<T> *_gate, ServiceListener<AlgoExecution<T>> *_next);
+
+  // Listener callback to process an add event to the Service
+  virtual void ProcessAdd(AlgoExecution<T> &data) override;
+
+  // Listener callback to process a remove event to the Service
+  virtual void ProcessRemove(AlgoExecution<T> &data) override {};
+
+  // Listener callback to process an update event to the Service
+  virtual void ProcessUpdate(AlgoExecution<T> &data) override {};
+
+private:
+  PreTradeRiskGate<T> *gate;
+  ServiceListener<AlgoExecution<T>> *next;
+
+};
+
+/**
+ * Listener applying the position service's positions to the gate.
+ * Type T is the product type.
+ */
+template<typename T>
+class RiskGatePositionListener : public ServiceListener<Position<T>>
+{
+
+public:
+
+  // ctor for a listener updating gate
+  RiskGatePositionListener(PreTradeRiskGate<T> *_gate);
+
+  // Listener callback to process an add event to the Service
+  virtual void ProcessAdd(Position<T> &data) override;
+
+  // Listener callback to process a remove event to the Service
+  virtual void ProcessRemove(Position<T> &data) override {};
+
+  // Listener callback to process an update event to the Service
+  virtual void ProcessUpdate(Position<T> &data) override {};
+
+private:
+  PreTradeRiskGate<T> *gate;
+
+};
+
+/**
+ * Listener applying the risk service's PV01s to the gate.
+ * Type T is the product type.
+ */
+template<typename T>
+class RiskGatePV01Listener : public ServiceListener<PV01<T>>
+{
+
+public:
+
+  // ctor for a listener updating gate
+  RiskGatePV01Listener(PreTradeRiskGate<T> *_gate);
+
+  // Listener callback to process an add event to the Service
+  virtual void ProcessAdd(PV01<T> &data) override;
+
+  // Listener callback to process a remove event to the Service
+  virtual void ProcessRemove(PV01<T> &data) override {};
+
+  // Listener callback to process an update event to the Service
+  virtual void ProcessUpdate(PV01<T> &data) override {};
+
+private:
+  PreTradeRiskGate<T> *gate;
+
+};
+
+template<typename T>
+PreTradeRiskGate<T>::PreTradeRiskGate(const vector<T> &_products, int execution_book_id) :
+  products(_products.size()), books(MAX_BOOKS), execution_book(execution_book_id), accepted(0), rejected(0)
+{
+  if (execution_book < 0 || execution_book >= MAX_BOOKS) throw out_of_range("no book " + to_string(execution_book));
+  for (size_t i = 0; i < _products.size(); i++) {
+    product_index.insert(make_pair(_products[i].GetProductId(), i));
+    ProductRisk &product = products[i];
+    for (int b = 0; b < MAX_BOOKS; b++) product.positions[b].store(0);
+    product.position.store(0);
+    product.pending.store(0);
+    product.unit_pv01.store(0);
+  }
+  for (auto &book : books) {
+    book.position.store(0);
+    book.pending.store(0);
+    book.pv01.store(0);
+  }
+}
+
+template<typename T>
+void PreTradeRiskGate<T>::SetProductLimits(const string &productId, const RiskLimits &limits)
+{
+  long index = FindProduct(productId);
+  if (index < 0) throw out_of_range("no product " + productId + " in the risk gate");
+  products[index].limits = limits;
+}
+
+template<typename T>
+void PreTradeRiskGate<T>::SetBookLimits(int book_id, const RiskLimits &limits)
+{
+  books.at(book_id).limits = limits;
+}
+
+template<typename T>
+RiskCheckResult PreTradeRiskGate<T>::Check(const ExecutionOrder<T> &order)
+{
+  long index = FindProduct(order.GetProduct().GetProductId());
+  if (index < 0) {
+    rejected.fetch_add(1, memory_order_relaxed);
+    return RISK_UNKNOWN_PRODUCT;
+  }
+  ProductRisk &product = products[index];
+  BookRisk &book = books[execution_book];
+  long quantity = order.GetVisibleQuantity() + order.GetHiddenQuantity();
+  if (order.GetSide() == BID) quantity = -quantity;
+
+  double notional = labs(quantity) * order.GetPrice() / RISK_GATE_PRICE_SCALE;
+  if (notional > product.limits.maxOrderNotional || notional > book.limits.maxOrderNotional) {
+    rejected.fetch_add(1, memory_order_relaxed);
+    return RISK_NOTIONAL_LIMIT;
+  }
+
+  // reserve first and check what the reservation leaves, so concurrent orders see each other
+  double unit_pv01 = product.unit_pv01.load(memory_order_relaxed);
+  long product_position = product.position.load(memory_order_relaxed) + product.pending.fetch_add(quantity, memory_order_acq_rel) + quantity;
+  if (labs(product_position) > product.limits.maxPosition)
+    return Reject(product, nullptr, quantity, 0, RISK_POSITION_LIMIT);
+  if (fabs(unit_pv01 * product_position) > product.limits.maxPV01)
+    return Reject(product, nullptr, quantity, 0, RISK_PV01_LIMIT);
+
+  long book_position = book.position.load(memory_order_relaxed) + book.pending.fetch_add(quantity, memory_order_acq_rel) + quantity;
+  if (labs(book_position) > book.limits.maxPosition)
+    return Reject(product, &book, quantity, 0, RISK_POSITION_LIMIT);
+  double pv01 = unit_pv01 * quantity;
+  double book_pv01 = AddPV01(book.pv01, pv01) + pv01;
+  if (fabs(book_pv01) > book.limits.maxPV01)
+    return Reject(product, &book, quantity, pv01, RISK_PV01_LIMIT);
+
+  accepted.fetch_add(1, memory_order_relaxed);
+  return RISK_ACCEPTED;
+}
+
+template<typename T>
+void PreTradeRiskGate<T>::OnPosition(const Position<T> &position)
+{
+  long index = FindProduct(position.GetProduct().GetProductId());
+  if (index < 0) return;
+  long positions[MAX_BOOKS];
+  for (int b = 0; b < MAX_BOOKS; b++) positions[b] = position.GetPosition(b);
+  ApplyPositions(products[index], positions);
+}
+
+template<typename T>
+void PreTradeRiskGate<T>::OnPV01(const PV01<T> &pv01)
+{
+  long index = FindProduct(pv01.GetProduct().GetProductId());
+  if (index < 0) return;
+  ApplyPV01(products[index], pv01.GetPV01());
+}
+
+template<typename T>
+void PreTradeRiskGate<T>::Seed(const SnapshotTable<PositionSnapshot> &positions, const SnapshotTable<RiskSnapshot> &pv01s)
+{
+  // PV01s first, so the positions move the books' PV01s at them
+  vector<pair<string, RiskSnapshot>> risks;
+  pv01s.ReadAll(risks);
+  for (auto &risk : risks) {
+    long index = FindProduct(risk.first);
+    if (index >= 0) ApplyPV01(products[index], risk.second.pv01);
+  }
+  vector<pair<string, PositionSnapshot>> held;
+  positions.ReadAll(held);
+  for (auto &position : held) {
+    long index = FindProduct(position.first);
+    if (index >= 0) ApplyPositions(products[index], position.second.positions);
+  }
+}
+
+template<typename T>
+void PreTradeRiskGate<T>::ApplyPositions(ProductRisk &product, const long *positions)
+{
+  double unit_pv01 = product.unit_pv01.load(memory_order_relaxed);
+  for (int b = 0; b < MAX_BOOKS; b++) {
+    long change = positions[b] - product.positions[b].load(memory_order_relaxed);
+    if (change == 0) continue;
+    product.positions[b].store(positions[b], memory_order_relaxed);
+    product.position.fetch_add(change, memory_order_relaxed);
+    books[b].position.fetch_add(change, memory_order_relaxed);
+    AddPV01(books[b].pv01, unit_pv01 * change);
+    if (b != execution_book) continue;
+
+    // a fill in the execution book takes the place of pending orders on its side
+    long pending = product.pending.load(memory_order_relaxed);
+    long filled = 0;
+    do {
+      if (pending == 0 || (pending > 0) != (change > 0)) break;
+      filled = labs(change) < labs(pending) ? change : pending;
+    } while (!product.pending.compare_exchange_weak(pending, pending - filled, memory_order_acq_rel));
+    if (pending != 0 && (pending > 0) == (change > 0)) {
+      books[b].pending.fetch_sub(filled, memory_order_relaxed);
+      AddPV01(books[b].pv01, -unit_pv01 * filled);
+    }
+  }
+}
+
+template<typename T>
+void PreTradeRiskGate<T>::ApplyPV01(ProductRisk &product, double unit_pv01)
+{
+  double change = unit_pv01 - product.unit_pv01.load(memory_order_relaxed);
+  if (change == 0) return;
+  product.unit_pv01.store(unit_pv01, memory_order_relaxed);
+  // the books' PV01s move by the change on what each holds of the product
+  for (int b = 0; b < MAX_BOOKS; b++) {
+    long held = product.positions[b].load(memory_order_relaxed);
+    if (b == execution_book) held += product.pending.load(memory_order_relaxed);
+    if (held != 0) AddPV01(books[b].pv01, change * held);
+  }
+}
+
+template<typename T>
+long PreTradeRiskGate<T>::GetPosition(const string &productId) const
+{
+  long index = FindProduct(productId);
+  if (index < 0) return 0;
+  return products[index].position.load(memory_order_relaxed) + products[index].pending.load(memory_order_relaxed);
+}
+
+template<typename T>
+double PreTradeRiskGate<T>::GetBookPV01(int book_id) const
+{
+  return books.at(book_id).pv01.load(memory_order_relaxed);
+}
+
+template<typename T>
+long PreTradeRiskGate<T>::GetAcceptedCount() const
+{
+  return accepted.load(memory_order_relaxed);
+}
+
+template<typename T>
+long PreTradeRiskGate<T>::GetRejectedCount() const
+{
+  return rejected.load(memory_order_relaxed);
+}
+
+template<typename T>
+long PreTradeRiskGate<T>::FindProduct(const string &productId) const
+{
+  // the map is only changed in the ctor, so finding in it needs no lock
+  auto found = product_index.find(productId);
+  return found == product_index.end() ? -1 : (long)found->second;
+}
+
+template<typename T>
+double PreTradeRiskGate<T>::AddPV01(atomic<double> &value, double change)
+{
+  double current = value.load(memory_order_relaxed);
+  while (!value.compare_exchange_weak(current, current + change, memory_order_acq_rel)) {
+  }
+  return current;
+}
+
+template<typename T>
+RiskCheckResult PreTradeRiskGate<T>::Reject(ProductRisk &product, BookRisk *book, long quantity, double pv01, RiskCheckResult result)
+{
+  product.pending.fetch_sub(quantity, memory_order_acq_rel);
+  if (book) {
+    book->pending.fetch_sub(quantity, memory_order_acq_rel);
+    if (pv01 != 0) AddPV01(book->pv01, -pv01);
+  }
+  rejected.fetch_add(1, memory_order_relaxed);
+  return result;
+}
+
+template<typename T>
+BondRiskGateListener<T>::BondRiskGateListener(PreTradeRiskGate<T> *_gate, ServiceListener<AlgoExecution<T>> *_next) :
+  gate(_gate), next(_next)
+{
+}
+
+template<typename T>
+void BondRiskGateListener<T>::ProcessAdd(AlgoExecution<T> &data)
+{
+  if (gate->Check(data.GetExecutionOrder()) == RISK_ACCEPTED)
+    next->ProcessAdd(data);
+}
+
+template<typename T>
+RiskGatePositionListener<T>::RiskGatePositionListener(PreTradeRiskGate<T> *_gate) :
+  gate(_gate)
+{
+}
+
+template<typename T>
+void RiskGatePositionListener<T>::ProcessAdd(Position<T> &data)
+{
+  gate->OnPosition(data);
+}
+
+template<typename T>
+RiskGatePV01Listener<T>::RiskGatePV01Listener(PreTradeRiskGate<T> *_gate) :
+  gate(_gate)
+{
+}
+
+template<typename T>
+void RiskGatePV01Listener<T>::ProcessAdd(PV01<T> &data)
+{
+  gate->OnPV01(data);
+}
+
+#endif
@@ -7,8 +7,13 @@
 #ifndef RISK_SERVICE_HPP
 #define RISK_SERVICE_HPP
 
+#include <unordered_map>
 #include "soa.hpp"
+#include "metrics.hpp"
 #include "positionservice.hpp"
+#include "snapshot.hpp"
+#include "checkpoint.hpp"
+#include "swapanalytics.hpp"
 #include "./Data/Bond_info.h"
 
 /**
@@ -16,12 +21,13 @@
  * Type T is the product type.
  */
 template<typename T>
-class PV01
+class PV01 : private CopyCounted<PV01<T>>
 {
 
 public:
 
   // ctor for a PV01 value
+  PV01() = default;
   PV01(const T &_product, double _pv01, long _quantity);
 
   // Get the product on this PV01 value
@@ -35,8 +41,8 @@ public:
 
 private:
   T product;
-  double pv01;
-  long quantity;
+  double pv01 = 0;
+  long quantity = 0;
 
 };
 
@@ -78,23 +84,99 @@ class RiskService : public Service<string,PV01 <T> >
 public:
 
   // Add a position that the service will risk
-  void AddPosition(Position<T> &position) = 0;
+  virtual void AddPosition(Position<T> &position) = 0;
 
   // Get the bucketed risk for the bucket sector
-  const PV01< BucketedSector<T> >& GetBucketedRisk(const BucketedSector<T> &sector) const = 0;
+  virtual PV01< BucketedSector<T> > GetBucketedRisk(const BucketedSector<T> &sector) const = 0;
+
+};
+
+/**
+ * PV01 per unit of a product: the value gained per 100 notional when yields fall 1bp.
+ * Each product type has its own specialization, picked at compile time by BondRiskService.
+ * Type T is the product type.
+ */
+template<typename T>
+class PV01Model;
+
+/**
+ * Bond PV01s from the table in Data/Bond_info.h.
+ */
+template<>
+class PV01Model<Bond>
+{
+
+public:
+
+  // Get the PV01 per unit of bond
+  double GetUnitPV01(const Bond &bond);
+
+};
+
+/**
+ * Swap PV01s off a discount curve for paying fixed at the par rate, so that a bought swap
+ * offsets a bought bond. Cached per product until the curve changes.
+ */
+template<>
+class PV01Model<IRSwap>
+{
+
+public:
+
+  // ctor for swaps risked off curve
+  PV01Model(const DiscountCurve &curve);
+
+  // Get the PV01 per unit of notional in swap
+  double GetUnitPV01(const IRSwap &swap);
+
+  // Risk off a new curve
+  void SetCurve(const DiscountCurve &curve);
+
+private:
+  SwapPricingEngine engine;
+  unordered_map<string, double> unit_pv01;
 
 };
 
 
+/**
+ * Published PV01 of a product as other threads read it.
+ */
+struct RiskSnapshot
+{
+  double pv01;
+  long quantity;
+};
+
+/**
+ * Checkpointed PV01 of a product.
+ */
+struct PV01Record
+{
+  char productId[CHECKPOINT_ID_SIZE];
+  double pv01;
+  long quantity;
+};
+
 template<typename T>
 class BondRiskService: public RiskService<T>{
 private:
     map<string, PV01<T>> pv_map;
     vector<ServiceListener<PV01<T>>*> listeners;
+    SnapshotTable<RiskSnapshot> snapshots;
+    PV01Model<T> model;
+    ServiceMetrics metrics;
 public:
-    BondRiskService();
+    BondRiskService(const PV01Model<T>& _model = PV01Model<T>());
+
+    // Risk a position: its aggregate quantity at the model's PV01 per unit
+    virtual void AddPosition(Position<T> &position) override;
+
     // Get the bucketed risk for the bucket sector
-    const PV01< BucketedSector<T> >& GetBucketedRisk(const BucketedSector<T> &sector) const;
+    virtual PV01< BucketedSector<T> > GetBucketedRisk(const BucketedSector<T> &sector) const override;
+
+    // Get the model pricing the PV01 per unit
+    PV01Model<T>& GetPV01Model();
 
     // Get data on our service given a key
     virtual PV01<T>& GetData(string key) override;
@@ -108,6 +190,16 @@ public:
 
     // Get all listeners on the Service.
     virtual const vector< ServiceListener<PV01<T>>* >& GetListeners() const override;
+
+    // Get the published PV01s, safe to read from any thread
+    const SnapshotTable<RiskSnapshot>& GetSnapshots() const;
+
+    // Write every PV01 into a checkpoint
+    void SaveCheckpoint(CheckpointWriter& writer) const;
+
+    // Restore the PV01s of a checkpoint into an empty service, looking the products up
+    // in products; listeners are not notified
+    void LoadCheckpoint(const CheckpointReader& reader, Service<string, T>* products);
 };
 
 
@@ -142,6 +234,24 @@ PV01<T>::PV01(const T &_product, double _pv01, long _quantity) :
   quantity = _quantity;
 }
 
+template<typename T>
+const T& PV01<T>::GetProduct() const
+{
+  return product;
+}
+
+template<typename T>
+double PV01<T>::GetPV01() const
+{
+  return pv01;
+}
+
+template<typename T>
+long PV01<T>::GetQuantity() const
+{
+  return quantity;
+}
+
 template<typename T>
 BucketedSector<T>::BucketedSector(const vector<T>& _products, string _name) :
   products(_products)
@@ -162,23 +272,67 @@ const string& BucketedSector<T>::GetName() const
 }
 
 
+double PV01Model<Bond>::GetUnitPV01(const Bond &bond)
+{
+  auto found = bond_risk.find(bond.GetProductId());
+  if (found == bond_risk.end()) throw out_of_range("no PV01 for bond " + bond.GetProductId());
+  return found->second;
+}
+
+PV01Model<IRSwap>::PV01Model(const DiscountCurve &curve) :
+  engine(curve)
+{
+}
+
+double PV01Model<IRSwap>::GetUnitPV01(const IRSwap &swap)
+{
+  const string &id = swap.GetProductId();
+  auto found = unit_pv01.find(id);
+  if (found != unit_pv01.end()) return found->second;
+  engine.AddProduct(swap);
+  double parRate = engine.Value(id, 0.0, 1.0).parRate;
+  // the engine's DV01 is what paying fixed gains when rates rise
+  double pv01 = -100 * engine.Value(id, parRate, 1.0).dv01;
+  unit_pv01.insert(make_pair(id, pv01));
+  return pv01;
+}
+
+void PV01Model<IRSwap>::SetCurve(const DiscountCurve &curve)
+{
+  engine.SetCurve(curve);
+  unit_pv01.clear();
+}
+
 template<typename T>
-BondRiskService<T>::BondRiskService(){
+BondRiskService<T>::BondRiskService(const PV01Model<T>& _model) :
+    model(_model), metrics("risk") {
     pv_map = map<string, PV01<T>>();
 }
 
+template<typename T>
+void BondRiskService<T>::AddPosition(Position<T> &position){
+    const T& product = position.GetProduct();
+    PV01<T> pv01(product, model.GetUnitPV01(product), position.GetAggregatePosition());
+    OnMessage(pv01);
+}
+
 // Get the bucketed risk for the bucket sector
 template<typename T>
-const PV01< BucketedSector<T> >& BondRiskService<T>::GetBucketedRisk(const BucketedSector<T> &sector) const {
-    BucketedSector<T> bond = sector;
+PV01< BucketedSector<T> > BondRiskService<T>::GetBucketedRisk(const BucketedSector<T> &sector) const {
     double total_pv01 = 0;
     long total_num = 1;
-    vector<T> vec = sector.GetProducts();
-    for(auto& i: vec){
-        string code = i.GetProductId();
-        total_pv01 += pv_map[code].GetPV01()*pv_map[code].GetQuantity();
+    for(auto& i: sector.GetProducts()){
+        auto found = pv_map.find(i.GetProductId());
+        if(found != pv_map.end()){
+            total_pv01 += found->second.GetPV01()*found->second.GetQuantity();
+        }
     }
-    return PV01<BucketedSector<T>>(bond, total_pv01, total_num);
+    return PV01<BucketedSector<T>>(sector, total_pv01, total_num);
+}
+
+template<typename T>
+PV01Model<T>& BondRiskService<T>::GetPV01Model(){
+    return model;
 }
 
 // Get data on our service given a key
@@ -190,7 +344,41 @@ PV01<T>& BondRiskService<T>::GetData(string key){
 // The callback that a Connector should invoke for any new or updated data
 template<typename T>
 void BondRiskService<T>::OnMessage(PV01<T> &data){
-    pv_map[data.GetProduct().GetProductId()] = data;
+    ServiceHop hop(metrics);
+    const string& key = data.GetProduct().GetProductId();
+    pv_map[key] = data;
+    snapshots.Publish(key, RiskSnapshot{data.GetPV01(), data.GetQuantity()});
+    for(auto& i:listeners){
+        i->ProcessAdd(data);
+    }
+    metrics.CountOut(listeners.size());
+}
+
+template<typename T>
+const SnapshotTable<RiskSnapshot>& BondRiskService<T>::GetSnapshots() const{
+    return snapshots;
+}
+
+template<typename T>
+void BondRiskService<T>::SaveCheckpoint(CheckpointWriter& writer) const{
+    writer.BeginSection(PV01_SECTION);
+    for(auto& i:pv_map){
+        PV01Record record;
+        CopyCheckpointId(record.productId, i.first);
+        record.pv01 = i.second.GetPV01();
+        record.quantity = i.second.GetQuantity();
+        writer.Write(record);
+    }
+    writer.EndSection(pv_map.size());
+}
+
+template<typename T>
+void BondRiskService<T>::LoadCheckpoint(const CheckpointReader& reader, Service<string, T>* products){
+    for(auto& record:reader.GetRecords<PV01Record>(PV01_SECTION)){
+        string key = record.productId;
+        pv_map.insert(pair<string, PV01<T>>(key, PV01<T>(products->GetData(key), record.pv01, record.quantity)));
+        snapshots.Publish(key, RiskSnapshot{record.pv01, record.quantity});
+    }
 }
 
 // Add a listener to the Service for callbacks on add, remove, and update events
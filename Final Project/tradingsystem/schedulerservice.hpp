@@ -0,0 +1,329 @@
+/**
+ * schedulerservice.hpp
+ * Defines the clocks and the Service for scheduling timed callbacks:
+ * throttles, expiries and periodic flushes.
+ */
+#ifndef SCHEDULER_SERVICE_HPP
+#define SCHEDULER_SERVICE_HPP
+
+#include <string>
+#include <map>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include "soa.hpp"
+#include "metrics.hpp"
+#include "timerwheel.hpp"
+
+using namespace std;
+
+/**
+ * Source of the current time in milliseconds.
+ */
+class Clock
+{
+
+public:
+
+  virtual ~Clock() = default;
+
+  // Get the current time
+  virtual long Now() const = 0;
+
+  // Move to a time seen on the feed; only a replay clock follows it
+  virtual void Update(long time) = 0;
+
+};
+
+/**
+ * Clock reading the machine's monotonic clock.
+ */
+class WallClock : public Clock
+{
+
+public:
+
+  long Now() const override;
+
+  void Update(long) override {};
+
+};
+
+/**
+ * Clock following the timestamps of a replayed feed.
+ */
+class ReplayClock : public Clock
+{
+
+public:
+
+  // ctor
+  ReplayClock(long start = 0);
+
+  long Now() const override;
+
+  void Update(long time) override;
+
+private:
+  long now;
+
+};
+
+/**
+ * A named timer firing, or a clock tick sent to the SchedulerService.
+ */
+class TimerEvent
+{
+
+public:
+
+  // ctor for an event
+  TimerEvent() = default;
+  TimerEvent(string _name, long _time);
+
+  // Get the timer name
+  const string& GetName() const;
+
+  // Get the time it fired at
+  long GetTime() const;
+
+private:
+  string name;
+  long time;
+
+};
+
+/**
+ * Scheduler Service running callbacks off a hierarchical TimerWheel.
+ * Keyed on timer name.
+ * Driven either from the wall clock, by calling Poll() from the event loop, or from a replay
+ * clock, by sending the feed's times through OnMessage(). Named timers are also published to
+ * the listeners as TimerEvents.
+ */
+class SchedulerService : public Service<string, TimerEvent>
+{
+
+public:
+
+  // ctor
+  SchedulerService(Clock *_clock);
+
+  // Get data on our service given a key
+  TimerEvent& GetData(string key) override;
+
+  // The callback that a Connector should invoke for any new or updated data
+  void OnMessage(TimerEvent &data) override;
+
+  // Add a listener to the Service for callbacks on add, remove, and update events
+  // for data to the Service.
+  void AddListener(ServiceListener<TimerEvent> *listener) override;
+
+  // Get all listeners on the Service.
+  const vector< ServiceListener<TimerEvent>* >& GetListeners() const override;
+
+  // Run callback at time when
+  TimerHandle ScheduleAt(long when, function<void()> callback);
+
+  // Run callback delay milliseconds from now
+  TimerHandle ScheduleAfter(long delay, function<void()> callback);
+
+  // Run callback every period milliseconds, publishing a TimerEvent named name each time.
+  // The returned handle cancels every later run.
+  TimerHandle SchedulePeriodic(const string &name, long period, function<void()> callback);
+
+  // Cancel a timer
+  bool Cancel(TimerHandle handle);
+
+  // Run every timer due by the clock's time
+  void Poll();
+
+  // Get the clock's time
+  long Now() const;
+
+private:
+  Clock *clock;
+  TimerWheel wheel;
+  map<string, TimerEvent> event_map;
+  vector<ServiceListener<TimerEvent>*> listeners;
+  // periodic timer ids mapped to the handle of their next run
+  map<TimerHandle, TimerHandle> periodic_map;
+  uint32_t periodic_count;
+  ServiceMetrics metrics;
+  Counter timers_scheduled;
+  Counter timers_cancelled;
+
+  // Schedule the next run of a periodic timer
+  void SchedulePeriodicRun(TimerHandle id, const string &name, long when, long period, function<void()> callback);
+
+};
+
+/**
+ * Listener polling a scheduler on every event of the service it listens to, so that timers
+ * run while a feed is read on the same thread rather than only between feeds. Added last,
+ * it polls once the service's other listeners have seen the event.
+ * Type V is the data type of the service.
+ */
+template<typename V>
+class SchedulerPollListener : public ServiceListener<V>
+{
+
+public:
+
+  // ctor for a listener polling scheduler
+  SchedulerPollListener(SchedulerService *_scheduler);
+
+  // Listener callback to process an add event to the Service
+  void ProcessAdd(V &) override;
+
+  // Listener callback to process a remove event to the Service
+  void ProcessRemove(V &) override {};
+
+  // Listener callback to process an update event to the Service
+  void ProcessUpdate(V &) override {};
+
+private:
+  SchedulerService *scheduler;
+
+};
+
+
+long WallClock::Now() const
+{
+  return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+ReplayClock::ReplayClock(long start)
+{
+  now = start;
+}
+
+long ReplayClock::Now() const
+{
+  return now;
+}
+
+void ReplayClock::Update(long time)
+{
+  if (time > now) now = time;
+}
+
+TimerEvent::TimerEvent(string _name, long _time) :
+  name(_name)
+{
+  time = _time;
+}
+
+const string& TimerEvent::GetName() const
+{
+  return name;
+}
+
+long TimerEvent::GetTime() const
+{
+  return time;
+}
+
+SchedulerService::SchedulerService(Clock *_clock) :
+  wheel(1, _clock->Now()), metrics("scheduler")
+{
+  clock = _clock;
+  periodic_count = 0;
+  timers_scheduled = metrics.AddCounter("timers_scheduled");
+  timers_cancelled = metrics.AddCounter("timers_cancelled");
+}
+
+TimerEvent& SchedulerService::GetData(string key)
+{
+  return event_map[key];
+}
+
+void SchedulerService::OnMessage(TimerEvent &data)
+{
+  ServiceHop hop(metrics);
+  clock->Update(data.GetTime());
+  Poll();
+}
+
+void SchedulerService::AddListener(ServiceListener<TimerEvent> *listener)
+{
+  listeners.push_back(listener);
+}
+
+const vector< ServiceListener<TimerEvent>* >& SchedulerService::GetListeners() const
+{
+  return listeners;
+}
+
+TimerHandle SchedulerService::ScheduleAt(long when, function<void()> callback)
+{
+  timers_scheduled.Add();
+  return wheel.Schedule(when, std::move(callback));
+}
+
+TimerHandle SchedulerService::ScheduleAfter(long delay, function<void()> callback)
+{
+  timers_scheduled.Add();
+  return wheel.Schedule(Now() + delay, std::move(callback));
+}
+
+TimerHandle SchedulerService::SchedulePeriodic(const string &name, long period, function<void()> callback)
+{
+  // periodic ids have generation 0, which the wheel never hands out
+  TimerHandle id = ++periodic_count;
+  SchedulePeriodicRun(id, name, Now() + period, period, std::move(callback));
+  return id;
+}
+
+void SchedulerService::SchedulePeriodicRun(TimerHandle id, const string &name, long when, long period, function<void()> callback)
+{
+  timers_scheduled.Add();
+  periodic_map[id] = wheel.Schedule(when, [this, id, name, when, period, callback]() {
+    callback();
+    TimerEvent event(name, when);
+    event_map[name] = event;
+    for (auto& i : listeners)
+      i->ProcessAdd(event);
+    metrics.CountOut(listeners.size());
+    // the callback or a listener may have cancelled it
+    if (periodic_map.count(id))
+      SchedulePeriodicRun(id, name, when + period, period, callback);
+  });
+}
+
+bool SchedulerService::Cancel(TimerHandle handle)
+{
+  auto periodic = periodic_map.find(handle);
+  if (periodic != periodic_map.end()) {
+    wheel.Cancel(periodic->second);
+    periodic_map.erase(periodic);
+    timers_cancelled.Add();
+    return true;
+  }
+  if (!wheel.Cancel(handle)) return false;
+  timers_cancelled.Add();
+  return true;
+}
+
+void SchedulerService::Poll()
+{
+  wheel.Advance(clock->Now());
+}
+
+long SchedulerService::Now() const
+{
+  return clock->Now();
+}
+
+template<typename V>
+SchedulerPollListener<V>::SchedulerPollListener(SchedulerService *_scheduler) :
+  scheduler(_scheduler)
+{
+}
+
+template<typename V>
+void SchedulerPollListener<V>::ProcessAdd(V &)
+{
+  scheduler->Poll();
+}
+
+#endif
@@ -0,0 +1,260 @@
+/**
+ * snapshot.hpp
+ * Defines the seqlock-protected snapshot table through which services expose
+ * their latest per-product state to readers on other threads (a GUI, a risk
+ * report, the historical writer) without locks and without racing OnMessage.
+ */
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <thread>
+#include <stdexcept>
+#include <type_traits>
+
+using namespace std;
+
+// Longest product identifier a snapshot slot holds
+const size_t SNAPSHOT_ID_SIZE = 32;
+
+/**
+ * Fixed-capacity table of per-product values of the trivially copyable type V.
+ * One thread, the owning service, registers products and publishes values;
+ * any number of threads read them. Each slot is a seqlock, so a read never
+ * blocks the writer and always returns a value the writer published whole.
+ * ReadAll additionally reports whether no publish overlapped the scan, i.e.
+ * whether the values form a single point in time across products.
+ */
+template<typename V>
+class SnapshotTable
+{
+
+  static_assert(is_trivially_copyable<V>::value, "snapshot values are copied byte-wise");
+
+public:
+
+  // ctor for a table of up to capacity products
+  SnapshotTable(size_t _capacity = 1024);
+  ~SnapshotTable();
+
+  SnapshotTable(const SnapshotTable&) = delete;
+  SnapshotTable& operator=(const SnapshotTable&) = delete;
+
+  // Get the slot for id, adding it the first time; writer only
+  size_t Register(const string &id);
+
+  // Publish value for the product in slot index; writer only
+  void Publish(size_t index, const V &value);
+
+  // Publish value for id, registering it if needed; writer only
+  void Publish(const string &id, const V &value);
+
+  // Get the slot for id, or -1 if it was never registered
+  long Find(const string &id) const;
+
+  // Copy the latest value in slot index; false until one is published
+  bool Read(size_t index, V &value) const;
+
+  // Copy the latest value for id; false if there is none
+  bool Read(const string &id, V &value) const;
+
+  // Copy every published value; true if they are from one point in time,
+  // false if publishes kept overlapping the scan for attempts tries
+  bool ReadAll(vector<pair<string, V>> &values, int attempts = 64) const;
+
+  // Get the number of registered products
+  size_t Size() const;
+
+  // Get the product identifier in slot index
+  string GetId(size_t index) const;
+
+  // Get the number of publishes so far
+  uint64_t GetVersion() const;
+
+private:
+  static const size_t WORDS = (sizeof(V) + 7) / 8;
+
+  // words are atomics so concurrent copies are well defined; the sequence says whether they are whole
+  struct Slot
+  {
+    atomic<uint64_t> sequence;
+    atomic<uint64_t> words[WORDS];
+    char id[SNAPSHOT_ID_SIZE + 1];
+  };
+
+  // slot size rounded to cache lines, so readers of one product do not hit the writer of the next
+  static const size_t STRIDE = (sizeof(Slot) + 63) / 64 * 64;
+
+  size_t capacity;
+  char *storage;
+  atomic<size_t> count;
+  alignas(64) atomic<uint64_t> version;
+  unordered_map<string, size_t> index_map;
+
+  Slot* GetSlot(size_t index) const;
+
+  // Copy slot's value once it is stable; false if it was never published
+  bool ReadSlot(const Slot *slot, V &value) const;
+
+};
+
+template<typename V>
+SnapshotTable<V>::SnapshotTable(size_t _capacity) :
+  capacity(_capacity), count(0), version(0)
+{
+  void *memory;
+  if (posix_memalign(&memory, 64, capacity * STRIDE) != 0) throw bad_alloc();
+  storage = (char*)memory;
+  for (size_t i = 0; i < capacity; i++)
+  {
+    Slot *slot = new (storage + i * STRIDE) Slot();
+    slot->sequence.store(0, memory_order_relaxed);
+    for (size_t w = 0; w < WORDS; w++) slot->words[w].store(0, memory_order_relaxed);
+  }
+}
+
+template<typename V>
+SnapshotTable<V>::~SnapshotTable()
+{
+  for (size_t i = 0; i < capacity; i++) GetSlot(i)->~Slot();
+  free(storage);
+}
+
+template<typename V>
+size_t SnapshotTable<V>::Register(const string &id)
+{
+  auto found = index_map.find(id);
+  if (found != index_map.end()) return found->second;
+  size_t index = count.load(memory_order_relaxed);
+  if (index == capacity) throw out_of_range("snapshot table full");
+  if (id.size() > SNAPSHOT_ID_SIZE) throw invalid_argument("product id too long for a snapshot: " + id);
+  memcpy(GetSlot(index)->id, id.c_str(), id.size() + 1);
+  index_map.insert(make_pair(id, index));
+  // readers only look at slots below count, so the id is complete before they see it
+  count.store(index + 1, memory_order_release);
+  return index;
+}
+
+template<typename V>
+void SnapshotTable<V>::Publish(size_t index, const V &value)
+{
+  uint64_t words[WORDS] = {};
+  memcpy(words, &value, sizeof(V));
+  Slot *slot = GetSlot(index);
+  uint64_t sequence = slot->sequence.load(memory_order_relaxed);
+  uint64_t current = version.load(memory_order_relaxed);
+
+  version.store(current + 1, memory_order_relaxed);
+  slot->sequence.store(sequence + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  for (size_t w = 0; w < WORDS; w++) slot->words[w].store(words[w], memory_order_relaxed);
+  slot->sequence.store(sequence + 2, memory_order_release);
+  version.store(current + 2, memory_order_release);
+}
+
+template<typename V>
+void SnapshotTable<V>::Publish(const string &id, const V &value)
+{
+  Publish(Register(id), value);
+}
+
+template<typename V>
+long SnapshotTable<V>::Find(const string &id) const
+{
+  size_t size = count.load(memory_order_acquire);
+  for (size_t i = 0; i < size; i++)
+    if (id == GetSlot(i)->id) return i;
+  return -1;
+}
+
+template<typename V>
+bool SnapshotTable<V>::Read(size_t index, V &value) const
+{
+  if (index >= count.load(memory_order_acquire)) return false;
+  return ReadSlot(GetSlot(index), value);
+}
+
+template<typename V>
+bool SnapshotTable<V>::Read(const string &id, V &value) const
+{
+  long index = Find(id);
+  return index >= 0 && ReadSlot(GetSlot(index), value);
+}
+
+template<typename V>
+bool SnapshotTable<V>::ReadAll(vector<pair<string, V>> &values, int attempts) const
+{
+  for (int attempt = 0; attempt < attempts; attempt++)
+  {
+    uint64_t before = version.load(memory_order_acquire);
+    if (before & 1)
+    {
+      this_thread::yield();
+      continue;
+    }
+    values.clear();
+    size_t size = count.load(memory_order_acquire);
+    V value;
+    for (size_t i = 0; i < size; i++)
+      if (ReadSlot(GetSlot(i), value)) values.push_back(make_pair(string(GetSlot(i)->id), value));
+    atomic_thread_fence(memory_order_acquire);
+    if (version.load(memory_order_relaxed) == before) return true;
+  }
+  return false;
+}
+
+template<typename V>
+size_t SnapshotTable<V>::Size() const
+{
+  return count.load(memory_order_acquire);
+}
+
+template<typename V>
+string SnapshotTable<V>::GetId(size_t index) const
+{
+  if (index >= count.load(memory_order_acquire)) throw out_of_range("no snapshot slot " + to_string(index));
+  return GetSlot(index)->id;
+}
+
+template<typename V>
+uint64_t SnapshotTable<V>::GetVersion() const
+{
+  return version.load(memory_order_acquire) / 2;
+}
+
+template<typename V>
+typename SnapshotTable<V>::Slot* SnapshotTable<V>::GetSlot(size_t index) const
+{
+  return (Slot*)(storage + index * STRIDE);
+}
+
+template<typename V>
+bool SnapshotTable<V>::ReadSlot(const Slot *slot, V &value) const
+{
+  uint64_t words[WORDS];
+  while (true)
+  {
+    uint64_t before = slot->sequence.load(memory_order_acquire);
+    if (before == 0) return false;
+    // mid-publish; let a preempted writer finish
+    if (before & 1)
+    {
+      this_thread::yield();
+      continue;
+    }
+    for (size_t w = 0; w < WORDS; w++) words[w] = slot->words[w].load(memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+    if (slot->sequence.load(memory_order_relaxed) == before) break;
+  }
+  memcpy(&value, words, sizeof(V));
+  return true;
+}
+
+#endif
@@ -86,6 +86,7 @@ public:
 class BondProductService:public Service<string, Bond>{
 private:
     map<string, Bond> bond_map;
+    vector<ServiceListener<Bond>*> listeners;
 public:
     //ctor
     BondProductService();
@@ -96,6 +97,9 @@ public:
     // Get data on our service given a key
     Bond& GetData(string key) override;
 
+    // Find a bond without adding it, nullptr if there is none with that id
+    const Bond* FindProduct(const string& key) const;
+
     // The callback that a Connector should invoke for any new or updated data
     void OnMessage(Bond &data) override {};
 
@@ -104,10 +108,46 @@ public:
     void AddListener(ServiceListener<Bond> *listener) override {};
 
     // Get all listeners on the Service.
-//    virtual const vector< ServiceListener<Bond>* >& GetListeners() const override{};
+    virtual const vector< ServiceListener<Bond>* >& GetListeners() const override;
 
 };
 
+// Store all interest rate swap information
+class IRSwapProductService:public Service<string, IRSwap>{
+private:
+    map<string, IRSwap> swap_map;
+    vector<ServiceListener<IRSwap>*> listeners;
+public:
+    //ctor
+    IRSwapProductService();
+
+    // Get all swaps with a term of termYears
+    vector<IRSwap> GetSwaps(int termYears);
+    void AddSwap(IRSwap &swap);
+
+    // Get data on our service given a key
+    IRSwap& GetData(string key) override;
+
+    // Find a swap without adding it, nullptr if there is none with that id
+    const IRSwap* FindProduct(const string& key) const;
+
+    // The callback that a Connector should invoke for any new or updated data
+    void OnMessage(IRSwap &data) override {};
+
+    // Add a listener to the Service for callbacks on add, remove, and update events
+    // for data to the Service.
+    void AddListener(ServiceListener<IRSwap> *listener) override {};
+
+    // Get all listeners on the Service.
+    virtual const vector< ServiceListener<IRSwap>* >& GetListeners() const override;
+
+};
+
+// What differs between product types, fixed at compile time: ProductTraits<T>::ProductService
+// is the service holding them and ParsePrice reads a price or rate from a feed
+template<typename T>
+struct ProductTraits;
+
 
 
 
@@ -136,9 +176,49 @@ Bond& BondProductService::GetData(string key){
     return bond_map[key];
 }
 
-//const vector< ServiceListener<Bond>* >& BondProductService::GetListeners() const {
-//    return;
-//};
+const Bond* BondProductService::FindProduct(const string& key) const{
+    auto i = bond_map.find(key);
+    return i == bond_map.end() ? nullptr : &i->second;
+}
+
+// Get all listeners on the Service.
+const vector< ServiceListener<Bond>* >& BondProductService::GetListeners() const {
+    return listeners;
+}
+
+//ctor
+IRSwapProductService::IRSwapProductService(){
+    swap_map = map<string, IRSwap>();
+}
+
+vector<IRSwap> IRSwapProductService::GetSwaps(int termYears){
+    vector<IRSwap> vec;
+    for(auto& swap:swap_map){
+        if(swap.second.GetTermYears() == termYears){
+            vec.push_back(swap.second);
+        }
+    }
+    return vec;
+}
+
+void IRSwapProductService::AddSwap(IRSwap &swap){
+    swap_map.insert(pair<string, IRSwap>(swap.GetProductId(), swap));
+}
+
+// Get data on our service given a key
+IRSwap& IRSwapProductService::GetData(string key){
+    return swap_map[key];
+}
+
+const IRSwap* IRSwapProductService::FindProduct(const string& key) const{
+    auto i = swap_map.find(key);
+    return i == swap_map.end() ? nullptr : &i->second;
+}
+
+// Get all listeners on the Service.
+const vector< ServiceListener<IRSwap>* >& IRSwapProductService::GetListeners() const {
+    return listeners;
+}
 //convert input data to price
 double transform_data_to_price(string& s) {
     double ans;
@@ -151,4 +231,30 @@ double transform_data_to_price(string& s) {
     return ans;
 }
 
+//convert the price in [begin, end), e.g. 99-31+, without building strings
+double transform_data_to_price(const char* begin, const char* end) {
+    const char* dash = end - 4;
+    long whole = 0;
+    for (const char* c = begin; c < dash; c++) {
+        whole = whole * 10 + (*c - '0');
+    }
+    int thirty_seconds = (dash[1] - '0') * 10 + (dash[2] - '0');
+    int eighths = dash[3] == '+' ? 4 : dash[3] - '0';
+    return whole + thirty_seconds / 32.0 + eighths / 256.0;
+}
+
+// Bonds are quoted in 32nds, e.g. 99-31+
+template<>
+struct ProductTraits<Bond>{
+    typedef BondProductService ProductService;
+    static double ParsePrice(string& s) { return transform_data_to_price(s); }
+};
+
+// Swaps are quoted as a fixed rate in percent, e.g. 3.875
+template<>
+struct ProductTraits<IRSwap>{
+    typedef IRSwapProductService ProductService;
+    static double ParsePrice(string& s) { return stod(s); }
+};
+
 #endif
@@ -0,0 +1,123 @@
+/**
+ * streamconsumer.cpp
+ * Reads the binary messages published by the connectors (price streams,
+ * executions, trades) and prints them as text.
+ *
+ * Usage: streamconsumer --listen <socket path>   wait for a BatchWriter to connect
+ *        streamconsumer --connect <address>      subscribe to a SocketPublisher
+ *        streamconsumer <file>                   read a recorded file or FIFO
+ */
+#include <iostream>
+#include <string>
+#include "wireformat.hpp"
+#include "eventloop.hpp"
+
+using namespace std;
+
+// Accept one publisher on a Unix domain socket at path
+int AcceptPublisher(const string &path)
+{
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) throw invalid_argument("socket path too long: " + path);
+  memcpy(address.sun_path, path.c_str(), path.size());
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) throw runtime_error(string("cannot create socket: ") + strerror(errno));
+  unlink(path.c_str());
+  if (bind(listener, (sockaddr*)&address, sizeof(address)) < 0 || listen(listener, 1) < 0)
+    throw runtime_error("cannot listen on " + path + ": " + strerror(errno));
+
+  int fd = accept(listener, nullptr, nullptr);
+  close(listener);
+  unlink(path.c_str());
+  if (fd < 0) throw runtime_error(string("accept failed: ") + strerror(errno));
+  return fd;
+}
+
+// Print one message
+void PrintMessage(const MessageHeader &header, const char *message)
+{
+  if (header.type == PRICE_STREAM_MESSAGE && header.length >= PRICE_STREAM_MESSAGE_SIZE)
+  {
+    PriceStreamRecord record = DecodePriceStream(message);
+    cout << header.sequence << ", " << record.productId
+         << ", Bid_Order: " << record.bidPrice << " " << record.bidVisibleQuantity << " " << record.bidHiddenQuantity
+         << ", Ask_Order: " << record.offerPrice << " " << record.offerVisibleQuantity << " " << record.offerHiddenQuantity
+         << '\n';
+  }
+  else if (header.type == EXECUTION_ORDER_MESSAGE && header.length >= EXECUTION_ORDER_MESSAGE_SIZE)
+  {
+    ExecutionOrderRecord record = DecodeExecutionOrder(message);
+    cout << header.sequence << ", " << header.timestamp / 1000000 << ", " << record.productId << ", " << record.orderId
+         << ", " << (record.side == 0 ? "BID" : "OFFER") << ", " << record.price
+         << ", " << record.visibleQuantity << ", " << record.hiddenQuantity << '\n';
+  }
+  else if (header.type == TRADE_MESSAGE && header.length >= TRADE_MESSAGE_SIZE)
+  {
+    TradeRecord record = DecodeTrade(message);
+    cout << header.sequence << ", " << record.productId << ", " << record.tradeId << ", " << record.price
+         << ", " << record.book << ", " << record.quantity << ", " << (record.side == 0 ? "BUY" : "SELL") << '\n';
+  }
+  else if (header.type == FEED_LINE_MESSAGE)
+  {
+    cout.write(message + MESSAGE_HEADER_SIZE, header.length - MESSAGE_HEADER_SIZE);
+    cout << '\n';
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc == 3 && (string(argv[1]) == "--listen" || string(argv[1]) == "--connect")) {}
+  else if (argc != 2)
+  {
+    cerr << "usage: " << argv[0] << " --listen <socket path> | --connect <address> | <file>" << '\n';
+    return 2;
+  }
+
+  try
+  {
+    const char *message;
+    MessageHeader header;
+    size_t count = 0;
+    if (argc == 3 && string(argv[1]) == "--connect")
+    {
+      EventLoop loop;
+      SocketSource source(&loop, argv[2]);
+      size_t size;
+      while (source.Receive(message, size))
+      {
+        ++count;
+        PrintMessage(DecodeHeader(message), message);
+      }
+    }
+    else
+    {
+      int fd;
+      if (argc == 3)
+      {
+        fd = AcceptPublisher(argv[2]);
+      }
+      else
+      {
+        fd = open(argv[1], O_RDONLY);
+        if (fd < 0) throw runtime_error(string("cannot open ") + argv[1] + ": " + strerror(errno));
+      }
+      MessageReader reader(fd);
+      while (reader.Next(message, header))
+      {
+        ++count;
+        PrintMessage(header, message);
+      }
+      close(fd);
+    }
+    cerr << "Read " << count << " messages" << '\n';
+  }
+  catch (const exception &e)
+  {
+    cerr << e.what() << '\n';
+    return 1;
+  }
+  return 0;
+}
@@ -8,9 +8,18 @@
 #define STREAMING_SERVICE_HPP
 
 #include "soa.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
 #include "marketdataservice.hpp"
+#include "schedulerservice.hpp"
+#include "wireformat.hpp"
+#include "transport.hpp"
+#include <set>
 //#include "BondAlgoStreamingService.h"
 
+// Lines logged for a price stream when there is nowhere to send it
+const LogFormat PRICE_STREAM_LOG = RegisterLogFormat("{}, Bid_Order: {}{}{}, Ask_Order: {}{}{}\n-----------------");
+
 /**
  * A price stream order with price and quantity (visible and hidden)
  */
@@ -48,7 +57,7 @@ private:
  * Type T is the product type.
  */
 template<typename T>
-class PriceStream
+class PriceStream : private CopyCounted<PriceStream<T>>
 {
 
 public:
@@ -74,6 +83,30 @@ private:
 
 };
 
+/**
+ * Checkpointed price stream of a product.
+ */
+struct StreamRecord
+{
+  char productId[CHECKPOINT_ID_SIZE];
+  double bidPrice;
+  long bidVisibleQuantity;
+  long bidHiddenQuantity;
+  double offerPrice;
+  long offerVisibleQuantity;
+  long offerHiddenQuantity;
+  // whether it changed since the streaming service last published it
+  long pending;
+};
+
+// Copy a price stream into a checkpoint record
+template<typename T>
+void SaveStream(const PriceStream<T> &stream, StreamRecord &record);
+
+// Rebuild the price stream of a checkpoint record in product
+template<typename T>
+PriceStream<T> RestoreStream(const StreamRecord &record, const T &product);
+
 /**
  * Streaming service to publish two-way prices.
  * Keyed on product identifier.
@@ -86,16 +119,17 @@ class StreamingService : public Service<string,PriceStream <T> >
 public:
 
   // Publish two-way prices
-  void PublishPrice(const PriceStream<T>& priceStream) = 0;
+  virtual void PublishPrice(const PriceStream<T>& priceStream) = 0;
 
 };
 
 template<typename T>
-class AlgoStreaming{
+class AlgoStreaming : private CopyCounted<AlgoStreaming<T>>{
 private:
     PriceStream<T> price_stream;
 
 public:
+    AlgoStreaming() = default;
     AlgoStreaming(PriceStream<T>& stream);
     void Run(Price<T> price);
     PriceStream<T> GetPriceStreaming() const;
@@ -103,22 +137,49 @@ public:
 };
 
 
+/**
+ * Publishes price streams either as text on stdout or as PRICE_STREAM_MESSAGEs:
+ * batched by a BatchWriter to a file or local socket, or sent to a MessageSink
+ * such as a SocketPublisher. Batches go out when full and, with a scheduler,
+ * every flush_interval milliseconds.
+ */
 template<typename T>
 class BondStreamingServiceConnector:public Connector<PriceStream<T>>{
+private:
+    BatchWriter* writer;
+    MessageSink* sink;
+    uint32_t sequence;
 public:
-    BondStreamingServiceConnector()=default;
+    BondStreamingServiceConnector();
+    BondStreamingServiceConnector(BatchWriter* _writer, SchedulerService* scheduler = nullptr, long flush_interval = 10);
+    BondStreamingServiceConnector(MessageSink* _sink);
     virtual void Publish(PriceStream<T>& data) override;
+
+    // Send the messages waiting in the current batch
+    void Flush();
 };
 
+// Without a scheduler every stream the algo updates is published at once. With a scheduler,
+// updates only replace a product's latest stream and a periodic timer publishes the latest
+// stream of each product that changed, once per refresh period.
 template<typename T>
-class BondStreamingService: public Service<string, StreamingService<T>>{
+class BondStreamingService: public StreamingService<T>{
 private:
     map<string, PriceStream<T>> stream_map;
     vector<ServiceListener<PriceStream<T>>*> listeners;
     BondStreamingServiceConnector<T>*  bond_streaming_service_connector;
+    SchedulerService* scheduler;
+    // products whose stream changed since the last refresh
+    set<string> changed;
+    ServiceMetrics metrics;
+    // streams replaced before a refresh published them
+    Counter coalesced_updates;
+
+    // publish the changed streams, on the refresh timer
+    void refresh();
 public:
-    BondStreamingService(){};
-    BondStreamingService(BondStreamingServiceConnector<T>* connector);
+    BondStreamingService();
+    BondStreamingService(BondStreamingServiceConnector<T>* connector, SchedulerService* _scheduler = nullptr, long refresh_interval = 10);
 
     // Get data on our service given a key
     virtual PriceStream<T>& GetData(string key) override;
@@ -134,7 +195,15 @@ public:
     virtual const vector< ServiceListener<PriceStream<T>>* >& GetListeners() const override;
 
     void update_algo(AlgoStreaming<T> & algo);
-    void PublishPrice(PriceStream<T> &data);
+    virtual void PublishPrice(const PriceStream<T> &data) override;
+
+    // Write the latest stream of every product, and whether it is still to be published,
+    // into a checkpoint
+    void SaveCheckpoint(CheckpointWriter& writer) const;
+
+    // Restore the streams of a checkpoint, looking the products up in products; those still
+    // to be published go out on the next refresh
+    void LoadCheckpoint(const CheckpointReader& reader, Service<string, T>* products);
 
 };
 
@@ -208,13 +277,42 @@ PriceStream<T> AlgoStreaming<T>::GetPriceStreaming() const{
     return price_stream;
 }
 
+template<typename T>
+void SaveStream(const PriceStream<T> &stream, StreamRecord &record)
+{
+  CopyCheckpointId(record.productId, stream.GetProduct().GetProductId());
+  record.bidPrice = stream.GetBidOrder().GetPrice();
+  record.bidVisibleQuantity = stream.GetBidOrder().GetVisibleQuantity();
+  record.bidHiddenQuantity = stream.GetBidOrder().GetHiddenQuantity();
+  record.offerPrice = stream.GetOfferOrder().GetPrice();
+  record.offerVisibleQuantity = stream.GetOfferOrder().GetVisibleQuantity();
+  record.offerHiddenQuantity = stream.GetOfferOrder().GetHiddenQuantity();
+  record.pending = 0;
+}
+
+template<typename T>
+PriceStream<T> RestoreStream(const StreamRecord &record, const T &product)
+{
+  PriceStreamOrder bid(record.bidPrice, record.bidVisibleQuantity, record.bidHiddenQuantity, BID);
+  PriceStreamOrder offer(record.offerPrice, record.offerVisibleQuantity, record.offerHiddenQuantity, OFFER);
+  return PriceStream<T>(product, bid, offer);
+}
+
 
 
 
 template<typename T>
-BondStreamingService<T>::BondStreamingService(BondStreamingServiceConnector<T>* connector){
+BondStreamingService<T>::BondStreamingService() : BondStreamingService(nullptr) {}
+
+template<typename T>
+BondStreamingService<T>::BondStreamingService(BondStreamingServiceConnector<T>* connector, SchedulerService* _scheduler, long refresh_interval) :
+    metrics("streaming") {
     stream_map = map<string, PriceStream<T>>();
     bond_streaming_service_connector = connector;
+    coalesced_updates = metrics.AddCounter("coalesced_updates");
+    scheduler = _scheduler;
+    if(scheduler)
+        scheduler->SchedulePeriodic("streaming_refresh", refresh_interval, [this](){ refresh(); });
 }
 
 // Get data on our service given a key
@@ -241,32 +339,123 @@ const vector< ServiceListener<PriceStream<T>>* >& BondStreamingService<T>::GetLi
 }
 template<typename T>
 void BondStreamingService<T>::update_algo(AlgoStreaming<T> & algo){
-    auto pstream = algo.GetPriceStream();
+    ServiceHop hop(metrics);
+    auto pstream = algo.GetPriceStreaming();
     string bond_code =pstream.GetProduct().GetProductId();
-    if(stream_map.find(bond_code)!=stream_map.end())
-        stream_map.erase(bond_code);
-    stream_map.insert(pair<string,PriceStream<T> >(bond_code,pstream));
+    auto stream = stream_map.find(bond_code);
+    if(stream != stream_map.end())
+        stream->second = pstream;
+    else
+        stream = stream_map.insert(pair<string,PriceStream<T> >(bond_code,pstream)).first;
     for(auto& i:listeners){
-        i->ProcessAdd(pstream);
+        i->ProcessAdd(stream->second);
     }
+    metrics.CountOut(listeners.size());
+
+    if(!scheduler){
+        PublishPrice(stream->second);
+        return;
+    }
+    if(!changed.insert(bond_code).second)
+        coalesced_updates.Add();
+}
+
+template<typename T>
+void BondStreamingService<T>::PublishPrice(const PriceStream<T> &data){
+    PriceStream<T> published = data;
+    bond_streaming_service_connector->Publish(published);
+}
+
+template<typename T>
+void BondStreamingService<T>::SaveCheckpoint(CheckpointWriter& writer) const{
+    writer.BeginSection(PRICE_STREAM_SECTION);
+    for(auto& i:stream_map){
+        StreamRecord record;
+        SaveStream(i.second, record);
+        record.pending = changed.count(i.first);
+        writer.Write(record);
+    }
+    writer.EndSection(stream_map.size());
+}
+
+template<typename T>
+void BondStreamingService<T>::LoadCheckpoint(const CheckpointReader& reader, Service<string, T>* products){
+    for(auto& record:reader.GetRecords<StreamRecord>(PRICE_STREAM_SECTION)){
+        string bond_code = record.productId;
+        stream_map[bond_code] = RestoreStream(record, products->GetData(bond_code));
+        if(record.pending)
+            changed.insert(bond_code);
+    }
+}
+
+template<typename T>
+void BondStreamingService<T>::refresh(){
+    for(auto& bond_code:changed){
+        bond_streaming_service_connector->Publish(stream_map[bond_code]);
+    }
+    changed.clear();
 }
 
+
 template<typename T>
-void BondStreamingService<T>::PublishPrice(PriceStream<T> &data){
-    bond_streaming_service_connector->Publish(data);
+BondStreamingServiceConnector<T>::BondStreamingServiceConnector(){
+    writer = nullptr;
+    sink = nullptr;
+    sequence = 0;
 }
 
+template<typename T>
+BondStreamingServiceConnector<T>::BondStreamingServiceConnector(BatchWriter* _writer, SchedulerService* scheduler, long flush_interval){
+    writer = _writer;
+    sink = nullptr;
+    sequence = 0;
+    if(scheduler)
+        scheduler->SchedulePeriodic("streaming_flush", flush_interval, [this](){ Flush(); });
+}
 
 template<typename T>
-void BondStreamingServiceConnectorPublish(PriceStream<T>& data) {
-    auto bond = data.GetProduct();
-    auto bid_order = data.GetBidOrder();
-    auto ask_order = data.GetOfferOrder();
+BondStreamingServiceConnector<T>::BondStreamingServiceConnector(MessageSink* _sink){
+    writer = nullptr;
+    sink = _sink;
+    sequence = 0;
+}
 
-    cout << bond.GetProductId()<<", Bid_Order: "<< bid_order.GetPrice()<<bid_order.GetVisibleQuantity() << bid_order.GetHiddenQuantity()<<
-    ", Ask_Order: "<<ask_order.GetPrice()<<ask_order.GetVisibleQuantity() <<ask_order.GetHiddenQuantity()<<endl;
-    cout<<"-----------------"<<endl;
+template<typename T>
+void BondStreamingServiceConnector<T>::Publish(PriceStream<T>& data) {
+    const string& product_id = data.GetProduct().GetProductId();
+    const PriceStreamOrder& bid_order = data.GetBidOrder();
+    const PriceStreamOrder& ask_order = data.GetOfferOrder();
+
+    if(!writer && !sink){
+        async_logger.Log(PRICE_STREAM_LOG, product_id, bid_order.GetPrice(), bid_order.GetVisibleQuantity(), bid_order.GetHiddenQuantity(),
+                         ask_order.GetPrice(), ask_order.GetVisibleQuantity(), ask_order.GetHiddenQuantity());
+        return;
+    }
+
+    PriceStreamRecord record;
+    CopyWireString(record.productId, product_id);
+    record.bidPrice = bid_order.GetPrice();
+    record.bidVisibleQuantity = bid_order.GetVisibleQuantity();
+    record.bidHiddenQuantity = bid_order.GetHiddenQuantity();
+    record.offerPrice = ask_order.GetPrice();
+    record.offerVisibleQuantity = ask_order.GetVisibleQuantity();
+    record.offerHiddenQuantity = ask_order.GetHiddenQuantity();
+
+    if(sink){
+        char message[PRICE_STREAM_MESSAGE_SIZE];
+        EncodePriceStream(message, ++sequence, WireTimestamp(), record);
+        sink->Send(message, PRICE_STREAM_MESSAGE_SIZE);
+        return;
+    }
+    char* out = writer->Reserve(PRICE_STREAM_MESSAGE_SIZE);
+    EncodePriceStream(out, ++sequence, WireTimestamp(), record);
+    writer->Commit(PRICE_STREAM_MESSAGE_SIZE);
+}
 
+template<typename T>
+void BondStreamingServiceConnector<T>::Flush() {
+    if(writer)
+        writer->Flush();
 }
 
 
@@ -278,8 +467,6 @@ BondStreamingServiceListener<T>::BondStreamingServiceListener(BondStreamingServi
 template<typename T>
 void BondStreamingServiceListener<T>::ProcessAdd(AlgoStreaming<T> &data) {
     bond_stream_service->update_algo(data);
-    auto ps = data.GetPriceStreaming();
-    bond_stream_service->PublishPrice(ps);
 }
 
 #endif
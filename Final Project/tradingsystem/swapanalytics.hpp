@@ -0,0 +1,461 @@
+/**
+ * swapanalytics.hpp
+ * Defines interest rate swap cash-flow schedules and the engine valuing swap positions off
+ * discount and projection curves: PV, DV01, par rate and annuity.
+ * Every date a flow pays or fixes on is interned once, so a new curve costs one discount
+ * factor per distinct date, and valuing a leg is a loop of loads and multiply-adds over
+ * flat arrays, two lanes wide on SSE2 (the value and its 1bp-shifted twin side by side).
+ */
+#ifndef SWAP_ANALYTICS_HPP
+#define SWAP_ANALYTICS_HPP
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <thread>
+#include <algorithm>
+#include <stdexcept>
+#include <cmath>
+
+#include "products.hpp"
+#include "curve.hpp"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+// Parallel zero rate shift DV01 is measured over
+const double DV01_SHIFT = 0.0001;
+// A first period shorter than this many days is merged into the next as a long stub
+const int MIN_STUB_DAYS = 7;
+
+// Get the year fraction from start to end under dayCount
+double YearFraction(const date &start, const date &end, DayCountConvention dayCount);
+
+// Get the months between payments at frequency
+int PeriodMonths(PaymentFrequency frequency);
+
+// Get the months in a floating index tenor
+int PeriodMonths(FloatingIndexTenor tenor);
+
+// Move a weekend date to the next weekday, or the previous one if that is in the next month
+date AdjustBusinessDay(const date &d);
+
+/**
+ * One accrual period of a swap leg, paid at its adjusted end.
+ */
+struct SwapPeriod
+{
+  date accrualStart;
+  date accrualEnd;
+  date paymentDate;
+  double yearFraction;
+};
+
+/**
+ * Fixed and floating leg periods of a swap, rolled back from the termination date
+ * so that any stub is at the front.
+ */
+struct SwapSchedule
+{
+  vector<SwapPeriod> fixedLeg;
+  vector<SwapPeriod> floatingLeg;
+};
+
+// Get the periods of a leg rolling every months months from effective to termination
+vector<SwapPeriod> BuildSwapLeg(const date &effective, const date &termination, int months, DayCountConvention dayCount);
+
+// Get the schedule of swap
+SwapSchedule BuildSwapSchedule(const IRSwap &swap);
+
+// Sum weights[i] * pairs[2 * slots[i] + lane] over n flows into result[lane], lanes 0 and 1
+void SumWeightedPairs(const double *weights, const int *slots, const double *pairs, int n, double *result);
+
+// Sum (projection[start] / projection[end] - 1) * discount[pay] over n floating periods, pairwise likewise
+void SumFloatingPairs(const int *starts, const int *ends, const int *pays, const double *projection,
+                      const double *discount, int n, double *result);
+
+/**
+ * Value of a swap position. PV and DV01 are in currency; DV01 is the change in PV when
+ * every zero rate rises by DV01_SHIFT, so it is positive for a payer. The par rate and the
+ * annuity (PV of 1 a year on the fixed schedule) are per unit notional.
+ */
+struct SwapValuation
+{
+  double pv;
+  double dv01;
+  double parRate;
+  double annuity;
+};
+
+/**
+ * Values positions in swaps off a discount curve and a projection curve for the floating
+ * index (the same curve unless set apart). Schedules are built once per product and shared
+ * by every position in it. Flows paying on or before the curve date are worth nothing;
+ * a period that fixed before it is projected off the curve, as there are no fixings.
+ */
+class SwapPricingEngine
+{
+
+public:
+
+  // ctor for an engine pricing off curve
+  SwapPricingEngine(const DiscountCurve &curve);
+
+  // Cache the schedule of swap if it is new; returns its index
+  size_t AddProduct(const IRSwap &swap);
+
+  // Add a position paying fixedRate on notional, receiving it if notional is negative; returns its index
+  size_t AddSwap(const IRSwap &swap, double fixedRate, double notional);
+
+  // Get the number of positions
+  size_t Size() const;
+
+  // Get the cached schedule of a product
+  const SwapSchedule& GetSchedule(const string &productId) const;
+
+  // Price off curve for both discounting and projection
+  void SetCurve(const DiscountCurve &curve);
+
+  // Price off separate discount and projection curves
+  void SetCurves(const DiscountCurve &discountCurve, const DiscountCurve &projectionCurve);
+
+  // Get the value of position index
+  SwapValuation Value(size_t index) const;
+
+  // Get the value of paying fixedRate on notional in a product added before, without adding a position
+  SwapValuation Value(const string &productId, double fixedRate, double notional) const;
+
+  // Value every position into valuations on threads threads; returns the total PV and DV01
+  pair<double, double> ValueAll(vector<SwapValuation> &valuations, int threads = 1) const;
+
+private:
+  struct SwapPosition
+  {
+    size_t schedule;
+    double fixed_rate;
+    double notional;
+  };
+
+  DiscountCurve discount_curve;
+  DiscountCurve projection_curve;
+  vector<SwapSchedule> schedules;
+  unordered_map<string, size_t> schedule_index;
+  vector<SwapPosition> positions;
+
+  // flows of every schedule back to back; schedule s owns [begin[s], begin[s + 1])
+  vector<size_t> fixed_begin;
+  vector<double> fixed_accrual;
+  vector<int> fixed_pay;
+  vector<size_t> floating_begin;
+  vector<int> floating_start;
+  vector<int> floating_end;
+  vector<int> floating_pay;
+
+  // the distinct dates flows refer to, by slot
+  vector<date> slot_dates;
+  unordered_map<long, int> slot_index;
+  // per slot, the discount factor and the same under the DV01 shift; zero once paid
+  vector<double> discount_pairs;
+  // per slot, the projection curve's discount factor and its shifted twin
+  vector<double> projection_pairs;
+
+  // Get the slot of d, adding it if new
+  int GetSlot(const date &d);
+
+  // Compute the pairs of the slots from first on off the current curves
+  void PriceSlots(size_t first);
+
+  // Value a position off the slot pairs
+  SwapValuation ValuePosition(const SwapPosition &position) const;
+
+};
+
+double YearFraction(const date &start, const date &end, DayCountConvention dayCount)
+{
+  switch (dayCount) {
+  case THIRTY_THREE_SIXTY: {
+    // 30/360 bond basis
+    int d1 = min<int>(start.day(), 30);
+    int d2 = end.day();
+    if (d1 == 30) d2 = min(d2, 30);
+    return (360.0 * (end.year() - start.year()) + 30.0 * (end.month() - start.month()) + (d2 - d1)) / 360.0;
+  }
+  case ACT_THREE_SIXTY:
+    return (end - start).days() / 360.0;
+  default:
+    throw invalid_argument("unknown day count convention");
+  }
+}
+
+int PeriodMonths(PaymentFrequency frequency)
+{
+  switch (frequency) {
+  case QUARTERLY: return 3;
+  case SEMI_ANNUAL: return 6;
+  case ANNUAL: return 12;
+  default: throw invalid_argument("unknown payment frequency");
+  }
+}
+
+int PeriodMonths(FloatingIndexTenor tenor)
+{
+  switch (tenor) {
+  case TENOR_1M: return 1;
+  case TENOR_3M: return 3;
+  case TENOR_6M: return 6;
+  case TENOR_12M: return 12;
+  default: throw invalid_argument("unknown floating index tenor");
+  }
+}
+
+date AdjustBusinessDay(const date &d)
+{
+  int weekday = d.day_of_week();
+  if (weekday != Saturday && weekday != Sunday) return d;
+  // modified following, without a holiday calendar
+  date next = d + days(weekday == Saturday ? 2 : 1);
+  if (next.month() == d.month()) return next;
+  return d - days(weekday == Saturday ? 1 : 2);
+}
+
+vector<SwapPeriod> BuildSwapLeg(const date &effective, const date &termination, int months, DayCountConvention dayCount)
+{
+  if (termination <= effective)
+    throw invalid_argument("swap terminates before it starts");
+  // unadjusted roll dates, each counted from the termination date so they do not drift
+  vector<date> rolls(1, termination);
+  for (int k = 1; ; k++) {
+    date roll = termination - boost::gregorian::months(k * months);
+    if ((roll - effective).days() < MIN_STUB_DAYS) break;
+    rolls.push_back(roll);
+  }
+  rolls.push_back(effective);
+  reverse(rolls.begin(), rolls.end());
+
+  vector<SwapPeriod> periods;
+  periods.reserve(rolls.size() - 1);
+  for (size_t i = 0; i + 1 < rolls.size(); i++) {
+    SwapPeriod period;
+    period.accrualStart = AdjustBusinessDay(rolls[i]);
+    period.accrualEnd = AdjustBusinessDay(rolls[i + 1]);
+    period.paymentDate = period.accrualEnd;
+    period.yearFraction = YearFraction(period.accrualStart, period.accrualEnd, dayCount);
+    periods.push_back(period);
+  }
+  return periods;
+}
+
+SwapSchedule BuildSwapSchedule(const IRSwap &swap)
+{
+  SwapSchedule schedule;
+  schedule.fixedLeg = BuildSwapLeg(swap.GetEffectiveDate(), swap.GetTerminationDate(),
+                                   PeriodMonths(swap.GetFixedLegPaymentFrequency()), swap.GetFixedLegDayCountConvention());
+  schedule.floatingLeg = BuildSwapLeg(swap.GetEffectiveDate(), swap.GetTerminationDate(),
+                                      PeriodMonths(swap.GetFloatingIndexTenor()), swap.GetFloatingLegDayCountConvention());
+  return schedule;
+}
+
+void SumWeightedPairs(const double *weights, const int *slots, const double *pairs, int n, double *result)
+{
+#if defined(__SSE2__)
+  __m128d sum = _mm_setzero_pd();
+  for (int i = 0; i < n; i++)
+    sum = _mm_add_pd(sum, _mm_mul_pd(_mm_set1_pd(weights[i]), _mm_loadu_pd(pairs + 2 * slots[i])));
+  _mm_storeu_pd(result, sum);
+#else
+  double sum0 = 0, sum1 = 0;
+  for (int i = 0; i < n; i++) {
+    const double *pair = pairs + 2 * slots[i];
+    sum0 += weights[i] * pair[0];
+    sum1 += weights[i] * pair[1];
+  }
+  result[0] = sum0;
+  result[1] = sum1;
+#endif
+}
+
+void SumFloatingPairs(const int *starts, const int *ends, const int *pays, const double *projection,
+                      const double *discount, int n, double *result)
+{
+#if defined(__SSE2__)
+  __m128d sum = _mm_setzero_pd();
+  const __m128d one = _mm_set1_pd(1.0);
+  for (int i = 0; i < n; i++) {
+    __m128d growth = _mm_div_pd(_mm_loadu_pd(projection + 2 * starts[i]), _mm_loadu_pd(projection + 2 * ends[i]));
+    sum = _mm_add_pd(sum, _mm_mul_pd(_mm_sub_pd(growth, one), _mm_loadu_pd(discount + 2 * pays[i])));
+  }
+  _mm_storeu_pd(result, sum);
+#else
+  double sum0 = 0, sum1 = 0;
+  for (int i = 0; i < n; i++) {
+    const double *start = projection + 2 * starts[i];
+    const double *end = projection + 2 * ends[i];
+    const double *pay = discount + 2 * pays[i];
+    sum0 += (start[0] / end[0] - 1) * pay[0];
+    sum1 += (start[1] / end[1] - 1) * pay[1];
+  }
+  result[0] = sum0;
+  result[1] = sum1;
+#endif
+}
+
+SwapPricingEngine::SwapPricingEngine(const DiscountCurve &curve) :
+  discount_curve(curve), projection_curve(curve)
+{
+  fixed_begin.push_back(0);
+  floating_begin.push_back(0);
+}
+
+size_t SwapPricingEngine::AddProduct(const IRSwap &swap)
+{
+  auto found = schedule_index.find(swap.GetProductId());
+  size_t schedule;
+  if (found != schedule_index.end()) {
+    schedule = found->second;
+  } else {
+    schedule = schedules.size();
+    schedules.push_back(BuildSwapSchedule(swap));
+    schedule_index.insert(make_pair(swap.GetProductId(), schedule));
+    size_t first_new_slot = slot_dates.size();
+    for (auto &period : schedules.back().fixedLeg) {
+      fixed_accrual.push_back(period.yearFraction);
+      fixed_pay.push_back(GetSlot(period.paymentDate));
+    }
+    for (auto &period : schedules.back().floatingLeg) {
+      floating_start.push_back(GetSlot(period.accrualStart));
+      floating_end.push_back(GetSlot(period.accrualEnd));
+      floating_pay.push_back(GetSlot(period.paymentDate));
+    }
+    fixed_begin.push_back(fixed_accrual.size());
+    floating_begin.push_back(floating_start.size());
+    PriceSlots(first_new_slot);
+  }
+  return schedule;
+}
+
+size_t SwapPricingEngine::AddSwap(const IRSwap &swap, double fixedRate, double notional)
+{
+  positions.push_back(SwapPosition{AddProduct(swap), fixedRate, notional});
+  return positions.size() - 1;
+}
+
+size_t SwapPricingEngine::Size() const
+{
+  return positions.size();
+}
+
+const SwapSchedule& SwapPricingEngine::GetSchedule(const string &productId) const
+{
+  auto found = schedule_index.find(productId);
+  if (found == schedule_index.end()) throw out_of_range("no swap schedule for " + productId);
+  return schedules[found->second];
+}
+
+void SwapPricingEngine::SetCurve(const DiscountCurve &curve)
+{
+  SetCurves(curve, curve);
+}
+
+void SwapPricingEngine::SetCurves(const DiscountCurve &discountCurve, const DiscountCurve &projectionCurve)
+{
+  discount_curve = discountCurve;
+  projection_curve = projectionCurve;
+  PriceSlots(0);
+}
+
+SwapValuation SwapPricingEngine::Value(size_t index) const
+{
+  return ValuePosition(positions.at(index));
+}
+
+SwapValuation SwapPricingEngine::Value(const string &productId, double fixedRate, double notional) const
+{
+  auto found = schedule_index.find(productId);
+  if (found == schedule_index.end()) throw out_of_range("no swap schedule for " + productId);
+  return ValuePosition(SwapPosition{found->second, fixedRate, notional});
+}
+
+pair<double, double> SwapPricingEngine::ValueAll(vector<SwapValuation> &valuations, int threads) const
+{
+  valuations.resize(positions.size());
+  if (threads < 1) threads = 1;
+  vector<pair<double, double>> totals(threads, make_pair(0.0, 0.0));
+  auto value_range = [&](int t) {
+    size_t begin = positions.size() * t / threads;
+    size_t end = positions.size() * (t + 1) / threads;
+    double pv = 0, dv01 = 0;
+    for (size_t i = begin; i < end; i++) {
+      valuations[i] = ValuePosition(positions[i]);
+      pv += valuations[i].pv;
+      dv01 += valuations[i].dv01;
+    }
+    totals[t] = make_pair(pv, dv01);
+  };
+  vector<thread> pool;
+  for (int t = 1; t < threads; t++)
+    pool.emplace_back(value_range, t);
+  value_range(0);
+  for (auto &worker : pool)
+    worker.join();
+
+  pair<double, double> total(0.0, 0.0);
+  for (auto &partial : totals) {
+    total.first += partial.first;
+    total.second += partial.second;
+  }
+  return total;
+}
+
+int SwapPricingEngine::GetSlot(const date &d)
+{
+  long day = d.day_number();
+  auto found = slot_index.find(day);
+  if (found != slot_index.end()) return found->second;
+  int slot = slot_dates.size();
+  slot_dates.push_back(d);
+  slot_index.insert(make_pair(day, slot));
+  return slot;
+}
+
+void SwapPricingEngine::PriceSlots(size_t first)
+{
+  discount_pairs.resize(2 * slot_dates.size());
+  projection_pairs.resize(2 * slot_dates.size());
+  for (size_t slot = first; slot < slot_dates.size(); slot++) {
+    const date &d = slot_dates[slot];
+    // a parallel shift s scales the discount factor to t by exp(-s t)
+    double t = discount_curve.GetTime(d);
+    double df = d > discount_curve.GetCurveDate() ? discount_curve.GetDiscountFactor(t) : 0.0;
+    discount_pairs[2 * slot] = df;
+    discount_pairs[2 * slot + 1] = df * exp(-DV01_SHIFT * t);
+    t = projection_curve.GetTime(d);
+    df = projection_curve.GetDiscountFactor(t);
+    projection_pairs[2 * slot] = df;
+    projection_pairs[2 * slot + 1] = df * exp(-DV01_SHIFT * t);
+  }
+}
+
+SwapValuation SwapPricingEngine::ValuePosition(const SwapPosition &position) const
+{
+  size_t s = position.schedule;
+  double annuity[2], floating[2];
+  size_t fixed_first = fixed_begin[s];
+  SumWeightedPairs(fixed_accrual.data() + fixed_first, fixed_pay.data() + fixed_first, discount_pairs.data(),
+                   fixed_begin[s + 1] - fixed_first, annuity);
+  size_t floating_first = floating_begin[s];
+  SumFloatingPairs(floating_start.data() + floating_first, floating_end.data() + floating_first,
+                   floating_pay.data() + floating_first, projection_pairs.data(), discount_pairs.data(),
+                   floating_begin[s + 1] - floating_first, floating);
+
+  SwapValuation valuation;
+  valuation.pv = position.notional * (floating[0] - position.fixed_rate * annuity[0]);
+  valuation.dv01 = position.notional * (floating[1] - position.fixed_rate * annuity[1]) - valuation.pv;
+  valuation.parRate = annuity[0] > 0 ? floating[0] / annuity[0] : 0.0;
+  valuation.annuity = annuity[0];
+  return valuation;
+}
+
+#endif
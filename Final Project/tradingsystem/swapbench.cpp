@@ -0,0 +1,136 @@
+/**
+ * swapbench.cpp
+ * Benchmarks SwapPricingEngine on a book of random swaps: schedule building, pricing a new
+ * curve and revaluing every position on 1 to the given number of threads, checked against
+ * a direct valuation that discounts each flow off the curve on its own.
+ *
+ * Usage: swapbench [--swaps n] [--threads n]
+ *   defaults: 100000 swaps, up to as many threads as cores
+ */
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <thread>
+#include "swapanalytics.hpp"
+
+using namespace std;
+
+// Get the seconds since start
+double SecondsSince(const chrono::steady_clock::time_point &start)
+{
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Get the PV of a position discounting every flow off the curves directly
+double DirectValue(const SwapSchedule &schedule, const DiscountCurve &curve, double fixedRate, double notional)
+{
+  double pv = 0;
+  for (auto &period : schedule.fixedLeg) {
+    if (period.paymentDate > curve.GetCurveDate())
+      pv -= fixedRate * period.yearFraction * curve.GetDiscountFactor(period.paymentDate);
+  }
+  for (auto &period : schedule.floatingLeg) {
+    if (period.paymentDate > curve.GetCurveDate()) {
+      double forward = curve.GetDiscountFactor(period.accrualStart) / curve.GetDiscountFactor(period.accrualEnd) - 1;
+      pv += forward * curve.GetDiscountFactor(period.paymentDate);
+    }
+  }
+  return notional * pv;
+}
+
+int main(int argc, char *argv[])
+{
+  size_t swaps = 100000;
+  int max_threads = max(1u, thread::hardware_concurrency());
+  for (int i = 1; i < argc; i++)
+  {
+    string argument = argv[i];
+    if (i + 1 < argc && argument == "--swaps") swaps = stoul(argv[++i]);
+    else if (i + 1 < argc && argument == "--threads") max_threads = stoi(argv[++i]);
+    else
+    {
+      cerr << "usage: " << argv[0] << " [--swaps n] [--threads n]" << '\n';
+      return 1;
+    }
+  }
+
+  date today(2023, Jan, 3);
+  vector<double> times = {0.25, 0.5, 1, 2, 3, 5, 7, 10, 20, 30};
+  vector<double> rates = {0.045, 0.046, 0.047, 0.0435, 0.041, 0.039, 0.038, 0.0375, 0.038, 0.0365};
+  DiscountCurve curve(today, times, rates);
+
+  // a mix of spot and forward starting, seasoned and new swaps of the standard tenors
+  mt19937_64 random(7);
+  int tenors[] = {1, 2, 3, 5, 7, 10, 15, 20, 30};
+  vector<IRSwap> book;
+  vector<double> fixed_rates, notionals;
+  book.reserve(swaps);
+  for (size_t i = 0; i < swaps; i++)
+  {
+    int tenor = tenors[random() % 9];
+    date effective = today + days((long)(random() % 1460) - 730);
+    date termination = effective + years(tenor);
+    if (termination <= today) termination = today + years(tenor);
+    FloatingIndexTenor index_tenor = random() % 2 ? TENOR_3M : TENOR_6M;
+    book.push_back(IRSwap("SWP" + to_string(i), random() % 2 ? THIRTY_THREE_SIXTY : ACT_THREE_SIXTY, ACT_THREE_SIXTY,
+                          (PaymentFrequency)(random() % 3), LIBOR, index_tenor, effective, termination, USD, tenor, STANDARD, OUTRIGHT));
+    fixed_rates.push_back(0.03 + (random() % 2000) / 100000.0);
+    notionals.push_back(((double)(random() % 100) + 1) * 1e6 * (random() % 2 ? 1 : -1));
+  }
+
+  auto start = chrono::steady_clock::now();
+  SwapPricingEngine engine(curve);
+  for (size_t i = 0; i < swaps; i++)
+    engine.AddSwap(book[i], fixed_rates[i], notionals[i]);
+  double build_seconds = SecondsSince(start);
+  size_t flows = 0;
+  for (auto &swap : book)
+  {
+    const SwapSchedule &schedule = engine.GetSchedule(swap.GetProductId());
+    flows += schedule.fixedLeg.size() + schedule.floatingLeg.size();
+  }
+  cout << swaps << " swaps, " << flows << " periods; schedules built in " << build_seconds * 1e3 << " ms" << '\n';
+
+  // a curve tick: every zero rate moves
+  DiscountCurve moved = curve.Shifted(0.0002);
+  start = chrono::steady_clock::now();
+  engine.SetCurve(moved);
+  cout << "new curve priced into the date slots in " << SecondsSince(start) * 1e6 << " us" << '\n';
+
+  vector<SwapValuation> valuations;
+  pair<double, double> total;
+  for (int threads = 1; threads <= max_threads; threads *= 2)
+  {
+    double best = 1e9;
+    for (int run = 0; run < 5; run++)
+    {
+      start = chrono::steady_clock::now();
+      total = engine.ValueAll(valuations, threads);
+      best = min(best, SecondsSince(start));
+    }
+    cout << "revalue all on " << setw(2) << threads << " threads: " << fixed << setprecision(2) << best * 1e3 << " ms, "
+         << best * 1e9 / flows << " ns/period" << '\n';
+  }
+  cout << "total PV " << setprecision(0) << total.first << ", DV01 " << total.second << '\n';
+
+  // the direct valuation the engine replaces, for its time and to check the numbers
+  start = chrono::steady_clock::now();
+  DiscountCurve shifted = moved.Shifted(DV01_SHIFT);
+  double direct_pv = 0, direct_dv01 = 0, worst = 0;
+  for (size_t i = 0; i < swaps; i++)
+  {
+    const SwapSchedule &schedule = engine.GetSchedule(book[i].GetProductId());
+    double pv = DirectValue(schedule, moved, fixed_rates[i], notionals[i]);
+    double dv01 = DirectValue(schedule, shifted, fixed_rates[i], notionals[i]) - pv;
+    direct_pv += pv;
+    direct_dv01 += dv01;
+    worst = max(worst, max(fabs(pv - valuations[i].pv), fabs(dv01 - valuations[i].dv01)));
+  }
+  double direct_seconds = SecondsSince(start);
+  cout << "direct valuation: " << setprecision(2) << direct_seconds * 1e3 << " ms, total PV " << setprecision(0) << direct_pv
+       << ", DV01 " << direct_dv01 << ", largest difference per swap " << scientific << setprecision(2) << worst << '\n';
+  return worst < 1e-3 ? 0 : 1;
+}
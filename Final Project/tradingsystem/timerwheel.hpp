@@ -0,0 +1,255 @@
+/**
+ * timerwheel.hpp
+ * Defines a hierarchical timer wheel for scheduling callbacks at a time.
+ * Time is whatever integer unit the caller advances the wheel with (milliseconds in this system).
+ */
+#ifndef TIMER_WHEEL_HPP
+#define TIMER_WHEEL_HPP
+
+#include <vector>
+#include <functional>
+#include <cstdint>
+
+using namespace std;
+
+// Handle to a scheduled timer, 0 is never a valid handle
+typedef uint64_t TimerHandle;
+
+/**
+ * Timer wheel with TIMER_LEVELS levels of TIMER_SLOTS slots. Level 0 slots are one tick wide,
+ * each level up is TIMER_SLOTS times coarser; timers on a coarse level cascade down as the
+ * wheel reaches their slot, so timers any distance out cost O(1) to schedule and cancel.
+ * Timers live in a pooled node array threaded into per-slot doubly linked lists,
+ * so nothing is allocated once the pool has grown.
+ */
+const int TIMER_LEVELS = 4;
+const int TIMER_SLOT_BITS = 8;
+const int TIMER_SLOTS = 1 << TIMER_SLOT_BITS;
+
+class TimerWheel
+{
+
+public:
+
+  // ctor
+  TimerWheel(long _tick = 1, long start = 0);
+
+  // Schedule callback to run once the wheel reaches time when
+  TimerHandle Schedule(long when, function<void()> callback);
+
+  // Cancel a timer, returning false if it already fired or was cancelled
+  bool Cancel(TimerHandle handle);
+
+  // Run every timer due at or before now
+  void Advance(long now);
+
+  // Get the time the wheel has been advanced to
+  long GetTime() const;
+
+  // Get the number of pending timers
+  size_t Size() const;
+
+private:
+  struct TimerNode
+  {
+    long due_tick;
+    int slot;
+    int prev;
+    int next;
+    uint32_t generation;
+    bool active;
+    function<void()> callback;
+  };
+
+  // list heads, TIMER_SLOTS per level
+  vector<int> heads;
+  vector<TimerNode> nodes;
+  vector<int> free_nodes;
+  // callbacks due in the tick being processed
+  vector<function<void()>> due;
+  long tick;
+  // tick the wheel has processed up to
+  long current_tick;
+  size_t pending;
+  // timers per level, so ticks with nothing to do are skipped
+  size_t level_count[TIMER_LEVELS];
+
+  // Put a node in the slot matching how far out it is
+  void Insert(int index);
+  // Move the timers of a slot down to the levels below
+  void Cascade(int level);
+  void Link(int index, int slot);
+  void Unlink(int index);
+  void Release(int index);
+
+};
+
+
+TimerWheel::TimerWheel(long _tick, long start)
+{
+  heads = vector<int>(TIMER_LEVELS * TIMER_SLOTS, -1);
+  tick = _tick;
+  current_tick = start / tick;
+  pending = 0;
+  for (int level = 0; level < TIMER_LEVELS; level++)
+    level_count[level] = 0;
+}
+
+TimerHandle TimerWheel::Schedule(long when, function<void()> callback)
+{
+  int index;
+  if (free_nodes.empty()) {
+    index = nodes.size();
+    nodes.push_back(TimerNode());
+    nodes[index].generation = 0;
+  } else {
+    index = free_nodes.back();
+    free_nodes.pop_back();
+  }
+  TimerNode &node = nodes[index];
+  // anything already due fires on the next tick
+  node.due_tick = max(when / tick, current_tick + 1);
+  node.active = true;
+  node.generation++;
+  node.callback = std::move(callback);
+  Insert(index);
+  pending++;
+  return ((TimerHandle)node.generation << 32) | (uint32_t)(index + 1);
+}
+
+bool TimerWheel::Cancel(TimerHandle handle)
+{
+  int index = (int)(uint32_t)handle - 1;
+  if (index < 0 || index >= (int)nodes.size())
+    return false;
+  TimerNode &node = nodes[index];
+  if (!node.active || node.generation != (uint32_t)(handle >> 32))
+    return false;
+  Unlink(index);
+  Release(index);
+  return true;
+}
+
+void TimerWheel::Advance(long now)
+{
+  long target = now / tick;
+  while (current_tick < target) {
+    if (pending == 0) {
+      current_tick = target;
+      break;
+    }
+    // with no timers below a level, jump straight to that level's next slot
+    int lowest = 0;
+    while (level_count[lowest] == 0)
+      lowest++;
+    if (lowest > 0) {
+      int bits = TIMER_SLOT_BITS * lowest;
+      long boundary = ((current_tick >> bits) + 1) << bits;
+      if (target < boundary) {
+        current_tick = target;
+        break;
+      }
+      current_tick = boundary - 1;
+    }
+    current_tick++;
+    // entering a new slot on a coarser level brings its timers down, coarsest first
+    int level = 0;
+    while (level + 1 < TIMER_LEVELS && (current_tick & (((long)1 << (TIMER_SLOT_BITS * (level + 1))) - 1)) == 0)
+      level++;
+    for (; level > 0; level--)
+      Cascade(level);
+
+    int slot = current_tick & (TIMER_SLOTS - 1);
+    int index = heads[slot];
+    while (index >= 0) {
+      TimerNode &node = nodes[index];
+      int next = node.next;
+      Unlink(index);
+      if (node.due_tick > current_tick) {
+        // beyond the wheel's horizon when it was placed
+        Insert(index);
+      } else {
+        due.push_back(std::move(node.callback));
+        Release(index);
+      }
+      index = next;
+    }
+    // run them after the slot is walked, the callbacks may schedule or cancel timers
+    for (size_t i = 0; i < due.size(); i++) {
+      due[i]();
+    }
+    due.clear();
+  }
+}
+
+long TimerWheel::GetTime() const
+{
+  return current_tick * tick;
+}
+
+size_t TimerWheel::Size() const
+{
+  return pending;
+}
+
+void TimerWheel::Insert(int index)
+{
+  TimerNode &node = nodes[index];
+  long delta = node.due_tick - current_tick;
+  int level = 0;
+  while (level + 1 < TIMER_LEVELS && delta >= ((long)1 << (TIMER_SLOT_BITS * (level + 1))))
+    level++;
+  long position = node.due_tick >> (TIMER_SLOT_BITS * level);
+  if (level == TIMER_LEVELS - 1 && delta >= ((long)1 << (TIMER_SLOT_BITS * TIMER_LEVELS))) {
+    // past the horizon: park it in the last slot and place it again when it cascades
+    position = (current_tick >> (TIMER_SLOT_BITS * level)) - 1;
+  }
+  Link(index, level * TIMER_SLOTS + (position & (TIMER_SLOTS - 1)));
+}
+
+void TimerWheel::Cascade(int level)
+{
+  int slot = level * TIMER_SLOTS + ((current_tick >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1));
+  int index = heads[slot];
+  heads[slot] = -1;
+  while (index >= 0) {
+    int next = nodes[index].next;
+    level_count[level]--;
+    Insert(index);
+    index = next;
+  }
+}
+
+void TimerWheel::Link(int index, int slot)
+{
+  TimerNode &node = nodes[index];
+  level_count[slot / TIMER_SLOTS]++;
+  node.slot = slot;
+  node.prev = -1;
+  node.next = heads[slot];
+  if (heads[slot] >= 0)
+    nodes[heads[slot]].prev = index;
+  heads[slot] = index;
+}
+
+void TimerWheel::Unlink(int index)
+{
+  TimerNode &node = nodes[index];
+  level_count[node.slot / TIMER_SLOTS]--;
+  if (node.prev >= 0)
+    nodes[node.prev].next = node.next;
+  else
+    heads[node.slot] = node.next;
+  if (node.next >= 0)
+    nodes[node.next].prev = node.prev;
+}
+
+void TimerWheel::Release(int index)
+{
+  nodes[index].active = false;
+  nodes[index].callback = nullptr;
+  free_nodes.push_back(index);
+  pending--;
+}
+
+#endif
@@ -10,11 +10,15 @@
 #include <string>
 #include <vector>
 #include "soa.hpp"
+#include "metrics.hpp"
 #include <map>
 #include <vector>
 #include <fstream>
 #include <sstream>
+#include <functional>
 #include "executionservice.hpp"
+#include "wireformat.hpp"
+#include "transport.hpp"
 
 // Trade sides
 enum Side { BUY, SELL };
@@ -24,7 +28,7 @@ enum Side { BUY, SELL };
  * Type T is the product type.
  */
 template<typename T>
-class Trade
+class Trade : private CopyCounted<Trade<T>>
 {
 
 public:
@@ -81,10 +85,11 @@ public:
 // (again, with a separate process reading from the file and publishing via socket into the trading system,
 // which populates via a Connector into the BondTradeBookingService).
 template<typename T>
-class BondTradeBookingService: public TradeBookingService<Trade <T>>{
+class BondTradeBookingService: public TradeBookingService<T>{
 private:
     map<string, Trade<T>> trade_map;
     vector<ServiceListener<Trade<T>>*> listeners;
+    ServiceMetrics metrics;
 public:
     BondTradeBookingService();
 
@@ -101,20 +106,34 @@ public:
     // Get all listeners on the Service.
     virtual const vector< ServiceListener<Trade<T>>* >& GetListeners() const override;
     //Book the trade
-    virtual void BookTrade(Trade<T> trade) override;
+    virtual void BookTrade(const Trade<T> &trade) override;
 };
 
 
+// Reads trades.txt into the BondTradeBookingService. Given a MessageSink it is
+// instead the feeder side of a separate feed process: Subscribe(istream&) parses
+// the file and Publish sends each trade as a TRADE_MESSAGE, which the trading
+// process's connector takes off a MessageSource with Subscribe(MessageSource&).
 template<typename T>
 class BondTradeBookingServiceConnector: public Connector<Trade<T>>{
 private:
     BondTradeBookingService<T>* bond_trade_booking_service;
-    BondProductService* bond_product_service;
+    typename ProductTraits<T>::ProductService* bond_product_service;
+    MessageSink* sink;
+    uint32_t sequence;
+    // messages taken off a MessageSource that were not a whole trade of a known product
+    long rejected;
 public:
-    BondTradeBookingServiceConnector(BondTradeBookingService<T>* trade_service, BondProductService* product_service);
+    BondTradeBookingServiceConnector(BondTradeBookingService<T>* trade_service, typename ProductTraits<T>::ProductService* product_service, MessageSink* _sink = nullptr);
     ~BondTradeBookingServiceConnector();
-    virtual void Publish(Trade<T>& data) override {};
-    void Subscribe(ifstream& data);
+    virtual void Publish(Trade<T>& data) override;
+    void Subscribe(istream& data);
+    // Take trade messages off source until it closes, skipping those with a sequence number up
+    // to skip_through, already booked before a restart; received gets the sequence number of
+    // every message taken after it. Returns the sequence number of the last message taken.
+    uint32_t Subscribe(MessageSource& source, uint32_t skip_through = 0, function<void(uint32_t)> received = nullptr);
+    // Get the number of messages Subscribe(MessageSource&) rejected
+    long GetRejectedCount() const;
 };
 
 template<typename T>
@@ -194,7 +213,8 @@ void TradeBookingService<T>::BookTrade(const Trade<T> &trade)
 
 
 template<typename T>
-BondTradeBookingService<T>::BondTradeBookingService(){
+BondTradeBookingService<T>::BondTradeBookingService() :
+    metrics("trade_booking") {
     trade_map = map<string, Trade<T>>();
 }
 
@@ -207,7 +227,8 @@ Trade<T>& BondTradeBookingService<T>::GetData(string key){
 // The callback that a Connector should invoke for any new or updated data
 template<typename T>
 void BondTradeBookingService<T>::OnMessage(Trade<T> &data){
-    string bond_code = data.GetProduct().GetProductID(); //********
+    ServiceHop hop(metrics);
+    string bond_code = data.GetProduct().GetProductId();
     if(trade_map.find(bond_code)!=trade_map.end()){
         trade_map.erase(bond_code);
     }
@@ -229,10 +250,12 @@ const vector< ServiceListener<Trade<T>>* >& BondTradeBookingService<T>::GetListe
 }
 //Book the trade
 template<typename T>
-void BondTradeBookingService<T>::BookTrade(Trade<T> trade){
+void BondTradeBookingService<T>::BookTrade(const Trade<T> &trade){
+    Trade<T> booked = trade;
     for (auto& i:listeners){
-        i->ProcessAdd(trade);
+        i->ProcessAdd(booked);
     }
+    metrics.CountOut(listeners.size());
 }
 
 
@@ -240,16 +263,19 @@ void BondTradeBookingService<T>::BookTrade(Trade<T> trade){
 
 
 template<typename T>
-BondTradeBookingServiceConnector<T>::BondTradeBookingServiceConnector(BondTradeBookingService<T>* trade_service, BondProductService* product_service) {
+BondTradeBookingServiceConnector<T>::BondTradeBookingServiceConnector(BondTradeBookingService<T>* trade_service, typename ProductTraits<T>::ProductService* product_service, MessageSink* _sink) {
     bond_trade_booking_service = trade_service;
     bond_product_service = product_service;
+    sink = _sink;
+    sequence = 0;
+    rejected = 0;
 }
 template<typename T>
 BondTradeBookingServiceConnector<T>::~BondTradeBookingServiceConnector(){}
 
 
 template<typename T>
-void BondTradeBookingServiceConnector<T>::Subscribe(ifstream& data){
+void BondTradeBookingServiceConnector<T>::Subscribe(istream& data){
     //generate trades.txt
     //--------
     //code | trader_id | price | book | num | direction
@@ -264,7 +290,7 @@ void BondTradeBookingServiceConnector<T>::Subscribe(ifstream& data){
     }
     string bond_code = vec_s[0];
     string trader_id = vec_s[1];
-    double price = transform_data_to_price(vec_s[2]);
+    double price = ProductTraits<T>::ParsePrice(vec_s[2]);
     string book = vec_s[3];
     long num = stol(vec_s[4]);
     string direction = vec_s[5];
@@ -276,10 +302,65 @@ void BondTradeBookingServiceConnector<T>::Subscribe(ifstream& data){
     }
     auto bond = bond_product_service->GetData(bond_code);
     Trade<T> trade(bond,trader_id, price, book, num, side);
-    bond_trade_booking_service->OnMessage(trade);
+    if(sink)
+        Publish(trade);
+    else
+        bond_trade_booking_service->OnMessage(trade);
     }
 }
 
+template<typename T>
+void BondTradeBookingServiceConnector<T>::Publish(Trade<T>& data){
+    TradeRecord record;
+    CopyWireString(record.productId, data.GetProduct().GetProductId());
+    CopyWireString(record.tradeId, data.GetTradeId());
+    CopyWireString(record.book, data.GetBook());
+    record.price = data.GetPrice();
+    record.quantity = data.GetQuantity();
+    record.side = data.GetSide() == BUY ? 0 : 1;
+    char message[TRADE_MESSAGE_SIZE];
+    EncodeTrade(message, ++sequence, WireTimestamp(), record);
+    sink->Send(message, TRADE_MESSAGE_SIZE);
+}
+
+template<typename T>
+uint32_t BondTradeBookingServiceConnector<T>::Subscribe(MessageSource& source, uint32_t skip_through, function<void(uint32_t)> received){
+    const char* message;
+    size_t size;
+    uint32_t last = skip_through;
+    while(source.Receive(message, size)){
+        if(size < MESSAGE_HEADER_SIZE){
+            rejected++;
+            continue;
+        }
+        MessageHeader header = DecodeHeader(message);
+        if(header.sequence <= skip_through)
+            continue;
+        last = header.sequence;
+        if(header.type != TRADE_MESSAGE || size < TRADE_MESSAGE_SIZE){
+            rejected++;
+        }else{
+            TradeRecord record = DecodeTrade(message);
+            // an unknown product is rejected rather than added to the product service
+            const T* bond = bond_product_service->FindProduct(record.productId);
+            if(!bond){
+                rejected++;
+            }else{
+                Trade<T> trade(*bond, record.tradeId, record.price, record.book, record.quantity, record.side == 0 ? BUY : SELL);
+                bond_trade_booking_service->OnMessage(trade);
+            }
+        }
+        if(received)
+            received(last);
+    }
+    return last;
+}
+
+template<typename T>
+long BondTradeBookingServiceConnector<T>::GetRejectedCount() const{
+    return rejected;
+}
+
 
 
 template<typename T>
@@ -311,8 +392,8 @@ void BondTradeBookingServiceListener<T>::ProcessAdd(ExecutionOrder<T>& data){
     //code | trader_id | price | book | num | direction
     //--------
     Trade<T> trade(bond, trade_id, price, book, num, side);
+    // OnMessage books it
     bond_trade_booking_service->OnMessage(trade);
-    bond_trade_booking_service->BookTrade(trade);
 
 }
 
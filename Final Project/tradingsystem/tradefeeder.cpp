@@ -0,0 +1,56 @@
+/**
+ * tradefeeder.cpp
+ * The separate feed process for trades: reads trades.txt and publishes each
+ * trade into the trading system over shared memory or loopback TCP.
+ *
+ * Usage: tradefeeder --shm <name> [file]   publish into the ring /dev/shm/<name> once the trading process attaches
+ *        tradefeeder --tcp <port> [file]   publish to a trading process listening on the port
+ */
+#include <iostream>
+#include <string>
+#include <memory>
+#include "soa.hpp"
+#include "products.hpp"
+#include "tradebookingservice.hpp"
+#include "feedinput.hpp"
+#include "transport.hpp"
+#include "./Data/Bond_info.h"
+
+using namespace std;
+
+int main(int argc, char *argv[])
+{
+  if (argc < 3 || argc > 4 || (string(argv[1]) != "--shm" && string(argv[1]) != "--tcp"))
+  {
+    cerr << "usage: " << argv[0] << " --shm <name> | --tcp <port> [file]" << '\n';
+    return 2;
+  }
+  string path = argc == 4 ? argv[3] : "trades.txt";
+
+  try
+  {
+    unique_ptr<MessageSink> sink;
+    if (string(argv[1]) == "--shm")
+      sink.reset(new ShmRingWriter(argv[2], 1 << 16, 112, 1));
+    else
+      sink.reset(new TcpSink(stoi(argv[2])));
+
+    // trades are encoded with the ids of the products they name, so the feeder knows them too
+    BondProductService product_service;
+    for (size_t k = 0; k < bond_code.size(); k++)
+    {
+      Bond bond(bond_code[k], CUSIP, "T", bond_coupon[k], bond_maturity[k]);
+      product_service.AddBond(bond);
+    }
+    BondTradeBookingServiceConnector<Bond> connector(nullptr, &product_service, sink.get());
+    FeedStream trades(path);
+    connector.Subscribe(trades);
+    sink->Close();
+  }
+  catch (const exception &e)
+  {
+    cerr << e.what() << '\n';
+    return 1;
+  }
+  return 0;
+}
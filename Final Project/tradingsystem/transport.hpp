@@ -0,0 +1,626 @@
+/**
+ * transport.hpp
+ * Defines the message transports between a feed process and the trading
+ * process: a single-writer broadcast ring in shared memory (/dev/shm), and
+ * a loopback TCP channel to compare it against.
+ */
+#ifndef TRANSPORT_HPP
+#define TRANSPORT_HPP
+
+#include <string>
+#include <vector>
+#include <istream>
+#include <streambuf>
+#include <new>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "wireformat.hpp"
+
+using namespace std;
+
+/**
+ * Sending end of a transport, used by a feeder's Connector::Publish.
+ */
+class MessageSink
+{
+
+public:
+
+  virtual ~MessageSink() = default;
+
+  // Send one message of size bytes
+  virtual void Send(const char *data, size_t size) = 0;
+
+  // Tell the receivers no more messages follow
+  virtual void Close() = 0;
+
+};
+
+/**
+ * Receiving end of a transport, drained by a service-side Connector's Subscribe.
+ */
+class MessageSource
+{
+
+public:
+
+  virtual ~MessageSource() = default;
+
+  // Block for the next message, valid until the next call; false once the sender has closed
+  virtual bool Receive(const char *&data, size_t &size) = 0;
+
+};
+
+/**
+ * Streambuf turning the FEED_LINE_MESSAGEs of a MessageSource back into
+ * newline-terminated text; other message types are skipped.
+ */
+class MessageStreamBuf : public streambuf
+{
+
+public:
+
+  // ctor over a source the caller keeps alive
+  MessageStreamBuf(MessageSource *_source);
+
+protected:
+  int_type underflow() override;
+
+private:
+  MessageSource *source;
+  vector<char> line;
+
+};
+
+/**
+ * Text feed read off a MessageSource, so a Connector's Subscribe(istream&)
+ * can take its lines from a socket or ring instead of a file.
+ */
+class MessageStream : public istream
+{
+
+public:
+
+  // ctor over a source the caller keeps alive
+  MessageStream(MessageSource *source);
+
+private:
+  MessageStreamBuf buffer;
+
+};
+
+const uint64_t SHM_RING_MAGIC = 0x31474e4952454546ULL; // "FEEDRING"
+
+/**
+ * Layout at the start of the shared segment; the slots follow it.
+ * Each slot is a seqlock: its sequence is odd while the writer fills it and
+ * 2 * (n + 1) once it holds message n. A reader that has spun for a while
+ * registers in waiters and sleeps on the wakeup futex, which the writer only
+ * bumps when someone is registered.
+ */
+struct ShmRingHeader
+{
+  uint64_t magic;
+  uint64_t slotCount;
+  uint64_t slotSize;
+  alignas(64) atomic<uint64_t> cursor;
+  atomic<uint32_t> closed;
+  alignas(64) atomic<uint32_t> waiters;
+  atomic<uint32_t> wakeup;
+  uint32_t gatingExpected;
+  atomic<uint32_t> gatingCount;
+};
+
+// Most readers a writer can be gated on
+const int SHM_RING_MAX_GATING = 8;
+
+/**
+ * Position a gating reader has consumed up to, on its own cache line.
+ */
+struct ShmRingGate
+{
+  alignas(64) atomic<uint64_t> consumed;
+};
+
+// Spins a reader makes before it sleeps; keeps latency low while a core is free
+const int SHM_RING_SPINS = 4000;
+
+struct ShmRingSlot
+{
+  atomic<uint64_t> sequence;
+  uint32_t size;
+  uint32_t reserved;
+};
+
+/**
+ * Writer of a shared-memory ring. By default it never waits for readers:
+ * each follows at its own pace and one lapped by a whole ring gets an
+ * overrun error. A feed that must not lose messages, like trades, names a
+ * number of gating readers: the writer waits for them to attach before the
+ * first message and never laps the slowest of them.
+ */
+class ShmRingWriter : public MessageSink
+{
+
+public:
+
+  // ctor creating /dev/shm/<name> with slot_count (a power of two) slots of up to max_message bytes
+  // and gated on gating_readers readers
+  ShmRingWriter(const string &_name, size_t slot_count = 1 << 16, size_t max_message = 112, int gating_readers = 0);
+  ~ShmRingWriter();
+
+  ShmRingWriter(const ShmRingWriter&) = delete;
+  ShmRingWriter& operator=(const ShmRingWriter&) = delete;
+
+  void Send(const char *data, size_t size) override;
+
+  void Close() override;
+
+  // Get the largest message a slot holds
+  size_t GetMaxMessage() const;
+
+private:
+  // Wake every sleeping reader
+  void Wake();
+
+  // Wait until the gating readers leave room for message next
+  void WaitForSpace();
+
+  string name;
+  void *segment;
+  size_t segment_size;
+  ShmRingHeader *header;
+  ShmRingGate *gates;
+  char *slots;
+  uint64_t mask;
+  uint64_t stride;
+  uint64_t next;
+  uint64_t limit;
+
+};
+
+/**
+ * Reader of a shared-memory ring. A plain reader starts from the oldest
+ * message still in the ring; a gating reader takes one of the writer's
+ * gating places and starts from the first message.
+ */
+class ShmRingReader : public MessageSource
+{
+
+public:
+
+  // ctor attaching to /dev/shm/<name>, waiting up to timeout milliseconds for the writer to create it
+  ShmRingReader(const string &name, long timeout = 5000, bool _gating = false);
+  ~ShmRingReader();
+
+  ShmRingReader(const ShmRingReader&) = delete;
+  ShmRingReader& operator=(const ShmRingReader&) = delete;
+
+  bool Receive(const char *&data, size_t &size) override;
+
+private:
+  // Sleep until the writer publishes past next or closes
+  void Sleep();
+
+  void *segment;
+  size_t segment_size;
+  ShmRingHeader *header;
+  ShmRingGate *gate;
+  char *slots;
+  uint64_t mask;
+  uint64_t stride;
+  uint64_t next;
+  vector<char> message;
+
+};
+
+/**
+ * Sending end of a loopback TCP channel; messages are framed by a 4-byte length.
+ */
+class TcpSink : public MessageSink
+{
+
+public:
+
+  // ctor connecting to a TcpSource on 127.0.0.1:port
+  TcpSink(int port);
+  ~TcpSink();
+
+  TcpSink(const TcpSink&) = delete;
+  TcpSink& operator=(const TcpSink&) = delete;
+
+  void Send(const char *data, size_t size) override;
+
+  void Close() override;
+
+private:
+  int fd;
+  vector<char> frame;
+
+};
+
+/**
+ * Receiving end of a loopback TCP channel. It listens from construction
+ * and accepts the sender on the first Receive.
+ */
+class TcpSource : public MessageSource
+{
+
+public:
+
+  // ctor listening on 127.0.0.1:port
+  TcpSource(int port);
+  ~TcpSource();
+
+  TcpSource(const TcpSource&) = delete;
+  TcpSource& operator=(const TcpSource&) = delete;
+
+  bool Receive(const char *&data, size_t &size) override;
+
+private:
+  int listener;
+  int fd;
+  vector<char> message;
+
+  // Read exactly size bytes; false at a clean end of stream before the first byte
+  bool ReadFully(char *out, size_t size);
+
+};
+
+MessageStreamBuf::MessageStreamBuf(MessageSource *_source) :
+  source(_source)
+{
+}
+
+MessageStreamBuf::int_type MessageStreamBuf::underflow()
+{
+  if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+  const char *data;
+  size_t size;
+  while (source->Receive(data, size))
+  {
+    if (size < MESSAGE_HEADER_SIZE || DecodeHeader(data).type != FEED_LINE_MESSAGE) continue;
+    line.assign(data + MESSAGE_HEADER_SIZE, data + size);
+    line.push_back('\n');
+    setg(line.data(), line.data(), line.data() + line.size());
+    return traits_type::to_int_type(*gptr());
+  }
+  return traits_type::eof();
+}
+
+MessageStream::MessageStream(MessageSource *source) :
+  istream(nullptr), buffer(source)
+{
+  rdbuf(&buffer);
+}
+
+// Bytes the ring header and gates take before the first slot
+const size_t SHM_RING_HEADER_SIZE = (sizeof(ShmRingHeader) + 63) / 64 * 64 + SHM_RING_MAX_GATING * sizeof(ShmRingGate);
+
+ShmRingWriter::ShmRingWriter(const string &_name, size_t slot_count, size_t max_message, int gating_readers) :
+  name(_name), segment(nullptr), header(nullptr), next(0)
+{
+  if (slot_count == 0 || (slot_count & (slot_count - 1)) != 0) throw invalid_argument("slot count must be a power of two");
+  if (gating_readers < 0 || gating_readers > SHM_RING_MAX_GATING) throw invalid_argument("too many gating readers");
+  mask = slot_count - 1;
+  stride = (sizeof(ShmRingSlot) + max_message + 63) / 64 * 64;
+  segment_size = SHM_RING_HEADER_SIZE + slot_count * stride;
+
+  int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) throw runtime_error("cannot create shared memory " + name + ": " + strerror(errno));
+  if (ftruncate(fd, segment_size) < 0)
+  {
+    int error = errno;
+    close(fd);
+    throw runtime_error("cannot size shared memory " + name + ": " + strerror(error));
+  }
+  segment = mmap(nullptr, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (segment == MAP_FAILED) throw runtime_error("cannot map shared memory " + name + ": " + strerror(errno));
+
+  // the segment starts zeroed, so every slot reads as empty; publish the geometry last
+  header = new (segment) ShmRingHeader();
+  gates = (ShmRingGate*)((char*)segment + (sizeof(ShmRingHeader) + 63) / 64 * 64);
+  for (int i = 0; i < SHM_RING_MAX_GATING; i++) new (gates + i) ShmRingGate();
+  slots = (char*)segment + SHM_RING_HEADER_SIZE;
+  for (uint64_t i = 0; i <= mask; i++) new (slots + i * stride) ShmRingSlot();
+  header->slotCount = slot_count;
+  header->slotSize = stride;
+  header->cursor.store(0, memory_order_relaxed);
+  header->closed.store(0, memory_order_relaxed);
+  header->waiters.store(0, memory_order_relaxed);
+  header->wakeup.store(0, memory_order_relaxed);
+  header->gatingExpected = gating_readers;
+  header->gatingCount.store(0, memory_order_relaxed);
+  limit = gating_readers == 0 ? UINT64_MAX : 0;
+  atomic_thread_fence(memory_order_release);
+  __atomic_store_n(&header->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+}
+
+ShmRingWriter::~ShmRingWriter()
+{
+  if (header) Close();
+  if (segment) munmap(segment, segment_size);
+  // readers keep their mapping; the name goes so the next writer starts clean
+  shm_unlink(name.c_str());
+}
+
+void ShmRingWriter::Send(const char *data, size_t size)
+{
+  if (size > stride - sizeof(ShmRingSlot)) throw invalid_argument("message too large for the ring");
+  if (next >= limit) WaitForSpace();
+  ShmRingSlot *slot = (ShmRingSlot*)(slots + (next & mask) * stride);
+  slot->sequence.store(2 * next + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  memcpy((char*)(slot + 1), data, size);
+  slot->size = size;
+  slot->sequence.store(2 * next + 2, memory_order_release);
+  header->cursor.store(++next, memory_order_seq_cst);
+  if (header->waiters.load(memory_order_seq_cst) != 0) Wake();
+}
+
+void ShmRingWriter::Close()
+{
+  header->closed.store(1, memory_order_seq_cst);
+  Wake();
+}
+
+void ShmRingWriter::Wake()
+{
+  header->wakeup.fetch_add(1, memory_order_seq_cst);
+  syscall(SYS_futex, &header->wakeup, FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+}
+
+void ShmRingWriter::WaitForSpace()
+{
+  int spins = 0;
+  while (true)
+  {
+    if (header->gatingCount.load(memory_order_acquire) >= header->gatingExpected)
+    {
+      uint64_t slowest = UINT64_MAX;
+      for (uint32_t i = 0; i < header->gatingExpected; i++)
+        slowest = min(slowest, gates[i].consumed.load(memory_order_acquire));
+      limit = slowest + mask + 1;
+      if (next < limit) return;
+    }
+    // give a reader on the same core the chance to catch up
+    if (++spins > SHM_RING_SPINS) this_thread::sleep_for(chrono::microseconds(50));
+  }
+}
+
+size_t ShmRingWriter::GetMaxMessage() const
+{
+  return stride - sizeof(ShmRingSlot);
+}
+
+ShmRingReader::ShmRingReader(const string &name, long timeout, bool _gating) :
+  segment(nullptr), header(nullptr), gate(nullptr)
+{
+  auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeout);
+  int fd;
+  struct stat info;
+  while (true)
+  {
+    fd = shm_open(name.c_str(), O_RDWR, 0);
+    // the writer may have created the name but not sized it yet
+    if (fd >= 0 && fstat(fd, &info) == 0 && (size_t)info.st_size > SHM_RING_HEADER_SIZE) break;
+    if (fd >= 0) close(fd);
+    if (chrono::steady_clock::now() > deadline) throw runtime_error("no shared memory ring " + name);
+    this_thread::sleep_for(chrono::milliseconds(1));
+  }
+  segment_size = info.st_size;
+  segment = mmap(nullptr, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (segment == MAP_FAILED) throw runtime_error("cannot map shared memory " + name + ": " + strerror(errno));
+
+  header = (ShmRingHeader*)segment;
+  while (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SHM_RING_MAGIC)
+  {
+    if (chrono::steady_clock::now() > deadline) throw runtime_error("shared memory " + name + " is not a ring");
+    this_thread::sleep_for(chrono::milliseconds(1));
+  }
+  mask = header->slotCount - 1;
+  stride = header->slotSize;
+  slots = (char*)segment + SHM_RING_HEADER_SIZE;
+  message.resize(stride);
+  if (_gating)
+  {
+    uint32_t index = header->gatingCount.fetch_add(1, memory_order_acq_rel);
+    if (index >= header->gatingExpected)
+    {
+      header->gatingCount.fetch_sub(1, memory_order_acq_rel);
+      munmap(segment, segment_size);
+      throw runtime_error("no gating place left on ring " + name);
+    }
+    gate = (ShmRingGate*)((char*)segment + (sizeof(ShmRingHeader) + 63) / 64 * 64) + index;
+    next = 0;
+    return;
+  }
+  uint64_t cursor = header->cursor.load(memory_order_acquire);
+  next = cursor > mask ? cursor - mask : 0;
+}
+
+ShmRingReader::~ShmRingReader()
+{
+  if (segment) munmap(segment, segment_size);
+}
+
+bool ShmRingReader::Receive(const char *&data, size_t &size)
+{
+  const ShmRingSlot *slot = (const ShmRingSlot*)(slots + (next & mask) * stride);
+  const uint64_t ready = 2 * next + 2;
+  int spins = 0;
+  while (true)
+  {
+    uint64_t sequence = slot->sequence.load(memory_order_acquire);
+    if (sequence == ready)
+    {
+      size = slot->size;
+      memcpy(message.data(), (const char*)(slot + 1), size);
+      atomic_thread_fence(memory_order_acquire);
+      // a changed sequence means the writer lapped us while we copied
+      if (slot->sequence.load(memory_order_relaxed) != ready) break;
+      ++next;
+      // the writer may reuse the slot once the message is copied out
+      if (gate) gate->consumed.store(next, memory_order_release);
+      data = message.data();
+      return true;
+    }
+    if (sequence > ready) break;
+    if (header->closed.load(memory_order_acquire) && header->cursor.load(memory_order_acquire) <= next) return false;
+    if (++spins > SHM_RING_SPINS)
+    {
+      Sleep();
+      spins = 0;
+    }
+  }
+  throw runtime_error("shared memory ring overrun at message " + to_string(next));
+}
+
+void ShmRingReader::Sleep()
+{
+  header->waiters.fetch_add(1, memory_order_seq_cst);
+  uint32_t wakeup = header->wakeup.load(memory_order_seq_cst);
+  // recheck after registering, so a message published in between is not slept through
+  if (header->cursor.load(memory_order_seq_cst) <= next && !header->closed.load(memory_order_seq_cst))
+  {
+    timespec timeout = {0, 100 * 1000 * 1000};
+    syscall(SYS_futex, &header->wakeup, FUTEX_WAIT, wakeup, &timeout, nullptr, 0);
+  }
+  header->waiters.fetch_sub(1, memory_order_seq_cst);
+}
+
+TcpSink::TcpSink(int port)
+{
+  sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) throw runtime_error(string("cannot create socket: ") + strerror(errno));
+  if (connect(fd, (sockaddr*)&address, sizeof(address)) < 0)
+  {
+    int error = errno;
+    close(fd);
+    throw runtime_error("cannot connect to port " + to_string(port) + ": " + strerror(error));
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+TcpSink::~TcpSink()
+{
+  Close();
+}
+
+void TcpSink::Send(const char *data, size_t size)
+{
+  if (fd < 0) throw runtime_error("send on a closed channel");
+  uint32_t length = size;
+  frame.resize(4 + size);
+  memcpy(frame.data(), &length, 4);
+  memcpy(frame.data() + 4, data, size);
+  const char *out = frame.data();
+  size_t left = frame.size();
+  while (left > 0)
+  {
+    ssize_t n = send(fd, out, left, MSG_NOSIGNAL);
+    if (n < 0)
+    {
+      if (errno == EINTR) continue;
+      throw runtime_error(string("send failed: ") + strerror(errno));
+    }
+    out += n;
+    left -= n;
+  }
+}
+
+void TcpSink::Close()
+{
+  if (fd >= 0) close(fd);
+  fd = -1;
+}
+
+TcpSource::TcpSource(int port) :
+  fd(-1)
+{
+  sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  listener = socket(AF_INET, SOCK_STREAM, 0);
+  if (listener < 0) throw runtime_error(string("cannot create socket: ") + strerror(errno));
+  int one = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(listener, (sockaddr*)&address, sizeof(address)) < 0 || listen(listener, 1) < 0)
+  {
+    int error = errno;
+    close(listener);
+    throw runtime_error("cannot listen on port " + to_string(port) + ": " + strerror(error));
+  }
+}
+
+TcpSource::~TcpSource()
+{
+  if (fd >= 0) close(fd);
+  close(listener);
+}
+
+bool TcpSource::Receive(const char *&data, size_t &size)
+{
+  if (fd < 0)
+  {
+    fd = accept(listener, nullptr, nullptr);
+    if (fd < 0) throw runtime_error(string("accept failed: ") + strerror(errno));
+  }
+  uint32_t length;
+  if (!ReadFully((char*)&length, 4)) return false;
+  if (message.size() < length) message.resize(length);
+  if (!ReadFully(message.data(), length)) throw runtime_error("channel closed inside a message");
+  data = message.data();
+  size = length;
+  return true;
+}
+
+bool TcpSource::ReadFully(char *out, size_t size)
+{
+  size_t done = 0;
+  while (done < size)
+  {
+    ssize_t n = recv(fd, out + done, size - done, 0);
+    if (n < 0)
+    {
+      if (errno == EINTR) continue;
+      throw runtime_error(string("recv failed: ") + strerror(errno));
+    }
+    if (n == 0)
+    {
+      if (done == 0) return false;
+      throw runtime_error("channel closed inside a message");
+    }
+    done += n;
+  }
+  return true;
+}
+
+#endif
@@ -0,0 +1,502 @@
+/**
+ * wireformat.hpp
+ * Defines the binary wire format published by the connectors, the batching
+ * writer that sends it to a file or a local socket, and the reader a
+ * separate consumer process decodes it with.
+ *
+ * Every message is a fixed-size little-endian record with a common header:
+ *   offset  0  uint16  length of the whole message in bytes
+ *   offset  2  uint16  message type
+ *   offset  4  uint32  sequence number, per publisher
+ *   offset  8  int64   publish time, nanoseconds since the epoch
+ */
+#ifndef WIRE_FORMAT_HPP
+#define WIRE_FORMAT_HPP
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+using namespace std;
+
+// Message types on the wire
+enum MessageType : uint16_t { PRICE_STREAM_MESSAGE = 1, TRADE_MESSAGE = 2, EXECUTION_ORDER_MESSAGE = 3, FEED_LINE_MESSAGE = 4 };
+
+const size_t MESSAGE_HEADER_SIZE = 16;
+
+// Longest product identifier carried on the wire, NUL padded
+const size_t WIRE_PRODUCT_ID_SIZE = 16;
+
+/**
+ * PRICE_STREAM_MESSAGE body, after the header:
+ *   offset 16  char[16] product identifier
+ *   offset 32  double   bid price
+ *   offset 40  int64    bid visible quantity
+ *   offset 48  int64    bid hidden quantity
+ *   offset 56  double   offer price
+ *   offset 64  int64    offer visible quantity
+ *   offset 72  int64    offer hidden quantity
+ */
+const size_t PRICE_STREAM_MESSAGE_SIZE = 80;
+
+/**
+ * TRADE_MESSAGE body, after the header:
+ *   offset 16  char[16] product identifier
+ *   offset 32  char[16] trade identifier
+ *   offset 48  char[16] book
+ *   offset 64  double   price
+ *   offset 72  int64    quantity
+ *   offset 80  uint8    side, 0 for BUY and 1 for SELL
+ */
+const size_t TRADE_MESSAGE_SIZE = 88;
+
+/**
+ * EXECUTION_ORDER_MESSAGE body, after the header:
+ *   offset 16  char[16] product identifier
+ *   offset 32  char[16] order identifier
+ *   offset 48  char[16] parent order identifier
+ *   offset 64  double   price
+ *   offset 72  int64    visible quantity
+ *   offset 80  int64    hidden quantity
+ *   offset 88  uint8    side, 0 for BID and 1 for OFFER
+ *   offset 89  uint8    order type, as OrderType
+ *   offset 90  uint8    1 for a child order
+ */
+const size_t EXECUTION_ORDER_MESSAGE_SIZE = 96;
+
+/**
+ * FEED_LINE_MESSAGE carries one line of a text feed file, without its
+ * newline, after the header; its length is the header's.
+ */
+const size_t MAX_FEED_LINE = 65535 - MESSAGE_HEADER_SIZE;
+
+/**
+ * Decoded header of a wire message.
+ */
+struct MessageHeader
+{
+  uint16_t length;
+  uint16_t type;
+  uint32_t sequence;
+  int64_t timestamp;
+};
+
+/**
+ * Flat, product-independent view of a two-way price stream on the wire.
+ */
+struct PriceStreamRecord
+{
+  char productId[WIRE_PRODUCT_ID_SIZE + 1];
+  double bidPrice;
+  int64_t bidVisibleQuantity;
+  int64_t bidHiddenQuantity;
+  double offerPrice;
+  int64_t offerVisibleQuantity;
+  int64_t offerHiddenQuantity;
+};
+
+/**
+ * Flat, product-independent view of a booked trade on the wire.
+ */
+struct TradeRecord
+{
+  char productId[WIRE_PRODUCT_ID_SIZE + 1];
+  char tradeId[WIRE_PRODUCT_ID_SIZE + 1];
+  char book[WIRE_PRODUCT_ID_SIZE + 1];
+  double price;
+  int64_t quantity;
+  uint8_t side;
+};
+
+/**
+ * Flat, product-independent view of an execution order on the wire.
+ */
+struct ExecutionOrderRecord
+{
+  char productId[WIRE_PRODUCT_ID_SIZE + 1];
+  char orderId[WIRE_PRODUCT_ID_SIZE + 1];
+  char parentOrderId[WIRE_PRODUCT_ID_SIZE + 1];
+  double price;
+  int64_t visibleQuantity;
+  int64_t hiddenQuantity;
+  uint8_t side;
+  uint8_t orderType;
+  uint8_t isChildOrder;
+};
+
+// Copy a string into a NUL-terminated record field, rejecting ones that do not fit on the wire
+void CopyWireString(char *field, const string &value);
+
+// Write a header into out
+void EncodeHeader(char *out, uint16_t length, uint16_t type, uint32_t sequence, int64_t timestamp);
+
+// Read the header at in
+MessageHeader DecodeHeader(const char *in);
+
+// Write a PRICE_STREAM_MESSAGE into out, which holds PRICE_STREAM_MESSAGE_SIZE bytes
+void EncodePriceStream(char *out, uint32_t sequence, int64_t timestamp, const PriceStreamRecord &record);
+
+// Read the body of the PRICE_STREAM_MESSAGE at in
+PriceStreamRecord DecodePriceStream(const char *in);
+
+// Write a TRADE_MESSAGE into out, which holds TRADE_MESSAGE_SIZE bytes
+void EncodeTrade(char *out, uint32_t sequence, int64_t timestamp, const TradeRecord &record);
+
+// Read the body of the TRADE_MESSAGE at in
+TradeRecord DecodeTrade(const char *in);
+
+// Write an EXECUTION_ORDER_MESSAGE into out, which holds EXECUTION_ORDER_MESSAGE_SIZE bytes
+void EncodeExecutionOrder(char *out, uint32_t sequence, int64_t timestamp, const ExecutionOrderRecord &record);
+
+// Read the body of the EXECUTION_ORDER_MESSAGE at in
+ExecutionOrderRecord DecodeExecutionOrder(const char *in);
+
+// Write a FEED_LINE_MESSAGE for the size bytes at line into out, which holds
+// MESSAGE_HEADER_SIZE + size bytes; returns the message length
+size_t EncodeFeedLine(char *out, uint32_t sequence, int64_t timestamp, const char *line, size_t size);
+
+// Nanoseconds since the epoch, for message timestamps
+int64_t WireTimestamp();
+
+/**
+ * Accumulates encoded messages and writes them with one system call per batch.
+ * A batch goes out when the next message would not fit, or on Flush(), which
+ * the owner calls from a timer so a quiet feed is not held back.
+ */
+class BatchWriter
+{
+
+public:
+
+  // ctor for a writer sending batches of up to batch_size bytes
+  BatchWriter(size_t _batch_size = 64 * 1024);
+  ~BatchWriter();
+
+  BatchWriter(const BatchWriter&) = delete;
+  BatchWriter& operator=(const BatchWriter&) = delete;
+
+  // Write to a file (or a FIFO a consumer is reading), truncating it
+  void OpenFile(const string &path);
+
+  // Write to a consumer listening on a Unix domain stream socket
+  void ConnectUnixSocket(const string &path);
+
+  // Whether there is somewhere to write
+  bool IsOpen() const;
+
+  // Get space for a message of size bytes in the current batch
+  char* Reserve(size_t size);
+
+  // Add the size bytes written at the last Reserve to the batch
+  void Commit(size_t size);
+
+  // Write the current batch out
+  void Flush();
+
+  // Get the number of bytes and batches written so far
+  size_t GetBytesWritten() const;
+  size_t GetBatchCount() const;
+
+private:
+  int fd;
+  vector<char> buffer;
+  size_t used;
+  size_t bytes_written;
+  size_t batch_count;
+
+  void Close();
+
+};
+
+/**
+ * Splits a byte stream from a file or socket back into whole messages.
+ */
+class MessageReader
+{
+
+public:
+
+  // ctor for a reader over an open descriptor; the reader does not own it
+  MessageReader(int _fd, size_t _buffer_size = 64 * 1024);
+
+  // Get the next message, blocking for more input; false at end of stream
+  bool Next(const char *&message, MessageHeader &header);
+
+private:
+  int fd;
+  vector<char> buffer;
+  size_t begin;
+  size_t end;
+
+};
+
+void CopyWireString(char *field, const string &value)
+{
+  if (value.size() > WIRE_PRODUCT_ID_SIZE) throw invalid_argument("field too long for the wire: " + value);
+  memcpy(field, value.c_str(), value.size() + 1);
+}
+
+void EncodeHeader(char *out, uint16_t length, uint16_t type, uint32_t sequence, int64_t timestamp)
+{
+  memcpy(out, &length, 2);
+  memcpy(out + 2, &type, 2);
+  memcpy(out + 4, &sequence, 4);
+  memcpy(out + 8, &timestamp, 8);
+}
+
+MessageHeader DecodeHeader(const char *in)
+{
+  MessageHeader header;
+  memcpy(&header.length, in, 2);
+  memcpy(&header.type, in + 2, 2);
+  memcpy(&header.sequence, in + 4, 4);
+  memcpy(&header.timestamp, in + 8, 8);
+  return header;
+}
+
+void EncodePriceStream(char *out, uint32_t sequence, int64_t timestamp, const PriceStreamRecord &record)
+{
+  EncodeHeader(out, PRICE_STREAM_MESSAGE_SIZE, PRICE_STREAM_MESSAGE, sequence, timestamp);
+  memset(out + 16, 0, WIRE_PRODUCT_ID_SIZE);
+  memcpy(out + 16, record.productId, strnlen(record.productId, WIRE_PRODUCT_ID_SIZE));
+  memcpy(out + 32, &record.bidPrice, 8);
+  memcpy(out + 40, &record.bidVisibleQuantity, 8);
+  memcpy(out + 48, &record.bidHiddenQuantity, 8);
+  memcpy(out + 56, &record.offerPrice, 8);
+  memcpy(out + 64, &record.offerVisibleQuantity, 8);
+  memcpy(out + 72, &record.offerHiddenQuantity, 8);
+}
+
+PriceStreamRecord DecodePriceStream(const char *in)
+{
+  PriceStreamRecord record;
+  memcpy(record.productId, in + 16, WIRE_PRODUCT_ID_SIZE);
+  record.productId[WIRE_PRODUCT_ID_SIZE] = '\0';
+  memcpy(&record.bidPrice, in + 32, 8);
+  memcpy(&record.bidVisibleQuantity, in + 40, 8);
+  memcpy(&record.bidHiddenQuantity, in + 48, 8);
+  memcpy(&record.offerPrice, in + 56, 8);
+  memcpy(&record.offerVisibleQuantity, in + 64, 8);
+  memcpy(&record.offerHiddenQuantity, in + 72, 8);
+  return record;
+}
+
+void EncodeTrade(char *out, uint32_t sequence, int64_t timestamp, const TradeRecord &record)
+{
+  EncodeHeader(out, TRADE_MESSAGE_SIZE, TRADE_MESSAGE, sequence, timestamp);
+  memset(out + 16, 0, 3 * WIRE_PRODUCT_ID_SIZE);
+  memcpy(out + 16, record.productId, strnlen(record.productId, WIRE_PRODUCT_ID_SIZE));
+  memcpy(out + 32, record.tradeId, strnlen(record.tradeId, WIRE_PRODUCT_ID_SIZE));
+  memcpy(out + 48, record.book, strnlen(record.book, WIRE_PRODUCT_ID_SIZE));
+  memcpy(out + 64, &record.price, 8);
+  memcpy(out + 72, &record.quantity, 8);
+  memset(out + 80, 0, 8);
+  out[80] = record.side;
+}
+
+TradeRecord DecodeTrade(const char *in)
+{
+  TradeRecord record;
+  memcpy(record.productId, in + 16, WIRE_PRODUCT_ID_SIZE);
+  record.productId[WIRE_PRODUCT_ID_SIZE] = '\0';
+  memcpy(record.tradeId, in + 32, WIRE_PRODUCT_ID_SIZE);
+  record.tradeId[WIRE_PRODUCT_ID_SIZE] = '\0';
+  memcpy(record.book, in + 48, WIRE_PRODUCT_ID_SIZE);
+  record.book[WIRE_PRODUCT_ID_SIZE] = '\0';
+  memcpy(&record.price, in + 64, 8);
+  memcpy(&record.quantity, in + 72, 8);
+  record.side = in[80];
+  return record;
+}
+
+void EncodeExecutionOrder(char *out, uint32_t sequence, int64_t timestamp, const ExecutionOrderRecord &record)
+{
+  EncodeHeader(out, EXECUTION_ORDER_MESSAGE_SIZE, EXECUTION_ORDER_MESSAGE, sequence, timestamp);
+  memset(out + 16, 0, EXECUTION_ORDER_MESSAGE_SIZE - 16);
+  memcpy(out + 16, record.productId, strnlen(record.productId, WIRE_PRODUCT_ID_SIZE));
+  memcpy(out + 32, record.orderId, strnlen(record.orderId, WIRE_PRODUCT_ID_SIZE));
+  memcpy(out + 48, record.parentOrderId, strnlen(record.parentOrderId, WIRE_PRODUCT_ID_SIZE));
+  memcpy(out + 64, &record.price, 8);
+  memcpy(out + 72, &record.visibleQuantity, 8);
+  memcpy(out + 80, &record.hiddenQuantity, 8);
+  out[88] = record.side;
+  out[89] = record.orderType;
+  out[90] = record.isChildOrder;
+}
+
+ExecutionOrderRecord DecodeExecutionOrder(const char *in)
+{
+  ExecutionOrderRecord record;
+  memcpy(record.productId, in + 16, WIRE_PRODUCT_ID_SIZE);
+  record.productId[WIRE_PRODUCT_ID_SIZE] = '\0';
+  memcpy(record.orderId, in + 32, WIRE_PRODUCT_ID_SIZE);
+  record.orderId[WIRE_PRODUCT_ID_SIZE] = '\0';
+  memcpy(record.parentOrderId, in + 48, WIRE_PRODUCT_ID_SIZE);
+  record.parentOrderId[WIRE_PRODUCT_ID_SIZE] = '\0';
+  memcpy(&record.price, in + 64, 8);
+  memcpy(&record.visibleQuantity, in + 72, 8);
+  memcpy(&record.hiddenQuantity, in + 80, 8);
+  record.side = in[88];
+  record.orderType = in[89];
+  record.isChildOrder = in[90];
+  return record;
+}
+
+size_t EncodeFeedLine(char *out, uint32_t sequence, int64_t timestamp, const char *line, size_t size)
+{
+  if (size > MAX_FEED_LINE) throw invalid_argument("feed line too long for the wire");
+  EncodeHeader(out, MESSAGE_HEADER_SIZE + size, FEED_LINE_MESSAGE, sequence, timestamp);
+  memcpy(out + MESSAGE_HEADER_SIZE, line, size);
+  return MESSAGE_HEADER_SIZE + size;
+}
+
+int64_t WireTimestamp()
+{
+  return chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+BatchWriter::BatchWriter(size_t _batch_size) :
+  fd(-1), buffer(_batch_size), used(0), bytes_written(0), batch_count(0)
+{
+}
+
+BatchWriter::~BatchWriter()
+{
+  if (fd >= 0)
+  {
+    try { Flush(); } catch (const exception&) {}
+  }
+  Close();
+}
+
+void BatchWriter::OpenFile(const string &path)
+{
+  Close();
+  fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) throw runtime_error("cannot open " + path + ": " + strerror(errno));
+}
+
+void BatchWriter::ConnectUnixSocket(const string &path)
+{
+  Close();
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) throw invalid_argument("socket path too long: " + path);
+  memcpy(address.sun_path, path.c_str(), path.size());
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) throw runtime_error(string("cannot create socket: ") + strerror(errno));
+  if (connect(fd, (sockaddr*)&address, sizeof(address)) < 0)
+  {
+    int error = errno;
+    Close();
+    throw runtime_error("cannot connect to " + path + ": " + strerror(error));
+  }
+}
+
+bool BatchWriter::IsOpen() const
+{
+  return fd >= 0;
+}
+
+char* BatchWriter::Reserve(size_t size)
+{
+  if (size > buffer.size()) buffer.resize(size);
+  if (used + size > buffer.size()) Flush();
+  return buffer.data() + used;
+}
+
+void BatchWriter::Commit(size_t size)
+{
+  used += size;
+  if (used == buffer.size()) Flush();
+}
+
+void BatchWriter::Flush()
+{
+  if (used == 0 || fd < 0) return;
+  const char *data = buffer.data();
+  size_t left = used;
+  while (left > 0)
+  {
+    ssize_t n = write(fd, data, left);
+    if (n < 0)
+    {
+      if (errno == EINTR) continue;
+      throw runtime_error(string("write failed: ") + strerror(errno));
+    }
+    data += n;
+    left -= n;
+  }
+  bytes_written += used;
+  ++batch_count;
+  used = 0;
+}
+
+size_t BatchWriter::GetBytesWritten() const
+{
+  return bytes_written;
+}
+
+size_t BatchWriter::GetBatchCount() const
+{
+  return batch_count;
+}
+
+void BatchWriter::Close()
+{
+  if (fd >= 0) close(fd);
+  fd = -1;
+}
+
+MessageReader::MessageReader(int _fd, size_t _buffer_size) :
+  fd(_fd), buffer(_buffer_size), begin(0), end(0)
+{
+}
+
+bool MessageReader::Next(const char *&message, MessageHeader &header)
+{
+  while (true)
+  {
+    if (end - begin >= MESSAGE_HEADER_SIZE)
+    {
+      header = DecodeHeader(buffer.data() + begin);
+      if (header.length < MESSAGE_HEADER_SIZE) throw runtime_error("corrupt message length");
+      if (end - begin >= header.length)
+      {
+        message = buffer.data() + begin;
+        begin += header.length;
+        return true;
+      }
+      if (header.length > buffer.size()) buffer.resize(header.length);
+    }
+
+    // move the partial message to the front and read more behind it
+    memmove(buffer.data(), buffer.data() + begin, end - begin);
+    end -= begin;
+    begin = 0;
+    ssize_t n = read(fd, buffer.data() + end, buffer.size() - end);
+    if (n < 0)
+    {
+      if (errno == EINTR) continue;
+      throw runtime_error(string("read failed: ") + strerror(errno));
+    }
+    if (n == 0)
+    {
+      if (end != 0) throw runtime_error("stream ended inside a message");
+      return false;
+    }
+    end += n;
+  }
+}
+
+#endif
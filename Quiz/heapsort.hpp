@@ -0,0 +1,292 @@
+/**
+ * heapsort.hpp
+ * In-place heapsort for vectors of doubles, on a binary heap and on a 4-ary heap
+ * (half the depth, and the four children of a node share a cache line), plus
+ * partial sorting and top-K selection built on the 4-ary heap.
+ * NaNs are sorted to the end and never selected.
+ */
+#ifndef HEAPSORT_HPP
+#define HEAPSORT_HPP
+
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <utility>
+#include <cstddef>
+using namespace std;
+
+//move the NaNs in [begin, end) to the end, returning where they start
+double* partition_nans(double* begin, double* end);
+
+//restore the max-heap heap[0..n) below node i
+void sift_down(double* heap, size_t n, size_t i);
+
+//arrange heap[0..n) into a max-heap
+void build_heap(double* heap, size_t n);
+
+//move the largest element of the max-heap heap[0..n) to heap[n - 1], leaving a heap of n - 1.
+//Floyd's bottom-up variant: walk the hole down along the larger children to a leaf, then
+//sift the displaced last element up from there, about one comparison per level instead of two
+void pop_heap_bottom_up(double* heap, size_t n);
+
+//heapsort [begin, end) of NaN-free values on a binary heap
+void heap_sort_range(double* begin, double* end);
+
+//index of the child of a 4-ary heap node, children first..first+3 below n, that is largest under less
+template<typename Less>
+size_t largest_child_4(const double* heap, size_t first, size_t n, Less less);
+
+//restore the 4-ary heap heap[0..n) below node i; less(a, b) says a belongs below b
+template<typename Less>
+void sift_down_4(double* heap, size_t n, size_t i, Less less);
+
+//arrange heap[0..n) into a 4-ary heap
+template<typename Less>
+void build_heap_4(double* heap, size_t n, Less less);
+
+//move the root of the 4-ary heap heap[0..n) to heap[n - 1], bottom-up like pop_heap_bottom_up
+template<typename Less>
+void pop_heap_4(double* heap, size_t n, Less less);
+
+//heapsort [begin, end) of NaN-free values on a 4-ary heap
+void heap_sort_4ary_range(double* begin, double* end);
+
+//heapsort v on a binary heap
+void heap_sort(vector<double>& v);
+
+//heapsort v on a 4-ary heap
+void heap_sort_4ary(vector<double>& v);
+
+//sort the k smallest elements of v into v[0..k), like std::partial_sort; the order of the
+//rest is unspecified. O(n log k)
+void partial_heap_sort(vector<double>& v, size_t k);
+
+//the k largest (or smallest) values of v, best first: the k best bids or offers of a book.
+//one pass over v keeping a k-element heap, so v is not copied or modified. O(n log k)
+vector<double> top_k(const vector<double>& v, size_t k, bool largest = true);
+
+
+double* partition_nans(double* begin, double* end){
+    //read-only scan up to the first NaN, which is usually the end
+    double* out = begin;
+    while (out != end && *out == *out){
+        out++;
+    }
+    for (double* cur = out; cur != end; cur++){
+        if (*cur == *cur){
+            std::swap(*out, *cur);
+            out++;
+        }
+    }
+    return out;
+}
+
+void sift_down(double* heap, size_t n, size_t i){
+    double value = heap[i];
+    while (true){
+        size_t child = 2 * i + 1;
+        if (child >= n){
+            break;
+        }
+        if (child + 1 < n && heap[child] < heap[child + 1]){
+            child++;
+        }
+        if (!(value < heap[child])){
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = value;
+}
+
+void build_heap(double* heap, size_t n){
+    for (size_t i = n / 2; i-- > 0;){
+        sift_down(heap, n, i);
+    }
+}
+
+void pop_heap_bottom_up(double* heap, size_t n){
+    double last = heap[n - 1];
+    heap[n - 1] = heap[0];
+    n--;
+    size_t hole = 0;
+    while (2 * hole + 1 < n){
+        size_t child = 2 * hole + 1;
+        if (child + 1 < n && heap[child] < heap[child + 1]){
+            child++;
+        }
+        heap[hole] = heap[child];
+        hole = child;
+    }
+    while (hole > 0){
+        size_t parent = (hole - 1) / 2;
+        if (!(heap[parent] < last)){
+            break;
+        }
+        heap[hole] = heap[parent];
+        hole = parent;
+    }
+    heap[hole] = last;
+}
+
+void heap_sort_range(double* begin, double* end){
+    size_t n = end - begin;
+    build_heap(begin, n);
+    for (size_t m = n; m > 1; m--){
+        pop_heap_bottom_up(begin, m);
+    }
+}
+
+template<typename Less>
+size_t largest_child_4(const double* heap, size_t first, size_t n, Less less){
+    if (first + 4 <= n){
+        //a tournament of selects instead of a chain of branches
+        size_t a = less(heap[first], heap[first + 1]) ? first + 1 : first;
+        size_t b = less(heap[first + 2], heap[first + 3]) ? first + 3 : first + 2;
+        return less(heap[a], heap[b]) ? b : a;
+    }
+    size_t best = first;
+    for (size_t c = first + 1; c < n; c++){
+        if (less(heap[best], heap[c])){
+            best = c;
+        }
+    }
+    return best;
+}
+
+template<typename Less>
+void sift_down_4(double* heap, size_t n, size_t i, Less less){
+    double value = heap[i];
+    while (4 * i + 1 < n){
+        size_t child = largest_child_4(heap, 4 * i + 1, n, less);
+        if (!less(value, heap[child])){
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = value;
+}
+
+template<typename Less>
+void build_heap_4(double* heap, size_t n, Less less){
+    if (n < 2){
+        return;
+    }
+    for (size_t i = (n - 2) / 4 + 1; i-- > 0;){
+        sift_down_4(heap, n, i, less);
+    }
+}
+
+template<typename Less>
+void pop_heap_4(double* heap, size_t n, Less less){
+    double last = heap[n - 1];
+    heap[n - 1] = heap[0];
+    n--;
+    size_t hole = 0;
+    while (4 * hole + 1 < n){
+        size_t child = largest_child_4(heap, 4 * hole + 1, n, less);
+        heap[hole] = heap[child];
+        hole = child;
+    }
+    while (hole > 0){
+        size_t parent = (hole - 1) / 4;
+        if (!less(heap[parent], last)){
+            break;
+        }
+        heap[hole] = heap[parent];
+        hole = parent;
+    }
+    heap[hole] = last;
+}
+
+void heap_sort_4ary_range(double* begin, double* end){
+    size_t n = end - begin;
+    build_heap_4(begin, n, less<double>());
+    for (size_t m = n; m > 1; m--){
+        pop_heap_4(begin, m, less<double>());
+    }
+}
+
+void heap_sort(vector<double>& v){
+    double* begin = v.data();
+    heap_sort_range(begin, partition_nans(begin, begin + v.size()));
+}
+
+void heap_sort_4ary(vector<double>& v){
+    double* begin = v.data();
+    heap_sort_4ary_range(begin, partition_nans(begin, begin + v.size()));
+}
+
+void partial_heap_sort(vector<double>& v, size_t k){
+    double* begin = v.data();
+    double* end = begin + v.size();
+    //gather the first k non-NaN values at the front; later NaNs never compare smaller
+    //than the root, so they stay out without a separate pass over v
+    size_t n = 0;
+    double* cur = begin;
+    for (; cur != end && n < k; cur++){
+        if (*cur == *cur){
+            std::swap(*cur, begin[n++]);
+        }
+    }
+    if (n == 0){
+        return;
+    }
+    //the k smallest so far, as a max-heap whose root is the one to evict next
+    build_heap_4(begin, n, less<double>());
+    for (; cur != end; cur++){
+        if (*cur < *begin){
+            std::swap(*cur, *begin);
+            sift_down_4(begin, n, 0, less<double>());
+        }
+    }
+    for (size_t m = n; m > 1; m--){
+        pop_heap_4(begin, m, less<double>());
+    }
+}
+
+vector<double> top_k(const vector<double>& v, size_t k, bool largest){
+    vector<double> heap;
+    heap.reserve(k);
+    size_t i = 0;
+    for (; i < v.size() && heap.size() < k; i++){
+        if (v[i] == v[i]){
+            heap.push_back(v[i]);
+        }
+    }
+    if (heap.empty()){
+        return heap;
+    }
+    size_t n = heap.size();
+    double* h = heap.data();
+    //the root is the worst of the best k: the smallest when keeping the largest.
+    //popping the heap then leaves the best at the front
+    if (largest){
+        build_heap_4(h, n, greater<double>());
+        for (; i < v.size(); i++){
+            if (v[i] > h[0]){
+                h[0] = v[i];
+                sift_down_4(h, n, 0, greater<double>());
+            }
+        }
+        for (size_t m = n; m > 1; m--){
+            pop_heap_4(h, m, greater<double>());
+        }
+    } else {
+        build_heap_4(h, n, less<double>());
+        for (; i < v.size(); i++){
+            if (v[i] < h[0]){
+                h[0] = v[i];
+                sift_down_4(h, n, 0, less<double>());
+            }
+        }
+        for (size_t m = n; m > 1; m--){
+            pop_heap_4(h, m, less<double>());
+        }
+    }
+    return heap;
+}
+
+#endif
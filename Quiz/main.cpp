@@ -1,5 +1,11 @@
 #include <iostream>
 #include <vector>
+#include <algorithm>
+#include <string>
+#include "quicksort.hpp"
+#include "heapsort.hpp"
+#include "parallelsort.hpp"
+#include "sortbench.hpp"
 using namespace std;
 
 //print the vector
@@ -9,68 +15,13 @@ void print(vector<double> &v){
     }
     cout << endl;
 }
-//swap the element in the vector
-void swap(double &a, double &b){
-    if(a > b){
-        auto temp = a;
-        a = b;
-        b = temp;
-    }
-}
-int pivot_idx(vector<double> &v, int left, int right){
-    //the first element of the vector
-    double pivot = v[left];
-    int count = 0;
-    //count the number of element < pivot
-    for (int i = left + 1; i <= right; i++){
-        if(v[i] <= pivot)
-            count++;
-    }
-
-    int idx = left + count;
-    swap(v[idx], v[left]);
-    //sort the vector
-    int i, j;
-    i = left;
-    j = right;
-    while (i < idx && j > idx){
-        while (v[i] <= pivot){
-            i++;
-        }
-        while (v[j] > pivot){
-            j--;
-        }
-        if (i < idx && j > idx) {
-            swap(v[i++], v[j--]);
-        }
-    }
-
-    return idx;
-}
 
-void quick_sort(vector<double> &v, int left, int right){
-    if (left >= right){
-        return;
+int main(int argc, char** argv) {
+    //MFE_Semester_1 --bench [max size]: check and time every sort instead of the demo
+    if (argc > 1 && string(argv[1]) == "--bench"){
+        size_t max_size = argc > 2 ? stoull(argv[2]) : 10000000;
+        return run_sort_bench(max_size) == 0 ? 0 : 1;
     }
-    int p = pivot_idx(v, left, right);
-
-    //sort the left part
-    quick_sort(v, left, p - 1);
-    //sort the right part
-    quick_sort(v, p + 1, right);
-
-}
-//Heap Sort
-void heap_sort(vector<double>& v){
-    make_heap(v.begin(), v.end());
-    for (int i = v.size() - 1; i > -1; i--){
-        swap(v[0], v[i]);
-        make_heap(v.begin(), v.begin() + i);
-    }
-}
-
-
-int main() {
     cout << "----Quicksort----" << endl;
     vector<double> v{2,7,5,9,4,6};
     cout<<"v: ";
@@ -85,6 +36,20 @@ int main() {
     heap_sort(v2);
     cout<<"v after heap sorting: ";
     print(v2);
+    cout << "----Parallel sort----" << endl;
+    vector<double> v3{2,7,5,9,4,6};
+    cout<<"v3: ";
+    print(v3);
+    parallel_sort(v3);
+    cout<<"v after parallel sorting: ";
+    print(v3);
+    cout << "----Radix sort----" << endl;
+    vector<double> v4{2,-7,5,-9,4,6};
+    cout<<"v4: ";
+    print(v4);
+    radix_sort(v4);
+    cout<<"v after radix sorting: ";
+    print(v4);
 
     return 0;
 }
@@ -0,0 +1,515 @@
+/**
+ * parallelsort.hpp
+ * Multi-threaded sorting for large vectors of doubles: a parallel sample sort whose
+ * buckets are sorted by pattern-defeating quicksort tasks on a work-stealing pool, and
+ * an LSD radix sort on the doubles' bits, mapped so that unsigned order is numeric order.
+ * NaNs are sorted to the end.
+ */
+#ifndef PARALLELSORT_HPP
+#define PARALLELSORT_HPP
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <random>
+#include <algorithm>
+#include <cstring>
+#include <cstddef>
+#include <cstdint>
+#include "quicksort.hpp"
+using namespace std;
+
+//vectors below this are sorted on the calling thread; spawning threads costs more
+const size_t PARALLEL_SORT_THRESHOLD = 1 << 17;
+//ranges below this are never split further between threads
+const size_t PARALLEL_SORT_GRAIN = 1 << 14;
+//samples drawn per bucket when choosing the splitters
+const size_t SAMPLE_SORT_OVERSAMPLING = 32;
+//most buckets a sample sort uses; bucket ids are stored in a byte
+const size_t SAMPLE_SORT_MAX_BUCKETS = 256;
+//bits sorted per radix sort pass, and the passes a 64-bit key needs
+const int RADIX_BITS = 8;
+const int RADIX_PASSES = 64 / RADIX_BITS;
+const size_t RADIX_BUCKETS = 1 << RADIX_BITS;
+//vectors below this are left to pdq_sort; the histograms cost more than they save
+const size_t RADIX_SORT_THRESHOLD = 1 << 10;
+
+//a pool of threads, each with its own deque of tasks. A thread runs the newest task of
+//its own deque and, when that is empty, steals the oldest task of another, so a task that
+//splits its work into subtasks keeps them local until some other thread runs dry.
+//the thread calling wait works as thread 0, so a pool of n threads starts n - 1 of them
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(unsigned threads);
+    ~WorkStealingPool();
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    //queue task; from a task, it goes on the running thread's own deque
+    void submit(function<void()> task);
+
+    //run tasks on the calling thread until every submitted task has finished
+    void wait();
+
+    //number of threads, counting the one that waits
+    unsigned size() const;
+
+private:
+    struct TaskQueue {
+        mutex lock;
+        deque<function<void()>> tasks;
+    };
+
+    vector<unique_ptr<TaskQueue>> queues;
+    vector<thread> workers;
+    //tasks sitting in a deque, and tasks submitted but not finished
+    atomic<size_t> queued;
+    atomic<size_t> pending;
+    atomic<bool> stopping;
+    mutex idle_lock;
+    condition_variable idle;
+
+    //the pool and deque of the running thread, if it belongs to a pool
+    static pair<WorkStealingPool*, unsigned>& current();
+
+    //the loop of the started threads
+    void work(unsigned self);
+
+    //run one task, from self's deque or stolen from another; false if there was none
+    bool run_one(unsigned self);
+};
+
+//sort v with up to threads threads (0 for one per core): sample sort into buckets by
+//splitters drawn from v, then sort the buckets, splitting oversized ones further
+void parallel_sort(vector<double>& v, unsigned threads = 0);
+
+//LSD radix sort of v with up to threads threads (0 for one per core), RADIX_BITS per pass
+//over the order-preserving bits of each double, skipping passes in which every key has the
+//same digit. O(n) with a scratch copy of v; -0.0 sorts before 0.0
+void radix_sort(vector<double>& v, unsigned threads = 0);
+
+//the bits of x as an unsigned key in the same order: negatives flipped whole, positives
+//with the sign bit set
+uint64_t radix_key(double x);
+
+//the double whose key is key
+double radix_value(uint64_t key);
+
+//read or write a key kept in the storage of a double
+uint64_t load_radix_key(const double* slot);
+void store_radix_key(double* slot, uint64_t key);
+
+//threads to sort n elements with: threads, or one per core for 0, but one below PARALLEL_SORT_THRESHOLD
+unsigned sort_threads(unsigned threads, size_t n);
+
+//pdq_sort [begin, end) of NaN-free values on the calling thread
+void sequential_sort(double* begin, double* end, bool leftmost = true);
+
+//run body(chunk, begin, end) over [0, n) cut into one chunk per pool thread, inline without a pool
+void run_chunks(WorkStealingPool* pool, size_t n, const function<void(unsigned, size_t, size_t)>& body);
+
+//sort [begin, end) and copy it to out, handing the larger side of a partition to the pool
+//while the range is over split_above; leftmost says no element before begin may be read
+void parallel_pdq_sort(WorkStealingPool& pool, double* begin, double* end, double* out,
+                       size_t split_above, bool leftmost);
+
+
+WorkStealingPool::WorkStealingPool(unsigned threads) : queued(0), pending(0), stopping(false){
+    if (threads == 0){
+        threads = 1;
+    }
+    for (unsigned i = 0; i < threads; i++){
+        queues.emplace_back(new TaskQueue());
+    }
+    for (unsigned i = 1; i < threads; i++){
+        workers.emplace_back(&WorkStealingPool::work, this, i);
+    }
+}
+
+WorkStealingPool::~WorkStealingPool(){
+    {
+        lock_guard<mutex> guard(idle_lock);
+        stopping = true;
+    }
+    idle.notify_all();
+    for (auto& worker : workers){
+        worker.join();
+    }
+}
+
+void WorkStealingPool::submit(function<void()> task){
+    pair<WorkStealingPool*, unsigned>& self = current();
+    unsigned index = self.first == this ? self.second : 0;
+    pending++;
+    {
+        lock_guard<mutex> guard(queues[index]->lock);
+        queues[index]->tasks.push_back(move(task));
+    }
+    queued++;
+    //taking the lock orders the count before any sleeper's check of it
+    {
+        lock_guard<mutex> guard(idle_lock);
+    }
+    idle.notify_one();
+}
+
+void WorkStealingPool::wait(){
+    pair<WorkStealingPool*, unsigned> saved = current();
+    current() = make_pair(this, 0u);
+    while (pending > 0){
+        if (!run_one(0)){
+            this_thread::yield();
+        }
+    }
+    current() = saved;
+}
+
+unsigned WorkStealingPool::size() const{
+    return queues.size();
+}
+
+pair<WorkStealingPool*, unsigned>& WorkStealingPool::current(){
+    static thread_local pair<WorkStealingPool*, unsigned> self(nullptr, 0);
+    return self;
+}
+
+void WorkStealingPool::work(unsigned self){
+    current() = make_pair(this, self);
+    while (true){
+        if (run_one(self)){
+            continue;
+        }
+        unique_lock<mutex> guard(idle_lock);
+        idle.wait(guard, [this]{ return stopping || queued > 0; });
+        if (stopping){
+            return;
+        }
+    }
+}
+
+bool WorkStealingPool::run_one(unsigned self){
+    function<void()> task;
+    size_t n = queues.size();
+    for (size_t i = 0; i < n && !task; i++){
+        TaskQueue& queue = *queues[(self + i) % n];
+        lock_guard<mutex> guard(queue.lock);
+        if (queue.tasks.empty()){
+            continue;
+        }
+        //newest of our own, oldest of anyone else's: stolen tasks are the biggest
+        if (i == 0){
+            task = move(queue.tasks.back());
+            queue.tasks.pop_back();
+        } else {
+            task = move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+    }
+    if (!task){
+        return false;
+    }
+    queued--;
+    task();
+    pending--;
+    return true;
+}
+
+unsigned sort_threads(unsigned threads, size_t n){
+    if (n < PARALLEL_SORT_THRESHOLD){
+        return 1;
+    }
+    //looked up only for big vectors: it reads /sys on Linux
+    return threads == 0 ? max(1u, thread::hardware_concurrency()) : threads;
+}
+
+void sequential_sort(double* begin, double* end, bool leftmost){
+    if (end - begin < 2){
+        return;
+    }
+    //log2 of the size bounds the bad partitions before heapsort takes over
+    int bad_allowed = 1;
+    for (ptrdiff_t size = end - begin; size > 1; size >>= 1){
+        bad_allowed++;
+    }
+    pdq_sort(begin, end, bad_allowed, leftmost);
+}
+
+void run_chunks(WorkStealingPool* pool, size_t n, const function<void(unsigned, size_t, size_t)>& body){
+    if (pool == nullptr){
+        body(0, 0, n);
+        return;
+    }
+    unsigned chunks = pool->size();
+    for (unsigned c = 0; c < chunks; c++){
+        size_t begin = n * c / chunks;
+        size_t end = n * (c + 1) / chunks;
+        pool->submit([&body, c, begin, end]{ body(c, begin, end); });
+    }
+    pool->wait();
+}
+
+void parallel_pdq_sort(WorkStealingPool& pool, double* begin, double* end, double* out,
+                       size_t split_above, bool leftmost){
+    while ((size_t)(end - begin) > split_above){
+        ptrdiff_t size = end - begin;
+        ptrdiff_t half = size / 2;
+        sort3(begin, begin + half, end - 1);
+        sort3(begin + 1, begin + (half - 1), end - 2);
+        sort3(begin + 2, begin + (half + 1), end - 3);
+        sort3(begin + (half - 1), begin + half, begin + (half + 1));
+        std::swap(*begin, *(begin + half));
+
+        pair<double*, bool> partition = partition_right(begin, end);
+        double* pivot_pos = partition.first;
+        ptrdiff_t l_size = pivot_pos - begin;
+        ptrdiff_t r_size = end - (pivot_pos + 1);
+        if (l_size < size / 8 || r_size < size / 8){
+            //a bad pivot, probably many equal keys: pdq_sort handles those best on its own
+            break;
+        }
+        out[l_size] = *pivot_pos;
+        //the pivot is never written again, so the right side may read it as its guard
+        double* r_begin = pivot_pos + 1;
+        double* r_out = out + (l_size + 1);
+        pool.submit([&pool, r_begin, end, r_out, split_above]{
+            parallel_pdq_sort(pool, r_begin, end, r_out, split_above, false);
+        });
+        end = pivot_pos;
+    }
+    sequential_sort(begin, end, leftmost);
+    memcpy(out, begin, (end - begin) * sizeof(double));
+}
+
+void parallel_sort(vector<double>& v, unsigned threads){
+    double* data = v.data();
+    size_t n = partition_nans(data, data + v.size()) - data;
+    threads = sort_threads(threads, n);
+    if (threads == 1){
+        sequential_sort(data, data + n);
+        return;
+    }
+    //bucketing would throw away the order pdq_sort finishes in one pass
+    if (is_sorted(data, data + n)){
+        return;
+    }
+
+    //a few buckets per thread, a power of two so a bucket id is a walk down a splitter tree
+    size_t buckets = 2;
+    while (buckets < 4 * threads && buckets < SAMPLE_SORT_MAX_BUCKETS){
+        buckets *= 2;
+    }
+    int levels = 0;
+    while ((size_t)1 << levels < buckets){
+        levels++;
+    }
+
+    //splitters from an oversorted sample, laid out breadth-first (node j's children at 2j, 2j + 1)
+    mt19937_64 random(n);
+    vector<double> sample(buckets * SAMPLE_SORT_OVERSAMPLING);
+    for (auto& s : sample){
+        s = data[random() % n];
+    }
+    sort(sample.begin(), sample.end());
+    vector<double> tree(buckets);
+    function<void(size_t, size_t, size_t)> place = [&](size_t node, size_t lo, size_t hi){
+        if (node >= buckets){
+            return;
+        }
+        size_t mid = (lo + hi) / 2;
+        tree[node] = sample[mid * SAMPLE_SORT_OVERSAMPLING - 1];
+        place(2 * node, lo, mid);
+        place(2 * node + 1, mid, hi);
+    };
+    place(1, 0, buckets);
+
+    WorkStealingPool pool(threads);
+    unique_ptr<unsigned char[]> ids(new unsigned char[n]);
+    unique_ptr<double[]> scratch(new double[n]);
+    vector<vector<size_t>> counts(threads, vector<size_t>(buckets, 0));
+
+    //classify: keys equal to a splitter go left, so bucket b holds (splitter b - 1, splitter b]
+    run_chunks(&pool, n, [&](unsigned c, size_t begin, size_t end){
+        size_t* count = counts[c].data();
+        const double* splitters = tree.data();
+        unsigned char* id = ids.get();
+        for (size_t i = begin; i < end; i++){
+            double x = data[i];
+            size_t node = 1;
+            for (int l = 0; l < levels; l++){
+                node = 2 * node + (splitters[node] < x);
+            }
+            size_t bucket = node - buckets;
+            id[i] = bucket;
+            count[bucket]++;
+        }
+    });
+
+    //each chunk scatters to its own slice of each bucket, after the earlier chunks' slices
+    vector<size_t> bucket_begin(buckets + 1, 0);
+    size_t offset = 0;
+    for (size_t b = 0; b < buckets; b++){
+        bucket_begin[b] = offset;
+        for (unsigned c = 0; c < threads; c++){
+            size_t count = counts[c][b];
+            counts[c][b] = offset;
+            offset += count;
+        }
+    }
+    bucket_begin[buckets] = n;
+    run_chunks(&pool, n, [&](unsigned c, size_t begin, size_t end){
+        size_t* next = counts[c].data();
+        const unsigned char* id = ids.get();
+        double* out = scratch.get();
+        for (size_t i = begin; i < end; i++){
+            out[next[id[i]]++] = data[i];
+        }
+    });
+
+    //sort each bucket in the scratch buffer and copy it back; a bucket much larger than
+    //its share, from duplicates or an unlucky sample, is split between threads as it sorts
+    size_t split_above = max(PARALLEL_SORT_GRAIN, 2 * n / buckets);
+    for (size_t b = 0; b < buckets; b++){
+        double* begin = scratch.get() + bucket_begin[b];
+        double* end = scratch.get() + bucket_begin[b + 1];
+        double* out = data + bucket_begin[b];
+        if (begin != end){
+            pool.submit([&pool, begin, end, out, split_above]{
+                parallel_pdq_sort(pool, begin, end, out, split_above, true);
+            });
+        }
+    }
+    pool.wait();
+}
+
+uint64_t radix_key(double x){
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return bits >> 63 ? ~bits : bits | ((uint64_t)1 << 63);
+}
+
+double radix_value(uint64_t key){
+    uint64_t bits = key >> 63 ? key & ~((uint64_t)1 << 63) : ~key;
+    double x;
+    memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+uint64_t load_radix_key(const double* slot){
+    uint64_t key;
+    memcpy(&key, slot, sizeof(key));
+    return key;
+}
+
+void store_radix_key(double* slot, uint64_t key){
+    memcpy(slot, &key, sizeof(key));
+}
+
+void radix_sort(vector<double>& v, unsigned threads){
+    double* data = v.data();
+    size_t n = partition_nans(data, data + v.size()) - data;
+    if (n < RADIX_SORT_THRESHOLD){
+        sequential_sort(data, data + n);
+        return;
+    }
+    threads = sort_threads(threads, n);
+    unique_ptr<WorkStealingPool> pool;
+    if (threads > 1){
+        pool.reset(new WorkStealingPool(threads));
+    }
+    unsigned chunks = pool ? threads : 1;
+
+    //keys live in the doubles' own storage and a scratch copy, as bits
+    unique_ptr<double[]> scratch(new double[n]);
+
+    //turn values into keys, counting every pass's digits at once
+    vector<vector<size_t>> totals(chunks, vector<size_t>(RADIX_PASSES * RADIX_BUCKETS, 0));
+    run_chunks(pool.get(), n, [&](unsigned c, size_t begin, size_t end){
+        size_t* total = totals[c].data();
+        for (size_t i = begin; i < end; i++){
+            uint64_t key = radix_key(data[i]);
+            store_radix_key(data + i, key);
+            for (int p = 0; p < RADIX_PASSES; p++){
+                total[p * RADIX_BUCKETS + ((key >> (p * RADIX_BITS)) & (RADIX_BUCKETS - 1))]++;
+            }
+        }
+    });
+
+    double* from = data;
+    double* to = scratch.get();
+    bool moved = false;
+    vector<vector<size_t>> counts(chunks, vector<size_t>(RADIX_BUCKETS));
+    for (int p = 0; p < RADIX_PASSES; p++){
+        int shift = p * RADIX_BITS;
+        //a pass where every key has the same digit moves nothing
+        bool trivial = false;
+        for (size_t b = 0; b < RADIX_BUCKETS; b++){
+            size_t total = 0;
+            for (unsigned c = 0; c < chunks; c++){
+                total += totals[c][p * RADIX_BUCKETS + b];
+            }
+            if (total == n){
+                trivial = true;
+            }
+        }
+        if (trivial){
+            continue;
+        }
+
+        //the chunks' histograms hold until a pass moves keys between chunks
+        if (!moved || chunks == 1){
+            for (unsigned c = 0; c < chunks; c++){
+                copy(totals[c].begin() + p * RADIX_BUCKETS, totals[c].begin() + (p + 1) * RADIX_BUCKETS,
+                     counts[c].begin());
+            }
+        } else {
+            run_chunks(pool.get(), n, [&](unsigned c, size_t begin, size_t end){
+                size_t* count = counts[c].data();
+                const double* in = from;
+                int digit = shift;
+                fill(count, count + RADIX_BUCKETS, 0);
+                for (size_t i = begin; i < end; i++){
+                    count[(load_radix_key(in + i) >> digit) & (RADIX_BUCKETS - 1)]++;
+                }
+            });
+        }
+
+        //bucket-major offsets keep the pass stable across chunks
+        size_t offset = 0;
+        for (size_t b = 0; b < RADIX_BUCKETS; b++){
+            for (unsigned c = 0; c < chunks; c++){
+                size_t count = counts[c][b];
+                counts[c][b] = offset;
+                offset += count;
+            }
+        }
+        run_chunks(pool.get(), n, [&](unsigned c, size_t begin, size_t end){
+            //locals, not captures: the stores below may alias anything the lambda refers to
+            size_t* next = counts[c].data();
+            const double* in = from;
+            double* out = to;
+            int digit = shift;
+            for (size_t i = begin; i < end; i++){
+                uint64_t key = load_radix_key(in + i);
+                store_radix_key(out + next[(key >> digit) & (RADIX_BUCKETS - 1)]++, key);
+            }
+        });
+        std::swap(from, to);
+        moved = true;
+    }
+
+    //back to values, in place or out of the scratch buffer after an odd number of passes
+    run_chunks(pool.get(), n, [&](unsigned, size_t begin, size_t end){
+        const double* in = from;
+        for (size_t i = begin; i < end; i++){
+            data[i] = radix_value(load_radix_key(in + i));
+        }
+    });
+}
+
+#endif
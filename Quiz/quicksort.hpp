@@ -0,0 +1,346 @@
+/**
+ * quicksort.hpp
+ * Pattern-defeating quicksort for vectors of doubles: ninther pivots, block-based
+ * branchless partitioning, insertion sort for small ranges, and a heapsort fallback
+ * after too many unbalanced partitions, so the worst case stays O(n log n).
+ * NaNs are sorted to the end.
+ */
+#ifndef QUICKSORT_HPP
+#define QUICKSORT_HPP
+
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <cstddef>
+#include <cstdint>
+#include "heapsort.hpp"
+using namespace std;
+
+//ranges below this are insertion sorted
+const ptrdiff_t INSERTION_SORT_THRESHOLD = 24;
+//ranges above this pick the pivot as the median of three medians of three
+const ptrdiff_t NINTHER_THRESHOLD = 128;
+//element moves a partial insertion sort may make before giving up
+const ptrdiff_t PARTIAL_INSERTION_SORT_LIMIT = 8;
+//elements classified per block by the branchless partition; offsets fit in a byte
+const ptrdiff_t PARTITION_BLOCK_SIZE = 64;
+
+//insertion sort [begin, end)
+void insertion_sort(double* begin, double* end);
+
+//insertion sort [begin, end) when *(begin - 1) is no greater than any element in it
+void unguarded_insertion_sort(double* begin, double* end);
+
+//insertion sort [begin, end), giving up after PARTIAL_INSERTION_SORT_LIMIT moves;
+//true if the range ended up sorted
+bool partial_insertion_sort(double* begin, double* end);
+
+//order *a <= *b without a branch
+void sort2(double* a, double* b);
+
+//order *a <= *b <= *c
+void sort3(double* a, double* b, double* c);
+
+//partition [begin, end) around the pivot *begin: smaller elements left, the rest right.
+//returns the pivot's final position, and whether the range was already partitioned
+pair<double*, bool> partition_right(double* begin, double* end);
+
+//partition [begin, end) around the pivot *begin with equal elements left; used when the
+//pivot equals the element before the range, so the left part is all equal and done
+double* partition_left(double* begin, double* end);
+
+//sort [begin, end) of NaN-free values; leftmost says there is no element before begin
+void pdq_sort(double* begin, double* end, int bad_allowed, bool leftmost);
+
+//sort v[left..right], both ends inclusive
+void quick_sort(vector<double> &v, int left, int right);
+
+//sort v
+void quick_sort(vector<double> &v);
+
+
+void insertion_sort(double* begin, double* end){
+    if (begin == end){
+        return;
+    }
+    for (double* cur = begin + 1; cur != end; cur++){
+        double value = *cur;
+        double* sift = cur;
+        while (sift != begin && value < *(sift - 1)){
+            *sift = *(sift - 1);
+            sift--;
+        }
+        *sift = value;
+    }
+}
+
+void unguarded_insertion_sort(double* begin, double* end){
+    for (double* cur = begin + 1; cur < end; cur++){
+        double value = *cur;
+        double* sift = cur;
+        while (value < *(sift - 1)){
+            *sift = *(sift - 1);
+            sift--;
+        }
+        *sift = value;
+    }
+}
+
+bool partial_insertion_sort(double* begin, double* end){
+    if (begin == end){
+        return true;
+    }
+    ptrdiff_t moves = 0;
+    for (double* cur = begin + 1; cur != end; cur++){
+        if (*cur < *(cur - 1)){
+            double value = *cur;
+            double* sift = cur;
+            do {
+                *sift = *(sift - 1);
+                sift--;
+            } while (sift != begin && value < *(sift - 1));
+            *sift = value;
+            moves += cur - sift;
+            if (moves > PARTIAL_INSERTION_SORT_LIMIT){
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void sort2(double* a, double* b){
+    double x = *a, y = *b;
+    *a = y < x ? y : x;
+    *b = y < x ? x : y;
+}
+
+void sort3(double* a, double* b, double* c){
+    sort2(a, b);
+    sort2(b, c);
+    sort2(a, b);
+}
+
+pair<double*, bool> partition_right(double* begin, double* end){
+    double pivot = *begin;
+    double* first = begin;
+    double* last = end;
+
+    //the median of three guarantees an element >= pivot to the right
+    while (*++first < pivot);
+    //and only the pivot itself guards the search from the right if nothing was smaller
+    if (first - 1 == begin){
+        while (first < last && !(*--last < pivot));
+    } else {
+        while (!(*--last < pivot));
+    }
+
+    bool already_partitioned = first >= last;
+    if (!already_partitioned){
+        std::swap(*first, *last);
+        first++;
+
+        //BlockQuicksort: record the offsets of misplaced elements in a block from each
+        //side with branch-free stores, then swap them pairwise
+        unsigned char offsets_l[PARTITION_BLOCK_SIZE];
+        unsigned char offsets_r[PARTITION_BLOCK_SIZE];
+        double* offsets_l_base = first;
+        double* offsets_r_base = last;
+        size_t num_l = 0, num_r = 0, start_l = 0, start_r = 0;
+
+        while (first < last){
+            //split what is left between the blocks that need refilling
+            size_t num_unknown = last - first;
+            size_t left_split = num_l == 0 ? (num_r == 0 ? num_unknown / 2 : num_unknown) : 0;
+            size_t right_split = num_r == 0 ? (num_unknown - left_split) : 0;
+
+            size_t left_count = min<size_t>(left_split, PARTITION_BLOCK_SIZE);
+            for (size_t i = 0; i < left_count; i++){
+                offsets_l[num_l] = i;
+                num_l += !(*first < pivot);
+                first++;
+            }
+            size_t right_count = min<size_t>(right_split, PARTITION_BLOCK_SIZE);
+            for (size_t i = 0; i < right_count;){
+                offsets_r[num_r] = ++i;
+                num_r += *--last < pivot;
+            }
+
+            size_t num = min(num_l, num_r);
+            if (num_l == num_r){
+                //plain swaps keep descending input O(n)
+                for (size_t i = 0; i < num; i++){
+                    std::swap(*(offsets_l_base + offsets_l[start_l + i]), *(offsets_r_base - offsets_r[start_r + i]));
+                }
+            } else if (num > 0){
+                //a cyclic permutation moves each element once instead of three times
+                double* l = offsets_l_base + offsets_l[start_l];
+                double* r = offsets_r_base - offsets_r[start_r];
+                double value = *l;
+                *l = *r;
+                for (size_t i = 1; i < num; i++){
+                    l = offsets_l_base + offsets_l[start_l + i];
+                    *r = *l;
+                    r = offsets_r_base - offsets_r[start_r + i];
+                    *l = *r;
+                }
+                *r = value;
+            }
+            num_l -= num;
+            num_r -= num;
+            start_l += num;
+            start_r += num;
+            if (num_l == 0){
+                start_l = 0;
+                offsets_l_base = first;
+            }
+            if (num_r == 0){
+                start_r = 0;
+                offsets_r_base = last;
+            }
+        }
+
+        //one side may still hold misplaced elements; swap them to the boundary
+        if (num_l){
+            while (num_l--){
+                std::swap(*(offsets_l_base + offsets_l[start_l + num_l]), *--last);
+            }
+            first = last;
+        }
+        if (num_r){
+            while (num_r--){
+                std::swap(*(offsets_r_base - offsets_r[start_r + num_r]), *first);
+                first++;
+            }
+            last = first;
+        }
+    }
+
+    double* pivot_pos = first - 1;
+    *begin = *pivot_pos;
+    *pivot_pos = pivot;
+    return make_pair(pivot_pos, already_partitioned);
+}
+
+double* partition_left(double* begin, double* end){
+    double pivot = *begin;
+    double* first = begin;
+    double* last = end;
+
+    while (pivot < *--last);
+    if (last + 1 == end){
+        while (first < last && !(pivot < *++first));
+    } else {
+        while (!(pivot < *++first));
+    }
+    while (first < last){
+        std::swap(*first, *last);
+        while (pivot < *--last);
+        while (!(pivot < *++first));
+    }
+
+    *begin = *last;
+    *last = pivot;
+    return last;
+}
+
+void pdq_sort(double* begin, double* end, int bad_allowed, bool leftmost){
+    //recurse into the smaller side and loop on the larger, so the stack stays O(log n)
+    while (true){
+        ptrdiff_t size = end - begin;
+        if (size < INSERTION_SORT_THRESHOLD){
+            if (leftmost){
+                insertion_sort(begin, end);
+            } else {
+                unguarded_insertion_sort(begin, end);
+            }
+            return;
+        }
+
+        //median of three, or Tukey's ninther for larger ranges, moved to *begin
+        ptrdiff_t half = size / 2;
+        if (size > NINTHER_THRESHOLD){
+            sort3(begin, begin + half, end - 1);
+            sort3(begin + 1, begin + (half - 1), end - 2);
+            sort3(begin + 2, begin + (half + 1), end - 3);
+            sort3(begin + (half - 1), begin + half, begin + (half + 1));
+            std::swap(*begin, *(begin + half));
+        } else {
+            sort3(begin + half, begin, end - 1);
+        }
+
+        //nothing in the range is smaller than the element before it; if the pivot equals
+        //that element, everything equal to it is already in place once moved left
+        if (!leftmost && !(*(begin - 1) < *begin)){
+            begin = partition_left(begin, end) + 1;
+            continue;
+        }
+
+        pair<double*, bool> partition = partition_right(begin, end);
+        double* pivot_pos = partition.first;
+        ptrdiff_t l_size = pivot_pos - begin;
+        ptrdiff_t r_size = end - (pivot_pos + 1);
+
+        if (l_size < size / 8 || r_size < size / 8){
+            //too many bad pivots: the input defeats the median, finish with heapsort
+            if (--bad_allowed == 0){
+                heap_sort_range(begin, end);
+                return;
+            }
+            //break up the pattern that produced the bad pivot
+            if (l_size >= INSERTION_SORT_THRESHOLD){
+                std::swap(*begin, *(begin + l_size / 4));
+                std::swap(*(pivot_pos - 1), *(pivot_pos - l_size / 4));
+                if (l_size > NINTHER_THRESHOLD){
+                    std::swap(*(begin + 1), *(begin + (l_size / 4 + 1)));
+                    std::swap(*(begin + 2), *(begin + (l_size / 4 + 2)));
+                    std::swap(*(pivot_pos - 2), *(pivot_pos - (l_size / 4 + 1)));
+                    std::swap(*(pivot_pos - 3), *(pivot_pos - (l_size / 4 + 2)));
+                }
+            }
+            if (r_size >= INSERTION_SORT_THRESHOLD){
+                std::swap(*(pivot_pos + 1), *(pivot_pos + (1 + r_size / 4)));
+                std::swap(*(end - 1), *(end - r_size / 4));
+                if (r_size > NINTHER_THRESHOLD){
+                    std::swap(*(pivot_pos + 2), *(pivot_pos + (2 + r_size / 4)));
+                    std::swap(*(pivot_pos + 3), *(pivot_pos + (3 + r_size / 4)));
+                    std::swap(*(end - 2), *(end - (1 + r_size / 4)));
+                    std::swap(*(end - 3), *(end - (2 + r_size / 4)));
+                }
+            }
+        } else if (partition.second && partial_insertion_sort(begin, pivot_pos)
+                   && partial_insertion_sort(pivot_pos + 1, end)){
+            //a balanced partition that moved nothing: the input was probably sorted
+            return;
+        }
+
+        if (l_size < r_size){
+            pdq_sort(begin, pivot_pos, bad_allowed, leftmost);
+            begin = pivot_pos + 1;
+            leftmost = false;
+        } else {
+            pdq_sort(pivot_pos + 1, end, bad_allowed, false);
+            end = pivot_pos;
+        }
+    }
+}
+
+void quick_sort(vector<double> &v, int left, int right){
+    if (left >= right){
+        return;
+    }
+    double* begin = v.data() + left;
+    double* end = partition_nans(begin, v.data() + right + 1);
+    //log2 of the size bounds the bad partitions before heapsort takes over
+    int bad_allowed = 1;
+    for (ptrdiff_t size = end - begin; size > 1; size >>= 1){
+        bad_allowed++;
+    }
+    pdq_sort(begin, end, bad_allowed, true);
+}
+
+void quick_sort(vector<double> &v){
+    quick_sort(v, 0, (int)v.size() - 1);
+}
+
+#endif
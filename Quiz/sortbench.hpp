@@ -0,0 +1,387 @@
+/**
+ * sortbench.hpp
+ * Benchmark and property checks for the sorts: adversarial inputs at sizes from 10 up,
+ * every sort checked for sorted output that is a permutation of its input, timed in
+ * nanoseconds per element; then the k smallest or largest picked out by partial_heap_sort, top_k
+ * and the standard library for several k, each checked against std::partial_sort; then the
+ * parallel sorts on 1 to 32 threads, to show how they scale.
+ */
+#ifndef SORTBENCH_HPP
+#define SORTBENCH_HPP
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <functional>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include "quicksort.hpp"
+#include "heapsort.hpp"
+#include "parallelsort.hpp"
+using namespace std;
+
+//elements sorted per timed run at least; small sizes repeat on copies to reach it
+const size_t BENCH_MIN_ELEMENTS = 1000000;
+//most threads the thread sweep runs the parallel sorts on, doubling from 1
+const unsigned BENCH_MAX_THREADS = 32;
+
+//a named way of sorting a vector
+struct SortAlgorithm {
+    string name;
+    function<void(vector<double>&)> sort;
+};
+
+//a named way of picking the k best values out of a vector, which it may reorder but must
+//leave a permutation of itself; select(v, k) returns them best first
+struct PartialSortAlgorithm {
+    string name;
+    bool largest;
+    function<vector<double>(vector<double>&, size_t)> select;
+};
+
+//a named input shape: fill(v, seed) fills v with it
+struct SortDistribution {
+    string name;
+    function<void(vector<double>&, uint64_t)> fill;
+};
+
+//an order-independent fingerprint of a multiset of doubles, bit patterns and all
+struct Fingerprint {
+    uint64_t sum;
+    uint64_t xor_all;
+    size_t nans;
+    bool operator==(const Fingerprint& other) const;
+};
+
+//the sorts under test: quick_sort, heap_sort, std::sort, and the others in the Quiz
+vector<SortAlgorithm> bench_algorithms();
+
+//partial_heap_sort, top_k both ways, std::partial_sort and std::nth_element
+vector<PartialSortAlgorithm> bench_partial_algorithms();
+
+//sorted, reverse, organ pipe, many duplicates, NaNs and random
+vector<SortDistribution> bench_distributions();
+
+//fingerprint the values in v
+Fingerprint fingerprint(const vector<double>& v);
+
+//true if v is non-decreasing, with any NaNs only at the end
+bool is_sorted_with_nans(const vector<double>& v);
+
+//sort copies of input with algorithm until BENCH_MIN_ELEMENTS are sorted, checking each;
+//returns ns per element, or a negative number if a copy came out wrong
+double bench_one(const SortAlgorithm& algorithm, const vector<double>& input);
+
+//pick the k best of copies of input with algorithm until BENCH_MIN_ELEMENTS are scanned,
+//checking each against std::partial_sort; returns ns per element, or a negative number if a
+//copy came out wrong
+double bench_partial(const PartialSortAlgorithm& algorithm, const vector<double>& input, size_t k);
+
+//run every partial algorithm on every distribution at sizes 10, 100, ... up to max_size for
+//k of 1, 10, 100 and 1000, printing a row per run; returns the number of failed checks
+int run_partial_bench(size_t max_size);
+
+//run parallel_sort and radix_sort on 1, 2, 4, ... BENCH_MAX_THREADS threads over random and
+//duplicate inputs of n elements, printing ns per element and the speedup over one thread;
+//returns the number of failed checks
+int run_thread_sweep(size_t n);
+
+//run every algorithm on every distribution at sizes 10, 100, ... up to max_size, printing
+//a row per run, then the partial sorts and the thread sweep at max_size; returns the number of failed checks
+int run_sort_bench(size_t max_size);
+
+
+bool Fingerprint::operator==(const Fingerprint& other) const{
+    return sum == other.sum && xor_all == other.xor_all && nans == other.nans;
+}
+
+vector<SortAlgorithm> bench_algorithms(){
+    return {
+        {"quick_sort", [](vector<double>& v){ quick_sort(v); }},
+        {"heap_sort", [](vector<double>& v){ heap_sort(v); }},
+        {"heap_sort_4ary", [](vector<double>& v){ heap_sort_4ary(v); }},
+        {"std::sort_heap", [](vector<double>& v){
+            double* end = partition_nans(v.data(), v.data() + v.size());
+            make_heap(v.data(), end);
+            sort_heap(v.data(), end);
+        }},
+        {"parallel_sort", [](vector<double>& v){ parallel_sort(v); }},
+        {"radix_sort", [](vector<double>& v){ radix_sort(v); }},
+        //std::sort needs the NaNs out of the way, since they compare false both ways
+        {"std::sort", [](vector<double>& v){ sort(v.data(), partition_nans(v.data(), v.data() + v.size())); }},
+    };
+}
+
+vector<PartialSortAlgorithm> bench_partial_algorithms(){
+    return {
+        {"partial_heap", false, [](vector<double>& v, size_t k){
+            partial_heap_sort(v, k);
+            size_t n = 0;
+            while (n < min(k, v.size()) && v[n] == v[n]){
+                n++;
+            }
+            return vector<double>(v.begin(), v.begin() + n);
+        }},
+        {"top_k", false, [](vector<double>& v, size_t k){ return top_k(v, k, false); }},
+        {"top_k largest", true, [](vector<double>& v, size_t k){ return top_k(v, k, true); }},
+        {"std::partial", false, [](vector<double>& v, size_t k){
+            double* end = partition_nans(v.data(), v.data() + v.size());
+            double* middle = v.data() + min<size_t>(k, end - v.data());
+            partial_sort(v.data(), middle, end);
+            return vector<double>(v.data(), middle);
+        }},
+        {"std::nth", false, [](vector<double>& v, size_t k){
+            double* end = partition_nans(v.data(), v.data() + v.size());
+            double* middle = v.data() + min<size_t>(k, end - v.data());
+            nth_element(v.data(), middle, end);
+            sort(v.data(), middle);
+            return vector<double>(v.data(), middle);
+        }},
+    };
+}
+
+vector<SortDistribution> bench_distributions(){
+    return {
+        {"sorted", [](vector<double>& v, uint64_t){
+            for (size_t i = 0; i < v.size(); i++){
+                v[i] = i;
+            }
+        }},
+        {"reverse", [](vector<double>& v, uint64_t){
+            for (size_t i = 0; i < v.size(); i++){
+                v[i] = v.size() - i;
+            }
+        }},
+        {"organ_pipe", [](vector<double>& v, uint64_t){
+            size_t half = v.size() / 2;
+            for (size_t i = 0; i < v.size(); i++){
+                v[i] = i < half ? i : v.size() - i;
+            }
+        }},
+        {"duplicates", [](vector<double>& v, uint64_t seed){
+            mt19937_64 random(seed);
+            for (auto& x : v){
+                x = random() % 16;
+            }
+        }},
+        {"nans", [](vector<double>& v, uint64_t seed){
+            mt19937_64 random(seed);
+            uniform_real_distribution<double> price(90, 110);
+            for (auto& x : v){
+                x = random() % 10 == 0 ? NAN : price(random);
+            }
+        }},
+        {"random", [](vector<double>& v, uint64_t seed){
+            mt19937_64 random(seed);
+            uniform_real_distribution<double> price(90, 110);
+            for (auto& x : v){
+                x = price(random);
+            }
+        }},
+    };
+}
+
+Fingerprint fingerprint(const vector<double>& v){
+    Fingerprint result = {0, 0, 0};
+    for (double x : v){
+        uint64_t bits;
+        memcpy(&bits, &x, sizeof(bits));
+        //splitmix64's finalizer, so that changed bits do not cancel out in the sum
+        bits += 0x9e3779b97f4a7c15ULL;
+        bits = (bits ^ (bits >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        bits = (bits ^ (bits >> 27)) * 0x94d049bb133111ebULL;
+        bits ^= bits >> 31;
+        result.sum += bits;
+        result.xor_all ^= bits;
+        result.nans += x != x;
+    }
+    return result;
+}
+
+bool is_sorted_with_nans(const vector<double>& v){
+    size_t nan_start = 0;
+    while (nan_start < v.size() && v[nan_start] == v[nan_start]){
+        nan_start++;
+    }
+    for (size_t i = 1; i < nan_start; i++){
+        if (v[i] < v[i - 1]){
+            return false;
+        }
+    }
+    for (size_t i = nan_start; i < v.size(); i++){
+        if (v[i] == v[i]){
+            return false;
+        }
+    }
+    return true;
+}
+
+double bench_one(const SortAlgorithm& algorithm, const vector<double>& input){
+    size_t n = max<size_t>(input.size(), 1);
+    size_t copies = max<size_t>(1, BENCH_MIN_ELEMENTS / n);
+    Fingerprint expected = fingerprint(input);
+    //copies are made up front so that only the sorting is timed
+    vector<vector<double>> runs(copies, input);
+    auto start = chrono::steady_clock::now();
+    for (auto& run : runs){
+        algorithm.sort(run);
+    }
+    auto stop = chrono::steady_clock::now();
+    for (auto& run : runs){
+        if (!is_sorted_with_nans(run) || !(fingerprint(run) == expected)){
+            return -1;
+        }
+    }
+    return chrono::duration<double, nano>(stop - start).count() / (copies * n);
+}
+
+double bench_partial(const PartialSortAlgorithm& algorithm, const vector<double>& input, size_t k){
+    size_t n = max<size_t>(input.size(), 1);
+    size_t copies = max<size_t>(1, BENCH_MIN_ELEMENTS / n);
+    Fingerprint expected_values = fingerprint(input);
+    //the reference: std::partial_sort over the values that are not NaN
+    vector<double> reference(input);
+    double* end = partition_nans(reference.data(), reference.data() + reference.size());
+    double* middle = reference.data() + min<size_t>(k, end - reference.data());
+    if (algorithm.largest){
+        partial_sort(reference.data(), middle, end, greater<double>());
+    } else {
+        partial_sort(reference.data(), middle, end);
+    }
+    reference.resize(middle - reference.data());
+    vector<vector<double>> runs(copies, input);
+    vector<vector<double>> selected(copies);
+    auto start = chrono::steady_clock::now();
+    for (size_t c = 0; c < copies; c++){
+        selected[c] = algorithm.select(runs[c], k);
+    }
+    auto stop = chrono::steady_clock::now();
+    for (size_t c = 0; c < copies; c++){
+        if (selected[c] != reference || !(fingerprint(runs[c]) == expected_values)){
+            return -1;
+        }
+    }
+    return chrono::duration<double, nano>(stop - start).count() / (copies * n);
+}
+
+int run_partial_bench(size_t max_size){
+    vector<PartialSortAlgorithm> algorithms = bench_partial_algorithms();
+    vector<SortDistribution> distributions = bench_distributions();
+    int failures = 0;
+    cout << endl << left << setw(12) << "input" << right << setw(11) << "n" << setw(6) << "k";
+    for (auto& algorithm : algorithms){
+        cout << setw(16) << algorithm.name;
+    }
+    cout << "   (ns/element)" << endl;
+    for (size_t n = 10; n <= max_size; n *= 10){
+        for (auto& distribution : distributions){
+            vector<double> input(n);
+            distribution.fill(input, n);
+            for (size_t k : {1, 10, 100, 1000}){
+                if (k > n){
+                    break;
+                }
+                cout << left << setw(12) << distribution.name << right << setw(11) << n << setw(6) << k;
+                for (auto& algorithm : algorithms){
+                    double ns = bench_partial(algorithm, input, k);
+                    if (ns < 0){
+                        failures++;
+                        cout << setw(16) << "FAIL";
+                    } else {
+                        cout << setw(16) << fixed << setprecision(2) << ns;
+                    }
+                    cout << flush;
+                }
+                cout << endl;
+            }
+        }
+    }
+    return failures;
+}
+
+int run_sort_bench(size_t max_size){
+    vector<SortAlgorithm> algorithms = bench_algorithms();
+    vector<SortDistribution> distributions = bench_distributions();
+    int failures = 0;
+    cout << left << setw(12) << "input" << right << setw(11) << "n";
+    for (auto& algorithm : algorithms){
+        cout << setw(16) << algorithm.name;
+    }
+    cout << "   (ns/element)" << endl;
+    for (size_t n = 10; n <= max_size; n *= 10){
+        for (auto& distribution : distributions){
+            vector<double> input(n);
+            distribution.fill(input, n);
+            cout << left << setw(12) << distribution.name << right << setw(11) << n;
+            for (auto& algorithm : algorithms){
+                double ns = bench_one(algorithm, input);
+                if (ns < 0){
+                    failures++;
+                    cout << setw(16) << "FAIL";
+                } else {
+                    cout << setw(16) << fixed << setprecision(2) << ns;
+                }
+                cout << flush;
+            }
+            cout << endl;
+        }
+    }
+    failures += run_partial_bench(max_size);
+    failures += run_thread_sweep(max_size);
+    cout << (failures == 0 ? "all sorts checked" : to_string(failures) + " failed checks") << endl;
+    return failures;
+}
+
+int run_thread_sweep(size_t n){
+    //below the threshold every thread count sorts on the calling thread alone
+    n = max(n, PARALLEL_SORT_THRESHOLD);
+    vector<SortDistribution> distributions;
+    for (auto& distribution : bench_distributions()){
+        if (distribution.name == "random" || distribution.name == "duplicates"){
+            distributions.push_back(distribution);
+        }
+    }
+    int failures = 0;
+    cout << endl << "thread sweep at n = " << n << ", " << thread::hardware_concurrency() << " cores" << endl;
+    cout << left << setw(16) << "sort" << setw(12) << "input" << right << setw(8) << "threads"
+         << setw(16) << "ns/element" << setw(10) << "speedup" << endl;
+    for (string name : {"parallel_sort", "radix_sort"}){
+        for (auto& distribution : distributions){
+            vector<double> input(n);
+            distribution.fill(input, n);
+            double one_thread = 0;
+            for (unsigned threads = 1; threads <= BENCH_MAX_THREADS; threads *= 2){
+                SortAlgorithm algorithm = {name, [name, threads](vector<double>& v){
+                    if (name == "parallel_sort"){
+                        parallel_sort(v, threads);
+                    } else {
+                        radix_sort(v, threads);
+                    }
+                }};
+                double ns = bench_one(algorithm, input);
+                cout << left << setw(16) << name << setw(12) << distribution.name << right << setw(8) << threads;
+                if (ns < 0){
+                    failures++;
+                    cout << setw(16) << "FAIL" << endl;
+                    continue;
+                }
+                if (threads == 1){
+                    one_thread = ns;
+                }
+                cout << setw(16) << fixed << setprecision(2) << ns;
+                if (one_thread > 0){
+                    cout << setw(9) << setprecision(2) << one_thread / ns << "x";
+                }
+                cout << endl;
+            }
+        }
+    }
+    return failures;
+}
+
+#endif